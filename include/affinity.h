@@ -0,0 +1,60 @@
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+
+/**
+	Which CPUs the threads of every role run on. Parsed from terms separated by '/', each
+	a role and a list of CPUs as in /sys (0-3,8):
+
+		tun=CPUS  rx=CPUS  tx=CPUS  ctl=CPUS
+
+	The tun reader takes the first CPU of its list. A link's receiver and sender take the
+	CPU at the link's index in their lists (round robin), so a link keeps its CPUs when it
+	reconnects. Control threads (timer, listener) may run on any CPU of theirs. Roles that
+	aren't given float.
+
+	"auto" puts the data path on the CPUs isolated from the scheduler (isolcpus=): the tun
+	reader on the first, receivers and senders on the others, and the control threads on
+	the rest of the machine. Without isolated CPUs, nothing is pinned.
+*/
+class Placement {
+public:
+	enum Role {TUN = 0, RECEIVER = 1, SENDER = 2, CONTROL = 3};
+	static const int ROLES = 4;
+
+	/**
+		Throws std::invalid_argument on terms it doesn't understand and on CPUs that
+		don't exist.
+	*/
+	static Placement parse(const std::string &spec);
+	static std::vector<int> parseCPUList(const std::string &list);
+	std::string describe() const;
+	bool isEmpty() const;
+
+	/**
+		The CPU a thread of the role runs on, -1 if it floats. Control threads have no
+		single CPU, they return the first of theirs.
+	*/
+	int cpuOf(Role role, uint32_t index=0) const;
+
+	/**
+		Pins the calling thread for its role and names it after it (as top -H shows).
+		Never throws: if pinning fails, the thread floats.
+	*/
+	void pin(Role role, uint32_t index=0, int debug=0) const;
+
+	/**
+		NUMA node of a CPU, or of the CPU the calling thread runs on. -1 if unknown.
+	*/
+	static int nodeOf(int cpu);
+	static int currentNode();
+private:
+	std::vector<int> cpus[ROLES];
+};
+
+
+#endif
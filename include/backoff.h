@@ -0,0 +1,35 @@
+#ifndef BACKOFF_H
+#define BACKOFF_H
+
+#include <chrono>
+#include <random>
+
+
+/**
+	Exponential backoff with jitter for reconnection attempts. Every delay is picked at
+	random between half and all of the current step, so links that drop together don't
+	reconnect in lockstep.
+*/
+class Backoff {
+public:
+	Backoff(std::chrono::milliseconds base=std::chrono::milliseconds(100),
+		std::chrono::milliseconds cap=std::chrono::milliseconds(10000));
+
+	/**
+		Delay before the next attempt. Doubles the step, up to the cap.
+	*/
+	std::chrono::milliseconds next();
+
+	/**
+		Call after a successful attempt.
+	*/
+	void reset() {step = base;};
+private:
+	std::chrono::milliseconds base;
+	std::chrono::milliseconds cap;
+	std::chrono::milliseconds step;
+	std::mt19937 rng;
+};
+
+
+#endif
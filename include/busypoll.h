@@ -0,0 +1,86 @@
+#ifndef BUSYPOLL_H
+#define BUSYPOLL_H
+
+#include <errno.h>
+#include <poll.h>
+#include <sys/types.h>
+
+#include <atomic>
+#include <chrono>
+
+
+/**
+	Low latency receiving for a single thread: spins on non-blocking reads as long as
+	something came in within the idle time, and goes back to blocking (in poll()) once
+	the traffic stops. Spinning saves the wake up of a blocking read, at the cost of a
+	CPU that's busy while it waits.
+
+	Counts how long the thread spun without getting anything and how long it slept, so
+	the cost shows. Disabled (idle time 0), it only blocks.
+*/
+class BusyPoll {
+public:
+	typedef std::chrono::steady_clock Clock;
+
+	BusyPoll() = default;
+	BusyPoll(const BusyPoll&) = delete;
+	BusyPoll &operator=(const BusyPoll&) = delete;
+
+	/**
+		Set before the reading starts.
+	*/
+	void setIdle(std::chrono::microseconds idle) {this->idle = idle;};
+	bool isEnabled() const {return idle.count() > 0;};
+
+	/**
+		Calls attempt, which must not block (MSG_DONTWAIT, O_NONBLOCK) and returns like
+		read(), until it gets something or fails with another error than EAGAIN. In
+		between, it spins or waits for fd to become readable.
+	*/
+	template <typename Attempt>
+	ssize_t read(int fd, Attempt attempt);
+
+	uint64_t getSpinNanos() const {return spin_ns;};
+	uint64_t getSleepNanos() const {return sleep_ns;};
+	uint64_t getEmptyReads() const {return empty_reads;};	// Spun on
+	uint64_t getSleeps() const {return sleeps;};
+private:
+	void sleep(int fd);
+	void addSpin(Clock::time_point from, Clock::time_point to);
+
+	std::chrono::microseconds idle{0};
+	Clock::time_point last_data;
+	std::atomic<uint64_t> spin_ns{0};
+	std::atomic<uint64_t> sleep_ns{0};
+	std::atomic<uint64_t> empty_reads{0};
+	std::atomic<uint64_t> sleeps{0};
+};
+
+
+template <typename Attempt>
+ssize_t BusyPoll::read(int fd, Attempt attempt) {
+	Clock::time_point spin_start;		// Epoch while not spinning
+	while (true) {
+		ssize_t n = attempt();
+		if (n >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+			Clock::time_point now = Clock::now();
+			addSpin(spin_start, now);
+			last_data = now;
+			return n;
+		}
+		Clock::time_point now = Clock::now();
+		if (spin_start == Clock::time_point()) {
+			spin_start = now;
+		}
+		if (now - last_data < idle) {
+			empty_reads.fetch_add(1, std::memory_order_relaxed);
+			continue;
+		}
+		addSpin(spin_start, now);
+		spin_start = Clock::time_point();
+		sleep(fd);
+	}
+}
+
+
+#endif
@@ -0,0 +1,123 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <inttypes.h>
+
+#include <atomic>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+#include "queue.h"
+
+
+/**
+	Decides which packets a Capture keeps. Parsed from comma separated terms, all of which
+	must match:
+
+		link=N  proto=tcp|udp|icmp|N  port=N  dir=in|out  class=interactive|assured|bulk
+
+	The empty filter matches everything.
+*/
+struct CaptureFilter {
+	int64_t link = -1;			// -1 means any
+	int proto = -1;
+	int port = -1;
+	int direction = -1;
+	int traffic_class = -1;
+
+	/**
+		Throws std::invalid_argument on terms it doesn't understand.
+	*/
+	static CaptureFilter parse(const std::string &spec);
+	std::string describe() const;
+};
+
+
+/**
+	Captures the inner packets as they leave through the IMux (outbound) and arrive at the
+	IDeMux (inbound), with the link, stream and sequence number they went with.
+
+	The packets go into a ring of fixed size slots in a memory mapped pcapng file. Every
+	slot is a complete Enhanced Packet Block followed by a filler block of a local type
+	that readers skip, so the file can be opened with Wireshark at any time, even while
+	it's written. Once the ring is full, the oldest packets are overwritten, which keeps
+	it cheap enough to stay armed. A snapshot (SIGUSR1, or snapshot()) copies the ring in
+	time order to a file of its own.
+*/
+class Capture {
+public:
+	enum Direction {OUTBOUND = 0, INBOUND = 1};
+
+	static const size_t SLOT_SIZE = 2304;	// Room for the largest message plus comment
+	static const size_t DEFAULT_SIZE_MB = 32;
+
+	Capture(const std::string &path, size_t size_mb, const CaptureFilter &filter,
+		int debug=0);
+	virtual ~Capture();
+	Capture(const Capture&) = delete;
+	Capture &operator=(const Capture&) = delete;
+
+	/**
+		Called on the hot path. Checks the filter, then copies the packet (the message's
+		payload, without trailers) into the next slot. Safe from any thread.
+	*/
+	void record(Direction direction, const Message &msg, uint32_t link_id, uint8_t stream,
+		bool has_seq, uint32_t seq);
+
+	/**
+		Whether the filter looks at the traffic class. Inbound messages aren't
+		classified unless it does.
+	*/
+	bool filtersClass() {return filter.traffic_class >= 0;};
+
+	/**
+		Writes what's in the ring, oldest first, to <path>.<time>.pcapng. Returns the
+		file name.
+	*/
+	std::string snapshot();
+
+	/**
+		Installs SIGUSR1 as the snapshot trigger. The signal only sets a flag; the
+		snapshot is taken by the next pollTrigger(), in the background.
+	*/
+	static void installTrigger();
+	void pollTrigger();
+
+	uint64_t getRecorded() {return next_slot;};
+private:
+	static void onSignal(int);
+	static std::atomic<bool> triggered;
+
+	size_t writeHeader(char *out);
+
+	std::string path;
+	CaptureFilter filter;
+	int debug;
+	int fd = -1;
+	char *map = nullptr;
+	size_t map_size = 0;
+	size_t header_size = 0;
+	size_t slots = 0;
+	std::atomic<uint64_t> next_slot{0};
+	// Per slot, 2n+1 while packet n is written into it, 2n+2 once it's complete. The
+	// snapshot drops what changed while it copied.
+	std::unique_ptr<std::atomic<uint64_t>[]> written;
+	std::thread snapshot_t;
+};
+
+
+class CaptureException : public std::exception {
+private:
+	std::string errorMsg;
+public:
+	CaptureException(const std::string &msg) : errorMsg(msg) {}
+	~CaptureException() throw() {};
+	virtual const char* what() const throw() {
+		return errorMsg.c_str();
+	}
+};
+
+
+#endif
@@ -0,0 +1,66 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "socket.h"
+
+
+class ConfigException : public std::exception {
+private:
+	std::string errorMsg;
+public:
+	ConfigException(const std::string &msg)
+		: errorMsg(msg) {}
+	~ConfigException() throw() {};
+	virtual const char* what() const throw() {
+		return errorMsg.c_str();
+	}
+};
+
+
+/**
+	The links of an endpoint, from a file that's read again on SIGHUP (see
+	Endpoint::reload()). One link per line:
+
+		link SOCKET_DES [weight=N] [impairment=TERMS] [shaping=TERMS]
+
+	SOCKET_DES as with -b. The named impairment and shaping replace the ones in it, if
+	any; weight is that of ScheduledLink::getWeight(), default 1. Empty lines and
+	everything after a '#' are ignored. Links are told apart by their key (see
+	SocketDescription::key()), so a file can't have the same one twice.
+*/
+namespace config {
+
+	/**
+		Throws ConfigException, with the line that's wrong.
+	*/
+	std::vector<SocketDescription> read(const std::string &path);
+
+	/**
+		What it takes to go from one set of links to another.
+	*/
+	struct Diff {
+		std::vector<SocketDescription> added;
+		std::vector<SocketDescription> removed;
+		std::vector<std::pair<SocketDescription, SocketDescription>> changed;	// From, to
+
+		bool isEmpty() const {return added.empty() && removed.empty() && changed.empty();};
+		std::string describe() const;
+	};
+	Diff diff(const std::vector<SocketDescription> &from,
+		const std::vector<SocketDescription> &to);
+
+	/**
+		True if a link can take the new description while it runs: only its weight or
+		its shaper's limits changed. Otherwise it needs new sockets.
+	*/
+	bool isRetunable(const SocketDescription &from, const SocketDescription &to);
+
+}
+
+
+#endif
@@ -0,0 +1,118 @@
+#ifndef CONTROL_H
+#define CONTROL_H
+
+#include <inttypes.h>
+
+#include <string>
+
+#include "queue.h"
+
+
+/**
+	Messages of type Message::CONTROL are handled by the link they arrive on and never
+	reach the tun. The first payload byte tells what kind of control message it is.
+
+	Heartbeat (and its ack, which echoes the heartbeat's body):
+ 	 * 	|  1   |  4  |    8    |
+	 * 	| kind | seq | sent_ns |
+
+	Hello, sent by the client as the first message on every (re)connected link. The
+	server answers with a hello ack carrying what the link agreed on: the lower version,
+	the features both sides have and the smaller maximum frame (whole message, header
+	included). A TCP link can consist of several parallel connections, told apart by
+	their stream number:
+ 	 * 	|  1   |     8      |    4    |   1    |    1    |    4     |     2     |
+	 * 	| kind | session_id | link_id | stream | version | features | max_frame |
+
+	MTU probe, padded with zeroes to size bytes (the whole message), and its ack, which
+	isn't padded. See PathMTU:
+ 	 * 	|  1   |  4  |  2   |   ...   |
+	 * 	| kind | seq | size | padding |
+
+	Padding, to be thrown away. Fills cover traffic frames up to their size, after the
+	message they carry, if any:
+ 	 * 	|  1   |   ...   |
+	 * 	| kind | zeroes  |
+
+	Peers from before the handshake (version 0) send and parse the first 14 bytes only.
+	They read both trailers, and frames up to Message::BUF_SIZE.
+
+	Until the ack is in, a link only uses FEATURE_SEQ. New trailers and frame formats
+	(compression, FEC, aggregation) each get the next feature bit, and are only put on
+	a link once its hello ack has their bit set.
+*/
+namespace control {
+
+	const char HEARTBEAT = 'h';
+	const char HEARTBEAT_ACK = 'H';
+	const char HELLO = 's';
+	const char HELLO_ACK = 'S';
+	const char MTU_PROBE = 'm';
+	const char MTU_PROBE_ACK = 'M';
+	const char PADDING = 'z';
+
+	const uint16_t HEARTBEAT_LENGTH = 1 + 4 + 8;
+	const uint16_t HELLO_V0_LENGTH = 1 + 8 + 4 + 1;
+	const uint16_t HELLO_LENGTH = HELLO_V0_LENGTH + 1 + 4 + 2;
+	const uint16_t MTU_PROBE_LENGTH = 1 + 4 + 2;
+
+	const uint8_t VERSION = 1;
+	const uint32_t FEATURE_SEQ = 0x1;			// Sequence number trailer
+	const uint32_t FEATURE_TIMESTAMP = 0x2;		// Timestamp trailer
+	const uint32_t FEATURE_PMTU = 0x4;			// Answers MTU probes
+	const uint32_t FEATURE_PACKED = 0x8;		// Reads several messages from one datagram
+	const uint32_t FEATURES = FEATURE_SEQ | FEATURE_TIMESTAMP | FEATURE_PMTU |
+		FEATURE_PACKED;		// What this version has
+	const uint32_t V0_FEATURES = FEATURE_SEQ | FEATURE_TIMESTAMP;
+
+	struct Hello {
+		uint64_t session_id = 0;
+		uint32_t link_id = 0;
+		uint8_t stream = 0;
+		uint8_t version = VERSION;
+		uint32_t features = FEATURES;
+		uint16_t max_frame = Message::BUF_SIZE;
+
+		/**
+			What both sides of a link can do: the answer to a peer's hello.
+		*/
+		Hello agree(const Hello &peer) const;
+	};
+
+	inline char kind(const Message &msg) {
+		return msg.payload_length > 0 ? msg.payload[0] : 0;
+	}
+
+	void makeHeartbeat(Message &msg, char kind, uint32_t seq, uint64_t sent_ns);
+
+	/**
+		Returns false if the message is too short to be a heartbeat.
+	*/
+	bool parseHeartbeat(const Message &msg, uint32_t &seq, uint64_t &sent_ns);
+
+	void makeHello(Message &msg, char kind, const Hello &hello);
+
+	/**
+		Returns false if the message is too short to be a hello. Hellos without a stream
+		number are from peers that only use one connection per link: stream 0. Hellos
+		without a version are version 0.
+	*/
+	bool parseHello(const Message &msg, Hello &hello);
+
+	std::string describeFeatures(uint32_t features);
+
+	/**
+		size is that of the whole message: probes are padded up to it. Acks only carry
+		it.
+	*/
+	void makeMTUProbe(Message &msg, char kind, uint32_t seq, uint16_t size);
+
+	/**
+		Returns false if the message is too short to be an MTU probe.
+	*/
+	bool parseMTUProbe(const Message &msg, uint32_t &seq, uint16_t &size);
+
+}
+
+
+#endif
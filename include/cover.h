@@ -0,0 +1,101 @@
+#ifndef COVER_H
+#define COVER_H
+
+#include <inttypes.h>
+#include <sys/uio.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+
+#include "queue.h"
+#include "wheel.h"
+
+
+/**
+	Cover traffic for a link: a frame of exactly size bytes in every slot, cover times a
+	second, so the link's timing and sizes say nothing about what's tunneled. Each slot
+	takes the next message of the link's send queue, if any, and fills the rest of the
+	frame with a padding message. Idle slots carry padding only.
+
+	The slots run on a TimerWheel shared by all links. They only pick the frame's message
+	and hand it to the link's own sender thread (run()), so a link whose sends block
+	holds up nobody else; a slot that comes while the previous frame is still being sent
+	is skipped. Frames are sent as an iovec: the message's own buffer, a four byte
+	padding header and a shared page of zeroes, so padding costs no copying.
+
+	Messages must leave room for the padding header, see getMTU(). A peer that can't
+	unpack a datagram gets real messages without padding.
+
+	Create with std::make_shared: pending slots only hold on to it weakly.
+*/
+class CoverTraffic : public std::enable_shared_from_this<CoverTraffic> {
+public:
+	typedef std::chrono::steady_clock Clock;
+
+	/**
+		Sends a frame. message is the message in it, nullptr for padding only.
+	*/
+	typedef std::function<void(Message *message, struct iovec *iov, int count)> Send;
+
+	static const uint16_t PADDING_HEADER = Message::HEADER_LENGTH + 1;
+
+	CoverTraffic(uint64_t pps, uint16_t size, double queue_ms, Queue &queue, Send send,
+		TimerWheel &wheel=TimerWheel::shared());
+	CoverTraffic(const CoverTraffic&) = delete;
+	CoverTraffic &operator=(const CoverTraffic&) = delete;
+
+	/**
+		Starts and stops the slots. Once stopped, it can't be started again.
+	*/
+	void start();
+	void stop();
+
+	/**
+		Sends the slots' frames until stop(). Run on the link's sender thread.
+	*/
+	void run();
+
+	/**
+		Whether the peer unpacks datagrams (control::FEATURE_PACKED).
+	*/
+	void setPacking(bool packing) {this->packing = packing;};
+
+	/**
+		Largest message that fits in a frame, with the padding header behind it.
+	*/
+	uint16_t getMTU() const {return size - PADDING_HEADER;};
+
+	/**
+		False if the send queue already holds queue_ms worth of slots.
+	*/
+	bool admits();
+
+	uint64_t getLateSlots() {return late_slots;};
+private:
+	void slot();
+	void sendFrame(Message *message);
+
+	Queue &queue;
+	Send send;
+	TimerWheel &wheel;
+	uint16_t size;
+	std::chrono::nanoseconds interval;
+	size_t backlog_limit;
+	std::atomic<bool> packing{false};
+
+	std::mutex mutex;		// Guards all below
+	std::condition_variable frame_ready;
+	Clock::time_point next_slot;
+	bool running = false;
+	bool stopped = false;
+	bool pending = false;		// A frame waits for run()
+	MessagePtr next_message;	// Its message, nullptr for padding only
+	std::atomic<uint64_t> late_slots{0};	// Skipped, the wheel or the sender was behind
+};
+
+
+#endif
@@ -0,0 +1,100 @@
+#ifndef DEVICE_H
+#define DEVICE_H
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "queue.h"
+
+
+/**
+	Where the IMux reads the packets to tunnel from and the IDeMux writes the tunneled
+	packets to. Normally the Tun, but anything that moves whole IP packets will do.
+*/
+class PacketDevice {
+public:
+	virtual ~PacketDevice() = default;
+
+	/**
+		Blocks until there's a packet, then puts it in msg as a DATA message. Leaves
+		Message::TRAILER_SPACE free at the end of the payload.
+	*/
+	virtual void receive(Message &msg) = 0;
+
+	/**
+		Like receive(), but returns false instead of blocking when there's nothing to read.
+	*/
+	virtual bool tryReceive(Message &msg) = 0;
+
+	/**
+		Writes the message's payload as a packet. Safe to call from all receive threads.
+	*/
+	virtual void writeMessage(Message &msg) = 0;
+	virtual std::string describeFull() = 0;
+};
+
+
+/**
+	A packet device in memory, for running endpoints without a tun (and without root).
+	Packets handed to inject() are what the IMux reads; the packets the IDeMux writes go
+	to the sink.
+
+	Like a tun, it drops packets rather than blocking whoever injects them when the IMux
+	doesn't keep up.
+*/
+class MemoryDevice : public PacketDevice {
+public:
+	typedef std::function<void(const char *pkt, size_t len)> Sink;
+
+	static const size_t DEFAULT_LIMIT = 1000;	// Same as a tun's default txqueuelen
+
+	MemoryDevice(const std::string &name, size_t limit=DEFAULT_LIMIT, int debug=0);
+	virtual ~MemoryDevice() = default;
+
+	/**
+		Queues a packet for the IMux. Returns false, dropping it, if the queue is full.
+		Packets longer than what fits in a message are cut short.
+	*/
+	bool inject(const char *pkt, size_t len);
+
+	/**
+		Set before the device is written to.
+	*/
+	void setSink(Sink sink) {this->sink = sink;};
+
+	void receive(Message &msg);
+	bool tryReceive(Message &msg);
+	void writeMessage(Message &msg);
+	std::string describeFull();
+
+	uint64_t getDropped() {return dropped;};
+	uint64_t getWritten() {return written;};
+private:
+	struct Slot {
+		uint16_t length;
+		char data[Message::PAYLOAD_SIZE - Message::TRAILER_SPACE];
+	};
+
+	void take(Message &msg);
+
+	std::string name;
+	int debug;
+	Sink sink;
+
+	// A ring of preallocated packets, so injecting doesn't allocate.
+	std::mutex mutex;
+	std::condition_variable not_empty;
+	std::vector<Slot> slots;
+	size_t head = 0;
+	size_t count = 0;
+
+	std::atomic<uint64_t> dropped{0};
+	std::atomic<uint64_t> written{0};
+};
+
+
+#endif
@@ -0,0 +1,61 @@
+#ifndef HEALTH_H
+#define HEALTH_H
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+
+
+/**
+	UP: heartbeats are answered, the link carries traffic.
+	SUSPECT: heartbeats went unanswered for a bit. No new traffic, but not given up yet.
+	DOWN: unanswered for too long. Heartbeats keep going out as probes.
+	PROBING: a down link answered again. Becomes UP after enough answered probes.
+*/
+enum class LinkState {UP, SUSPECT, DOWN, PROBING};
+
+
+std::string linkState2String(LinkState state);
+
+
+/**
+	Per link state machine, fed by heartbeat acks (receive thread) and periodic checks
+	(monitor thread).
+*/
+class LinkHealth {
+public:
+	typedef std::chrono::steady_clock::time_point TimePoint;
+	typedef std::chrono::steady_clock::duration Duration;
+
+	static const int PROBES_TO_UP = 3;
+
+	LinkState getState() const {return state.load(std::memory_order_relaxed);};
+
+	/**
+		Smoothed round trip time of the heartbeats, zero until the first ack.
+	*/
+	std::chrono::microseconds getRTT() const {
+		return std::chrono::microseconds(srtt_us.load(std::memory_order_relaxed));
+	};
+
+	/**
+		Both return true if the state changed.
+	*/
+	bool onAck(TimePoint now, Duration rtt);
+	bool check(TimePoint now, Duration suspect_after, Duration down_after);
+
+	/**
+		Time since the last ack (or since the first check, if there never was one).
+	*/
+	Duration silentFor(TimePoint now);
+private:
+	std::mutex mutex;
+	std::atomic<LinkState> state{LinkState::UP};
+	TimePoint last_ack{};
+	int probes = 0;
+	std::atomic<int64_t> srtt_us{0};
+};
+
+
+#endif
@@ -1,24 +1,120 @@
 #ifndef IDEMUX_H
 #define IDEMUX_H
 
+#include <atomic>
+#include <chrono>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <vector>
 
+#include "capture.h"
 #include "queue.h"
+#include "stats.h"
 //#include "tun.h"
 
-class Tun;	// Forward declaration to Tun to handle circular dependencies.
-			// tun.h is included in idemux.cpp to get the rest.
+class PacketDevice;	// Forward declaration to handle circular dependencies.
+					// device.h is included in idemux.cpp to get the rest.
 
+/**
+	Writes the messages of all links into the tun. Messages with a sequence number are put
+	back in order first: a message that arrives ahead of a missing one is held until the
+	gap is filled, or until it has waited for the hold time.
+*/
 class IDeMux{
 public:
+	static const size_t MAX_HELD = 512;		// Held messages before a gap is given up on
+	static const int32_t MAX_AHEAD = 4096;	// Further off means the peer started over
+
 	IDeMux() = default;
-	IDeMux(std::shared_ptr<Tun> tun, int debug=0);
+	IDeMux(std::shared_ptr<PacketDevice> tun, int hold_ms=50, int debug=0);
 	virtual ~IDeMux() = default;
+
+	/**
+		Safe to call from all receive threads at once.
+	*/
 	void handleMessage(Message &msg);
+
+	/**
+		The same, at a given time rather than now. For running on a simulated clock.
+	*/
+	void handleMessage(Message &msg, std::chrono::steady_clock::time_point now);
+
+	/**
+		The same, but takes the message over, so holding it doesn't take a copy.
+	*/
+	void handleMessage(MessagePtr msg, std::chrono::steady_clock::time_point now);
+
+	/**
+		Releases the messages that waited too long for a gap. Call periodically.
+	*/
+	void flushExpired(std::chrono::steady_clock::time_point now);
+
+	/**
+		Forgets the sequence numbering, e.g. because the peer restarted.
+	*/
+	void reset();
+
+	uint64_t getReordered() {return reordered;};
+	uint64_t getLate() {return late;};
+	uint64_t getLost() {return lost;};
+	size_t getHeld();
+
+	/**
+		Indexed by stats::IDeMuxCounter.
+	*/
+	stats::Counters &getCounters() {return counters;};
+
+	/**
+		Captures the messages coming in from the links from now on, before reordering.
+		Set before the links are started.
+	*/
+	void setCapture(std::shared_ptr<Capture> capture) {capture_ptr = capture;};
 private:
-	std::shared_ptr<Tun> tun_ptr;
+	// Serial number arithmetic, so the order survives wrapping around.
+	struct SeqLess {
+		bool operator()(uint32_t a, uint32_t b) const {
+			return static_cast<int32_t>(a - b) < 0;
+		}
+	};
+
+	/**
+		owned is msg, or nullptr if it's the caller's.
+	*/
+	void accept(Message &msg, MessagePtr owned, std::chrono::steady_clock::time_point now);
+	void release(Message &msg);
+
+	/**
+		Move the held messages that are next in order, or were given up on, to ready.
+		Call with mutex held.
+	*/
+	void releaseInOrder();
+	void skipGap();
+
+	/**
+		Writes the ready messages into the tun, with msg (if any) in front of the one at
+		msg_at, after letting go of lock (on mutex). Writes made by different threads
+		keep the order of their batches.
+	*/
+	void writeReady(std::unique_lock<std::mutex> &lock, Message *msg=nullptr,
+		size_t msg_at=0);
+
+	std::shared_ptr<PacketDevice> tun_ptr;
+	std::shared_ptr<Capture> capture_ptr;
+	std::chrono::milliseconds hold_time{0};
 	int debug;
+
+	stats::Counters counters;
+	std::mutex mutex;
+	std::map<uint32_t, MessagePtr, SeqLess> held;	// queued_at is the arrival time here
+	std::vector<MessagePtr> ready;		// Taken out of held, to be written
+	std::mutex write_mutex;				// Taken while holding mutex, never the other way
+	bool synced = false;
+	uint32_t next_seq = 0;
+	std::atomic<uint64_t> reordered{0};		// Arrived ahead of a gap and were held
+	std::atomic<uint64_t> late{0};			// Arrived after their gap was given up on
+	std::atomic<uint64_t> lost{0};			// Sequence numbers that never showed up in time
 };
 
 
-#endif
\ No newline at end of file
+#endif
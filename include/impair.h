@@ -0,0 +1,172 @@
+#ifndef IMPAIR_H
+#define IMPAIR_H
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "log.h"
+#include "queue.h"
+#include "socket.h"
+#include "wheel.h"
+
+
+/**
+	What an impaired link does to the messages it sends. Parsed from the terms of a socket
+	description, separated by '/':
+
+		delay=MS  jitter=MS  dist=uniform|normal|pareto  loss=PCT  gilbert=PCT
+		recover=PCT  badloss=PCT  rate=KBIT  queue=MS  reorder=PCT  seed=N
+
+	Loss is Bernoulli with probability loss, unless gilbert is set: then it's a
+	Gilbert-Elliott model that goes from the good to the bad state with probability
+	gilbert and back with probability recover, losing loss percent of the messages in
+	the good state and badloss percent in the bad state.
+
+	rate caps the link's bandwidth, with a drop tail queue of queue ms. Reordered messages
+	skip the delay, so they overtake the ones sent before them. The seed makes the random
+	choices repeatable.
+*/
+struct Impairment {
+	enum Distribution {UNIFORM, NORMAL, PARETO};
+
+	double delay_ms = 0;
+	double jitter_ms = 0;
+	Distribution distribution = UNIFORM;
+	double loss = 0;			// Fractions, 0..1
+	double gilbert = 0;
+	double recover = 0.25;
+	double bad_loss = 1;
+	uint64_t rate_kbit = 0;		// 0 means no cap
+	double queue_ms = 50;
+	double reorder = 0;
+	uint64_t seed = 0;			// 0 means a random seed
+
+	/**
+		Throws std::invalid_argument on terms it doesn't understand.
+	*/
+	static Impairment parse(const std::string &spec);
+	std::string describe() const;
+};
+
+
+/**
+	Applies an Impairment to a stream of messages: decides which get lost and when the
+	others go out, then hands them to the send function on its wheel's thread.
+*/
+class Impairer {
+public:
+	typedef std::function<void(Message&)> SendFunction;
+
+	Impairer(const Impairment &impairment, SendFunction send, int debug=0);
+	virtual ~Impairer() = default;
+
+	/**
+		Copies the message, the caller may reuse it right away.
+	*/
+	void submit(const Message &message);
+
+	/**
+		Stops sending. Messages still on their way are lost.
+	*/
+	void stop() {wheel.stop();};
+
+	uint64_t getLost() {return lost;};
+	uint64_t getOverflows() {return overflows;};
+	uint64_t getReordered() {return reordered;};
+private:
+	bool isLost();
+	std::chrono::nanoseconds pickDelay();
+
+	Impairment impairment;
+	SendFunction send;
+	int debug;
+
+	std::mutex mutex;		// Guards all below, submit() may be called from any thread
+	std::mt19937_64 rng;
+	bool bad_state = false;
+	TimerWheel::Clock::time_point link_free;	// When the rate limited link is idle again
+	uint64_t lost = 0;
+	uint64_t overflows = 0;
+	uint64_t reordered = 0;
+
+	TimerWheel wheel;		// Last, so it stops before the rest goes away
+};
+
+
+/**
+	Decorates a socket type with an Impairer on its way out. Both ends of a link should
+	impair their own sending side to impair the link both ways.
+
+		new ImpairedSocket<ClientUDPSocket>(impairment, des, idemux_ptr, debug);
+*/
+template <typename Base>
+class ImpairedSocket : public Base {
+public:
+	template <typename... Args>
+	ImpairedSocket(const Impairment &impairment, Args&&... args) :
+		Base(std::forward<Args>(args)...),
+		impairer(impairment, [this] (Message &message) {this->sendNow(message);},
+			this->debug) {}
+	virtual ~ImpairedSocket() {
+		impairer.stop();
+	}
+
+	void sendMessage(Message &message) {
+		impairer.submit(message);
+	}
+	Impairer &getImpairer() {return impairer;};
+
+	/**
+		Impaired messages are copied into the Impairer and sent from more than one
+		thread, they keep being copied into the kernel too.
+	*/
+	void enableZeroCopy(uint16_t) {}
+private:
+	void sendNow(Message &message) {
+		// Messages that aren't delayed go out on the sender's thread, the rest on the
+		// wheel's.
+		std::lock_guard<std::mutex> lock(send_mutex);
+		try {
+			Base::sendMessage(message);
+		} catch (std::exception &e) {
+			// The receiving side notices dead links, a failed send just loses the message.
+			LOG_DEBUG(this->debug, 2, "impaired send on {} failed: {}", this->describeFull(),
+				e.what());
+		}
+	}
+
+	std::mutex send_mutex;
+	Impairer impairer;
+};
+
+
+/**
+	Creates a socket of type S, impaired, shaped and weighted as its description asks.
+*/
+template <typename S, typename... Args>
+std::shared_ptr<Socket> makeSocket(const SocketDescription &des, Args&&... args) {
+	std::shared_ptr<Socket> socket;
+	if (des.impairment.empty()) {
+		socket.reset(new S(des, std::forward<Args>(args)...));
+	} else {
+		socket.reset(new ImpairedSocket<S>(Impairment::parse(des.impairment), des,
+			std::forward<Args>(args)...));
+	}
+	if (!des.shaping.empty()) {
+		socket->setShaping(Shaping::parse(des.shaping));
+	}
+	socket->setWeight(des.weight);
+	return socket;
+}
+
+
+#endif
@@ -1,29 +1,161 @@
 #ifndef IMUX_H
 #define IMUX_H
 
+#include <functional>
 #include <map>
 #include <memory>
 #include <string>
 #include <vector>
 
+#include "capture.h"
+#include "mempool.h"
 #include "queue.h"
+#include "scheduler.h"
+#include "snapshot.h"
 #include "socket.h"
-#include "tun.h"
+#include "stats.h"
+#include "device.h"
+
+
+/**
+	The sockets of one link, its streams (see StreamPool), as a single link to the
+	scheduler. A message goes out on the usable stream with the shortest backlog. Links
+	that aren't pooled have just one.
+*/
+class StreamGroup : public ScheduledLink {
+public:
+	explicit StreamGroup(uint32_t link_id) : link_id(link_id) {}
+
+	uint32_t getLinkId() {return link_id;};
+	void add(Socket *socket) {streams.push_back(socket);};
+
+	/**
+		The stream a message goes out on right now.
+	*/
+	Socket *pick();
+
+	bool isUsable() {return pick()->isUsable();};
+	std::chrono::microseconds getSmoothedRTT() {return pick()->getSmoothedRTT();};
+	size_t getBacklog() {return pick()->getBacklog();};
+	uint16_t getMTU() override {return pick()->getMTU();};
+	int getWeight() override {return pick()->getWeight();};
+	bool admits(uint16_t size) override {return pick()->admits(size);};
+private:
+	uint32_t link_id;
+	std::vector<Socket*> streams;	// Kept alive by the LinkSet
+};
+
+
+/**
+	The links IMux can choose from. Never changed once published, see Snapshot.
+*/
+struct LinkSet {
+	std::map<std::string, std::shared_ptr<Socket>> sockets_map;
+	std::vector<std::shared_ptr<Socket>> sockets_vector;
+	// The same sockets by link id, in the order their links were attached.
+	std::vector<std::shared_ptr<StreamGroup>> groups;
+	std::vector<ScheduledLink*> links_vector;	// The groups, for the scheduler
+};
 
 class IMux {
 public:
-	IMux(std::shared_ptr<Tun> tun, int debug=0);
+	// Maximum number of messages read from the tun in one go. They are sent off in order
+	// of their traffic class.
+	static const int BATCH_SIZE = 32;
+
+	/**
+		With timestamps, every message carries the time it was read from the tun, so
+		the peer can tell its latency. The messages read from the tun come from a pool
+		on pool_node, the NUMA node of the tun reader's CPU. -1 if it floats.
+	*/
+	IMux(std::shared_ptr<PacketDevice> tun, bool timestamps=false, int debug=0,
+		int pool_node=-1);
 	virtual ~IMux() = default;
+	/**
+		Adds or removes a link. Safe to call from any thread while the tun is being read;
+		the reader picks up the new link set with the next message.
+	*/
 	void attachSocket(std::shared_ptr<Socket> socket);
+	void detachSocket(std::shared_ptr<Socket> socket);
+
+	/**
+		Removes a link that isn't needed anymore but still works: it gets no new messages,
+		sends the ones it has queued and shuts down, see Socket::finishSending().
+	*/
+	void retireSocket(std::shared_ptr<Socket> socket);
+
+	/**
+		Groups the sockets by link id again. Call when a socket learned its link id from
+		a hello.
+	*/
+	void regroup();
+
+	/**
+		Calls fn for every attached link, on a consistent snapshot of the link set.
+	*/
+	void forEachSocket(const std::function<void(const std::shared_ptr<Socket>&)> &fn);
+
+	/**
+		Reads the tun and hands the messages to the links.
+	*/
 	void readTunLoop();
-	//oid detachSocket(Socket &socket);
+
+	/**
+		Indexed by stats::IMuxCounter.
+	*/
+	stats::Counters &getCounters() {return counters;};
+	uint64_t getPoolMisses() {return message_pool->getMisses();};
+
+	/**
+		Captures the messages handed to the links from now on. Set before the tun is read.
+	*/
+	void setCapture(std::shared_ptr<Capture> capture) {capture_ptr = capture;};
+
+	/**
+		Round robin unless set otherwise. Set before the tun is read.
+	*/
+	void setScheduler(std::unique_ptr<Scheduler> scheduler) {
+		scheduler_ptr = std::move(scheduler);
+	};
+
+	/**
+		Which of the links a message goes out on: the one the scheduler picks, unless that
+		one wouldn't send it right away (see ScheduledLink::admits()) and another one
+		would. Then spilled is set. -1 if none of the links takes the message. The
+		simulator routes its messages through here as well.
+	*/
+	static int route(Scheduler &scheduler, const Message &message,
+		const std::vector<ScheduledLink*> &links, bool &spilled);
 private:
-	void handleMessage(Message &message);
-	std::map<std::string, std::shared_ptr<Socket>> sockets_map;
-	std::vector<std::shared_ptr<Socket>> sockets_vector;
-	std::shared_ptr<Tun> tun_ptr;
+	void handleMessage(MessagePtr message);
+
+	/**
+		Takes the socket out of the link set. False if it wasn't in it.
+	*/
+	bool unlink(const std::shared_ptr<Socket> &socket);
+
+	/**
+		Puts the sockets of the set into groups by their link id.
+	*/
+	static void group(LinkSet &set);
+
+	/**
+		The next link after the picked one that takes the message and whose shaper lets
+		it through right away, -1 if there's none.
+	*/
+	static int spillOver(const Message &message, const std::vector<ScheduledLink*> &links,
+		int picked);
+	// Never replaced. Shared with the queues of the links it fed (see
+	// Queue::holdPool()), whose sockets the endpoint may keep after the IMux is gone.
+	std::shared_ptr<MessagePool> message_pool;
+	Snapshot<LinkSet> links;
+	stats::Counters counters;
+	std::shared_ptr<PacketDevice> tun_ptr;
+	std::shared_ptr<Capture> capture_ptr;
+	std::unique_ptr<Scheduler> scheduler_ptr;
+	bool timestamps;
 	int debug;
-	int index = 0;
+	uint32_t next_seq = 0;
 };
 
 
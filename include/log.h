@@ -0,0 +1,147 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <inttypes.h>
+#include <string.h>
+
+#include <string>
+#include <type_traits>
+
+
+// Debug levels above this are compiled out entirely. Set with
+// cmake -DMULTITUN_LOG_LEVEL=N (0-3).
+#define MULTITUN_LOG_LEVEL @MULTITUN_LOG_LEVEL@
+
+
+/**
+	Logs at debug level, if both the compiled in level and the runtime debug level allow.
+	Arguments are captured in binary and formatted later, on the logger's thread:
+
+		LOG_DEBUG(debug, 3, "read {} bytes from fd {}", n_read, sock_fd);
+
+	Every {} is replaced by the next argument. Integers, floating point numbers, C strings
+	and std::strings are accepted; strings are copied. Those that don't fit in the
+	record's TEXT_SIZE are copied to the heap instead, which is slower but keeps them
+	whole.
+*/
+#define LOG_DEBUG(debug, level, ...) \
+	do { \
+		if ((level) <= MULTITUN_LOG_LEVEL && (debug) >= (level)) { \
+			logging::write((level), __VA_ARGS__); \
+		} \
+	} while (0)
+
+#define LOG_ERROR(...) logging::write(logging::ERROR, __VA_ARGS__)
+
+
+/**
+	Asynchronous logger. Every thread writes fixed size binary records into a ring of its
+	own, without locks or system calls; a background thread formats and prints them in
+	time order. It sleeps while nothing is logged, the first record after that wakes it.
+	When a thread's ring is full, its records are dropped and counted instead of blocking
+	the thread.
+*/
+namespace logging {
+
+	const int ERROR = 0;
+	const int MAX_ARGS = 8;
+	const int TEXT_SIZE = 224;	// Room for the string arguments of a record
+	const int RING_SIZE = 512;	// Records per thread, a power of two
+
+	struct Record {
+		enum Type : uint8_t {INT, UINT, DOUBLE, STRING, LONG_STRING};
+		union Value {
+			int64_t i;
+			uint64_t u;
+			double d;
+			struct {
+				uint16_t offset;
+				uint16_t length;
+			} s;
+			std::string *long_s;	// Owned, freed by release()
+		};
+
+		uint64_t ns;			// Steady clock time of logging, for the order
+		const char *format;		// Must be a string literal, it's read much later
+		int level;
+		uint8_t n_args;
+		uint16_t text_used;
+		Type types[MAX_ARGS];
+		Value values[MAX_ARGS];
+		char text[TEXT_SIZE];
+
+		void add(int64_t value);
+		void add(uint64_t value);
+		void add(double value);
+		void add(const char *value, size_t length);
+
+		template <typename T>
+		typename std::enable_if<std::is_integral<T>::value && std::is_signed<T>::value>::type
+		capture(T value) {add(static_cast<int64_t>(value));}
+
+		template <typename T>
+		typename std::enable_if<std::is_integral<T>::value && !std::is_signed<T>::value>::type
+		capture(T value) {add(static_cast<uint64_t>(value));}
+
+		template <typename T>
+		typename std::enable_if<std::is_floating_point<T>::value>::type
+		capture(T value) {add(static_cast<double>(value));}
+
+		template <typename T>
+		typename std::enable_if<std::is_enum<T>::value>::type
+		capture(T value) {add(static_cast<int64_t>(value));}
+
+		void capture(const char *value) {add(value, strlen(value));}
+		void capture(const std::string &value) {add(value.data(), value.size());}
+
+		/**
+			Formats the record, without the level prefix.
+		*/
+		std::string formatText() const;
+
+		/**
+			Frees what the record holds on the heap, once it's formatted.
+		*/
+		void release();
+	};
+
+	/**
+		Reserves the next record in this thread's ring. Returns nullptr if it's full.
+	*/
+	Record *reserve();
+
+	/**
+		Hands the record filled in after reserve() to the logger thread.
+	*/
+	void commit();
+
+	inline void captureAll(Record &) {}
+
+	template <typename T, typename... Rest>
+	void captureAll(Record &record, const T &first, const Rest&... rest) {
+		record.capture(first);
+		captureAll(record, rest...);
+	}
+
+	template <typename... Args>
+	void write(int level, const char *format, const Args&... args) {
+		static_assert(sizeof...(Args) <= MAX_ARGS, "too many log arguments");
+		Record *record = reserve();
+		if (record == nullptr) {
+			return;
+		}
+		record->format = format;
+		record->level = level;
+		captureAll(*record, args...);
+		commit();
+	}
+
+	/**
+		Blocks until everything logged so far is printed.
+	*/
+	void flush();
+
+}
+
+
+#endif
@@ -0,0 +1,57 @@
+#ifndef MEMPOOL_H
+#define MEMPOOL_H
+
+#include <atomic>
+#include <memory>
+
+#include "queue.h"
+
+
+/**
+	Preallocated messages, in memory of a given NUMA node. Taking a message and giving it
+	back is a couple of pointer swaps instead of a 2 kB malloc and free, and the buffers
+	stay where they are, in the node's memory and in the caches.
+
+	Only one thread (the owner, the tun reader) takes messages. Any thread may give them
+	back, by letting go of the MessagePtr. When the pool runs out, messages come from the
+	heap. The pool must outlive the messages it hands out.
+*/
+class MessagePool {
+public:
+	static const size_t DEFAULT_SIZE = 2048;		// About 4 MB
+
+	/**
+		A node of -1 leaves the memory where the kernel puts it, which is on the node of
+		the thread creating the pool.
+	*/
+	MessagePool(size_t size=DEFAULT_SIZE, int node=-1, int debug=0);
+	virtual ~MessagePool();
+	MessagePool(const MessagePool&) = delete;
+	MessagePool &operator=(const MessagePool&) = delete;
+
+	/**
+		Only from the owner thread.
+	*/
+	MessagePtr take();
+
+	/**
+		Called by MessageDeleter, from any thread.
+	*/
+	void give(Message *msg);
+
+	uint64_t getMisses() {return misses;};
+private:
+	struct Slot {
+		alignas(Message) char storage[sizeof(Message)];		// First, a Message* is a Slot*
+		Slot *next;
+	};
+
+	size_t size;
+	Slot *slots;
+	Slot *taken_from = nullptr;				// The owner's, no one else touches it
+	std::atomic<Slot*> given_back{nullptr};	// Pushed by any thread, taken all at once
+	std::atomic<uint64_t> misses{0};		// Came from the heap
+};
+
+
+#endif
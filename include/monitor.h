@@ -0,0 +1,41 @@
+#ifndef MONITOR_H
+#define MONITOR_H
+
+#include <chrono>
+#include <memory>
+
+#include "imux.h"
+
+
+/**
+	Sends heartbeats over every link attached to the IMux and moves the links through
+	their LinkHealth states when the heartbeats go unanswered. Restartable links that stay
+	down are shut down, so their owner reconnects them.
+*/
+class LinkMonitor {
+public:
+	// In heartbeat intervals without an ack.
+	static constexpr double SUSPECT_AFTER = 2.5;
+	static constexpr double DOWN_AFTER = 5;
+	static constexpr double RESTART_AFTER = 20;
+
+	LinkMonitor(std::shared_ptr<IMux> imux_ptr, int interval_ms, int debug=0);
+	virtual ~LinkMonitor() = default;
+
+	/**
+		Does whatever is due at time now. Call often, the time between calls decides how
+		fast a silent link is noticed.
+	*/
+	void tick(std::chrono::steady_clock::time_point now);
+private:
+	std::shared_ptr<IMux> imux_ptr;
+	std::chrono::milliseconds interval;
+	std::chrono::steady_clock::duration suspect_after;
+	std::chrono::steady_clock::duration down_after;
+	std::chrono::steady_clock::duration restart_after;
+	std::chrono::steady_clock::time_point next_heartbeat{};
+	int debug;
+};
+
+
+#endif
@@ -4,11 +4,15 @@
 
 #include <string>
 #include <vector>
+#include "affinity.h"
+#include "capture.h"
 #include "socket.h"
 
 
 class Options {
 public:
+	static const int MAX_STREAMS = 64;
+
 	Options();
 	void parse(int argc, char* argv[]);
 	void printHelp(std::ostream &out);
@@ -24,7 +28,22 @@ public:
 	std::string clone_dev;
 	bool options_flag = false;
 	bool close_tun = false;
+	int heartbeat_interval = 100;	// ms, 0 disables heartbeats
+	int reorder_hold = 50;			// ms, 0 disables reordering
+	int max_streams = 4;			// Per TCP link, client side
+	std::string scheduler = "rr";	// Picks the link for every message, see scheduler.h
+	Placement placement;			// CPUs of the threads, by role. Empty: they float
+	int busy_poll = 0;				// us of spinning on reads after the last packet, 0 blocks
+	bool probe_mtu = false;			// Path MTU discovery on UDP links
+	bool size_tun = false;			// Set the tun's MTU to what all links carry
+	int zero_copy = 0;				// Smallest frame TCP links send with MSG_ZEROCOPY, 0 for none
+	std::string stats_path;			// Unix socket for the stats, empty for none
+	bool timestamps = false;		// Stamp messages for the latency histograms
+	std::string capture_path;		// pcapng capture ring, empty for none
+	size_t capture_size_mb = Capture::DEFAULT_SIZE_MB;
+	CaptureFilter capture_filter;
 	std::vector<SocketDescription> sock_des;
+	std::string config_path;		// File the links come from instead of -b, empty for none
 	int major_version = @SIMPLETUN_VERSION_MAJOR@;
 	int minor_version = @SIMPLETUN_VERSION_MINOR@;
 	int patch_version = @SIMPLETUN_VERSION_PATCH@;
@@ -0,0 +1,61 @@
+#ifndef PACKET_H
+#define PACKET_H
+
+#include <inttypes.h>
+#include <stddef.h>
+
+
+/**
+	Helpers that peek into the inner (tunneled) IP packets. They never trust the packet:
+	anything that can't be parsed is treated as a single anonymous flow.
+*/
+namespace packet {
+
+	/**
+		Traffic classes, from most to least urgent. The numeric value is used as index, so
+		keep them dense.
+	*/
+	enum Class : uint8_t {
+		INTERACTIVE = 0,	// Pure TCP ACKs, DNS, ICMP, EF and network control DSCPs
+		ASSURED = 1,		// AF marked DSCPs
+		BULK = 2,			// Everything else
+	};
+	const int CLASSES = 3;
+
+	/**
+		Puts the packet in a traffic class by looking at its DSCP, protocol, ports and TCP
+		flags. Cheap enough to call for every packet read from the tun. Like flowHash()
+		and transport(), it looks past IPv6 extension headers.
+	*/
+	Class classify(const char *pkt, size_t len);
+
+	/**
+		Hashes the inner flow (addresses, protocol and ports if present) of an IPv4 or
+		IPv6 packet. Packets of the same flow always end up with the same hash.
+	*/
+	uint32_t flowHash(const char *pkt, size_t len);
+
+	/**
+		Finds the transport protocol and, for TCP and UDP, the ports. Ports are 0 when
+		there are none (other protocols, non-first fragments, truncated packets). Returns
+		false if the packet isn't IPv4 or IPv6.
+	*/
+	bool transport(const char *pkt, size_t len, uint8_t &proto, uint16_t &src_port,
+		uint16_t &dst_port);
+
+	/**
+		Returns true if the packet's ECN field says the sender understands ECN
+		(ECT(0) or ECT(1)), or if the packet was already marked.
+	*/
+	bool isECNCapable(const char *pkt, size_t len);
+
+	/**
+		Sets the ECN field to CE (congestion experienced). Only works on ECN capable
+		packets, returns false otherwise. Fixes up the IPv4 header checksum.
+	*/
+	bool markCongestion(char *pkt, size_t len);
+
+}
+
+
+#endif
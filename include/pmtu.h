@@ -0,0 +1,69 @@
+#ifndef PMTU_H
+#define PMTU_H
+
+#include <inttypes.h>
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+
+
+/**
+	Path MTU discovery for a datagram link, after RFC 8899 (DPLPMTUD), in frames: the
+	whole message, header and trailers included, as it goes into one datagram.
+
+	Padded probes go out as control messages, with the don't fragment bit set. A probe
+	that's acked got through. One that goes unanswered MAX_PROBES times in a row did not.
+	The first probe of a search is the limit itself (the peer's maximum frame), so a clean
+	path is confirmed in one round trip. After that, the search halves the range between
+	the largest confirmed size and the smallest failed one. Every RAISE_AFTER, the search
+	starts over, for paths that got better.
+
+	The MTU starts at BASE, like RFC 8899's BASE_PLPMTU, as the don't fragment bit is set
+	from the start: anything bigger could be dropped on the way. Acked probes raise it to
+	the largest confirmed size, failed ones never take it below BASE.
+*/
+class PathMTU {
+public:
+	typedef std::chrono::steady_clock::time_point TimePoint;
+
+	// IPv6's minimum MTU (1280) less the IPv6 and UDP headers. Presumed to work.
+	static const uint16_t BASE = 1232;
+	static const int MAX_PROBES = 3;
+	static const uint16_t GRANULARITY = 16;	// Searching stops when the range is this small
+	static constexpr std::chrono::milliseconds PROBE_TIMEOUT{500};
+	static constexpr std::chrono::minutes RAISE_AFTER{10};
+
+	/**
+		Sets the largest frame to search up to and starts searching.
+	*/
+	void start(uint16_t limit);
+
+	/**
+		The size of the probe to send at time now, 0 if none is due. Gives up on the
+		probe in flight if it timed out.
+	*/
+	uint16_t next(TimePoint now);
+
+	/**
+		A probe of the size was acked. Returns true if the MTU changed.
+	*/
+	bool onAck(uint16_t size);
+
+	uint16_t getMTU() const {return mtu.load(std::memory_order_relaxed);};
+	bool isSearching();
+private:
+	std::mutex mutex;
+	std::atomic<uint16_t> mtu{UINT16_MAX};
+	uint16_t limit = 0;			// 0: not started
+	uint16_t confirmed = 0;		// Largest acked
+	uint16_t failed = 0;		// Smallest that didn't get through, 0 if none did
+	uint16_t probing = 0;		// In flight
+	int tries = 0;
+	TimePoint sent_at{};
+	TimePoint raise_at{};
+	bool searching = false;
+};
+
+
+#endif
@@ -0,0 +1,94 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "imux.h"
+#include "socket.h"
+
+
+/**
+	The parallel connections (streams) of a single TCP link. One TCP connection can't
+	send faster than its congestion window allows, however much the IMux offers it. When
+	the streams keep their windows full (as reported by TCP_INFO) the pool asks for one
+	more, up to max_streams. When the link stays idle, it lets the newest one go again:
+	it's retired from the IMux, and closes once it has sent its queue.
+
+	The pool only decides how many streams are wanted. Its owner runs a thread per stream
+	that connects it while it's wanted and waits while it's not.
+*/
+class StreamPool {
+public:
+	static constexpr std::chrono::seconds SCALE_INTERVAL{1};
+	// Share of the samples in an interval that must be cwnd limited to grow.
+	static const int GROW_PERCENT = 50;
+	// Share of the samples in an interval with (next to) nothing in flight to count as
+	// idle. Heartbeats and their delayed ACKs keep a segment in flight now and then.
+	static const int IDLE_PERCENT = 90;
+	static const uint32_t IDLE_SEGMENTS = 2;
+	// Idle intervals in a row before a stream is dropped.
+	static const int SHRINK_AFTER = 5;
+
+	StreamPool(const std::string &name, int max_streams, std::shared_ptr<IMux> imux_ptr,
+		int debug=0);
+	virtual ~StreamPool() = default;
+
+	int getMaxStreams() {return max_streams;};
+	int getWanted();
+	bool isWanted(int stream);
+
+	/**
+		Blocks until the stream is wanted, or the pool is closed.
+	*/
+	void waitUntilWanted(int stream);
+
+	/**
+		Sleeps for duration, but returns early (false) when the stream is no longer wanted.
+	*/
+	bool sleepWhileWanted(int stream, std::chrono::milliseconds duration);
+
+	/**
+		Called by the stream's thread when it's connected and when it's lost.
+	*/
+	void add(int stream, std::shared_ptr<TCPSocket> socket);
+	void remove(int stream);
+
+	/**
+		The link is going away: no stream is wanted any more, and the threads waiting
+		for one to be wake up.
+	*/
+	void close();
+
+	/**
+		Samples the connected streams and decides about growing or shrinking once every
+		SCALE_INTERVAL. Call often; the samples are only as good as their number.
+	*/
+	void tick(std::chrono::steady_clock::time_point now);
+private:
+	void decide();
+
+	std::string name;
+	int max_streams;
+	std::shared_ptr<IMux> imux_ptr;
+	int debug;
+
+	std::mutex mutex;
+	std::condition_variable wanted_changed;
+	int wanted = 1;
+	bool closed = false;
+	std::vector<std::shared_ptr<TCPSocket>> streams;	// nullptr if not connected
+
+	std::chrono::steady_clock::time_point next_decision{};
+	int samples = 0;
+	int limited_samples = 0;
+	int idle_samples = 0;
+	int idle_intervals = 0;
+};
+
+
+#endif
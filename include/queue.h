@@ -4,35 +4,120 @@
 #include <inttypes.h>
 #include <stdlib.h>
 #include <arpa/inet.h>
+#include <endian.h>
 
 #include <string.h>
 #include <sys/types.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <memory>
+#include <mutex>
 #include <vector>
 
+#include "packet.h"
+#include "stats.h"
+
 struct Message {
 	/*	Message format (in bytes):
 	 *
-	 *  	|   2    |  1   |  1..PAYLOAD_SIZE |
- 	 * 		| plsize | type | payload ...      |
+	 *  	|   2    |  1   |  1..PAYLOAD_SIZE |   0..   |
+ 	 * 		| plsize | type | payload ...      | trailers |
 	 *
 	 * 	plsize and type are always set, as soon as possible.
-	 *	plsize denotes the payload size. 
+	 *	plsize denotes the payload size, trailers included.
 	 *	Total message size is plsize + Message::HEADER_LENGTH
+	 *
+	 *	Flags in the type byte tell which trailers follow the payload. They're appended
+	 *	in the order below and stripped in reverse by parseTrailers():
+	 *		FLAG_TIMESTAMP: 8 byte wall clock time in ns the message was read from the
+	 *			tun (network order)
+	 *		FLAG_SEQ: 4 byte sequence number (network order)
 	 */
 	static const uint16_t BUF_SIZE = 2000;
 	static const uint16_t PAYLOAD_SIZE = 1997;
 	static const uint16_t HEADER_LENGTH = 3;
+	static const uint16_t TRAILER_SPACE = 16;	// Kept free for trailers when filling the
+												// payload from the tun
 
 	static const char DATA = '0';
 	static const char CONTROL = '1';
 
+	static const char FLAG_SEQ = 0x40;
+	// Not 0x20 or 0x10, those are part of '0' and '1' themselves.
+	static const char FLAG_TIMESTAMP = static_cast<char>(0x80);
+	static const char FLAGS = FLAG_SEQ | FLAG_TIMESTAMP;
+	static const uint16_t SEQ_LENGTH = 4;
+	static const uint16_t TIMESTAMP_LENGTH = 8;
+
 	char buffer[BUF_SIZE];
 	char *payload;
 	uint16_t payload_length;
 	char type;
 
+	// Filled in by appendSeq() or parseTrailers().
+	bool has_seq = false;
+	uint32_t seq = 0;
+
+	// Wall clock time the message was read from the tun, stats::wallNanos(). Set by the
+	// IMux on this side, only with timestamps (-l); sent over the wire (and filled in by
+	// parseTrailers() on the other side) only if appendTimestamp() is called.
+	uint64_t tun_ns = 0;
+	bool has_timestamp = false;
+
+	// Receiving side: when the kernel got the message, and the latency histograms of the
+	// link it came in on. Not sent over the wire.
+	uint64_t received_ns = 0;
+	std::shared_ptr<stats::Latency> latency;
+
+	// Receiving side: the link and stream the message came in on. Not sent over the wire.
+	uint32_t link_id = 0;
+	uint8_t stream = 0;
+
+	// Set when the message is put in a link's send queue. The queue compares it with the
+	// time of dequeueing to get the sojourn time. Not sent over the wire.
+	std::chrono::steady_clock::time_point queued_at;
+
+	// Set by the IMux classifier, decides the message's band in the send queue. Not sent
+	// over the wire.
+	packet::Class traffic_class = packet::BULK;
+
 	Message() : payload(buffer + 3) {}
 
+	// Only copies the part of the buffer that's in use, and keeps payload pointing into
+	// its own buffer.
+	Message(const Message &other) : payload(buffer + HEADER_LENGTH) {
+		*this = other;
+	}
+
+	Message &operator=(const Message &other) {
+		if (this != &other) {
+			memcpy(buffer, other.buffer, HEADER_LENGTH + other.payload_length);
+			payload_length = other.payload_length;
+			type = other.type;
+			has_seq = other.has_seq;
+			seq = other.seq;
+			tun_ns = other.tun_ns;
+			has_timestamp = other.has_timestamp;
+			received_ns = other.received_ns;
+			latency = other.latency;
+			link_id = other.link_id;
+			stream = other.stream;
+			queued_at = other.queued_at;
+			traffic_class = other.traffic_class;
+		}
+		return *this;
+	}
+
+	/**
+		Message kind (DATA or CONTROL), without the trailer flags.
+	*/
+	char kind() const {
+		return type & ~FLAGS;
+	}
+
 	void setType(const char type) {
 		this->type = type;
 		//memcpy(buffer + 2, &type, 1);
@@ -55,6 +140,44 @@ struct Message {
 		type = buffer[2];
 	}
 
+	void appendSeq(uint32_t seq) {
+		uint32_t net_seq = htonl(seq);
+		memcpy(payload + payload_length, &net_seq, SEQ_LENGTH);
+		setSize(payload_length + SEQ_LENGTH);
+		setType(type | FLAG_SEQ);
+		has_seq = true;
+		this->seq = seq;
+	}
+
+	void appendTimestamp() {
+		uint64_t net_ns = htobe64(tun_ns);
+		memcpy(payload + payload_length, &net_ns, TIMESTAMP_LENGTH);
+		setSize(payload_length + TIMESTAMP_LENGTH);
+		setType(type | FLAG_TIMESTAMP);
+		has_timestamp = true;
+	}
+
+	/**
+		Strips the trailers off a received message, leaving payload_length at the size of
+		the payload alone. Call after the whole message was read.
+	*/
+	void parseTrailers() {
+		if ((type & FLAG_SEQ) && payload_length >= SEQ_LENGTH) {
+			uint32_t net_seq;
+			payload_length -= SEQ_LENGTH;
+			memcpy(&net_seq, payload + payload_length, SEQ_LENGTH);
+			seq = ntohl(net_seq);
+			has_seq = true;
+		}
+		if ((type & FLAG_TIMESTAMP) && payload_length >= TIMESTAMP_LENGTH) {
+			uint64_t net_ns;
+			payload_length -= TIMESTAMP_LENGTH;
+			memcpy(&net_ns, payload + payload_length, TIMESTAMP_LENGTH);
+			tun_ns = be64toh(net_ns);
+			has_timestamp = true;
+		}
+	}
+
 	uint16_t getPayloadSize() {
 		uint16_t size;
 		memcpy((char*) &size, buffer, 2);
@@ -63,15 +186,124 @@ struct Message {
 };
 
 
-/*
+class MessagePool;
+
+/**
+	Gives messages that came from a MessagePool back to it, deletes the others.
+*/
+struct MessageDeleter {
+	MessagePool *pool = nullptr;
+	void operator()(Message *msg) const;
+};
+
+
+typedef std::unique_ptr<Message, MessageDeleter> MessagePtr;
+
+
+/**
+	Send queue of a single link. Implements FQ-CoDel (RFC 8290): messages are hashed on
+	their inner flow into sub-queues that are served by deficit round robin, and every
+	sub-queue runs CoDel (RFC 8289) on the sojourn time of its messages. ECN capable inner
+	packets are marked instead of dropped.
+
+	On top of that, interactive messages go into a strict priority band that is always
+	served first, and flows of assured messages get a double quantum. When the queue is
+	full, the flow holding the most bytes loses its oldest message. The priority band only
+	loses messages once the flows are empty.
+
+	Safe to use with multiple producers and a single consumer.
+*/
 class Queue {
 public:
-	Queue();
-	void enqueue(Message);
-	Message &dequeue();
+	static const size_t FLOWS = 64;
+	static const size_t LIMIT = 1024;		// Messages over all sub-queues
+	static const int QUANTUM = 1514;		// Bytes per round
+	static const size_t PRIORITY_LIMIT = 128;	// Messages in the priority band, the
+											// rest spills over into the normal flows
+	static constexpr std::chrono::microseconds TARGET{5000};
+	static constexpr std::chrono::microseconds INTERVAL{100000};
+
+	Queue(size_t limit=LIMIT);
+	virtual ~Queue() = default;
+
+	/**
+		Takes ownership of the message. Returns false if it (or another message, to make
+		room) was dropped because the queue is full.
+	*/
+	bool enqueue(MessagePtr msg);
+
+	/**
+		Blocks until a message may be sent. Returns nullptr once the queue is closed.
+		Without wait, it returns nullptr right away if there's nothing to send.
+	*/
+	MessagePtr dequeue(bool wait=true);
+
+	/**
+		Like dequeue(), but gives up at deadline and returns nullptr. See isClosed()
+		for why.
+	*/
+	MessagePtr dequeueUntil(std::chrono::steady_clock::time_point deadline);
+	bool isClosed();
+
+	/**
+		Keeps the pool the queued messages may come from alive as long as the queue.
+	*/
+	void holdPool(std::shared_ptr<MessagePool> pool);
+
+	/**
+		Wakes up the consumer, which gets nullptr from now on.
+	*/
+	void close();
+
+	/**
+		Takes no more messages, but lets the consumer have the ones it holds. The queue
+		closes once they're gone.
+	*/
+	void closeWhenEmpty();
+
+	size_t size();
+	uint64_t getDrops() {return drops;};
+	uint64_t getMarks() {return marks;};
+	uint64_t getOverflows() {return overflows;};
+
 private:
-	std::vector<Message> queue;
+	typedef std::chrono::steady_clock::time_point TimePoint;
+
+	struct Flow {
+		std::deque<MessagePtr> messages;
+		size_t bytes = 0;
+		int deficit = 0;
+		int quantum = QUANTUM;
+		bool listed = false;		// Is on new_flows or old_flows
+
+		// CoDel state
+		TimePoint first_above_time{};
+		TimePoint drop_next{};
+		uint32_t count = 0;
+		uint32_t last_count = 0;
+		bool dropping = false;
+	};
+
+	MessagePtr pop(Flow &flow, TimePoint now, bool &ok_to_drop);
+	MessagePtr codelDequeue(Flow &flow, TimePoint now);
+	bool markOrDrop(MessagePtr &msg);
+	void dropFromFattest();
+	static TimePoint controlLaw(TimePoint t, uint32_t count);
+
+	std::shared_ptr<MessagePool> pool;	// First, so it goes after the messages
+	std::mutex mutex;
+	std::condition_variable not_empty;
+	Flow flows[FLOWS];
+	Flow priority_flow;
+	std::list<Flow*> new_flows;
+	std::list<Flow*> old_flows;
+	size_t limit;
+	size_t length = 0;
+	bool closed = false;
+	bool closing = false;		// Closes when it runs empty
+	std::atomic<uint64_t> drops{0};		// Dropped by CoDel
+	std::atomic<uint64_t> marks{0};		// ECN marked by CoDel
+	std::atomic<uint64_t> overflows{0};	// Dropped because the queue was full
 };
-*/
 
 #endif
\ No newline at end of file
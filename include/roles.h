@@ -1,26 +1,137 @@
 #ifndef ROLES_H
 #define ROLES_H
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <thread>
+#include <vector>
 
+#include "affinity.h"
+#include "capture.h"
+#include "device.h"
 #include "options.h"
 #include "imux.h"
 #include "idemux.h"
+#include "monitor.h"
+#include "pool.h"
 #include "socket.h"
+#include "stats.h"
 #include "tun.h"
 
 
 class Endpoint {
 public:
-	Endpoint(const Options &options);
+	static constexpr std::chrono::milliseconds TIMER_TICK{10};
+	// How often the links' receivers are compared with where the kernel steers their
+	// packets.
+	static constexpr std::chrono::seconds STEERING_CHECK{10};
+
+	/**
+		Reads and writes the packets to tunnel on the given device, or on the tun the
+		options ask for if there's none.
+	*/
+	Endpoint(const Options &options, std::shared_ptr<PacketDevice> device=nullptr);
 	virtual ~Endpoint() = default;
-protected:								// This order is imporant!
-	std::shared_ptr<Tun> tun_ptr;		// first Tun
+
+	/**
+		Reads the configuration file (-g) again and applies what changed: removes,
+		changes and adds links while the tun, IMux and IDeMux keep forwarding. Links
+		take new weights and shaper limits in place, other changes get them new sockets
+		(see config::isRetunable()). A file that doesn't parse changes nothing. Runs on
+		a thread of its own on SIGHUP.
+	*/
+	void reload();
+protected:
+	/**
+		The roles' part of a reload, called one link at a time. Throw SocketException if
+		the link couldn't be set up, a later reload tries again.
+	*/
+	virtual void addLink(const SocketDescription &des) = 0;
+	virtual void removeLink(const SocketDescription &des) = 0;
+	virtual void changeLink(const SocketDescription &from, const SocketDescription &to) = 0;
+
+	/**
+		Gives a socket of a link the weight and shaper limits of its new description.
+	*/
+	void retuneSocket(Socket &socket, const SocketDescription &des);
+
+	/**
+		Run a link's receiving and sending loops, on the CPUs the placement has for the
+		link's index. If the link dies, it's detached from the IMux and both loops are
+		stopped; the other links keep going.
+	*/
+	void runReceiver(std::shared_ptr<Socket> socket, uint32_t index);
+	void runSender(std::shared_ptr<Socket> socket, uint32_t index);
+	void dropLink(std::shared_ptr<Socket> socket);
+
+	/**
+		Reports links whose packets the kernel processes on another CPU (or NUMA node)
+		than the one their receiver is pinned to, so the NIC's IRQ affinity or RPS can be
+		lined up with it. Only with pinned receivers.
+	*/
+	void checkSteering();
+
+	/**
+		Sends the links' MTU probes that are due. With size_tun, and once no link is
+		searching anymore, sets the tun's MTU to the smallest the links carry, less the
+		message header and trailers.
+	*/
+	void checkPathMTU(std::chrono::steady_clock::time_point now);
+
+	/**
+		Starts the timer thread. It drives the link monitor (if heartbeats are enabled),
+		the IDeMux's reorder timeouts and the capture snapshots.
+	*/
+	void startTimer();
+	void timerLoop();
+
+	/**
+		Starts serving the stats, if asked for.
+	*/
+	void startStats();
+	void renderStats(stats::Writer &writer);
+
+	/**
+		Runs on the timer thread every TIMER_TICK, for the roles' own periodic work.
+	*/
+	virtual void onTimer(std::chrono::steady_clock::time_point) {};
+
+	/**
+		Installs SIGHUP as the reload trigger, like Capture::installTrigger(). The timer
+		thread starts the reload.
+	*/
+	static void installReloadTrigger();
+	static void onReloadSignal(int);
+	void pollReload();
+	static std::atomic<bool> reload_requested;
+
+	std::thread timer_t;
+								// This order is imporant!
+	std::shared_ptr<PacketDevice> tun_ptr;	// first Tun (or another device)
 	std::shared_ptr<IMux> imux_ptr;		// IMux uses Tun
 	std::shared_ptr<IDeMux> idemux_ptr;	// IDeMux uses tun as well
+	std::shared_ptr<LinkMonitor> monitor_ptr;	// Uses IMux. nullptr if heartbeats are off
+	std::shared_ptr<Capture> capture_ptr;	// Used by IMux and IDeMux. nullptr if not asked for
+	std::unique_ptr<stats::Server> stats_ptr;	// Uses all of the above. nullptr if not asked for
 	std::map<std::string, std::thread> sockets_t;
+	Placement placement;
+	std::mutex steering_mutex;
+	std::map<Socket*, int> receiver_cpus;		// Of the pinned receivers
+	std::map<Socket*, int> reported_cpus;		// Incoming CPU last reported, by link
+	bool timestamps;
+	std::chrono::microseconds busy_poll;	// 0: receivers block
+	bool probe_mtu;
+	bool size_tun;
+	uint16_t zero_copy;		// 0: links copy
+	int tun_mtu = 0;		// Last set, 0 if never
+	std::string config_path;	// Empty if the links came from -b
+	std::vector<SocketDescription> config;	// The links as applied, used by reloads only
+	std::thread reload_t;
+	std::atomic<bool> reloading{false};
 	int debug;
 };
 
@@ -30,16 +141,60 @@ public:
 	/**
 		Reads options and configures the sockets as requested. Doesn't connect yet.
 	*/
-	Client(const Options &options);
+	Client(const Options &options, std::shared_ptr<PacketDevice> device=nullptr);
 	virtual ~Client() = default;
 
+	// A link that stayed up this long gets its reconnection backoff reset.
+	static constexpr std::chrono::seconds STABLE_AFTER{10};
+
 	/**
-		Walks through the sockets and connects them, spawning a new thread per socket
-		to listen with. Then feeds the sockets into its imux and idemuxes.
+		Spawns a thread per link that connects it, feeds it into the imux and keeps
+		reconnecting it whenever it's lost. All links connect at the same time, and
+		traffic flows as soon as the first one is up.
 	*/
 	void start();
 private:
-	std::map<std::string, std::shared_ptr<Socket>> socket_ptrs;
+	/**
+		A link of the configuration, shared with the threads of its streams.
+	*/
+	struct Link {
+		uint32_t id;
+		std::string key;					// Of its description, which keeps it
+		std::unique_ptr<StreamPool> pool;	// nullptr for links of a single connection
+		std::mutex mutex;					// Guards all below
+		std::condition_variable retiring;
+		SocketDescription des;
+		uint32_t generation = 0;			// Counts the changes to des
+		bool retired = false;				// Removed, its threads end
+	};
+
+	std::shared_ptr<Link> makeLink(uint32_t id, const SocketDescription &des);
+	std::shared_ptr<Link> findLink(const std::string &key);
+	std::shared_ptr<Socket> createSocket(const SocketDescription &des);
+
+	/**
+		Starts a thread per stream the link may grow to. Hold links_mutex.
+	*/
+	void startLink(std::shared_ptr<Link> link);
+
+	/**
+		Connects the link, receives on it until it's lost, then reconnects with backoff.
+		Each (re)connected link says hello first, binding it to this client's session.
+		TCP links run this for every stream in their pool; a stream waits while the pool
+		doesn't want it. A changed link reconnects right away, a retired one stops.
+	*/
+	void maintainLink(std::shared_ptr<Link> link, int stream);
+	void onTimer(std::chrono::steady_clock::time_point now);
+
+	void addLink(const SocketDescription &des);
+	void removeLink(const SocketDescription &des);
+	void changeLink(const SocketDescription &from, const SocketDescription &to);
+	std::vector<std::shared_ptr<Socket>> socketsOf(uint32_t link_id);
+
+	uint64_t session_id;
+	int max_streams;
+	std::mutex links_mutex;		// Guards links and threads
+	std::vector<std::shared_ptr<Link>> links;	// Indexed by link id, nullptr once removed
 	std::map<std::string, std::thread> threads;
 
 };
@@ -50,7 +205,7 @@ public:
 	/**
 		Reads options and configures the sockets as requested. Doesn't connect yet.
 	*/
-	Server(const Options &options);
+	Server(const Options &options, std::shared_ptr<PacketDevice> device=nullptr);
 	virtual ~Server() = default;
 
 	/**
@@ -60,9 +215,54 @@ public:
 	void start();
 	void performListening();
 private:
+	/**
+		Called for every hello. Starts over when the client restarted (new session),
+		replaces an older connection of the same link and stream, and groups the
+		connection with the other streams of its link in the IMux.
+	*/
+	void onHello(Socket &socket, uint64_t session_id, uint32_t link_id, uint8_t stream);
+	void attachLink(std::shared_ptr<Socket> socket);
+	void startThreads(std::shared_ptr<Socket> socket, uint32_t index);
+	void forgetConnection(const std::string &name);
+
+	/**
+		Forgets the accepted connections that are shut down: lost, replaced by a newer
+		one, or let go by the client's pool. Peers reconnect from new ports, so nothing
+		else would.
+	*/
+	void onTimer(std::chrono::steady_clock::time_point now);
+
+	/**
+		Creates the link's listening or UDP socket. Once started, also the UDP socket's
+		threads, and the listening thread looks at the new listening socket. Hold
+		links_mutex.
+	*/
+	void openLink(const SocketDescription &des, uint32_t index, bool started);
+	std::vector<std::string> connectionsOf(const std::string &listener);
+	void wakeListening();
+
+	void addLink(const SocketDescription &des);
+	void removeLink(const SocketDescription &des);
+	void changeLink(const SocketDescription &from, const SocketDescription &to);
+
+	std::mutex session_mutex;
+	uint64_t current_session = 0;
+	// The connections of a link, by stream. UDP links and single TCP connections only
+	// have stream 0.
+	std::map<uint32_t, std::map<uint8_t, std::weak_ptr<Socket>>> links_by_id;
+
+	// Changed by the listening thread and reloads
+	std::mutex links_mutex;		// Guards all below
 	std::map<std::string, std::unique_ptr<ServerTCPSocket>> listen_socket_ptrs;
+	// Index of the description that a listening or UDP socket came from, by name. Picks
+	// the CPUs of its links.
+	std::map<std::string, uint32_t> link_indexes;
+	uint32_t next_index = 0;
 	std::map<std::string, std::shared_ptr<Socket>> socket_ptrs;
+	std::map<std::string, std::string> listeners;	// Listening socket of a connection, by name
 	std::map<std::string, std::thread> threads;
+	std::map<std::string, std::thread> send_threads;
+	int wake_fd;		// eventfd, wakes the listening thread when its sockets change
 };
 
 
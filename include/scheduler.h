@@ -0,0 +1,112 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <chrono>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "queue.h"
+
+
+/**
+	What a scheduler gets to know about a link. Implemented by Socket, and by the
+	simulator's modeled links.
+*/
+class ScheduledLink {
+public:
+	virtual ~ScheduledLink() = default;
+	virtual bool isUsable() = 0;
+
+	/**
+		Smoothed round trip time, zero while it's not known.
+	*/
+	virtual std::chrono::microseconds getSmoothedRTT() = 0;
+
+	/**
+		Messages waiting to be sent on the link.
+	*/
+	virtual size_t getBacklog() = 0;
+
+	/**
+		Largest message the link carries whole, header and trailers included.
+	*/
+	virtual uint16_t getMTU() {return Message::BUF_SIZE;};
+
+	/**
+		Share of the turns the link gets, relative to the others. 0 keeps it as a
+		standby that's only used when nothing else is.
+	*/
+	virtual int getWeight() {return 1;};
+
+	/**
+		False if the link would hold a message of size bytes back right now, e.g. in its
+		shaper. The IMux then looks for another link that takes it.
+	*/
+	virtual bool admits(uint16_t) {return true;};
+
+	/**
+		Usable, and the message fits, with the trailers the IMux appends once the link
+		is picked.
+	*/
+	bool takes(const Message &msg) {
+		return isUsable() && Message::HEADER_LENGTH + msg.payload_length +
+			Message::SEQ_LENGTH + Message::TIMESTAMP_LENGTH <= getMTU();
+	};
+};
+
+
+/**
+	Decides which link the IMux sends the next message over. Only ever called from one
+	thread (the one reading the tun), so it may keep state without locking.
+*/
+class Scheduler {
+public:
+	virtual ~Scheduler() = default;
+
+	/**
+		Index into links of the link to use, or -1 if none of them takes the message
+		(see ScheduledLink::takes()).
+	*/
+	virtual int pick(const Message &msg, const std::vector<ScheduledLink*> &links) = 0;
+	virtual std::string getName() = 0;
+
+	/**
+		"rr" or "minrtt". Throws std::invalid_argument on other names.
+	*/
+	static std::unique_ptr<Scheduler> create(const std::string &name);
+};
+
+
+/**
+	Takes the usable links in turn, each for as many messages in a row as its weight.
+	Standbys (weight 0) only get what no other link takes.
+*/
+class RoundRobinScheduler : public Scheduler {
+public:
+	int pick(const Message &msg, const std::vector<ScheduledLink*> &links);
+	std::string getName() {return "rr";};
+private:
+	size_t index = 0;
+	int taken = 0;		// Messages the link at index got in this turn
+};
+
+
+/**
+	Prefers the link with the lowest round trip time, as long as its backlog stays below
+	BACKLOG_LIMIT; then the next fastest takes over. When all links are that backed up,
+	the one with the shortest backlog gets the message. Links without an RTT yet count
+	as the fastest, so they're tried. Weights only tell standbys (0) apart, those are
+	used when no other link takes the message.
+*/
+class MinRTTScheduler : public Scheduler {
+public:
+	static const size_t BACKLOG_LIMIT = 32;
+
+	int pick(const Message &msg, const std::vector<ScheduledLink*> &links);
+	std::string getName() {return "minrtt";};
+};
+
+
+#endif
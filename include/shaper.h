@@ -0,0 +1,124 @@
+#ifndef SHAPER_H
+#define SHAPER_H
+
+#include <inttypes.h>
+
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+
+#include "queue.h"
+#include "wheel.h"
+
+
+/**
+	How much a shaped link may send. Parsed from terms separated by '/':
+
+		rate=KBIT  burst=BYTES  pps=N  queue=MS  cover=N  size=BYTES
+
+	rate and pps cap the link's bits and messages per second (headers included), burst
+	is what it may send at once after being idle (default 10 ms worth at rate, at least
+	two full messages). Messages over the limits wait up to queue ms (default 50) for
+	their turn, the rest are dropped.
+
+	cover turns the link into cover traffic instead (see CoverTraffic): exactly cover
+	datagrams per second, all of size bytes (default 1200), whether there's anything
+	to send or not. rate, burst and pps don't apply then.
+*/
+struct Shaping {
+	uint64_t rate_kbit = 0;		// 0 means no cap
+	uint64_t burst_bytes = 0;	// 0 means the default
+	uint64_t pps = 0;			// 0 means no cap
+	double queue_ms = 50;
+	uint64_t cover_pps = 0;		// 0 means no cover traffic
+	uint16_t cover_size = 1200;
+
+	/**
+		Throws std::invalid_argument on terms it doesn't understand.
+	*/
+	static Shaping parse(const std::string &spec);
+	std::string describe() const;
+	bool isEmpty() const {return rate_kbit == 0 && pps == 0 && cover_pps == 0;};
+};
+
+
+/**
+	Token bucket shaper for a link's send path: one bucket of bytes, one of messages.
+	Conforming messages go through right away, the others wait in the shaper until the
+	buckets have refilled and are released on a TimerWheel shared by all shapers, so
+	nothing sleeps and no link needs a thread of its own.
+
+	The IMux asks admits() before it gives a shaped link a message, and spills it over
+	to another link if it doesn't.
+
+	Create with std::make_shared: pending timers only hold on to it weakly.
+*/
+class Shaper : public std::enable_shared_from_this<Shaper> {
+public:
+	typedef std::chrono::steady_clock Clock;
+	typedef std::function<void(MessagePtr)> Release;
+
+	Shaper(const Shaping &shaping, Release release, TimerWheel &wheel=TimerWheel::shared());
+	Shaper(const Shaper&) = delete;
+	Shaper &operator=(const Shaper&) = delete;
+
+	/**
+		True if a message of size bytes would go through right now.
+	*/
+	bool admits(uint16_t size);
+
+	/**
+		Releases the message now or later. Returns false if it had to be dropped because
+		the shaper holds too much already.
+	*/
+	bool submit(MessagePtr message);
+
+	/**
+		Takes the new limits, keeping what's held. For links that stay shaped; cover
+		traffic can't be switched on or off this way.
+	*/
+	void retune(const Shaping &shaping);
+
+	/**
+		Drops what's held. Nothing is released anymore once it returns.
+	*/
+	void stop();
+
+	uint64_t getDelayed() {return delayed;};
+	uint64_t getDropped() {return dropped;};
+private:
+	void configure(const Shaping &shaping);
+	void refill(Clock::time_point now);
+	bool conforms(uint16_t size);
+	void take(uint16_t size);
+	void drain();
+	void scheduleDrain(Clock::time_point now);
+
+	Release release;
+	TimerWheel &wheel;
+
+	std::mutex mutex;		// Guards all below. Held while releasing, see stop()
+	Shaping shaping;
+	double bytes_per_ns;
+	double packets_per_ns;
+	double burst;				// Bytes
+	double packet_burst;
+	std::chrono::nanoseconds max_wait;
+	double tokens;
+	double packet_tokens;
+	Clock::time_point refilled_at;
+	std::deque<MessagePtr> held;
+	size_t held_bytes = 0;
+	bool drain_pending = false;
+	bool stopped = false;
+	std::atomic<uint64_t> delayed{0};
+	std::atomic<uint64_t> dropped{0};
+};
+
+
+#endif
@@ -0,0 +1,129 @@
+#ifndef SHM_H
+#define SHM_H
+
+#include <inttypes.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <atomic>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+
+class ShmException : public std::exception {
+private:
+	std::string errorMsg;
+public:
+	ShmException(const std::string &msg)
+		: errorMsg(msg) {}
+	~ShmException() throw() {};
+	virtual const char* what() const throw() {
+		return errorMsg.c_str();
+	}
+};
+
+
+/**
+	Single producer, single consumer ring of messages in shared memory, one direction of
+	a ShmChannel. Slots hold one message each, with its length in front.
+
+	Neither side makes a system call while the other keeps up. Only a consumer that
+	found the ring empty, or a producer that found it full, sleeps on an eventfd, and
+	says so in the shared memory first, so the other side knows to write it.
+
+	Both sides also wait on a file descriptor that becomes readable when the link is
+	gone (the Unix socket the channel was set up over), so neither sleeps forever.
+*/
+class ShmRing {
+public:
+	static const uint32_t SLOTS = 1024;				// A power of two. 2 MB, fits the caches
+	static const uint32_t SLOT_SIZE = 2048;
+	static const uint32_t MAX_LENGTH = SLOT_SIZE - sizeof(uint16_t);
+	static const int YIELDS = 16;		// Before a consumer sleeps
+
+	/**
+		The part in shared memory. Zeroed memory is an empty ring.
+	*/
+	struct Shared {
+		alignas(64) std::atomic<uint32_t> head;		// Next slot to read
+		alignas(64) std::atomic<uint32_t> tail;		// Next slot to write
+		alignas(64) std::atomic<uint32_t> consumer_waiting;
+		alignas(64) std::atomic<uint32_t> producer_waiting;
+		alignas(64) char slots[SLOTS][SLOT_SIZE];
+	};
+
+	ShmRing(Shared *shared, int data_fd, int space_fd) :
+		shared(shared), data_fd(data_fd), space_fd(space_fd) {}
+
+	/**
+		Producer. Copies the buffers into the next slot, waiting for one to become free
+		if the ring is full. Returns false if closed_fd became readable while waiting.
+		Throws ShmException if it's longer than MAX_LENGTH.
+	*/
+	bool push(const struct iovec *iov, int count, int closed_fd);
+
+	/**
+		Consumer. Copies the next message into buf (up to max bytes) and returns its
+		length, -1 if the ring is empty.
+	*/
+	ssize_t pop(char *buf, size_t max);
+
+	/**
+		Consumer. Waits until there's something to pop(), yielding the CPU a few times
+		before it sleeps. Returns false if closed_fd became readable instead.
+	*/
+	bool wait(int closed_fd);
+
+	uint64_t getWakeups() {return wakeups;};		// eventfd writes
+	uint64_t getSleeps() {return sleeps;};
+private:
+	bool sleep(int fd, int closed_fd);
+	void wake(int fd);
+
+	Shared *shared;
+	int data_fd;		// Written when there's something new for a sleeping consumer
+	int space_fd;		// Written when there's room for a sleeping producer
+	std::atomic<uint64_t> wakeups{0};
+	std::atomic<uint64_t> sleeps{0};
+};
+
+
+/**
+	Both directions of a link between two processes on this host: two ShmRings in a
+	memfd, and their eventfds. The client creates it and passes the file descriptors to
+	the server over their Unix socket (SCM_RIGHTS), the server maps the same memory with
+	the directions swapped.
+*/
+class ShmChannel {
+public:
+	/**
+		Client side. Creates the memory and eventfds and sends them over unix_fd.
+	*/
+	static std::unique_ptr<ShmChannel> create(int unix_fd);
+
+	/**
+		Server side. Receives them from unix_fd. Blocks until they arrive, or until the
+		socket's receive timeout.
+	*/
+	static std::unique_ptr<ShmChannel> receive(int unix_fd);
+
+	~ShmChannel();
+	ShmChannel(const ShmChannel&) = delete;
+	ShmChannel &operator=(const ShmChannel&) = delete;
+
+	ShmRing &getIn() {return *in;};
+	ShmRing &getOut() {return *out;};
+private:
+	static const int FDS = 5;		// memfd, then data and space eventfds per direction
+
+	ShmChannel(int fds[FDS], bool client);
+
+	int fds[FDS];
+	void *memory = nullptr;
+	std::unique_ptr<ShmRing> in;
+	std::unique_ptr<ShmRing> out;
+};
+
+
+#endif
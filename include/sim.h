@@ -0,0 +1,128 @@
+#ifndef SIM_H
+#define SIM_H
+
+#include <chrono>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "idemux.h"
+#include "mempool.h"
+#include "scheduler.h"
+
+
+/**
+	A modeled link: fixed round trip time, a bottleneck of the given rate with a drop tail
+	queue, and random loss after the bottleneck.
+*/
+struct SimLinkModel {
+	double rtt_ms = 20;
+	double rate_mbit = 10;
+	double loss = 0;		// Fraction, 0..1
+	double queue_ms = 100;
+
+	std::string describe() const;
+};
+
+
+struct SimConfig {
+	std::vector<SimLinkModel> links;
+	std::string scheduler = "rr";
+	int reorder_hold_ms = 50;
+	size_t packet_size = 1400;
+	double load = 0.9;		// Offered, as a fraction of the links' total rate
+	double seconds = 10;	// Simulated time the traffic runs
+	uint64_t seed = 1;
+};
+
+
+struct SimResult {
+	uint64_t offered = 0;
+	uint64_t delivered = 0;		// Written to the (simulated) tun
+	uint64_t queue_drops = 0;	// Links' bottleneck queues were full
+	uint64_t link_losses = 0;
+	uint64_t unschedulable = 0;	// The scheduler had no link
+	uint64_t reordered = 0;		// Held by the IDeMux for an earlier message
+	uint64_t late = 0;			// Arrived after the IDeMux gave up on them
+	size_t max_held = 0;		// Deepest the IDeMux's reorder buffer got
+	double goodput_mbit = 0;
+	double latency_p50_ms = 0;	// From the source to the tun
+	double latency_p99_ms = 0;
+	uint64_t events = 0;
+	double wall_seconds = 0;
+};
+
+
+/**
+	Discrete event simulation of a client's data path, on a virtual clock: a constant rate
+	source, the IMux's own routing (the real Scheduler, and spilling over), modeled links,
+	and the real IDeMux putting the messages back in order. Runs as fast as the events can
+	be processed, and the same config always gives the same result.
+
+	There are only three kinds of events: the source sends, the IDeMux flushes, and a
+	message arrives. A link's messages arrive in the order they were sent (its bottleneck
+	is first in, first out and its delay fixed), so the next event is the earliest of the
+	next send, the next flush and every link's next arrival. No event queue, and nothing
+	allocated per event.
+*/
+class Simulation {
+public:
+	typedef std::chrono::steady_clock::time_point TimePoint;
+
+	// How often the IDeMux gives up on gaps, as the Endpoint's timer does.
+	static constexpr std::chrono::milliseconds FLUSH_INTERVAL{10};
+
+	Simulation(const SimConfig &config);
+	virtual ~Simulation();
+	Simulation(const Simulation&) = delete;
+	Simulation &operator=(const Simulation&) = delete;
+
+	SimResult run();
+
+	TimePoint now() {return clock;};
+private:
+	class Link;
+	class Device;
+
+	/**
+		When an event is due. Events at the same time run in the order they were
+		scheduled.
+	*/
+	struct Due {
+		TimePoint when;
+		uint64_t order;
+		bool operator<(const Due &other) const {
+			return when != other.when ? when < other.when : order < other.order;
+		}
+	};
+	Due due(TimePoint when) {return {std::max(when, clock), next_order++};};
+
+	void sendNext();
+	void flush();
+	bool arriving();
+
+	SimConfig config;
+	SimResult result;
+	TimePoint clock;
+	TimePoint end;
+	uint64_t next_order = 0;
+	std::mt19937_64 rng;
+
+	std::unique_ptr<MessagePool> message_pool;	// Before anything that holds messages
+	std::shared_ptr<Device> device;
+	std::shared_ptr<IDeMux> idemux;
+	std::unique_ptr<Scheduler> scheduler;
+	std::vector<std::unique_ptr<Link>> links;
+	std::vector<ScheduledLink*> links_vector;
+	std::chrono::nanoseconds send_interval;
+	uint32_t next_seq = 0;
+
+	bool sending = false;
+	Due next_send;
+	bool flushing = false;
+	Due next_flush;
+};
+
+
+#endif
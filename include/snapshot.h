@@ -0,0 +1,178 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+
+/**
+	Hands out reader slots to threads, one per thread for its whole lifetime. The slot is
+	returned when the thread exits. Threads beyond MAX_READERS all get SHARED, which users
+	of the slots have to be prepared to share between threads.
+*/
+class ReaderSlots {
+public:
+	static const int MAX_READERS = 256;
+	static const int SHARED = MAX_READERS;
+	static const int SLOTS = MAX_READERS + 1;	// Including SHARED
+	static int mine();
+private:
+	struct Claim {
+		Claim();
+		~Claim();
+		int index;
+	};
+	static std::mutex mutex;
+	static std::vector<int> free_slots;
+	static int next_slot;
+};
+
+
+/**
+	Publishes immutable versions of a T, RCU style. Readers pin the current version without
+	taking a lock and keep using it for as long as their ReadGuard lives. Writers copy the
+	current version, change the copy and swap it in atomically. Old versions are freed with
+	epoch based reclamation once no reader can still see them.
+
+	Readers must not hold on to a guard for long; it holds back reclamation.
+
+		Snapshot<Links>::ReadGuard links(snapshot);
+		links->doSomething();
+*/
+template <typename T>
+class Snapshot {
+public:
+	class ReadGuard {
+	public:
+		ReadGuard(Snapshot &owner) : owner(owner), index(ReaderSlots::mine()) {
+			if (index == ReaderSlots::SHARED) {
+				owner.pinShared();
+			} else if (owner.slots[index].depth++ == 0) {
+				owner.slots[index].epoch.store(owner.global_epoch.load());
+			}
+			value = owner.current.load();
+		}
+		~ReadGuard() {
+			if (index == ReaderSlots::SHARED) {
+				owner.unpinShared();
+			} else if (--owner.slots[index].depth == 0) {
+				owner.slots[index].epoch.store(0, std::memory_order_release);
+			}
+		}
+		ReadGuard(const ReadGuard&) = delete;
+		ReadGuard &operator=(const ReadGuard&) = delete;
+		const T &operator*() const {return *value;};
+		const T *operator->() const {return value;};
+	private:
+		Snapshot &owner;
+		int index;
+		const T *value;
+	};
+
+	Snapshot() : current(new T()) {}
+	virtual ~Snapshot() {
+		delete current.load();
+		for (auto it=retired.begin(); it!=retired.end(); it++) {
+			delete it->second;
+		}
+	}
+	Snapshot(const Snapshot&) = delete;
+	Snapshot &operator=(const Snapshot&) = delete;
+
+	/**
+		Copies the current version, lets change() modify the copy and publishes it.
+		Writers are serialized.
+	*/
+	void update(const std::function<void(T&)> &change) {
+		std::lock_guard<std::mutex> lock(writer_mutex);
+		T *next = new T(*current.load());
+		change(*next);
+		const T *old = current.exchange(next);
+		uint64_t epoch = global_epoch.fetch_add(1);
+		retired.push_back({epoch, old});
+		reclaim();
+	}
+
+	/**
+		Frees the versions no reader can see anymore. Done by update() already, but can
+		be called to release memory when there are no updates for a while.
+	*/
+	void collect() {
+		std::lock_guard<std::mutex> lock(writer_mutex);
+		reclaim();
+	}
+
+private:
+	// Padded to a cache line so readers on different cores don't share lines. Padding
+	// rather than alignas, as C++14's new doesn't honour extended alignment.
+	struct Slot {
+		std::atomic<uint64_t> epoch{0};		// 0 means the slot's thread doesn't read
+		int depth = 0;						// Only touched by the slot's own thread
+		char padding[64 - sizeof(std::atomic<uint64_t>) - sizeof(int)];
+	};
+
+	// The shared slot counts its readers in the top bits of one word and keeps the epoch
+	// the first of them pinned in the rest. Later ones may see newer versions only, so
+	// that epoch covers them too until the last one leaves.
+	static const int SHARED_COUNT_SHIFT = 48;
+	static const uint64_t SHARED_EPOCH_MASK = (uint64_t(1) << SHARED_COUNT_SHIFT) - 1;
+
+	void pinShared() {
+		uint64_t word = shared.load();
+		uint64_t next;
+		do {
+			uint64_t epoch = word & SHARED_EPOCH_MASK;
+			if (epoch == 0) {
+				epoch = global_epoch.load();
+			}
+			next = (((word >> SHARED_COUNT_SHIFT) + 1) << SHARED_COUNT_SHIFT) | epoch;
+		} while (!shared.compare_exchange_weak(word, next));
+	}
+
+	void unpinShared() {
+		uint64_t word = shared.load();
+		uint64_t next;
+		do {
+			uint64_t count = (word >> SHARED_COUNT_SHIFT) - 1;
+			next = count == 0 ? 0 : (count << SHARED_COUNT_SHIFT) | (word & SHARED_EPOCH_MASK);
+		} while (!shared.compare_exchange_weak(word, next, std::memory_order_release));
+	}
+
+	void reclaim() {
+		// A reader that pinned epoch e may see any version that was retired at e or later.
+		uint64_t oldest = UINT64_MAX;
+		for (int i = 0; i < ReaderSlots::MAX_READERS; i++) {
+			uint64_t e = slots[i].epoch.load();
+			if (e != 0 && e < oldest) {
+				oldest = e;
+			}
+		}
+		uint64_t e = shared.load() & SHARED_EPOCH_MASK;
+		if (e != 0 && e < oldest) {
+			oldest = e;
+		}
+		auto it = retired.begin();
+		while (it != retired.end()) {
+			if (it->first < oldest) {
+				delete it->second;
+				it = retired.erase(it);
+			} else {
+				++it;
+			}
+		}
+	}
+
+	std::atomic<const T*> current;
+	std::atomic<uint64_t> global_epoch{1};
+	Slot slots[ReaderSlots::MAX_READERS];	// SHARED uses the shared word instead
+	std::atomic<uint64_t> shared{0};
+	std::mutex writer_mutex;
+	std::vector<std::pair<uint64_t, const T*>> retired;
+};
+
+
+#endif
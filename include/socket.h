@@ -1,15 +1,32 @@
 #ifndef SOCKET_H
 #define SOCKET_H
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
 #include <memory>
+#include <mutex>
 #include <stdexcept>
 #include <string>
-
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "busypoll.h"
+#include "control.h"
+#include "cover.h"
+#include "health.h"
+#include "pmtu.h"
 #include "idemux.h"
 #include "queue.h"
+#include "scheduler.h"
+#include "shaper.h"
+#include "shm.h"
+#include "stats.h"
+#include "zerocopy.h"
 
 // http://stackoverflow.com/questions/28828957/enum-to-string-in-modern-c-and-future-c17
-enum class SocketType {TCP, UDP};
+enum class SocketType {TCP, UDP, XDP, UNIX, SHM};
 
 
 static SocketType string2SocketType(std::string s) {
@@ -17,6 +34,12 @@ static SocketType string2SocketType(std::string s) {
 		return SocketType::TCP;
 	} else if (s == "UDP") {
 		return SocketType::UDP;
+	} else if (s == "XDP") {
+		return SocketType::XDP;
+	} else if (s == "UNIX") {
+		return SocketType::UNIX;
+	} else if (s == "SHM") {
+		return SocketType::SHM;
 	} else {
 		throw std::invalid_argument(s);
 	}
@@ -29,33 +52,283 @@ static std::string socketType2String(SocketType type) {
 			return "TCP";
 		case SocketType::UDP:
 			return "UDP";
+		case SocketType::XDP:
+			return "XDP";
+		case SocketType::UNIX:
+			return "UNIX";
+		case SocketType::SHM:
+			return "SHM";
 	}
 }
 
 
+/**
+	Links to a process on this host. Their descriptions name a Unix socket path instead
+	of an IP and port, and the server listens on it like on a TCP port.
+*/
+inline bool isLocal(SocketType type) {
+	return type == SocketType::UNIX || type == SocketType::SHM;
+}
+
+
 struct SocketDescription {
 	SocketType type;
-	std::string ip;
-	int port;
+	std::string ip;				// The path of local links
+	int port;					// 0 for local links, or which connection to the path
+	std::string impairment;		// Impairment to emulate on the link, see impair.h
+	std::string shaping;		// Caps on what the link sends, see shaper.h
+	int weight = 1;				// See ScheduledLink::getWeight()
+
+	/**
+		Parses TYPE:IP:PORT[:IMPAIRMENT[:SHAPING]], or TYPE:PATH[:IMPAIRMENT[:SHAPING]]
+		for local links. Throws std::invalid_argument.
+	*/
+	static SocketDescription parse(const std::string &spec);
+
+	/**
+		TYPE:IP:PORT, what tells links apart. Also the name of the server's listening
+		and UDP sockets.
+	*/
+	std::string key() const;
 };
 
 
 
 
-class Socket {
+/**
+	Microseconds between two stats::wallNanos() times, 0 if to is before from.
+*/
+uint64_t elapsedMicros(uint64_t from_ns, uint64_t to_ns);
+
+
+class XSK;
+
+
+class Socket : public ScheduledLink {
 public:
+	static constexpr std::chrono::seconds CONNECT_TIMEOUT{5};
+	static constexpr std::chrono::milliseconds ATTEMPT_DELAY{250};
+
 	Socket(const SocketDescription &des, int sock_fd, std::shared_ptr<IDeMux> idemux_ptr,
 		int sock_type_c, int debug=0);
 	Socket(const SocketDescription &des, std::shared_ptr<IDeMux> idemux_ptr, 
 		int sock_type_c, int debug=0);
 	virtual ~Socket();
-	void connectSocket();
+
+	/**
+		Resolves the description and connects. Stream sockets race their addresses
+		Happy Eyeballs style, with non-blocking connects that give up after
+		CONNECT_TIMEOUT.
+	*/
+	virtual void connectSocket();
 	std::string describe();
 	std::string describeFull();
 	virtual void startReceiving()=0;
 	virtual void sendMessage(Message &message)=0;
+
+	/**
+		Sends the buffers as one datagram (or back to back on a stream). Used by cover
+		traffic, which goes around sendMessage() and its impairment.
+	*/
+	virtual void sendVector(struct iovec *iov, int count)=0;
 	virtual bool isReady()=0;
+
+	/**
+		Ready, and the heartbeats say the link works. Only usable links get traffic.
+	*/
+	bool isUsable() {return isReady() && health.getState() == LinkState::UP;};
+	std::chrono::microseconds getSmoothedRTT() {return health.getRTT();};
+	size_t getBacklog() {return send_queue.size();};
+
+	/**
+		Caps what the link sends with a Shaper, in front of the send queue, or replaces
+		the sending thread's loop with CoverTraffic. Call before anything is sent.
+	*/
+	void setShaping(const Shaping &shaping);
+	std::shared_ptr<Shaper> getShaper() {return shaper;};
+	std::shared_ptr<CoverTraffic> getCover() {return cover;};
+
+	/**
+		Has the link's shaper take new limits while it sends. False if that's not
+		possible: the link isn't shaped, or it is or would be cover traffic.
+	*/
+	bool retuneShaping(const Shaping &shaping);
+
+	/**
+		See ScheduledLink::getWeight(). May change while the IMux picks.
+	*/
+	void setWeight(int weight) {this->weight = weight;};
+	int getWeight() override {return weight;};
+
+	/**
+		False if the shaper would hold a message of size bytes back right now.
+	*/
+	bool admits(uint16_t size) override {
+		return (!shaper || shaper->admits(size)) && (!cover || cover->admits());
+	};
+	LinkHealth &getHealth() {return health;};
+	void sendHeartbeat();
+
+	/**
+		Binds the link to a session. Sent by the client on every (re)connect, the server
+		calls the hello handler and answers.
+	*/
+	void sendHello(uint64_t session_id, uint32_t link_id, uint8_t stream=0);
+	typedef std::function<void(Socket&, uint64_t session_id, uint32_t link_id,
+		uint8_t stream)> HelloHandler;
+	void setHelloHandler(HelloHandler handler) {hello_handler = handler;};
+	uint32_t getLinkId() {return link_id;};
+	uint8_t getStream() {return stream;};
+
+	/**
+		What the hello handshake agreed on for the link. Until it's done: version 0,
+		FEATURE_SEQ only and frames up to Message::BUF_SIZE.
+	*/
+	uint8_t getVersion() {return version;};
+	uint32_t getFeatures() {return features;};
+	bool hasFeature(uint32_t feature) {return (features & feature) == feature;};
+	uint16_t getMaxFrame() {return max_frame;};
+
+	/**
+		Has datagram links find their path MTU (see PathMTU) once the peer agreed to it,
+		and sets the don't fragment bit on everything they send: datagrams that don't
+		fit the path are lost rather than fragmented. Call before the hello handshake.
+		Stream links don't need it, the kernel takes care of their segments.
+	*/
+	void enablePathMTU();
+
+	/**
+		Sends the next MTU probe, if one is due. Called periodically.
+	*/
+	void probePathMTU(std::chrono::steady_clock::time_point now);
+	PathMTU &getPathMTU() {return path_mtu;};
+	uint16_t getMTU() {
+		return std::min<uint16_t>({max_frame, path_mtu.getMTU(),
+			cover ? cover->getMTU() : Message::BUF_SIZE});
+	};
+
+	/**
+		Restartable links are shut down by the LinkMonitor when they stay down, so the
+		owner can reconnect them.
+	*/
+	void setRestartable(bool restartable) {this->restartable = restartable;};
+	bool isRestartable() {return restartable;};
+
+	/**
+		Puts the message in the link's send queue. Returns false if the queue had to drop
+		a message, or if the message is bigger than the peer takes (then it's dropped).
+		The actual sending happens on the thread that runs startSending().
+	*/
+	bool enqueueMessage(MessagePtr message);
+
+	/**
+		Drains the send queue into sendMessage(). Blocks, so give it its own thread.
+		With zero copy, waits for the kernel to be done with the messages before it
+		returns, see ZeroCopy::finish(). Shuts the socket down when the queue closes.
+	*/
+	void startSending();
+	Queue &getSendQueue() {return send_queue;};
+
+	/**
+		Indexed by stats::LinkCounter.
+	*/
+	stats::Counters &getCounters() {return counters;};
+	stats::Latency &getLatency() {return *latency;};
+
+	/**
+		Asks the kernel to timestamp received datagrams, for the one way latency of
+		timestamped messages. Without it, they're timed when read.
+	*/
+	void enableTimestamping();
+
+	/**
+		Makes the receive loop spin on non-blocking reads while traffic flows, see
+		BusyPoll, and asks the kernel to busy poll the NIC queue for the socket
+		(SO_BUSY_POLL, SO_PREFER_BUSY_POLL) instead of waiting for its interrupt. Call
+		before startReceiving().
+	*/
+	void enableBusyPoll(std::chrono::microseconds idle);
+	const BusyPoll &getBusyPoll() {return busy_poll;};
+
+	/**
+		Has stream links send frames of at least threshold bytes with MSG_ZEROCOPY, see
+		ZeroCopy. Datagram links keep copying. Call before startSending().
+	*/
+	virtual void enableZeroCopy(uint16_t threshold);
+	const ZeroCopy &getZeroCopy() {return zero_copy;};
+
+	/**
+		The AF_XDP socket of XDP links, once it's up. nullptr for the others.
+	*/
+	virtual XSK *getXSK() {return nullptr;};
+
+	/**
+		The CPU the kernel last processed the link's incoming packets on (where the NIC
+		queue's interrupt or RPS steered them), -1 if nothing came in yet.
+	*/
+	int getIncomingCPU();
+
+	/**
+		Makes startReceiving() and startSending() return. Used when the link is dead.
+	*/
+	void shutdownSocket();
+
+	/**
+		Like shutdownSocket(), but only once the sender has sent what's queued. Takes no
+		more messages meanwhile.
+	*/
+	void finishSending();
+	bool isShutDown() {return shut_down;};
 protected:
+	/**
+		Called by the receive loops for every message. Control messages are handled by
+		the link itself, the rest goes to the IDeMux.
+	*/
+	void deliver(Message &msg);
+	void handleControl(Message &msg);
+	void agree(const control::Hello &agreed);
+
+	/**
+		Counts a message that's bigger than the peer or the path takes. Datagram links
+		drop those (probes among them) instead of failing.
+	*/
+	void dropOversize(const Message &message);
+
+	void resolve();
+	void openSocket(const struct addrinfo *ai);
+	int raceConnect();
+
+	/**
+		recvfrom() that also picks up the kernel's receive timestamp, if any, into
+		msg.received_ns. addr may be nullptr. Busy polls if enabled.
+	*/
+	ssize_t receiveDatagram(Message &msg, struct sockaddr_storage *addr,
+		socklen_t *addr_length);
+
+	/**
+		Delivers the message read into msg, and whatever else the datagram was packed
+		with (see control::FEATURE_PACKED). Padding is skipped.
+	*/
+	void deliverDatagram(Message &msg, ssize_t n_read);
+
+	/**
+		Called with the sender of every datagram that didn't come in through the kernel
+		socket, so the link can follow its peer.
+	*/
+	virtual void notePeer(const struct sockaddr_storage&, socklen_t, const Message&) {}
+
+	/**
+		Sends a frame of cover traffic, counting it.
+	*/
+	void sendCover(Message *message, struct iovec *iov, int count);
+	void sendLoop();
+
+	/**
+		Sends the message without copying it and keeps it until the kernel is done with
+		it. Only called if zero copy is enabled.
+	*/
+	virtual void sendZeroCopy(MessagePtr message) {sendMessage(*message);};
+
 	int sock_type_c = 0;	// overridden by ctor in subclasses
 	SocketType type;
 	std::string ip;
@@ -63,8 +336,31 @@ protected:
 	int debug;
 	int sock_fd;
 	std::shared_ptr<IDeMux> idemux_ptr;
-
-	struct addrinfo *servinfo; // Freed in destructor
+	Queue send_queue;
+	stats::Counters counters;
+	// Shared with the messages held by the IDeMux, which may outlive the socket.
+	std::shared_ptr<stats::Latency> latency{new stats::Latency()};
+	std::atomic<bool> shut_down{false};
+	BusyPoll busy_poll;		// Used by the receiving thread only
+	ZeroCopy zero_copy;		// Used by the sending thread only
+	LinkHealth health;
+	std::atomic<uint32_t> heartbeat_seq{0};
+	std::atomic<uint32_t> link_id{0};
+	std::atomic<uint8_t> stream{0};			// Connection within a TCP link's pool
+	std::atomic<uint64_t> session_id{0};	// Only known on the client side
+	std::atomic<uint8_t> version{0};
+	std::atomic<uint32_t> features{control::FEATURE_SEQ};
+	std::atomic<uint16_t> max_frame{Message::BUF_SIZE};
+	std::shared_ptr<Shaper> shaper;		// nullptr if the link isn't shaped
+	std::shared_ptr<CoverTraffic> cover;	// nullptr unless the link sends cover traffic
+	std::atomic<int> weight{1};
+	bool probes_mtu = false;
+	PathMTU path_mtu;
+	std::atomic<uint32_t> mtu_probe_seq{0};
+	HelloHandler hello_handler;
+	bool restartable = false;
+
+	struct addrinfo *servinfo = nullptr; // Freed in destructor
 };
 
 
@@ -75,6 +371,7 @@ public:
 	virtual ~ClientUDPSocket() = default;
 	void startReceiving();
 	void sendMessage(Message &message);
+	void sendVector(struct iovec *iov, int count);
 	bool isReady() {return true;};
 };
 
@@ -85,14 +382,64 @@ public:
 		int debug=0);
 	void startReceiving();
 	void sendMessage(Message &message);
+	void sendVector(struct iovec *iov, int count);
 	bool isReady() {return knows_peer;};
+protected:
+	void notePeer(const struct sockaddr_storage &addr, socklen_t addr_length,
+		const Message &msg);
 private:
-	bool knows_peer = false;
+	void setPeer(const struct sockaddr_storage &addr, socklen_t addr_length);
+	std::atomic<bool> knows_peer{false};
+	std::mutex peer_mutex;		// Guards peer_addr, it changes when the client reconnects
 	struct sockaddr_storage peer_addr;
 	socklen_t peer_addr_length = sizeof peer_addr;
 };
 
 
+/**
+	A link over a Unix SOCK_SEQPACKET socket: a connection, like TCP, that keeps the
+	messages apart, like UDP. For chaining with other processes on the host.
+*/
+class UnixSocket : public Socket {
+public:
+	UnixSocket(const SocketDescription &des, int sock_fd, std::shared_ptr<IDeMux> idemux_ptr,
+		int debug=0);
+	UnixSocket(const SocketDescription &des, std::shared_ptr<IDeMux> idemux_ptr, int debug=0);
+	virtual ~UnixSocket() = default;
+	void connectSocket();
+	void startReceiving();
+	void sendMessage(Message &message);
+	void sendVector(struct iovec *iov, int count);
+	bool isReady() {return true;};
+};
+
+
+/**
+	A link through a ShmChannel: messages go through shared memory, and the Unix socket
+	it was set up over only tells when the other side is gone.
+*/
+class ShmSocket : public UnixSocket {
+public:
+	/**
+		Accepted connection. Its receiving thread gets the channel first, and throws
+		SocketException if that doesn't arrive within CONNECT_TIMEOUT. Not ready until
+		then, messages sent before are dropped.
+	*/
+	ShmSocket(const SocketDescription &des, int sock_fd, std::shared_ptr<IDeMux> idemux_ptr,
+		int debug=0);
+	ShmSocket(const SocketDescription &des, std::shared_ptr<IDeMux> idemux_ptr, int debug=0);
+	virtual ~ShmSocket() = default;
+	void connectSocket();
+	void startReceiving();
+	void sendMessage(Message &message);
+	void sendVector(struct iovec *iov, int count);
+	bool isReady() {return has_channel;};
+private:
+	std::unique_ptr<ShmChannel> channel;	// Only used once has_channel is set
+	std::atomic<bool> has_channel{false};
+};
+
+
 class TCPSocket : public Socket {
 public:
 	TCPSocket(const SocketDescription &des, int sock_fd, std::shared_ptr<IDeMux> idemux_ptr,
@@ -101,7 +448,16 @@ public:
 	virtual ~TCPSocket() = default;
 	void startReceiving();
 	void sendMessage(Message &message);
+	void sendVector(struct iovec *iov, int count);
 	bool isReady() {return true;};
+
+	/**
+		The kernel's view of the connection (congestion window, data in flight, ...).
+		Returns false if it's not available, e.g. after the link was shut down.
+	*/
+	bool getTCPInfo(struct tcp_info &info);
+protected:
+	void sendZeroCopy(MessagePtr message);
 private:
 	int readAll(char* buf, int n);
 };	
@@ -162,17 +518,31 @@ public:
 		const SocketDescription &des,
 		std::shared_ptr<IDeMux> idemux_ptr,
 		int debug=0);
+	~ServerTCPSocket();
+	ServerTCPSocket(const ServerTCPSocket&) = delete;
+	ServerTCPSocket &operator=(const ServerTCPSocket&) = delete;
 	std::shared_ptr<Socket> acceptPeerConnection();
+
+	/**
+		Connections accepted from now on get the impairment, shaping and weight of des.
+	*/
+	void retune(const SocketDescription &des);
 	std::string describe();
 	std::string describeFull();
 	int getFD() {return sock_fd;};
 private:
+	void listenLocal();
+
 	SocketType type;
 	std::string ip;
 	int port;
+	std::string impairment;		// Passed on to the accepted connections
+	std::string shaping;
+	int weight;
 	int debug;
-	int sock_fd;
+	int sock_fd = -1;
 	std::shared_ptr<IDeMux> idemux_ptr;
+	int accepted = 0;			// Numbers the connections of local links
 };
 
 
@@ -0,0 +1,206 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <time.h>
+#include <utility>
+#include <vector>
+
+#include "snapshot.h"
+
+
+namespace stats {
+
+	/**
+		What a link counts. Indexes into its Counters.
+	*/
+	enum LinkCounter {
+		PACKETS_IN,
+		BYTES_IN,
+		PACKETS_OUT,
+		BYTES_OUT,
+		SEND_CALLS,		// System calls spent on sending
+		ERRORS,			// Read and write errors, malformed messages
+		OVERSIZE_DROPS,	// Bigger than the peer's maximum frame or the path MTU
+		PADDING_OUT,	// Cover traffic frames without a message in them
+	};
+
+	/**
+		What the IMux counts.
+	*/
+	enum IMuxCounter {
+		TUN_PACKETS_READ,
+		TUN_BYTES_READ,
+		NO_LINK_DROPS,	// Dropped because no link was usable
+		SPILLED_OVER,	// Sent on another link than picked, the picked one's shaper was full
+	};
+
+	/**
+		What the IDeMux counts.
+	*/
+	enum IDeMuxCounter {
+		LINK_PACKETS_IN,
+		TUN_PACKETS_WRITTEN,
+		TUN_BYTES_WRITTEN,
+	};
+
+
+	/**
+		A handful of counters that many threads count in at the same time, without
+		sharing cache lines: every thread counts in its own slot (the same slots Snapshot
+		hands out to its readers, threads beyond those share one). Counting is a relaxed add; reading sums over all slots,
+		so it's slow and not a consistent snapshot, but every counter only goes up.
+	*/
+	class Counters {
+	public:
+		static const int SIZE = 8;	// Exactly a cache line worth of counters per slot
+
+		Counters();
+		Counters(const Counters&) = delete;
+		Counters &operator=(const Counters&) = delete;
+
+		void add(int counter, uint64_t n=1) {
+			slots[ReaderSlots::mine()].values[counter].fetch_add(n, std::memory_order_relaxed);
+		}
+		uint64_t get(int counter) const;
+	private:
+		struct Slot {
+			std::atomic<uint64_t> values[SIZE];
+		};
+		std::unique_ptr<char[]> memory;
+		Slot *slots;	// ReaderSlots::SLOTS of them, in memory, aligned to a cache line
+	};
+
+
+	/**
+		Wall clock time in nanoseconds. Timestamps that travel to the peer use it, as do
+		the kernel's receive timestamps. Comparing with the peer's clock only makes sense
+		when both clocks are synchronized (NTP, PTP).
+	*/
+	inline uint64_t wallNanos() {
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+	}
+
+
+	/**
+		Log-linear histogram in the style of HdrHistogram: values below SUB_BUCKETS are
+		counted exactly, above that every power of two is split into SUB_BUCKETS buckets,
+		so a value is off by at most 1/SUB_BUCKETS. Recording is a few relaxed adds and
+		safe from any thread.
+	*/
+	class Histogram {
+	public:
+		static const int SUB_BUCKETS = 16;
+		static const int SUB_BITS = 4;		// log2(SUB_BUCKETS)
+		static const int BUCKETS = SUB_BUCKETS + (64 - SUB_BITS) * SUB_BUCKETS;
+
+		Histogram();
+		Histogram(const Histogram&) = delete;
+		Histogram &operator=(const Histogram&) = delete;
+
+		void record(uint64_t value) {
+			buckets[bucketOf(value)].fetch_add(1, std::memory_order_relaxed);
+			count.fetch_add(1, std::memory_order_relaxed);
+			sum.fetch_add(value, std::memory_order_relaxed);
+		}
+
+		uint64_t getCount() const {return count.load(std::memory_order_relaxed);};
+		uint64_t getSum() const {return sum.load(std::memory_order_relaxed);};
+
+		/**
+			The value below which a fraction q (0..1) of the recorded values are, rounded
+			up to the end of its bucket. 0 if nothing was recorded.
+		*/
+		uint64_t percentile(double q) const;
+	private:
+		static int bucketOf(uint64_t value) {
+			if (value < SUB_BUCKETS) {
+				return static_cast<int>(value);
+			}
+			int magnitude = 63 - __builtin_clzll(value);		// >= SUB_BITS
+			int shift = magnitude - SUB_BITS;
+			int sub = static_cast<int>(value >> shift) - SUB_BUCKETS;
+			return SUB_BUCKETS + shift * SUB_BUCKETS + sub;
+		}
+		static uint64_t upperBound(int bucket);
+
+		std::atomic<uint64_t> buckets[BUCKETS];
+		std::atomic<uint64_t> count{0};
+		std::atomic<uint64_t> sum{0};
+	};
+
+
+	/**
+		Where a link's messages spend their time, in microseconds. Only timestamped
+		messages are counted.
+	*/
+	struct Latency {
+		Histogram tun_to_wire;	// Sender: read from the tun until handed to the socket
+		Histogram one_way;		// Receiver: the peer's tun read until our kernel got it
+		Histogram reorder_hold;	// Receiver: our kernel got it until written to the tun
+		Histogram end_to_end;	// Receiver: the peer's tun read until written to our tun
+	};
+
+
+	/**
+		Writes the Prometheus text exposition format.
+
+			stats::Writer w(out);
+			w.header("multitun_link_packets_in_total", "counter", "Messages received");
+			w.sample("multitun_link_packets_in_total", {{"link", "0"}}, 42);
+	*/
+	class Writer {
+	public:
+		typedef std::vector<std::pair<std::string, std::string>> Labels;
+
+		Writer(std::ostream &out) : out(out) {}
+		void header(const std::string &name, const std::string &type, const std::string &help);
+		void sample(const std::string &name, const Labels &labels, uint64_t value);
+
+		/**
+			The p50, p99 and p999 of a histogram as a summary, with its _sum and _count.
+		*/
+		void summary(const std::string &name, const Labels &labels, const Histogram &histogram);
+	private:
+		std::ostream &out;
+	};
+
+
+	/**
+		Serves the metrics on a Unix socket. Every connection gets the current metrics and
+		is closed. Understands just enough HTTP to be scraped by Prometheus or curl
+		(--unix-socket), plain readers like socat get the bare text.
+	*/
+	class Server {
+	public:
+		typedef std::function<void(Writer&)> Renderer;
+
+		Server(const std::string &path, Renderer render, int debug=0);
+		virtual ~Server();
+
+		/**
+			Starts serving on a thread of its own.
+		*/
+		void start();
+	private:
+		void serveLoop();
+		void serve(int fd);
+
+		std::string path;
+		Renderer render;
+		int debug;
+		int sock_fd;
+		std::thread serve_t;
+	};
+
+}
+
+
+#endif
@@ -0,0 +1,162 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <inttypes.h>
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "device.h"
+#include "stats.h"
+
+
+/**
+	The IP packets of a pcap or pcapng file, in time order, with their time relative to
+	the first. Link layer headers (Ethernet, Linux cooked, BSD loopback) are taken off,
+	so it works on tun captures (including the ones of a Capture) as well as on captures
+	of physical interfaces.
+
+	Packets that can't be replayed whole are skipped: other protocols than IP, packets
+	cut short by the snap length and packets longer than what fits in a message.
+*/
+class Trace {
+public:
+	enum Direction {ANY, INBOUND, OUTBOUND};
+
+	/**
+		Reads the whole file. Only keeps the packets of the given direction, as far as
+		the file records directions (pcapng's epb_flags), which a Capture always does.
+		Throws TraceException if the file can't be read or parsed.
+	*/
+	static Trace load(const std::string &path, Direction direction=ANY);
+
+	size_t size() const {return packets.size();};
+	const char *data(size_t i) const {return bytes.data() + packets[i].offset;};
+	uint16_t length(size_t i) const {return packets[i].length;};
+	uint64_t timeOf(size_t i) const {return packets[i].ns;};	// Since the first packet
+
+	uint64_t getDuration() const {return packets.empty() ? 0 : packets.back().ns;};
+	uint64_t getBytes() const {return bytes.size();};
+	uint64_t getSkipped() const {return skipped;};
+private:
+	struct Packet {
+		uint64_t ns;
+		size_t offset;		// In bytes
+		uint16_t length;
+	};
+
+	void add(uint64_t ns, int link_type, const char *frame, size_t captured, size_t length);
+	void loadPcap(const std::vector<char> &file);
+	void loadPcapng(const std::vector<char> &file, Direction direction);
+
+	std::vector<Packet> packets;
+	std::vector<char> bytes;
+	uint64_t skipped = 0;
+};
+
+
+/**
+	Replays a Trace into a MemoryDevice, either with the trace's timing (scaled by speed)
+	or as fast as the device takes the packets (speed 0).
+
+	Every packet that has room for it gets a stamp, the steady clock time it was injected,
+	in the first bytes of its transport payload, for a ReplayMeter at the far side. The
+	addresses, ports and flags stay as they were captured, so the flows are classified as
+	they were. Transport checksums aren't fixed, the packets never reach a stack.
+
+	With more than one copy, every packet is injected that many times, each copy with
+	its source address moved up by the copy's number: copies are flows of their own.
+*/
+class TraceReplayer {
+public:
+	static const size_t STAMP_LENGTH = 8;
+	static const int MAX_COPIES = 256;
+	static constexpr std::chrono::milliseconds LATE{1};		// Behind the trace's timing
+
+	TraceReplayer(std::shared_ptr<MemoryDevice> device, const Trace &trace, double speed=1,
+		int copies=1);
+
+	/**
+		Replays the trace loops times, blocking. Loops follow each other with the trace's
+		average gap between packets.
+	*/
+	void run(int loops=1);
+
+	/**
+		Where the stamp of a packet goes, or 0 if it has no room for one.
+	*/
+	static size_t stampOffset(const char *pkt, size_t len);
+
+	uint64_t getSent() {return sent;};
+	uint64_t getSentBytes() {return sent_bytes;};
+	uint64_t getRefused() {return refused;};
+	uint64_t getLate() {return late;};
+private:
+	void inject(size_t i, int copy);
+
+	std::shared_ptr<MemoryDevice> device;
+	const Trace &trace;
+	double speed;
+	int copies;
+	std::vector<char> packet;
+
+	std::atomic<uint64_t> sent{0};			// Taken by the device
+	std::atomic<uint64_t> sent_bytes{0};
+	std::atomic<uint64_t> refused{0};		// Dropped by the device, it was full
+	std::atomic<uint64_t> late{0};			// Injected more than LATE after their time
+};
+
+
+/**
+	Counts the packets of a TraceReplayer as they come out of a device. Use as the
+	device's sink, and start() it once the packets that came before are through.
+	Latency and reordering are measured on the stamped packets only.
+*/
+class ReplayMeter {
+public:
+	static const size_t FLOW_BUCKETS = 1024;
+
+	ReplayMeter() = default;
+	ReplayMeter(const ReplayMeter&) = delete;
+	ReplayMeter &operator=(const ReplayMeter&) = delete;
+
+	void start();
+	void onPacket(const char *pkt, size_t len);
+
+	uint64_t getPackets() {return packets;};
+	uint64_t getBytes() {return bytes;};
+	uint64_t getStamped() {return stamped;};
+	uint64_t getReordered() {return reordered;};
+
+	/**
+		Latency in nanoseconds, from the replayer to the meter.
+	*/
+	const stats::Histogram &getLatency() {return latency;};
+private:
+	std::atomic<uint64_t> since_ns{UINT64_MAX};		// Not started
+	std::atomic<uint64_t> packets{0};
+	std::atomic<uint64_t> bytes{0};
+	std::atomic<uint64_t> stamped{0};
+	std::atomic<uint64_t> reordered{0};		// Stamped earlier than a packet of its flow before it
+	std::atomic<uint64_t> latest_stamp[FLOW_BUCKETS] = {};	// By flow hash
+	stats::Histogram latency;
+};
+
+
+class TraceException : public std::exception {
+private:
+	std::string errorMsg;
+public:
+	TraceException(const std::string &msg) : errorMsg(msg) {}
+	~TraceException() throw() {};
+	virtual const char* what() const throw() {
+		return errorMsg.c_str();
+	}
+};
+
+
+#endif
@@ -0,0 +1,94 @@
+#ifndef TRAFFIC_H
+#define TRAFFIC_H
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <vector>
+
+#include "device.h"
+#include "stats.h"
+
+
+/**
+	Generates IPv4/UDP packets into a MemoryDevice, spread over a number of flows (source
+	ports). Every packet carries a sequence number (per flow) and the steady clock time it was made,
+	for a TrafficMeter at the other end.
+*/
+class TrafficGenerator {
+public:
+	static const size_t HEADER_LENGTH = 28;		// IPv4 and UDP headers
+	static const size_t MIN_SIZE = HEADER_LENGTH + 16;
+	static const int MAX_FLOWS = 256;
+
+	/**
+		Packets are size bytes, IP header included (at least MIN_SIZE). A rate of 0 sends
+		as fast as the device takes them.
+	*/
+	TrafficGenerator(std::shared_ptr<MemoryDevice> device, size_t size, int flows=16,
+		uint64_t rate_pps=0);
+
+	/**
+		Sends for the given time, blocking.
+	*/
+	void run(std::chrono::steady_clock::duration duration);
+
+	uint64_t getSent() {return sent;};
+	uint64_t getRefused() {return refused;};
+
+	/**
+		Reads back what the generator put in a packet. Returns false if it isn't one of
+		its packets.
+	*/
+	static bool parse(const char *pkt, size_t len, int &flow, uint64_t &seq,
+		uint64_t &sent_ns);
+private:
+	void build(int flow);
+
+	std::shared_ptr<MemoryDevice> device;
+	std::vector<char> packet;
+	int flows;
+	std::vector<uint64_t> next_seq;		// By flow
+	uint64_t rate_pps;
+	std::atomic<uint64_t> sent{0};		// Taken by the device
+	std::atomic<uint64_t> refused{0};	// Dropped by the device, it was full
+};
+
+
+/**
+	Counts the packets of a TrafficGenerator as they come out of a device, and how long
+	they took. Use as the device's sink.
+*/
+class TrafficMeter {
+public:
+	TrafficMeter() = default;
+	TrafficMeter(const TrafficMeter&) = delete;
+	TrafficMeter &operator=(const TrafficMeter&) = delete;
+
+	void onPacket(const char *pkt, size_t len);
+
+	/**
+		Only counts the packets generated from since_ns (steady clock) on, e.g. to leave
+		out the warm up.
+	*/
+	void countFrom(uint64_t since_ns) {this->since_ns = since_ns;};
+
+	uint64_t getPackets() {return packets;};
+	uint64_t getBytes() {return bytes;};
+	uint64_t getReordered() {return reordered;};
+
+	/**
+		Latency in nanoseconds, from the generator to the meter.
+	*/
+	const stats::Histogram &getLatency() {return latency;};
+private:
+	std::atomic<uint64_t> since_ns{0};
+	std::atomic<uint64_t> packets{0};
+	std::atomic<uint64_t> bytes{0};
+	std::atomic<uint64_t> reordered{0};		// Arrived after a later packet of its flow
+	std::atomic<uint64_t> highest_seq[TrafficGenerator::MAX_FLOWS] = {};
+	stats::Histogram latency;
+};
+
+
+#endif
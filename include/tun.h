@@ -1,14 +1,17 @@
 #ifndef SIMPLETUN_H
 #define SIMPLETUN_H
 
+#include <chrono>
 #include <exception>
 #include <memory>
 #include <string>
 
+#include "busypoll.h"
+#include "device.h"
 #include "options.h"
 #include "queue.h"
 
-class Tun {
+class Tun : public PacketDevice {
 public:
 	Tun(const std::string &if_name, 
 		const std::string &clone_dev,
@@ -21,12 +24,26 @@ public:
 	int sendSimple(const std::string &s);
 	int sendSimple(char buffer[], int count);
 	void receive(Message &msg);
+	bool tryReceive(Message &msg);
 	void writeMessage(Message &msg);
 	std::string describeFull();
+
+	/**
+		Makes receive() spin on non-blocking reads while packets come in, see BusyPoll.
+		Set before the tun is read.
+	*/
+	void enableBusyPoll(std::chrono::microseconds idle);
+	const BusyPoll &getBusyPoll() {return busy_poll;};
+
+	/**
+		Sets the interface's MTU. Throws TunException if the kernel won't.
+	*/
+	void setMTU(int mtu);
 protected:
 	std::string if_name;
 	int tun_fd;
 	int debug;
+	BusyPoll busy_poll;		// Used by the reading thread only
 };
 
 
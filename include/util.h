@@ -6,13 +6,17 @@
 #include <string>
 #include <sstream>
 
+#include "log.h"
 
-inline void debugOut(int level, std::string msg) {
-	std::cout << "[d" + std::to_string(level) + "] " << msg << std::endl;
+
+// Both go through the asynchronous logger. On hot paths, prefer LOG_DEBUG: it doesn't
+// build the string unless the level is enabled and formats on the logger's thread.
+inline void debugOut(int level, const std::string &msg) {
+	logging::write(level, "{}", msg);
 }
 
-inline void errorOut(std::string msg) {
-	std::cout << "\033[91m[e] " << msg << "\033[0m" << std::endl;
+inline void errorOut(const std::string &msg) {
+	logging::write(logging::ERROR, "{}", msg);
 }
 
 
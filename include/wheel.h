@@ -0,0 +1,73 @@
+#ifndef WHEEL_H
+#define WHEEL_H
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+/**
+	Runs callbacks at a given time, on a thread of its own. Timers go into the slot of
+	the tick they're due in; timers further off than a turn of the wheel stay in their
+	slot for the next turns. The thread sleeps until the first tick whose slot holds a
+	timer, or while no timer is pending.
+
+	Callbacks due in the same tick run in the order of their due times.
+*/
+class TimerWheel {
+public:
+	typedef std::chrono::steady_clock Clock;
+	typedef std::function<void()> Callback;
+
+	static constexpr std::chrono::microseconds TICK{250};
+	static const size_t SLOTS = 8192;		// A turn of about 2 s
+
+	TimerWheel();
+	virtual ~TimerWheel();
+	TimerWheel(const TimerWheel&) = delete;
+	TimerWheel &operator=(const TimerWheel&) = delete;
+
+	/**
+		Runs callback at when, or on the next tick if that's already past.
+	*/
+	void schedule(Clock::time_point when, Callback callback);
+
+	/**
+		Stops the thread. Pending timers never run.
+	*/
+	void stop();
+
+	/**
+		One wheel for everybody who doesn't need their own, started on first use.
+	*/
+	static TimerWheel &shared();
+private:
+	struct Timer {
+		Clock::time_point when;
+		Callback callback;
+	};
+
+	void run();
+	uint64_t tickOf(Clock::time_point when);
+
+	/**
+		The first tick after current_tick whose slot isn't empty. Nothing is due before
+		it. Hold the mutex, with timers pending.
+	*/
+	uint64_t nextBusyTick();
+
+	std::mutex mutex;
+	std::condition_variable wake_up;
+	std::vector<std::vector<Timer>> slots;
+	Clock::time_point start;
+	uint64_t current_tick = 0;
+	size_t pending = 0;
+	bool stopped = false;
+	std::thread thread;
+};
+
+
+#endif
@@ -0,0 +1,348 @@
+#ifndef XDP_H
+#define XDP_H
+
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/uio.h>
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "control.h"
+#include "log.h"
+#include "queue.h"
+#include "socket.h"
+
+
+class XDPException : public std::exception {
+private:
+	std::string errorMsg;
+	int error;
+public:
+	XDPException(const std::string &msg, int error=0)
+		: errorMsg(msg), error(error) {}
+	~XDPException() throw() {};
+	virtual const char* what() const throw() {
+		return errorMsg.c_str();
+	}
+	int getError() const {return error;};	// errno of the call that failed, 0 if none
+};
+
+
+/**
+	An AF_XDP socket for the UDP datagrams of one local IPv4 address and port, on queue 0
+	of the interface that has the address. An XDP program redirects matching frames to
+	it before the kernel's network stack sees them; the rest (other addresses or ports,
+	fragments, IP options, other queues) passes on to the kernel as usual.
+
+	The frames live in a UMEM of NUM_FRAMES frames of FRAME_SIZE bytes. The first half
+	goes to the fill ring for receiving, the second half is for sending. Received frames
+	are handed out by receive() and go back to the fill ring on release(). Sent frames
+	come back through the completion ring.
+
+	Sending needs Ethernet, IP and UDP headers, which are taken from a frame the peer
+	sent (setPeer()), with the addresses swapped. Until one came in, send() refuses and
+	the kernel has to send.
+
+	Native XDP and zero copy are used where the driver supports them, generic XDP and
+	copying (e.g. on veth) otherwise. An interface takes one XDP program, so one XSK.
+	Needs CAP_NET_ADMIN and CAP_BPF (or root). IPv4 only.
+*/
+class XSK {
+public:
+	static const uint32_t FRAME_SIZE = 4096;
+	static const uint32_t NUM_FRAMES = 2048;
+	static const uint32_t RING_SIZE = NUM_FRAMES / 2;
+	static const uint16_t HEADERS_LENGTH = 14 + 20 + 8;	// Ethernet, IPv4, UDP
+	static const uint32_t KICK_BATCH = 16;	// Sends between wake ups of the kernel at most
+
+	/**
+		A received datagram, valid until release().
+	*/
+	struct Frame {
+		const char *headers;		// Ethernet header onwards
+		const char *payload;		// UDP payload
+		uint16_t length;			// Of the payload
+		struct sockaddr_storage from;
+	};
+
+	/**
+		Sets up the UMEM, rings and XDP program for the local address, which must be a
+		specific IPv4 address and port. Throws XDPException.
+	*/
+	XSK(const struct sockaddr_in &local, int debug=0);
+	~XSK();
+	XSK(const XSK&) = delete;
+	XSK &operator=(const XSK&) = delete;
+
+	int getFD() {return xsk_fd;};
+	std::string describe();		// Interface, queue and mode
+
+	/**
+		Receiving, for a single thread. Waits up to timeout_ms for datagrams and fills in
+		up to max of them. Frames that aren't well formed UDP are skipped. Call release()
+		when done with the frames, also if none were returned.
+	*/
+	size_t receive(Frame *frames, size_t max, int timeout_ms);
+	void release();
+
+	/**
+		Takes the headers to send with from a received frame.
+	*/
+	void setPeer(const Frame &frame);
+	bool knowsPeer() {return knows_peer;};
+
+	/**
+		Sends the buffers as one datagram to the peer. The kernel is woken up to send if
+		flush, or if enough went into the ring without. Returns the number of system
+		calls it took (0 if it only went into the ring), -1 if it couldn't send it:
+		the peer isn't known yet, it's bigger than the interface's MTU or the ring is
+		full.
+	*/
+	int send(const struct iovec *iov, int count, bool flush=true);
+
+	/**
+		Wakes up the kernel for what's in the ring, if anything.
+	*/
+	void flush();
+
+	uint64_t getFramesIn() {return frames_in;};
+	uint64_t getFramesOut() {return frames_out;};
+	uint64_t getKicks() {return kicks;};
+	uint64_t getKernelDrops();	// Frames the kernel couldn't put in the rings
+private:
+	struct Ring {
+		uint32_t *producer = nullptr;
+		uint32_t *consumer = nullptr;
+		void *descs = nullptr;
+		void *map = nullptr;
+		size_t map_length = 0;
+	};
+
+	int findInterface(const struct sockaddr_in &local);
+	void loadProgram(const struct sockaddr_in &local);
+	void attachProgram();
+	void mapRing(Ring &ring, int option, uint64_t desc_offset, uint64_t desc_size,
+		uint64_t page_offset, const void *offsets);
+	void kick();
+	void reapCompletions();
+	void cleanUp();
+
+	int debug;
+	int if_index = 0;
+	std::string if_name;
+	uint16_t if_mtu = 0;
+	int xsk_fd = -1;
+	int map_fd = -1;
+	int prog_fd = -1;
+	int link_fd = -1;
+	bool native = false;
+	bool zero_copy = false;
+	char *umem = nullptr;
+	Ring fill, completion, rx, tx;
+
+	// Receiving
+	uint32_t rx_taken = 0;		// By the last receive(), not released yet
+
+	// Sending
+	std::mutex tx_mutex;		// Guards all below
+	std::vector<uint64_t> free_frames;
+	char header[HEADERS_LENGTH];
+	std::atomic<bool> knows_peer{false};
+	uint16_t ip_id = 0;
+	std::atomic<uint32_t> unkicked{0};
+
+	std::atomic<uint64_t> frames_in{0};
+	std::atomic<uint64_t> frames_out{0};
+	std::atomic<uint64_t> kicks{0};
+};
+
+
+/**
+	Decorates a UDP socket type with an XSK: the link's datagrams come in and go out
+	through AF_XDP instead of the kernel's UDP stack. The kernel socket stays, it holds
+	the address and port, sends until the XSK knows the peer and receives what the XDP
+	program passes on. If the XSK can't be set up (no permission, no driver support, the
+	interface is taken), the link is a plain UDP link.
+
+		makeSocket<XDPSocket<ServerUDPSocket>>(des, idemux_ptr, debug);
+*/
+template <typename Base>
+class XDPSocket : public Base {
+public:
+	static const size_t BATCH = 64;		// Frames per receive()
+	static const int POLL_MS = 100;		// Between checks for shutdown
+	static const int SETUP_TRIES = 20;	// While the interface is taken, by our old link
+	static constexpr std::chrono::milliseconds SETUP_RETRY{100};
+
+	template <typename... Args>
+	XDPSocket(Args&&... args) : Base(std::forward<Args>(args)...) {}
+	virtual ~XDPSocket() = default;
+
+	void startReceiving();
+
+	void sendMessage(Message &message) {
+		struct iovec iov = {message.buffer,
+			static_cast<size_t>(Message::HEADER_LENGTH + message.payload_length)};
+		if (!sendFrame(&iov, 1)) {
+			Base::sendMessage(message);
+		}
+	}
+	void sendVector(struct iovec *iov, int count) {
+		if (!sendFrame(iov, count)) {
+			Base::sendVector(iov, count);
+		}
+	}
+	XSK *getXSK() {return ready.load();};
+private:
+	bool setUp();
+	bool sendFrame(struct iovec *iov, int count);
+	void receiveFrames(const std::atomic<bool> &kernel_failed);
+
+	std::unique_ptr<XSK> xsk;			// Created by the receiving thread
+	std::atomic<XSK*> ready{nullptr};	// Set once it's up
+};
+
+
+template <typename Base>
+constexpr std::chrono::milliseconds XDPSocket<Base>::SETUP_RETRY;
+
+
+template <typename Base>
+void XDPSocket<Base>::startReceiving() {
+	if (!setUp()) {
+		Base::startReceiving();
+		return;
+	}
+
+	// What the XDP program passes on still arrives on the kernel socket.
+	std::exception_ptr kernel_error;
+	std::atomic<bool> kernel_failed{false};
+	std::thread kernel([this, &kernel_error, &kernel_failed] () {
+		try {
+			Base::startReceiving();
+		} catch (std::exception &e) {
+			kernel_error = std::current_exception();
+			kernel_failed = true;
+		}
+	});
+	try {
+		receiveFrames(kernel_failed);
+	} catch (std::exception &e) {
+		this->shutdownSocket();
+		kernel.join();
+		throw;
+	}
+	if (kernel_failed) {
+		kernel.join();
+		std::rethrow_exception(kernel_error);
+	}
+	this->shutdownSocket();
+	kernel.join();
+}
+
+
+template <typename Base>
+bool XDPSocket<Base>::setUp() {
+	struct sockaddr_storage local;
+	socklen_t length = sizeof local;
+	if (getsockname(this->sock_fd, (struct sockaddr*)&local, &length) == -1) {
+		return false;
+	}
+	if (local.ss_family != AF_INET) {
+		if (this->debug >= 1) {debugOut(1,
+		"no AF_XDP on " + this->describeFull() + ": XDP links are IPv4 only"
+		);}
+		return false;
+	}
+	for (int tries = 1; ; tries++) {
+		try {
+			xsk.reset(new XSK(*(struct sockaddr_in*)&local, this->debug));
+			break;
+		} catch (XDPException &e) {
+			// A reconnecting link's predecessor may still hold the interface.
+			if (e.getError() == EBUSY && tries < SETUP_TRIES && !this->shut_down) {
+				std::this_thread::sleep_for(SETUP_RETRY);
+				continue;
+			}
+			if (this->debug >= 1) {debugOut(1,
+			"no AF_XDP on " + this->describeFull() + ", the kernel's UDP sends and receives: " +
+			e.what()
+			);}
+			return false;
+		}
+	}
+	ready = xsk.get();
+	if (this->debug >= 1) {debugOut(1,
+	this->describeFull() + " goes through AF_XDP on " + xsk->describe()
+	);}
+	return true;
+}
+
+
+template <typename Base>
+bool XDPSocket<Base>::sendFrame(struct iovec *iov, int count) {
+	XSK *x = ready.load();
+	if (x == nullptr) {
+		return false;
+	}
+	// More to come right away from the send queue, the kernel can be woken up for it.
+	int calls = x->send(iov, count, this->send_queue.size() == 0);
+	if (calls < 0) {
+		return false;
+	}
+	this->counters.add(stats::SEND_CALLS, calls);
+	LOG_DEBUG(this->debug, 3, "wrote a frame into {} through AF_XDP", this->describeFull());
+	return true;
+}
+
+
+template <typename Base>
+void XDPSocket<Base>::receiveFrames(const std::atomic<bool> &kernel_failed) {
+	XSK::Frame frames[BATCH];
+	while (!this->shut_down && !kernel_failed) {
+		size_t n = xsk->receive(frames, BATCH, POLL_MS);
+		for (size_t i = 0; i < n; i++) {
+			const XSK::Frame &frame = frames[i];
+			if (frame.length < Message::HEADER_LENGTH) {
+				continue;
+			}
+			Message msg;
+			ssize_t n_read = std::min<size_t>(frame.length, Message::BUF_SIZE);
+			memcpy(msg.buffer, frame.payload, n_read);
+			msg.received_ns = 0;	// No kernel timestamps, taken on delivery
+			msg.parseHeader();
+
+			// Like the kernel socket: a reconnected client comes from a new port.
+			bool hello = msg.kind() == Message::CONTROL && control::kind(msg) == control::HELLO;
+			if (!xsk->knowsPeer() || hello) {
+				xsk->setPeer(frame);
+			}
+			this->notePeer(frame.from, sizeof(struct sockaddr_in), msg);
+
+			if (msg.payload_length + Message::HEADER_LENGTH > n_read) {
+				LOG_DEBUG(this->debug, 2, "msg states payload={} bytes, but couldn't read it all",
+					msg.payload_length);
+				this->counters.add(stats::ERRORS);
+				continue;
+			}
+			LOG_DEBUG(this->debug, 3, "read {} bytes from {} through AF_XDP",
+				msg.payload_length + 3, this->describeFull());
+			this->deliverDatagram(msg, n_read);
+		}
+		xsk->release();
+		// Sends that were told more would follow, and then nothing did (e.g. impaired).
+		xsk->flush();
+	}
+}
+
+
+#endif
@@ -0,0 +1,107 @@
+#ifndef ZEROCOPY_H
+#define ZEROCOPY_H
+
+#include <inttypes.h>
+#include <sys/types.h>
+
+#include <atomic>
+#include <chrono>
+#include <deque>
+
+#include "queue.h"
+
+
+/**
+	The sending side of MSG_ZEROCOPY on a stream socket, for one sending thread. Frames
+	of at least the threshold go out with MSG_ZEROCOPY: the kernel sends from the
+	message's buffer itself instead of copying it. The message is held until the kernel
+	reports it done with the buffer on the socket's error queue, and only goes back to
+	its pool then. Smaller frames are cheaper to copy than to pin and track, they're
+	sent as before.
+
+	Every send() with MSG_ZEROCOPY gets the next number of a counter kept by the kernel,
+	and completions come as ranges of those numbers. TCP reports them in order, so a
+	completion releases every held message up to its end.
+
+	The kernel may still end up copying (e.g. on loopback, or if the device can't
+	scatter-gather). It says so in the completion; getCopied() counts those.
+
+	A link going away waits a while for the rest of its completions (finish()). What's
+	still held after that is leaked rather than reused: the kernel may still send, or
+	resend, from it.
+*/
+class ZeroCopy {
+public:
+	// Held messages before the sender waits for completions. Keeps the pool from
+	// running dry on a slow link.
+	static const size_t MAX_HELD = 64;
+	static const int WAIT_MS = 100;		// Per wait for completions, before checking again
+	// How often an idle sender looks for completions while it holds messages.
+	static constexpr std::chrono::milliseconds IDLE_REAP{10};
+	static constexpr std::chrono::milliseconds FINISH_TIMEOUT{1000};
+
+	ZeroCopy() = default;
+	~ZeroCopy();
+	ZeroCopy(const ZeroCopy&) = delete;
+	ZeroCopy &operator=(const ZeroCopy&) = delete;
+
+	/**
+		Sets SO_ZEROCOPY on the socket. Returns false, and stays disabled, if the kernel
+		doesn't support it. Call before the sending starts.
+	*/
+	bool enable(int fd, uint16_t threshold);
+	bool isEnabled() const {return fd >= 0;};
+
+	/**
+		Whether a frame of size bytes should go out zero copy.
+	*/
+	bool wants(uint16_t size) const {return fd >= 0 && size >= threshold;};
+
+	/**
+		send() with MSG_ZEROCOPY. Returns like send(). Falls back to copying if the
+		socket is out of memory for pinned pages (ENOBUFS).
+	*/
+	ssize_t send(const char *buf, size_t length);
+
+	/**
+		Holds on to the message sent with the last send()s until they completed, then
+		reaps what completed so far. Waits for completions if too much is held.
+	*/
+	void hold(MessagePtr message);
+
+	/**
+		Releases the messages of all completions on the error queue. If wait, first waits
+		up to WAIT_MS for one.
+	*/
+	void reap(bool wait=false);
+
+	/**
+		Waits up to FINISH_TIMEOUT for all held messages to complete, then leaks the
+		rest. Call when the sending is over, before the socket is closed.
+	*/
+	void finish();
+
+	uint64_t getSends() const {return sends;};
+	uint64_t getCopied() const {return copied;};
+	size_t getHeld() const {return held_count;};
+private:
+	struct Held {
+		uint32_t last_id;		// Of the send() calls that carried it
+		MessagePtr message;
+	};
+
+	void release(uint32_t through);
+	void leak();
+
+	int fd = -1;
+	uint16_t threshold = 0;
+	uint32_t next_id = 0;		// The kernel's counter, as of the next send()
+	bool sent_since_hold = false;
+	std::deque<Held> held;
+	std::atomic<size_t> held_count{0};
+	std::atomic<uint64_t> sends{0};		// Zero copy send() calls
+	std::atomic<uint64_t> copied{0};	// Of those, the kernel copied after all
+};
+
+
+#endif
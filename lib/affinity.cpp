@@ -0,0 +1,213 @@
+#include <ctype.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+
+#include "affinity.h"
+#include "util.h"
+
+
+const int Placement::ROLES;
+
+
+namespace {
+
+	const char *ROLE_NAMES[Placement::ROLES] = {"tun", "rx", "tx", "ctl"};
+
+	std::string readLine(const std::string &path) {
+		std::ifstream in(path);
+		std::string line;
+		std::getline(in, line);
+		return line;
+	}
+
+	std::string formatCPUList(const std::vector<int> &cpus) {
+		std::stringstream ss;
+		for (size_t i = 0; i < cpus.size(); i++) {
+			ss << (i > 0 ? "," : "") << cpus[i];
+		}
+		return ss.str();
+	}
+
+}
+
+
+std::vector<int> Placement::parseCPUList(const std::string &list) {
+	long configured = sysconf(_SC_NPROCESSORS_CONF);
+	std::vector<int> cpus;
+	std::stringstream ss(list);
+	std::string range;
+	while (std::getline(ss, range, ',')) {
+		if (range.empty()) {
+			continue;
+		}
+		int first, last;
+		try {
+			size_t dash = range.find('-');
+			first = std::stoi(range.substr(0, dash));
+			last = (dash == std::string::npos) ? first : std::stoi(range.substr(dash + 1));
+		} catch (std::exception &e) {
+			throw std::invalid_argument("bad CPU list: " + list);
+		}
+		if (first < 0 || last < first || last >= std::min<long>(configured, CPU_SETSIZE)) {
+			throw std::invalid_argument("no such CPUs: " + range);
+		}
+		for (int cpu = first; cpu <= last; cpu++) {
+			cpus.push_back(cpu);
+		}
+	}
+	return cpus;
+}
+
+
+Placement Placement::parse(const std::string &spec) {
+	Placement placement;
+	if (spec == "auto") {
+		std::vector<int> isolated = parseCPUList(readLine("/sys/devices/system/cpu/isolated"));
+		if (isolated.empty()) {
+			return placement;
+		}
+		placement.cpus[TUN] = {isolated[0]};
+		if (isolated.size() > 1) {
+			isolated.erase(isolated.begin());
+		}
+		// A link's receiver and sender share a CPU, and with it the socket's cache lines.
+		placement.cpus[RECEIVER] = isolated;
+		placement.cpus[SENDER] = isolated;
+		std::vector<int> online = parseCPUList(readLine("/sys/devices/system/cpu/online"));
+		for (int cpu : online) {
+			if (std::find(isolated.begin(), isolated.end(), cpu) == isolated.end() &&
+					cpu != placement.cpus[TUN][0]) {
+				placement.cpus[CONTROL].push_back(cpu);
+			}
+		}
+		return placement;
+	}
+
+	std::stringstream ss(spec);
+	std::string term;
+	while (std::getline(ss, term, '/')) {
+		if (term.empty()) {
+			continue;
+		}
+		size_t eq = term.find('=');
+		if (eq == std::string::npos) {
+			throw std::invalid_argument("placement term without '=': " + term);
+		}
+		std::string role = term.substr(0, eq);
+		auto name = std::find_if(std::begin(ROLE_NAMES), std::end(ROLE_NAMES),
+			[&role] (const char *name) {return role == name;});
+		if (name == std::end(ROLE_NAMES)) {
+			throw std::invalid_argument("unknown role: " + role);
+		}
+		placement.cpus[name - std::begin(ROLE_NAMES)] = parseCPUList(term.substr(eq + 1));
+	}
+	return placement;
+}
+
+
+std::string Placement::describe() const {
+	if (isEmpty()) {
+		return "floating";
+	}
+	std::stringstream ss;
+	bool first = true;
+	for (int role = 0; role < ROLES; role++) {
+		if (!cpus[role].empty()) {
+			ss << (first ? "" : ", ") << ROLE_NAMES[role] << " on " << formatCPUList(cpus[role]);
+			first = false;
+		}
+	}
+	return ss.str();
+}
+
+
+bool Placement::isEmpty() const {
+	for (int role = 0; role < ROLES; role++) {
+		if (!cpus[role].empty()) {
+			return false;
+		}
+	}
+	return true;
+}
+
+
+int Placement::cpuOf(Role role, uint32_t index) const {
+	const std::vector<int> &list = cpus[role];
+	if (list.empty()) {
+		return -1;
+	}
+	return (role == CONTROL) ? list[0] : list[index % list.size()];
+}
+
+
+void Placement::pin(Role role, uint32_t index, int debug) const {
+	std::string name = std::string("mt-") + ROLE_NAMES[role];
+	if (role == RECEIVER || role == SENDER) {
+		name += "-" + std::to_string(index);
+	}
+	pthread_setname_np(pthread_self(), name.substr(0, 15).c_str());
+
+	const std::vector<int> &list = cpus[role];
+	if (list.empty()) {
+		return;
+	}
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	if (role == CONTROL) {
+		for (int cpu : list) {
+			CPU_SET(cpu, &set);
+		}
+	} else {
+		CPU_SET(cpuOf(role, index), &set);
+	}
+	int error = pthread_setaffinity_np(pthread_self(), sizeof set, &set);
+	if (error != 0) {
+		errorOut("can't pin " + name + " to CPU(s) " + formatCPUList(list) + ": " +
+			strerror(error) + ". it floats.");
+		return;
+	}
+	if (debug >= 2) {debugOut(2,
+	"pinned " + name + " to CPU " + (role == CONTROL ? formatCPUList(list) :
+		std::to_string(cpuOf(role, index))) + " (node " +
+		std::to_string(nodeOf(cpuOf(role, index))) + ")"
+	);}
+}
+
+
+int Placement::nodeOf(int cpu) {
+	if (cpu < 0) {
+		return -1;
+	}
+	std::string path = "/sys/devices/system/cpu/cpu" + std::to_string(cpu);
+	DIR *dir = opendir(path.c_str());
+	if (dir == nullptr) {
+		return -1;
+	}
+	int node = -1;
+	while (struct dirent *entry = readdir(dir)) {
+		if (strncmp(entry->d_name, "node", 4) == 0 && isdigit(entry->d_name[4])) {
+			node = atoi(entry->d_name + 4);
+			break;
+		}
+	}
+	closedir(dir);
+	return node;
+}
+
+
+int Placement::currentNode() {
+	unsigned cpu, node;
+	if (syscall(SYS_getcpu, &cpu, &node, nullptr) != 0) {
+		return -1;
+	}
+	return static_cast<int>(node);
+}
@@ -0,0 +1,15 @@
+#include <algorithm>
+
+#include "backoff.h"
+
+
+Backoff::Backoff(std::chrono::milliseconds base, std::chrono::milliseconds cap) :
+	base(base), cap(cap), step(base), rng(std::random_device()()) {}
+
+
+std::chrono::milliseconds Backoff::next() {
+	std::uniform_int_distribution<long> jitter(step.count() / 2, step.count());
+	std::chrono::milliseconds delay(jitter(rng));
+	step = std::min(cap, step * 2);
+	return delay;
+}
@@ -0,0 +1,20 @@
+#include "busypoll.h"
+
+
+void BusyPoll::sleep(int fd) {
+	Clock::time_point start = Clock::now();
+	struct pollfd pfd = {.fd=fd, .events=POLLIN, .revents=0};
+	// Errors (and EINTR) show in the next attempt, or it's tried again.
+	poll(&pfd, 1, -1);
+	sleep_ns.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(
+		Clock::now() - start).count(), std::memory_order_relaxed);
+	sleeps.fetch_add(1, std::memory_order_relaxed);
+}
+
+
+void BusyPoll::addSpin(Clock::time_point from, Clock::time_point to) {
+	if (from != Clock::time_point()) {
+		spin_ns.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(
+			to - from).count(), std::memory_order_relaxed);
+	}
+}
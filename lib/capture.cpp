@@ -0,0 +1,422 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <sstream>
+#include <vector>
+
+#include "capture.h"
+#include "packet.h"
+#include "stats.h"
+#include "util.h"
+
+
+const size_t Capture::SLOT_SIZE;
+const size_t Capture::DEFAULT_SIZE_MB;
+std::atomic<bool> Capture::triggered{false};
+
+
+namespace {
+
+	// pcapng block types and options, see draft-ietf-opsawg-pcapng
+	const uint32_t SECTION_HEADER_BLOCK = 0x0A0D0D0A;
+	const uint32_t INTERFACE_DESCRIPTION_BLOCK = 0x00000001;
+	const uint32_t ENHANCED_PACKET_BLOCK = 0x00000006;
+	const uint32_t FILLER_BLOCK = 0x80000001;		// Local use, readers skip it
+	const uint32_t BYTE_ORDER_MAGIC = 0x1A2B3C4D;
+
+	const uint16_t OPT_ENDOFOPT = 0;
+	const uint16_t OPT_COMMENT = 1;
+	const uint16_t IF_NAME = 2;
+	const uint16_t IF_TSRESOL = 9;
+	const uint16_t EPB_FLAGS = 2;
+	const uint32_t EPB_INBOUND = 0x1;
+	const uint32_t EPB_OUTBOUND = 0x2;
+
+	const uint16_t LINKTYPE_RAW = 101;	// Raw IPv4 or IPv6, which is what the tun gives us
+	const size_t EPB_FIXED = 28;		// Block header up to the packet data
+	const size_t MAX_COMMENT = 96;
+
+	size_t pad4(size_t n) {
+		return (n + 3) & ~static_cast<size_t>(3);
+	}
+
+
+	/**
+		Appends to a block under construction, in host byte order (pcapng readers use the
+		byte order magic).
+	*/
+	struct BlockWriter {
+		char *out;
+		size_t used = 0;
+
+		BlockWriter(char *out) : out(out) {}
+
+		void u16(uint16_t value) {
+			memcpy(out + used, &value, sizeof value);
+			used += sizeof value;
+		}
+		void u32(uint32_t value) {
+			memcpy(out + used, &value, sizeof value);
+			used += sizeof value;
+		}
+		void bytes(const void *data, size_t length) {
+			memcpy(out + used, data, length);
+			memset(out + used + length, 0, pad4(length) - length);
+			used += pad4(length);
+		}
+		void option(uint16_t code, const void *data, uint16_t length) {
+			u16(code);
+			u16(length);
+			bytes(data, length);
+		}
+	};
+
+
+	/**
+		Writes value in decimal, without the locale and allocations of the standard
+		formatters. Returns the number of digits.
+	*/
+	size_t writeDecimal(char *out, uint32_t value) {
+		char digits[10];
+		size_t n = 0;
+		do {
+			digits[n++] = static_cast<char>('0' + value % 10);
+			value /= 10;
+		} while (value > 0);
+		for (size_t i = 0; i < n; i++) {
+			out[i] = digits[n - 1 - i];
+		}
+		return n;
+	}
+
+
+	size_t writeText(char *out, const char *text) {
+		size_t n = strlen(text);
+		memcpy(out, text, n);
+		return n;
+	}
+
+
+	void writeFiller(char *out, size_t length) {
+		uint32_t type = FILLER_BLOCK;
+		uint32_t block_length = static_cast<uint32_t>(length);
+		memcpy(out, &type, 4);
+		memcpy(out + 4, &block_length, 4);
+		memcpy(out + length - 4, &block_length, 4);
+	}
+
+
+	int parseProto(const std::string &value) {
+		if (value == "tcp") {
+			return 6;
+		} else if (value == "udp") {
+			return 17;
+		} else if (value == "icmp") {
+			return 1;
+		} else if (value == "icmp6") {
+			return 58;
+		}
+		return std::stoi(value);
+	}
+
+}
+
+
+CaptureFilter CaptureFilter::parse(const std::string &spec) {
+	CaptureFilter filter;
+	std::stringstream ss(spec);
+	std::string term;
+	while (std::getline(ss, term, ',')) {
+		if (term.empty()) {
+			continue;
+		}
+		size_t eq = term.find('=');
+		if (eq == std::string::npos) {
+			throw std::invalid_argument("capture filter term without '=': " + term);
+		}
+		std::string key = term.substr(0, eq);
+		std::string value = term.substr(eq + 1);
+		if (key == "link") {
+			filter.link = std::stoll(value);
+		} else if (key == "proto") {
+			filter.proto = parseProto(value);
+		} else if (key == "port") {
+			filter.port = std::stoi(value);
+		} else if (key == "dir" && (value == "in" || value == "out")) {
+			filter.direction = (value == "in") ? Capture::INBOUND : Capture::OUTBOUND;
+		} else if (key == "class" && value == "interactive") {
+			filter.traffic_class = packet::INTERACTIVE;
+		} else if (key == "class" && value == "assured") {
+			filter.traffic_class = packet::ASSURED;
+		} else if (key == "class" && value == "bulk") {
+			filter.traffic_class = packet::BULK;
+		} else {
+			throw std::invalid_argument("unknown capture filter term: " + term);
+		}
+	}
+	return filter;
+}
+
+
+std::string CaptureFilter::describe() const {
+	std::stringstream ss;
+	if (link >= 0) {
+		ss << "link=" << link << " ";
+	}
+	if (proto >= 0) {
+		ss << "proto=" << proto << " ";
+	}
+	if (port >= 0) {
+		ss << "port=" << port << " ";
+	}
+	if (direction >= 0) {
+		ss << "dir=" << (direction == Capture::INBOUND ? "in" : "out") << " ";
+	}
+	if (traffic_class >= 0) {
+		ss << "class=" << traffic_class << " ";
+	}
+	std::string s = ss.str();
+	return s.empty() ? "all" : s.substr(0, s.size() - 1);
+}
+
+
+Capture::Capture(const std::string &path, size_t size_mb, const CaptureFilter &filter,
+	int debug) : path(path), filter(filter), debug(debug) {
+
+	char header[256];
+	header_size = writeHeader(header);
+	slots = std::max<size_t>(1, size_mb * 1024 * 1024 / SLOT_SIZE);
+	map_size = header_size + slots * SLOT_SIZE;
+
+	fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1) {
+		throw CaptureException(std::string("can't open capture file ") + path + ": " +
+			strerror(errno));
+	}
+	if (ftruncate(fd, map_size) == -1) {
+		close(fd);
+		throw CaptureException(std::string("can't size capture file: ") + strerror(errno));
+	}
+	void *address = mmap(nullptr, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (address == MAP_FAILED) {
+		close(fd);
+		throw CaptureException(std::string("can't map capture file: ") + strerror(errno));
+	}
+	map = static_cast<char*>(address);
+
+	memcpy(map, header, header_size);
+	written.reset(new std::atomic<uint64_t>[slots]);
+	for (size_t i = 0; i < slots; i++) {
+		writeFiller(map + header_size + i * SLOT_SIZE, SLOT_SIZE);
+		written[i].store(0, std::memory_order_relaxed);
+	}
+
+	if (debug >= 1) {debugOut(1,
+	std::string("capturing ") + filter.describe() + " into " + path + " (" +
+	std::to_string(slots) + " packets)"
+	);}
+}
+
+
+Capture::~Capture() {
+	if (snapshot_t.joinable()) {
+		snapshot_t.join();
+	}
+	munmap(map, map_size);
+	close(fd);
+}
+
+
+size_t Capture::writeHeader(char *out) {
+	// Section header
+	BlockWriter shb(out);
+	shb.u32(SECTION_HEADER_BLOCK);
+	shb.u32(28);
+	shb.u32(BYTE_ORDER_MAGIC);
+	shb.u16(1);				// Version 1.0
+	shb.u16(0);
+	shb.u32(0xffffffff);	// Section length unknown
+	shb.u32(0xffffffff);
+	shb.u32(28);
+
+	// Interface description, timestamps in nanoseconds
+	BlockWriter idb(out + shb.used);
+	idb.u32(INTERFACE_DESCRIPTION_BLOCK);
+	idb.u32(0);				// Filled in below
+	idb.u16(LINKTYPE_RAW);
+	idb.u16(0);
+	idb.u32(Message::PAYLOAD_SIZE);
+	idb.option(IF_NAME, "multitun", 8);
+	uint8_t resolution = 9;
+	idb.option(IF_TSRESOL, &resolution, 1);
+	idb.option(OPT_ENDOFOPT, nullptr, 0);
+	idb.u32(idb.used + 4);
+	uint32_t idb_length = idb.used;
+	memcpy(idb.out + 4, &idb_length, 4);
+
+	return shb.used + idb.used;
+}
+
+
+void Capture::record(Direction direction, const Message &msg, uint32_t link_id,
+	uint8_t stream, bool has_seq, uint32_t seq) {
+
+	// The filter, cheapest terms first.
+	if ((filter.direction >= 0 && filter.direction != direction) ||
+			(filter.link >= 0 && filter.link != link_id)) {
+		return;
+	}
+	if (filter.traffic_class >= 0 && filter.traffic_class != msg.traffic_class) {
+		return;
+	}
+	if (filter.proto >= 0 || filter.port >= 0) {
+		uint8_t proto;
+		uint16_t src_port, dst_port;
+		if (!packet::transport(msg.payload, msg.payload_length, proto, src_port, dst_port) ||
+				(filter.proto >= 0 && filter.proto != proto) ||
+				(filter.port >= 0 && filter.port != src_port && filter.port != dst_port)) {
+			return;
+		}
+	}
+
+	uint64_t n = next_slot.fetch_add(1, std::memory_order_relaxed);
+	char *slot = map + header_size + (n % slots) * SLOT_SIZE;
+	// Snapshots skip the slot while it's being written, and so do readers of the file.
+	written[n % slots].store(2 * n + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	writeFiller(slot, SLOT_SIZE);
+
+	char comment[MAX_COMMENT];	// Room for the longest, all numbers at their largest
+	size_t comment_length = writeText(comment, "link=");
+	comment_length += writeDecimal(comment + comment_length, link_id);
+	comment_length += writeText(comment + comment_length, " stream=");
+	comment_length += writeDecimal(comment + comment_length, stream);
+	comment_length += writeText(comment + comment_length, " seq=");
+	if (has_seq) {
+		comment_length += writeDecimal(comment + comment_length, seq);
+	} else {
+		comment_length += writeText(comment + comment_length, "none");
+	}
+
+	uint64_t ns = (direction == INBOUND && msg.received_ns != 0) ?
+		msg.received_ns : stats::wallNanos();
+	uint32_t captured = std::min<uint32_t>(msg.payload_length, Message::PAYLOAD_SIZE);
+	uint32_t flags = (direction == INBOUND) ? EPB_INBOUND : EPB_OUTBOUND;
+
+	BlockWriter epb(slot);
+	epb.u32(FILLER_BLOCK);	// The real type is written last
+	epb.u32(0);
+	epb.u32(0);				// Interface 0
+	epb.u32(static_cast<uint32_t>(ns >> 32));
+	epb.u32(static_cast<uint32_t>(ns));
+	epb.u32(captured);
+	epb.u32(msg.payload_length);
+	epb.bytes(msg.payload, captured);
+	epb.option(OPT_COMMENT, comment, comment_length);
+	epb.option(EPB_FLAGS, &flags, sizeof flags);
+	epb.option(OPT_ENDOFOPT, nullptr, 0);
+	uint32_t length = epb.used + 4;
+	epb.u32(length);
+	memcpy(slot + 4, &length, 4);
+	writeFiller(slot + length, SLOT_SIZE - length);
+
+	uint32_t type = ENHANCED_PACKET_BLOCK;
+	std::atomic_thread_fence(std::memory_order_release);
+	memcpy(slot, &type, 4);
+	written[n % slots].store(2 * n + 2, std::memory_order_release);
+}
+
+
+std::string Capture::snapshot() {
+	std::string name = path + "." + std::to_string(stats::wallNanos() / 1000000000) + ".pcapng";
+	int out = open(name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (out == -1) {
+		throw CaptureException(std::string("can't open snapshot ") + name + ": " +
+			strerror(errno));
+	}
+
+	std::vector<char> buffer(header_size);
+	memcpy(buffer.data(), map, header_size);
+	uint64_t end = next_slot.load();
+	uint64_t begin = (end > slots) ? end - slots : 0;
+	uint64_t packets = 0;
+	for (uint64_t n = begin; n < end; n++) {
+		const char *slot = map + header_size + (n % slots) * SLOT_SIZE;
+		std::atomic<uint64_t> &done = written[n % slots];
+		if (done.load(std::memory_order_acquire) != 2 * n + 2) {
+			continue;	// Still being written, or written over already
+		}
+		uint32_t length;
+		memcpy(&length, slot + 4, 4);
+		if (length > SLOT_SIZE) {
+			continue;
+		}
+		size_t copied = buffer.size();
+		buffer.insert(buffer.end(), slot, slot + length);
+		// A writer that came round meanwhile may have torn what was copied.
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (done.load(std::memory_order_relaxed) != 2 * n + 2) {
+			buffer.resize(copied);
+			continue;
+		}
+		++packets;
+	}
+
+	const char *data = buffer.data();
+	size_t left = buffer.size();
+	while (left > 0) {
+		ssize_t n_written = write(out, data, left);
+		if (n_written < 0) {
+			close(out);
+			throw CaptureException(std::string("can't write snapshot: ") + strerror(errno));
+		}
+		data += n_written;
+		left -= n_written;
+	}
+	close(out);
+
+	if (debug >= 1) {debugOut(1,
+	std::string("wrote ") + std::to_string(packets) + " captured packets to " + name
+	);}
+	return name;
+}
+
+
+void Capture::installTrigger() {
+	struct sigaction action;
+	memset(&action, 0, sizeof action);
+	action.sa_handler = onSignal;
+	action.sa_flags = SA_RESTART;	// Don't break the blocking reads of the links
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGUSR1, &action, nullptr);
+}
+
+
+void Capture::onSignal(int) {
+	triggered = true;
+}
+
+
+void Capture::pollTrigger() {
+	if (!triggered.exchange(false)) {
+		return;
+	}
+	// Copying the ring takes a while, don't hold up the caller (the timer thread).
+	if (snapshot_t.joinable()) {
+		snapshot_t.join();
+	}
+	snapshot_t = std::thread([this] () {
+		try {
+			snapshot();
+		} catch (CaptureException &e) {
+			errorOut(e.what());
+		}
+	});
+}
@@ -0,0 +1,150 @@
+#include <errno.h>
+#include <string.h>
+
+#include <fstream>
+#include <map>
+#include <set>
+#include <sstream>
+
+#include "config.h"
+#include "impair.h"
+
+
+std::vector<SocketDescription> config::read(const std::string &path) {
+	std::ifstream file(path);
+	if (!file) {
+		throw ConfigException("can't read " + path + ": " + strerror(errno));
+	}
+	std::vector<SocketDescription> links;
+	std::set<std::string> keys;
+	std::string line;
+	int number = 0;
+	while (std::getline(file, line)) {
+		++number;
+		std::string where = path + ":" + std::to_string(number) + ": ";
+		line = line.substr(0, line.find('#'));
+		std::stringstream stream(line);
+		std::string word;
+		if (!(stream >> word)) {
+			continue;
+		}
+		if (word != "link") {
+			throw ConfigException(where + "unknown statement: " + word);
+		}
+		std::string spec;
+		if (!(stream >> spec)) {
+			throw ConfigException(where + "link without a socket description");
+		}
+		SocketDescription des;
+		try {
+			des = SocketDescription::parse(spec);
+			while (stream >> word) {
+				size_t equals = word.find('=');
+				if (equals == std::string::npos) {
+					throw std::invalid_argument("setting without '=': " + word);
+				}
+				std::string name = word.substr(0, equals);
+				std::string value = word.substr(equals + 1);
+				if (name == "weight") {
+					size_t used = 0;
+					des.weight = std::stoi(value, &used);
+					if (used != value.size() || des.weight < 0) {
+						throw std::invalid_argument("invalid weight: " + value);
+					}
+				} else if (name == "impairment") {
+					Impairment::parse(value);
+					des.impairment = value;
+				} else if (name == "shaping") {
+					Shaping::parse(value);
+					des.shaping = value;
+				} else {
+					throw std::invalid_argument("unknown setting: " + name);
+				}
+			}
+		} catch (std::invalid_argument &e) {
+			throw ConfigException(where + e.what());
+		} catch (std::out_of_range &e) {
+			throw ConfigException(where + "number out of range");
+		}
+		if (!keys.insert(des.key()).second) {
+			throw ConfigException(where + des.key() + " is there already");
+		}
+		links.push_back(des);
+	}
+	return links;
+}
+
+
+std::string config::Diff::describe() const {
+	std::string s;
+	auto list = [&s] (const std::string &what, const std::vector<std::string> &keys) {
+		if (keys.empty()) {
+			return;
+		}
+		s += (s.empty() ? "" : ", ") + what;
+		for (auto it=keys.begin(); it!=keys.end(); it++) {
+			s += " " + *it;
+		}
+	};
+	std::vector<std::string> keys;
+	for (auto it=added.begin(); it!=added.end(); it++) {
+		keys.push_back(it->key());
+	}
+	list("adding", keys);
+	keys.clear();
+	for (auto it=removed.begin(); it!=removed.end(); it++) {
+		keys.push_back(it->key());
+	}
+	list("removing", keys);
+	keys.clear();
+	for (auto it=changed.begin(); it!=changed.end(); it++) {
+		keys.push_back(it->second.key());
+	}
+	list("changing", keys);
+	return s.empty() ? "nothing changed" : s;
+}
+
+
+config::Diff config::diff(const std::vector<SocketDescription> &from,
+	const std::vector<SocketDescription> &to) {
+	Diff diff;
+	std::map<std::string, const SocketDescription*> old_links;
+	for (auto it=from.begin(); it!=from.end(); it++) {
+		old_links[it->key()] = &*it;
+	}
+	for (auto it=to.begin(); it!=to.end(); it++) {
+		auto old = old_links.find(it->key());
+		if (old == old_links.end()) {
+			diff.added.push_back(*it);
+			continue;
+		}
+		const SocketDescription &was = *old->second;
+		if (was.weight != it->weight || was.impairment != it->impairment ||
+				was.shaping != it->shaping) {
+			diff.changed.push_back({was, *it});
+		}
+		old_links.erase(old);
+	}
+	// In their old order.
+	for (auto it=from.begin(); it!=from.end(); it++) {
+		if (old_links.count(it->key()) > 0) {
+			diff.removed.push_back(*it);
+		}
+	}
+	return diff;
+}
+
+
+bool config::isRetunable(const SocketDescription &from, const SocketDescription &to) {
+	if (from.impairment != to.impairment) {
+		return false;	// Built into the socket, see makeSocket()
+	}
+	if (from.shaping == to.shaping) {
+		return true;
+	}
+	// A shaper can take new limits, but it can't appear, go away or become cover traffic.
+	Shaping old_shaping = Shaping::parse(from.shaping);
+	Shaping new_shaping = Shaping::parse(to.shaping);
+	return !from.shaping.empty() && !to.shaping.empty() &&
+		old_shaping.cover_pps == 0 && new_shaping.cover_pps == 0;
+}
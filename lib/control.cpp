@@ -0,0 +1,140 @@
+#include <endian.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include "control.h"
+
+
+void control::makeHeartbeat(Message &msg, char kind, uint32_t seq, uint64_t sent_ns) {
+	msg.setType(Message::CONTROL);
+	msg.payload[0] = kind;
+	seq = htobe32(seq);
+	sent_ns = htobe64(sent_ns);
+	memcpy(msg.payload + 1, &seq, sizeof seq);
+	memcpy(msg.payload + 5, &sent_ns, sizeof sent_ns);
+	msg.setSize(HEARTBEAT_LENGTH);
+	msg.traffic_class = packet::INTERACTIVE;
+}
+
+
+bool control::parseHeartbeat(const Message &msg, uint32_t &seq, uint64_t &sent_ns) {
+	if (msg.payload_length < HEARTBEAT_LENGTH) {
+		return false;
+	}
+	memcpy(&seq, msg.payload + 1, sizeof seq);
+	memcpy(&sent_ns, msg.payload + 5, sizeof sent_ns);
+	seq = be32toh(seq);
+	sent_ns = be64toh(sent_ns);
+	return true;
+}
+
+
+control::Hello control::Hello::agree(const Hello &peer) const {
+	Hello agreed = peer;
+	agreed.version = std::min(version, peer.version);
+	agreed.features = features & peer.features;
+	agreed.max_frame = std::min(max_frame, peer.max_frame);
+	return agreed;
+}
+
+
+void control::makeHello(Message &msg, char kind, const Hello &hello) {
+	msg.setType(Message::CONTROL);
+	msg.payload[0] = kind;
+	uint64_t session_id = htobe64(hello.session_id);
+	uint32_t link_id = htobe32(hello.link_id);
+	uint32_t features = htobe32(hello.features);
+	uint16_t max_frame = htobe16(hello.max_frame);
+	memcpy(msg.payload + 1, &session_id, sizeof session_id);
+	memcpy(msg.payload + 9, &link_id, sizeof link_id);
+	msg.payload[13] = static_cast<char>(hello.stream);
+	msg.payload[14] = static_cast<char>(hello.version);
+	memcpy(msg.payload + 15, &features, sizeof features);
+	memcpy(msg.payload + 19, &max_frame, sizeof max_frame);
+	msg.setSize(HELLO_LENGTH);
+	msg.traffic_class = packet::INTERACTIVE;
+}
+
+
+bool control::parseHello(const Message &msg, Hello &hello) {
+	if (msg.payload_length < HELLO_V0_LENGTH - 1) {
+		return false;
+	}
+	memcpy(&hello.session_id, msg.payload + 1, sizeof hello.session_id);
+	memcpy(&hello.link_id, msg.payload + 9, sizeof hello.link_id);
+	hello.session_id = be64toh(hello.session_id);
+	hello.link_id = be32toh(hello.link_id);
+	hello.stream = (msg.payload_length >= HELLO_V0_LENGTH) ?
+		static_cast<uint8_t>(msg.payload[13]) : 0;
+	if (msg.payload_length < HELLO_LENGTH) {
+		hello.version = 0;
+		hello.features = V0_FEATURES;
+		hello.max_frame = Message::BUF_SIZE;
+		return true;
+	}
+	hello.version = static_cast<uint8_t>(msg.payload[14]);
+	memcpy(&hello.features, msg.payload + 15, sizeof hello.features);
+	memcpy(&hello.max_frame, msg.payload + 19, sizeof hello.max_frame);
+	hello.features = be32toh(hello.features);
+	hello.max_frame = be16toh(hello.max_frame);
+	// Too small for a heartbeat: not a peer to talk to.
+	if (hello.max_frame < Message::HEADER_LENGTH + HEARTBEAT_LENGTH) {
+		return false;
+	}
+	return true;
+}
+
+
+std::string control::describeFeatures(uint32_t features) {
+	std::string names;
+	if (features & FEATURE_SEQ) {
+		names += "seq";
+	}
+	if (features & FEATURE_TIMESTAMP) {
+		names += names.empty() ? "timestamp" : ",timestamp";
+	}
+	if (features & FEATURE_PMTU) {
+		names += names.empty() ? "pmtu" : ",pmtu";
+	}
+	if (features & FEATURE_PACKED) {
+		names += names.empty() ? "packed" : ",packed";
+	}
+	uint32_t unknown = features & ~FEATURES;
+	if (unknown != 0) {
+		char hex[16];
+		snprintf(hex, sizeof hex, "0x%x", unknown);
+		names += (names.empty() ? "" : ",") + std::string(hex);
+	}
+	return names.empty() ? "none" : names;
+}
+
+
+void control::makeMTUProbe(Message &msg, char kind, uint32_t seq, uint16_t size) {
+	msg.setType(Message::CONTROL);
+	msg.payload[0] = kind;
+	uint32_t net_seq = htobe32(seq);
+	uint16_t net_size = htobe16(size);
+	memcpy(msg.payload + 1, &net_seq, sizeof net_seq);
+	memcpy(msg.payload + 5, &net_size, sizeof net_size);
+	uint16_t length = MTU_PROBE_LENGTH;
+	if (kind == MTU_PROBE && size > Message::HEADER_LENGTH + MTU_PROBE_LENGTH) {
+		length = std::min(size, static_cast<uint16_t>(Message::BUF_SIZE)) - Message::HEADER_LENGTH;
+		memset(msg.payload + MTU_PROBE_LENGTH, 0, length - MTU_PROBE_LENGTH);
+	}
+	msg.setSize(length);
+	msg.traffic_class = packet::INTERACTIVE;
+}
+
+
+bool control::parseMTUProbe(const Message &msg, uint32_t &seq, uint16_t &size) {
+	if (msg.payload_length < MTU_PROBE_LENGTH) {
+		return false;
+	}
+	memcpy(&seq, msg.payload + 1, sizeof seq);
+	memcpy(&size, msg.payload + 5, sizeof size);
+	seq = be32toh(seq);
+	size = be16toh(size);
+	return true;
+}
@@ -0,0 +1,123 @@
+#include <arpa/inet.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include "control.h"
+#include "cover.h"
+
+
+const uint16_t CoverTraffic::PADDING_HEADER;
+
+
+namespace {
+
+	// What all padding is made of. Only ever read.
+	const char ZEROES[Message::BUF_SIZE] = {};
+
+}
+
+
+CoverTraffic::CoverTraffic(uint64_t pps, uint16_t size, double queue_ms, Queue &queue,
+	Send send, TimerWheel &wheel) :
+	queue(queue), send(send), wheel(wheel), size(size),
+	interval(std::chrono::nanoseconds(1000000000) / std::max<uint64_t>(pps, 1)),
+	backlog_limit(std::max<size_t>(1, static_cast<size_t>(pps * queue_ms / 1000))) {}
+
+
+void CoverTraffic::start() {
+	std::lock_guard<std::mutex> lock(mutex);
+	if (running || stopped) {
+		return;
+	}
+	running = true;
+	next_slot = Clock::now();
+	std::weak_ptr<CoverTraffic> weak = shared_from_this();
+	wheel.schedule(next_slot, [weak] () {
+		if (auto cover = weak.lock()) {
+			cover->slot();
+		}
+	});
+}
+
+
+void CoverTraffic::stop() {
+	std::lock_guard<std::mutex> lock(mutex);
+	running = false;
+	stopped = true;
+	frame_ready.notify_all();
+}
+
+
+void CoverTraffic::run() {
+	std::unique_lock<std::mutex> lock(mutex);
+	while (true) {
+		frame_ready.wait(lock, [this] () {return stopped || pending;});
+		if (stopped) {
+			return;
+		}
+		MessagePtr frame_message = std::move(next_message);
+		pending = false;
+		lock.unlock();
+		sendFrame(frame_message.get());
+		lock.lock();
+	}
+}
+
+
+bool CoverTraffic::admits() {
+	return queue.size() < backlog_limit;
+}
+
+
+void CoverTraffic::slot() {
+	std::lock_guard<std::mutex> lock(mutex);
+	if (!running) {
+		return;
+	}
+
+	if (pending) {
+		++late_slots;		// The sender is still on the last one
+	} else {
+		next_message = queue.dequeue(false);
+		pending = true;
+		frame_ready.notify_one();
+	}
+
+	// Slots keep their spacing. If the wheel fell behind, the missed ones are skipped
+	// rather than sent in a burst.
+	auto now = Clock::now();
+	next_slot += interval;
+	if (next_slot + interval < now) {
+		late_slots += (now - next_slot) / interval;
+		next_slot = now;
+	}
+	std::weak_ptr<CoverTraffic> weak = shared_from_this();
+	wheel.schedule(next_slot, [weak] () {
+		if (auto cover = weak.lock()) {
+			cover->slot();
+		}
+	});
+}
+
+
+void CoverTraffic::sendFrame(Message *message) {
+	struct iovec iov[3];
+	int count = 0;
+	uint16_t used = 0;
+	if (message != nullptr) {
+		used = Message::HEADER_LENGTH + message->payload_length;
+		iov[count++] = {message->buffer, used};
+	}
+	char header[PADDING_HEADER];
+	if (message == nullptr || (packing && size - used >= PADDING_HEADER)) {
+		uint16_t padding = size - used;
+		uint16_t payload_length = htons(padding - Message::HEADER_LENGTH);
+		memcpy(header, &payload_length, sizeof payload_length);
+		header[2] = Message::CONTROL;
+		header[3] = control::PADDING;
+		iov[count++] = {header, PADDING_HEADER};
+		iov[count++] = {const_cast<char*>(ZEROES), static_cast<size_t>(padding - PADDING_HEADER)};
+	}
+	send(message, iov, count);
+}
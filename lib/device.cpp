@@ -0,0 +1,75 @@
+#include <string.h>
+
+#include <algorithm>
+
+#include "device.h"
+#include "log.h"
+
+
+const size_t MemoryDevice::DEFAULT_LIMIT;
+
+
+MemoryDevice::MemoryDevice(const std::string &name, size_t limit, int debug) :
+	name(name), debug(debug), slots(std::max<size_t>(1, limit)) {}
+
+
+bool MemoryDevice::inject(const char *pkt, size_t len) {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (count == slots.size()) {
+			++dropped;
+			return false;
+		}
+		Slot &slot = slots[(head + count) % slots.size()];
+		slot.length = static_cast<uint16_t>(std::min(len, sizeof slot.data));
+		memcpy(slot.data, pkt, slot.length);
+		++count;
+	}
+	not_empty.notify_one();
+	return true;
+}
+
+
+void MemoryDevice::receive(Message &msg) {
+	std::unique_lock<std::mutex> lock(mutex);
+	not_empty.wait(lock, [this] () {return count > 0;});
+	take(msg);
+}
+
+
+bool MemoryDevice::tryReceive(Message &msg) {
+	std::lock_guard<std::mutex> lock(mutex);
+	if (count == 0) {
+		return false;
+	}
+	take(msg);
+	return true;
+}
+
+
+void MemoryDevice::take(Message &msg) {
+	// Called with the mutex held.
+	Slot &slot = slots[head];
+	head = (head + 1) % slots.size();
+	--count;
+
+	msg.setType(Message::DATA);
+	memcpy(msg.payload, slot.data, slot.length);
+	msg.setSize(slot.length);
+
+	LOG_DEBUG(debug, 3, "read {} bytes from {}", slot.length, name);
+}
+
+
+void MemoryDevice::writeMessage(Message &msg) {
+	++written;
+	if (sink) {
+		sink(msg.payload, msg.payload_length);
+	}
+	LOG_DEBUG(debug, 3, "wrote {} bytes into {}", msg.payload_length, name);
+}
+
+
+std::string MemoryDevice::describeFull() {
+	return std::string("memory device (name=") + name + ")";
+}
@@ -0,0 +1,92 @@
+#include "health.h"
+
+
+std::string linkState2String(LinkState state) {
+	switch (state) {
+		case LinkState::UP:
+			return "up";
+		case LinkState::SUSPECT:
+			return "suspect";
+		case LinkState::DOWN:
+			return "down";
+		case LinkState::PROBING:
+			return "probing";
+	}
+	return "unknown";
+}
+
+
+bool LinkHealth::onAck(TimePoint now, Duration rtt) {
+	std::lock_guard<std::mutex> lock(mutex);
+	last_ack = now;
+
+	// Same smoothing as TCP's SRTT (RFC 6298).
+	int64_t sample = std::chrono::duration_cast<std::chrono::microseconds>(rtt).count();
+	int64_t srtt = srtt_us.load(std::memory_order_relaxed);
+	srtt_us.store(srtt == 0 ? sample : srtt + (sample - srtt) / 8, std::memory_order_relaxed);
+
+	LinkState old_state = state.load();
+	LinkState new_state = old_state;
+	switch (old_state) {
+		case LinkState::UP:
+		case LinkState::SUSPECT:
+			new_state = LinkState::UP;
+			break;
+		case LinkState::DOWN:
+			probes = 1;
+			new_state = LinkState::PROBING;
+			break;
+		case LinkState::PROBING:
+			if (++probes >= PROBES_TO_UP) {
+				new_state = LinkState::UP;
+			}
+			break;
+	}
+	state.store(new_state);
+	return new_state != old_state;
+}
+
+
+bool LinkHealth::check(TimePoint now, Duration suspect_after, Duration down_after) {
+	std::lock_guard<std::mutex> lock(mutex);
+	if (last_ack == TimePoint{}) {
+		// First check: start counting from here.
+		last_ack = now;
+		return false;
+	}
+
+	Duration silence = now - last_ack;
+	LinkState old_state = state.load();
+	LinkState new_state = old_state;
+	switch (old_state) {
+		case LinkState::UP:
+			if (silence > suspect_after) {
+				new_state = LinkState::SUSPECT;
+			}
+			break;
+		case LinkState::SUSPECT:
+			if (silence > down_after) {
+				new_state = LinkState::DOWN;
+			}
+			break;
+		case LinkState::PROBING:
+			// A probe went unanswered, start over.
+			if (silence > suspect_after) {
+				new_state = LinkState::DOWN;
+			}
+			break;
+		case LinkState::DOWN:
+			break;
+	}
+	state.store(new_state);
+	return new_state != old_state;
+}
+
+
+LinkHealth::Duration LinkHealth::silentFor(TimePoint now) {
+	std::lock_guard<std::mutex> lock(mutex);
+	if (last_ack == TimePoint{}) {
+		return Duration::zero();
+	}
+	return now - last_ack;
+}
@@ -1,16 +1,170 @@
 #include <iostream>
 
 #include "idemux.h"
+#include "packet.h"
 #include "queue.h"
 #include "util.h"
-#include "tun.h"
+#include "device.h"
+#include "socket.h"
 
-IDeMux::IDeMux(std::shared_ptr<Tun> tun_ptr, int debug) :
-	tun_ptr(tun_ptr), debug(debug) {
+IDeMux::IDeMux(std::shared_ptr<PacketDevice> tun_ptr, int hold_ms, int debug) :
+	tun_ptr(tun_ptr), hold_time(hold_ms), debug(debug) {
 
 }
 
 
 void IDeMux::handleMessage(Message &msg) {
+	handleMessage(msg, std::chrono::steady_clock::now());
+}
+
+
+void IDeMux::handleMessage(Message &msg, std::chrono::steady_clock::time_point now) {
+	accept(msg, MessagePtr(), now);
+}
+
+
+void IDeMux::handleMessage(MessagePtr msg, std::chrono::steady_clock::time_point now) {
+	Message &ref = *msg;
+	accept(ref, std::move(msg), now);
+}
+
+
+void IDeMux::accept(Message &msg, MessagePtr owned, std::chrono::steady_clock::time_point now) {
+	counters.add(stats::LINK_PACKETS_IN);
+	if (capture_ptr) {
+		if (capture_ptr->filtersClass()) {
+			// The peer's IMux classified it, but the class doesn't travel.
+			msg.traffic_class = packet::classify(msg.payload, msg.payload_length);
+		}
+		capture_ptr->record(Capture::INBOUND, msg, msg.link_id, msg.stream, msg.has_seq,
+			msg.seq);
+	}
+	if (hold_time.count() == 0 || !msg.has_seq) {
+		release(msg);
+		return;
+	}
+
+	std::unique_lock<std::mutex> lock(mutex);
+	if (!synced) {
+		next_seq = msg.seq;
+		synced = true;
+	}
+
+	int32_t ahead = static_cast<int32_t>(msg.seq - next_seq);
+	if (ahead < -MAX_AHEAD || ahead > MAX_AHEAD) {
+		if (debug >= 1) {debugOut(1,
+		std::string("sequence number jumped to ") + std::to_string(msg.seq) + ", resyncing"
+		);}
+		while (!held.empty()) {
+			skipGap();
+		}
+		next_seq = msg.seq;
+		ahead = 0;
+	}
+	if (ahead < 0) {
+		// Its gap was given up on already. Better late than never.
+		++late;
+		writeReady(lock, &msg, ready.size());
+		return;
+	}
+	if (ahead == 0) {
+		// After what a resync gave up on, before what it lets go.
+		size_t msg_at = ready.size();
+		++next_seq;
+		releaseInOrder();
+		writeReady(lock, &msg, msg_at);
+		return;
+	}
+
+	uint32_t seq = msg.seq;
+	MessagePtr copy = owned ? std::move(owned) : MessagePtr(new Message(msg));
+	copy->queued_at = now;
+	if (held.emplace(seq, std::move(copy)).second) {
+		++reordered;
+	}
+	if (held.size() > MAX_HELD) {
+		skipGap();
+	}
+	writeReady(lock);
+}
+
+
+void IDeMux::flushExpired(std::chrono::steady_clock::time_point now) {
+	if (hold_time.count() == 0) {
+		return;
+	}
+	std::unique_lock<std::mutex> lock(mutex);
+	while (!held.empty() && now - held.begin()->second->queued_at >= hold_time) {
+		skipGap();
+	}
+	writeReady(lock);
+}
+
+
+void IDeMux::reset() {
+	std::unique_lock<std::mutex> lock(mutex);
+	while (!held.empty()) {
+		skipGap();
+	}
+	synced = false;
+	writeReady(lock);
+}
+
+
+size_t IDeMux::getHeld() {
+	std::lock_guard<std::mutex> lock(mutex);
+	return held.size();
+}
+
+
+void IDeMux::release(Message &msg) {
 	tun_ptr->writeMessage(msg);
-}
\ No newline at end of file
+	if (msg.latency) {
+		uint64_t now = stats::wallNanos();
+		msg.latency->reorder_hold.record(elapsedMicros(msg.received_ns, now));
+		msg.latency->end_to_end.record(elapsedMicros(msg.tun_ns, now));
+	}
+	counters.add(stats::TUN_PACKETS_WRITTEN);
+	counters.add(stats::TUN_BYTES_WRITTEN, msg.payload_length);
+}
+
+
+void IDeMux::releaseInOrder() {
+	while (!held.empty() && held.begin()->first == next_seq) {
+		ready.push_back(std::move(held.begin()->second));
+		held.erase(held.begin());
+		++next_seq;
+	}
+}
+
+
+void IDeMux::writeReady(std::unique_lock<std::mutex> &lock, Message *msg, size_t msg_at) {
+	std::vector<MessagePtr> batch;
+	batch.swap(ready);
+	if (msg == nullptr && batch.empty()) {
+		return;
+	}
+	// Taken before the reorder lock is let go, so the next batch can't overtake this
+	// one on the way to the tun.
+	std::lock_guard<std::mutex> write_lock(write_mutex);
+	lock.unlock();
+	for (size_t i = 0; i < batch.size(); i++) {
+		if (msg != nullptr && i == msg_at) {
+			release(*msg);
+		}
+		release(*batch[i]);
+	}
+	if (msg != nullptr && msg_at >= batch.size()) {
+		release(*msg);
+	}
+}
+
+
+void IDeMux::skipGap() {
+	// Gives up on everything before the first held message.
+	uint32_t first = held.begin()->first;
+	lost += static_cast<uint32_t>(first - next_seq);
+	LOG_DEBUG(debug, 3, "gave up waiting for {} messages from {}", first - next_seq, next_seq);
+	next_seq = first;
+	releaseInOrder();
+}
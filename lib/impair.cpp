@@ -0,0 +1,185 @@
+#include <algorithm>
+#include <cmath>
+#include <sstream>
+
+#include "impair.h"
+#include "util.h"
+
+
+Impairment Impairment::parse(const std::string &spec) {
+	Impairment impairment;
+	std::stringstream ss(spec);
+	std::string term;
+	while (std::getline(ss, term, '/')) {
+		if (term.empty()) {
+			continue;
+		}
+		size_t eq = term.find('=');
+		if (eq == std::string::npos) {
+			throw std::invalid_argument("impairment term without '=': " + term);
+		}
+		std::string key = term.substr(0, eq);
+		std::string value = term.substr(eq + 1);
+		double number;
+		try {
+			number = (key == "dist") ? 0 : std::stod(value);
+		} catch (std::exception &e) {
+			throw std::invalid_argument("impairment term isn't a number: " + term);
+		}
+		if (number < 0) {
+			throw std::invalid_argument("impairment term can't be negative: " + term);
+		}
+		bool percentage = (key == "loss" || key == "gilbert" || key == "recover" ||
+			key == "badloss" || key == "reorder");
+		if (percentage && number > 100) {
+			throw std::invalid_argument("impairment percentage above 100: " + term);
+		}
+
+		if (key == "delay") {
+			impairment.delay_ms = number;
+		} else if (key == "jitter") {
+			impairment.jitter_ms = number;
+		} else if (key == "dist" && value == "uniform") {
+			impairment.distribution = UNIFORM;
+		} else if (key == "dist" && value == "normal") {
+			impairment.distribution = NORMAL;
+		} else if (key == "dist" && value == "pareto") {
+			impairment.distribution = PARETO;
+		} else if (key == "loss") {
+			impairment.loss = number / 100;
+		} else if (key == "gilbert") {
+			impairment.gilbert = number / 100;
+		} else if (key == "recover") {
+			impairment.recover = number / 100;
+		} else if (key == "badloss") {
+			impairment.bad_loss = number / 100;
+		} else if (key == "rate") {
+			impairment.rate_kbit = static_cast<uint64_t>(number);
+		} else if (key == "queue") {
+			impairment.queue_ms = number;
+		} else if (key == "reorder") {
+			impairment.reorder = number / 100;
+		} else if (key == "seed") {
+			impairment.seed = static_cast<uint64_t>(number);
+		} else {
+			throw std::invalid_argument("unknown impairment term: " + term);
+		}
+	}
+	return impairment;
+}
+
+
+std::string Impairment::describe() const {
+	static const char *distributions[] = {"uniform", "normal", "pareto"};
+	std::stringstream ss;
+	ss << "delay " << delay_ms << " ms";
+	if (jitter_ms > 0) {
+		ss << " +- " << jitter_ms << " ms " << distributions[distribution];
+	}
+	if (gilbert > 0) {
+		ss << ", gilbert-elliott loss " << 100 * loss << "%/" << 100 * bad_loss << "% (p "
+			<< 100 * gilbert << "%, r " << 100 * recover << "%)";
+	} else if (loss > 0) {
+		ss << ", loss " << 100 * loss << "%";
+	}
+	if (rate_kbit > 0) {
+		ss << ", rate " << rate_kbit << " kbit/s, queue " << queue_ms << " ms";
+	}
+	if (reorder > 0) {
+		ss << ", reorder " << 100 * reorder << "%";
+	}
+	return ss.str();
+}
+
+
+Impairer::Impairer(const Impairment &impairment, SendFunction send, int debug) :
+	impairment(impairment), send(send), debug(debug),
+	rng(impairment.seed != 0 ? impairment.seed : std::random_device()()) {
+
+	if (debug >= 1) {debugOut(1,
+	"impairing a link: " + impairment.describe()
+	);}
+}
+
+
+bool Impairer::isLost() {
+	std::uniform_real_distribution<double> coin(0, 1);
+	if (impairment.gilbert > 0) {
+		// Change state first, then lose according to the new state.
+		if (bad_state) {
+			bad_state = coin(rng) >= impairment.recover;
+		} else {
+			bad_state = coin(rng) < impairment.gilbert;
+		}
+		return coin(rng) < (bad_state ? impairment.bad_loss : impairment.loss);
+	}
+	return impairment.loss > 0 && coin(rng) < impairment.loss;
+}
+
+
+std::chrono::nanoseconds Impairer::pickDelay() {
+	double delay = impairment.delay_ms;
+	double jitter = impairment.jitter_ms;
+	if (jitter > 0) {
+		switch (impairment.distribution) {
+			case Impairment::UNIFORM:
+				delay += std::uniform_real_distribution<double>(-jitter, jitter)(rng);
+				break;
+			case Impairment::NORMAL:
+				delay += std::normal_distribution<double>(0, jitter)(rng);
+				break;
+			case Impairment::PARETO: {
+				// Heavy tail above the base delay, with a mean of jitter (shape 3).
+				const double shape = 3;
+				double u = std::uniform_real_distribution<double>(0, 1)(rng);
+				delay += jitter * (shape - 1) * (std::pow(1 - u, -1 / shape) - 1);
+				break;
+			}
+		}
+	}
+	return std::chrono::nanoseconds(static_cast<int64_t>(std::max(delay, 0.0) * 1e6));
+}
+
+
+void Impairer::submit(const Message &message) {
+	auto now = TimerWheel::Clock::now();
+	TimerWheel::Clock::time_point when;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (isLost()) {
+			++lost;
+			LOG_DEBUG(debug, 3, "impairment lost a message of {} bytes", message.payload_length);
+			return;
+		}
+
+		// The rate cap queues the message behind the ones still being serialized.
+		when = now;
+		if (impairment.rate_kbit > 0) {
+			auto backlog = std::max(link_free, now) - now;
+			if (backlog > std::chrono::microseconds(
+					static_cast<int64_t>(impairment.queue_ms * 1000))) {
+				++overflows;
+				return;
+			}
+			uint64_t bits = 8 * (Message::HEADER_LENGTH + message.payload_length);
+			link_free = std::max(link_free, now) +
+				std::chrono::microseconds(bits * 1000 / impairment.rate_kbit);
+			when = link_free;
+		}
+
+		if (impairment.reorder > 0 &&
+				std::uniform_real_distribution<double>(0, 1)(rng) < impairment.reorder) {
+			++reordered;
+		} else {
+			when += pickDelay();
+		}
+	}
+
+	if (when <= now) {
+		Message copy(message);
+		send(copy);
+		return;
+	}
+	std::shared_ptr<Message> copy(new Message(message));
+	wheel.schedule(when, [this, copy] () {this->send(*copy);});
+}
@@ -1,46 +1,231 @@
+#include <algorithm>
+#include <deque>
 #include <iostream>
 #include <map>
 #include <memory>
 
+#include "affinity.h"
 #include "imux.h"
+#include "packet.h"
 #include "util.h"
 
-IMux::IMux(std::shared_ptr<Tun> tun_ptr, int debug) : tun_ptr(tun_ptr), debug(debug) {}
+Socket *StreamGroup::pick() {
+	if (streams.size() == 1) {
+		return streams[0];
+	}
+	Socket *shortest = nullptr;
+	size_t shortest_backlog = 0;
+	for (auto it=streams.begin(); it!=streams.end(); it++) {
+		if (!(*it)->isUsable()) {
+			continue;
+		}
+		size_t backlog = (*it)->getBacklog();
+		if (shortest == nullptr || backlog < shortest_backlog) {
+			shortest = *it;
+			shortest_backlog = backlog;
+		}
+	}
+	return (shortest != nullptr) ? shortest : streams[0];
+}
+
+
+IMux::IMux(std::shared_ptr<PacketDevice> tun_ptr, bool timestamps, int debug, int pool_node) :
+	message_pool(std::make_shared<MessagePool>(MessagePool::DEFAULT_SIZE, pool_node, debug)),
+	tun_ptr(tun_ptr), scheduler_ptr(new RoundRobinScheduler()), timestamps(timestamps),
+	debug(debug) {}
 
 
 void IMux::attachSocket(std::shared_ptr<Socket> socket) {
-	sockets_map.insert({socket->describe(), socket});
-	sockets_vector.push_back(socket);
+	socket->getSendQueue().holdPool(message_pool);
+	links.update([&socket] (LinkSet &set) {
+		set.sockets_map.insert({socket->describe(), socket});
+		set.sockets_vector.push_back(socket);
+		group(set);
+	});
 	if (debug >= 2) {debugOut(2,
 	std::string("attached to imux ") + socket->describeFull()
 	);}
 }
 
 
+void IMux::detachSocket(std::shared_ptr<Socket> socket) {
+	if (!unlink(socket)) {
+		return;
+	}
+	// Stops the link's sender thread. Whatever is still in its queue is lost.
+	socket->getSendQueue().close();
+	if (debug >= 1) {debugOut(1,
+	std::string("detached from imux ") + socket->describeFull()
+	);}
+}
+
+
+void IMux::retireSocket(std::shared_ptr<Socket> socket) {
+	if (!unlink(socket)) {
+		return;
+	}
+	socket->finishSending();
+	if (debug >= 1) {debugOut(1,
+	std::string("retired from imux ") + socket->describeFull() +
+	", closing it once its queue is sent"
+	);}
+}
+
+
+bool IMux::unlink(const std::shared_ptr<Socket> &socket) {
+	bool found = false;
+	links.update([&socket, &found] (LinkSet &set) {
+		auto it = std::find(set.sockets_vector.begin(), set.sockets_vector.end(), socket);
+		if (it == set.sockets_vector.end()) {
+			return;
+		}
+		found = true;
+		set.sockets_vector.erase(it);
+		auto map_it = set.sockets_map.find(socket->describe());
+		if (map_it != set.sockets_map.end() && map_it->second == socket) {
+			set.sockets_map.erase(map_it);
+		}
+		group(set);
+	});
+	return found;
+}
+
+
+void IMux::regroup() {
+	links.update([] (LinkSet &set) {
+		group(set);
+	});
+}
+
+
+void IMux::group(LinkSet &set) {
+	// Built anew, older versions of the set still use theirs.
+	set.groups.clear();
+	set.links_vector.clear();
+	std::map<uint32_t, StreamGroup*> by_id;
+	for (auto it=set.sockets_vector.begin(); it!=set.sockets_vector.end(); it++) {
+		uint32_t link_id = (*it)->getLinkId();
+		auto group_it = by_id.find(link_id);
+		if (group_it == by_id.end()) {
+			set.groups.push_back(std::make_shared<StreamGroup>(link_id));
+			set.links_vector.push_back(set.groups.back().get());
+			group_it = by_id.insert({link_id, set.groups.back().get()}).first;
+		}
+		group_it->second->add(it->get());
+	}
+}
+
+
+void IMux::forEachSocket(const std::function<void(const std::shared_ptr<Socket>&)> &fn) {
+	Snapshot<LinkSet>::ReadGuard set(links);
+	for (auto it=set->sockets_vector.begin(); it!=set->sockets_vector.end(); it++) {
+		fn(*it);
+	}
+}
+
+
 void IMux::readTunLoop() {
+	std::deque<MessagePtr> classes[packet::CLASSES];
+	MessagePtr msg = message_pool->take();
 	while (true) {
-		Message msg;
-		tun_ptr->receive(msg);	// will block until there's a message.
-		handleMessage(msg);
+		// Block for the first message, then take whatever else is waiting in the tun so
+		// ACKs, DNS and the like can overtake the bulk data read in the same batch.
+		tun_ptr->receive(*msg);	// will block until there's a message.
+		int batch = 0;
+		do {
+			// Only timestamped messages are timed, the clock isn't free.
+			if (timestamps) {
+				msg->tun_ns = stats::wallNanos();
+			}
+			counters.add(stats::TUN_PACKETS_READ);
+			counters.add(stats::TUN_BYTES_READ, msg->payload_length);
+			msg->traffic_class = packet::classify(msg->payload, msg->payload_length);
+			classes[msg->traffic_class].push_back(std::move(msg));
+			msg = message_pool->take();
+		} while (++batch < BATCH_SIZE && tun_ptr->tryReceive(*msg));
+
+		for (int c = 0; c < packet::CLASSES; c++) {
+			while (!classes[c].empty()) {
+				handleMessage(std::move(classes[c].front()));
+				classes[c].pop_front();
+			}
+		}
+		if (batch > 1) {
+			LOG_DEBUG(debug, 3, "handled a batch of {} messages from the tun", batch);
+		}
 	}
 }
 
 
-void IMux::handleMessage(Message &message) {
-	// Just pick the first one in the vector for now.
+int IMux::spillOver(const Message &message, const std::vector<ScheduledLink*> &links,
+	int picked) {
+	uint16_t size = Message::HEADER_LENGTH + message.payload_length + Message::SEQ_LENGTH +
+		Message::TIMESTAMP_LENGTH;
+	size_t n = links.size();
+	for (size_t i = 0; i < n; i++) {
+		size_t candidate = (picked + i) % n;
+		if ((i == 0 || links[candidate]->takes(message)) && links[candidate]->admits(size)) {
+			return static_cast<int>(candidate);
+		}
+	}
+	return -1;
+}
+
 
-	if (!sockets_vector[index]->isReady()) {
-		// Too bad, I don't feel like doing something smart right now.
-		if (debug >= 2) {debugOut(2,
-		std::string("") + sockets_vector[index]->describeFull() + " was chosen but is not ready (no peer?). dropping message."
-		);}
+int IMux::route(Scheduler &scheduler, const Message &message,
+	const std::vector<ScheduledLink*> &links, bool &spilled) {
+	spilled = false;
+	// Links that aren't usable (no peer yet, or the heartbeats say it's suspect or down)
+	// are skipped by the scheduler.
+	int picked = scheduler.pick(message, links);
+	if (picked < 0) {
+		return -1;
+	}
+	// Over its shaping limits, the picked link would hold the message back. If none of
+	// the others can take it, it does.
+	int spilled_to = spillOver(message, links, picked);
+	if (spilled_to >= 0 && spilled_to != picked) {
+		spilled = true;
+		return spilled_to;
+	}
+	return picked;
+}
+
+
+void IMux::handleMessage(MessagePtr message) {
+	Snapshot<LinkSet>::ReadGuard set(links);
+	const auto &sockets_vector = set->sockets_vector;
+	if (sockets_vector.empty()) {
+		LOG_DEBUG(debug, 2, "no links attached. dropping message.");
+		counters.add(stats::NO_LINK_DROPS);
 		return;
 	}
-	sockets_vector[index]->sendMessage(message);
-	if (debug >= 2) {debugOut(2,
-	std::string("chose ") + sockets_vector[index]->describeFull() + " to send data"
-	);}
 
-	index = (++index) % sockets_vector.size();
-	//(*(sockets.begin()->second)).sendMessage(message);
-}
\ No newline at end of file
+	bool spilled;
+	int picked = route(*scheduler_ptr, *message, set->links_vector, spilled);
+	if (spilled) {
+		counters.add(stats::SPILLED_OVER);
+	}
+	if (picked >= 0) {
+		Socket *socket = set->groups[picked]->pick();
+		LOG_DEBUG(debug, 2, "chose {} to send data", socket->describeFull());
+		bool numbered = socket->hasFeature(control::FEATURE_SEQ);
+		if (capture_ptr) {
+			capture_ptr->record(Capture::OUTBOUND, *message, socket->getLinkId(),
+				socket->getStream(), numbered, next_seq);
+		}
+		// Numbered here, so the order survives being spread over the links. A peer that
+		// doesn't take the trailer gets the message as it is, and no gap in the numbers.
+		if (timestamps && socket->hasFeature(control::FEATURE_TIMESTAMP)) {
+			message->appendTimestamp();
+		}
+		if (numbered) {
+			message->appendSeq(next_seq++);
+		}
+		socket->enqueueMessage(std::move(message));
+		return;
+	}
+
+	LOG_DEBUG(debug, 2, "none of the links is usable. dropping message.");
+	counters.add(stats::NO_LINK_DROPS);
+}
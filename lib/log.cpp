@@ -0,0 +1,308 @@
+#include <stdio.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "log.h"
+
+
+namespace {
+
+	// Between drains while something is logged, so a batch of several threads' records
+	// is printed in time order. Idle, the drain thread sleeps until woken.
+	const std::chrono::milliseconds DRAIN_INTERVAL{1};
+
+	/**
+		Single producer (the owning thread), single consumer (whoever drains, under the
+		logger's drain mutex).
+	*/
+	struct Ring {
+		logging::Record records[logging::RING_SIZE];
+		std::atomic<uint64_t> head{0};		// Next record to write
+		std::atomic<uint64_t> tail{0};		// Next record to read
+		std::atomic<uint64_t> dropped{0};
+		std::atomic<bool> orphaned{false};	// Its thread exited
+		uint64_t reserved = 0;				// Producer only
+	};
+
+
+	class Logger {
+	public:
+		Logger() : drain_t([this] () {this->drainLoop();}) {}
+		~Logger() {
+			{
+				std::lock_guard<std::mutex> lock(wake_mutex);
+				stopping = true;
+			}
+			wake_up.notify_one();
+			drain_t.join();
+			drain();
+		}
+
+		/**
+			Called after every commit. Cheap unless the drain thread sleeps.
+		*/
+		void wake() {
+			if (!sleeping.load()) {
+				return;
+			}
+			{
+				std::lock_guard<std::mutex> lock(wake_mutex);
+				sleeping = false;
+			}
+			wake_up.notify_one();
+		}
+
+		std::shared_ptr<Ring> newRing() {
+			std::shared_ptr<Ring> ring(new Ring());
+			std::lock_guard<std::mutex> lock(rings_mutex);
+			rings.push_back(ring);
+			return ring;
+		}
+
+		/**
+			Returns false if there was nothing to print.
+		*/
+		bool drain() {
+			std::lock_guard<std::mutex> drain_lock(drain_mutex);
+			std::vector<std::shared_ptr<Ring>> current;
+			{
+				std::lock_guard<std::mutex> lock(rings_mutex);
+				current = rings;
+			}
+
+			batch.clear();
+			uint64_t dropped = 0;
+			for (auto it=current.begin(); it!=current.end(); it++) {
+				Ring &ring = **it;
+				// Checked before reading, so a thread that exits meanwhile is drained
+				// once more before its ring goes.
+				bool orphaned = ring.orphaned.load();
+				uint64_t head = ring.head.load(std::memory_order_acquire);
+				uint64_t tail = ring.tail.load(std::memory_order_relaxed);
+				for (; tail != head; tail++) {
+					logging::Record &record = ring.records[tail & (logging::RING_SIZE - 1)];
+					batch.push_back({record.ns, record.level, record.formatText()});
+					record.release();
+				}
+				ring.tail.store(tail, std::memory_order_release);
+				dropped += ring.dropped.exchange(0);
+				if (orphaned) {
+					std::lock_guard<std::mutex> lock(rings_mutex);
+					rings.erase(std::find(rings.begin(), rings.end(), *it));
+				}
+			}
+			if (batch.empty() && dropped == 0) {
+				return false;
+			}
+
+			std::stable_sort(batch.begin(), batch.end(), [] (const Line &a, const Line &b) {
+				return a.ns < b.ns;
+			});
+			for (auto it=batch.begin(); it!=batch.end(); it++) {
+				print(it->level, it->text);
+			}
+			if (dropped > 0) {
+				print(logging::ERROR, std::to_string(dropped) +
+					" log messages dropped, the logger couldn't keep up");
+			}
+			fflush(stdout);
+			return true;
+		}
+
+	private:
+		struct Line {
+			uint64_t ns;
+			int level;
+			std::string text;
+		};
+
+		static void print(int level, const std::string &text) {
+			if (level == logging::ERROR) {
+				fprintf(stdout, "\033[91m[e] %s\033[0m\n", text.c_str());
+			} else {
+				fprintf(stdout, "[d%d] %s\n", level, text.c_str());
+			}
+		}
+
+		void drainLoop() {
+			while (!stopping) {
+				if (drain()) {
+					std::this_thread::sleep_for(DRAIN_INTERVAL);
+					continue;
+				}
+				// Says it sleeps before looking again, so a record committed in between
+				// either shows up here or wakes it (see wake()).
+				std::unique_lock<std::mutex> lock(wake_mutex);
+				sleeping = true;
+				if (isPending()) {
+					sleeping = false;
+					continue;
+				}
+				wake_up.wait(lock, [this] () {return !sleeping || stopping;});
+			}
+		}
+
+		bool isPending() {
+			std::lock_guard<std::mutex> lock(rings_mutex);
+			for (auto it=rings.begin(); it!=rings.end(); it++) {
+				if ((*it)->head.load() != (*it)->tail.load() || (*it)->dropped.load() > 0) {
+					return true;
+				}
+			}
+			return false;
+		}
+
+		std::mutex rings_mutex;
+		std::vector<std::shared_ptr<Ring>> rings;
+		std::mutex drain_mutex;
+		std::vector<Line> batch;	// Reused between drains
+		std::atomic<bool> stopping{false};
+		std::mutex wake_mutex;
+		std::condition_variable wake_up;
+		std::atomic<bool> sleeping{false};
+		std::thread drain_t;
+	};
+
+
+	Logger &logger() {
+		static Logger instance;
+		return instance;
+	}
+
+
+	/**
+		Registers the thread's ring on its first log, and orphans it when the thread exits.
+	*/
+	struct RingHandle {
+		RingHandle() : ring(logger().newRing()) {}
+		~RingHandle() {
+			ring->orphaned = true;
+		}
+		std::shared_ptr<Ring> ring;
+	};
+
+
+	Ring &myRing() {
+		thread_local RingHandle handle;
+		return *handle.ring;
+	}
+
+
+	uint64_t nowNanos() {
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+}
+
+
+void logging::Record::add(int64_t value) {
+	types[n_args] = INT;
+	values[n_args++].i = value;
+}
+
+
+void logging::Record::add(uint64_t value) {
+	types[n_args] = UINT;
+	values[n_args++].u = value;
+}
+
+
+void logging::Record::add(double value) {
+	types[n_args] = DOUBLE;
+	values[n_args++].d = value;
+}
+
+
+void logging::Record::add(const char *value, size_t length) {
+	if (length > static_cast<size_t>(TEXT_SIZE - text_used)) {
+		types[n_args] = LONG_STRING;
+		values[n_args++].long_s = new std::string(value, length);
+		return;
+	}
+	memcpy(text + text_used, value, length);
+	types[n_args] = STRING;
+	values[n_args].s.offset = text_used;
+	values[n_args++].s.length = static_cast<uint16_t>(length);
+	text_used += length;
+}
+
+
+std::string logging::Record::formatText() const {
+	std::string out;
+	int arg = 0;
+	for (const char *p = format; *p != '\0'; p++) {
+		if (p[0] != '{' || p[1] != '}' || arg >= n_args) {
+			out += *p;
+			continue;
+		}
+		const Value &value = values[arg];
+		switch (types[arg]) {
+			case INT:
+				out += std::to_string(value.i);
+				break;
+			case UINT:
+				out += std::to_string(value.u);
+				break;
+			case DOUBLE:
+				out += std::to_string(value.d);
+				break;
+			case STRING:
+				out.append(text + value.s.offset, value.s.length);
+				break;
+			case LONG_STRING:
+				out += *value.long_s;
+				break;
+		}
+		arg++;
+		p++;	// Skip the '}'
+	}
+	return out;
+}
+
+
+void logging::Record::release() {
+	for (int i = 0; i < n_args; i++) {
+		if (types[i] == LONG_STRING) {
+			delete values[i].long_s;
+		}
+	}
+	n_args = 0;
+}
+
+
+logging::Record *logging::reserve() {
+	Ring &ring = myRing();
+	uint64_t head = ring.head.load(std::memory_order_relaxed);
+	if (head - ring.tail.load(std::memory_order_acquire) >= static_cast<uint64_t>(RING_SIZE)) {
+		ring.dropped.fetch_add(1, std::memory_order_relaxed);
+		return nullptr;
+	}
+	Record *record = &ring.records[head & (RING_SIZE - 1)];
+	record->ns = nowNanos();
+	record->n_args = 0;
+	record->text_used = 0;
+	ring.reserved = head + 1;
+	return record;
+}
+
+
+void logging::commit() {
+	Ring &ring = myRing();
+	// Sequentially consistent, against the drain thread's look at the rings after it
+	// said it sleeps.
+	ring.head.store(ring.reserved);
+	logger().wake();
+}
+
+
+void logging::flush() {
+	logger().drain();
+}
@@ -0,0 +1,89 @@
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/mempolicy.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <algorithm>
+#include <new>
+#include <stdexcept>
+
+#include "mempool.h"
+#include "util.h"
+
+
+const size_t MessagePool::DEFAULT_SIZE;
+
+
+void MessageDeleter::operator()(Message *msg) const {
+	if (pool != nullptr) {
+		pool->give(msg);
+	} else {
+		delete msg;
+	}
+}
+
+
+MessagePool::MessagePool(size_t size, int node, int debug) : size(std::max<size_t>(size, 1)) {
+	size_t length = this->size * sizeof(Slot);
+	void *memory = mmap(nullptr, length, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (memory == MAP_FAILED) {
+		throw std::bad_alloc();
+	}
+	if (node >= 0) {
+		// Before the pages are touched, that's when they get their node. No libnuma for
+		// the one call.
+		unsigned long mask[16] = {};
+		if (node < static_cast<int>(sizeof mask * 8)) {
+			mask[node / (sizeof mask[0] * 8)] = 1UL << (node % (sizeof mask[0] * 8));
+			if (syscall(SYS_mbind, memory, length, MPOL_PREFERRED, mask, sizeof mask * 8,
+					0) != 0) {
+				errorOut(std::string("can't put the message pool on node ") +
+					std::to_string(node) + ": " + strerror(errno));
+			}
+		}
+	}
+	slots = static_cast<Slot*>(memory);
+
+	// Linking them up touches every page.
+	for (size_t i = 0; i < this->size; i++) {
+		slots[i].next = (i + 1 < this->size) ? &slots[i + 1] : nullptr;
+	}
+	taken_from = slots;
+
+	if (debug >= 2) {debugOut(2,
+	"allocated a pool of " + std::to_string(this->size) + " messages on node " +
+	std::to_string(node)
+	);}
+}
+
+
+MessagePool::~MessagePool() {
+	munmap(slots, size * sizeof(Slot));
+}
+
+
+MessagePtr MessagePool::take() {
+	if (taken_from == nullptr) {
+		taken_from = given_back.exchange(nullptr, std::memory_order_acquire);
+		if (taken_from == nullptr) {
+			misses.fetch_add(1, std::memory_order_relaxed);
+			return MessagePtr(new Message);
+		}
+	}
+	Slot *slot = taken_from;
+	taken_from = slot->next;
+	return MessagePtr(new (slot->storage) Message, MessageDeleter{this});
+}
+
+
+void MessagePool::give(Message *msg) {
+	msg->~Message();
+	Slot *slot = reinterpret_cast<Slot*>(msg);
+	// Only the owner takes, and it takes the whole list, so there's no ABA.
+	slot->next = given_back.load(std::memory_order_relaxed);
+	while (!given_back.compare_exchange_weak(slot->next, slot, std::memory_order_release,
+		std::memory_order_relaxed)) {}
+}
@@ -0,0 +1,50 @@
+#include "monitor.h"
+#include "util.h"
+
+
+constexpr double LinkMonitor::SUSPECT_AFTER;
+constexpr double LinkMonitor::DOWN_AFTER;
+constexpr double LinkMonitor::RESTART_AFTER;
+
+
+static std::chrono::steady_clock::duration intervals(std::chrono::milliseconds interval,
+	double n) {
+	return std::chrono::duration_cast<std::chrono::steady_clock::duration>(interval * n);
+}
+
+
+LinkMonitor::LinkMonitor(std::shared_ptr<IMux> imux_ptr, int interval_ms, int debug) :
+	imux_ptr(imux_ptr), interval(interval_ms),
+	suspect_after(intervals(interval, SUSPECT_AFTER)),
+	down_after(intervals(interval, DOWN_AFTER)),
+	restart_after(intervals(interval, RESTART_AFTER)),
+	debug(debug) {}
+
+
+void LinkMonitor::tick(std::chrono::steady_clock::time_point now) {
+	bool send = now >= next_heartbeat;
+	if (send) {
+		next_heartbeat = now + interval;
+	}
+
+	imux_ptr->forEachSocket([this, now, send] (const std::shared_ptr<Socket> &socket) {
+		if (!socket->isReady()) {
+			return;		// UDP server that hasn't heard from its peer yet
+		}
+		LinkHealth &health = socket->getHealth();
+		if (send) {
+			// Also sent when the link is down: then they're the probes.
+			socket->sendHeartbeat();
+		}
+		if (health.check(now, suspect_after, down_after) && debug >= 1) {debugOut(1,
+		socket->describeFull() + " is " + linkState2String(health.getState())
+		);}
+		if (socket->isRestartable() && health.getState() == LinkState::DOWN &&
+				health.silentFor(now) > restart_after) {
+			if (debug >= 1) {debugOut(1,
+			std::string("giving up on ") + socket->describeFull()
+			);}
+			socket->shutdownSocket();
+		}
+	});
+}
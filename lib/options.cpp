@@ -10,10 +10,16 @@
 #include <getopt.h>
 #include <vector>
 
+#include "config.h"
+#include "impair.h"
 #include "options.h"
+#include "scheduler.h"
 #include "socket.h"
 
 
+const int Options::MAX_STREAMS;
+
+
 Options::Options() {}
 
 
@@ -24,7 +30,7 @@ void Options::parse(int argc, char* argv[]) {
 	prog_name = argv[0] ;
 	std::stringstream ss;	
 	// The leading colon makes sure we're notified of missing arguments to options. (case ':')
-	const char *optstring = ":hvscb:f:t:d:o";
+	const char *optstring = ":hvscb:g:f:t:d:ok:r:p:m:lC:F:S:A:B:M:Z:";
 	while ((c = getopt (argc, argv, optstring)) != -1) {
 		switch (c) {
 			case 'h':
@@ -40,33 +46,21 @@ void Options::parse(int argc, char* argv[]) {
 				client_flag = true;
 				break;
 			case 'b': {
-					std::stringstream stream1((std::string(optarg)));
-					std::string config;
-					while (std::getline(stream1, config, ',')) {
-						std::stringstream stream2(config);
-						std::vector<std::string> elems;
-						std::string item;
-						while (std::getline(stream2, item, ':')) {
-							elems.push_back(item);
-						}
-						if (elems.size() == 3) {
-							SocketType st;
-							std::string ip;
-							int port;
-							try {
-								st = string2SocketType(elems[0]);
-							} catch (std::invalid_argument &e) {
-								ss << "invalid socket(s) description: " << optarg;
-								throw OptionsParseException(ss.str());
-							}
-							ip = elems[1];
-							port = std::stoi(elems[2]);
-							SocketDescription des = {.type=st, .ip=ip, .port=port};
-							sock_des.push_back(des);
+					std::stringstream stream(optarg);
+					std::string spec;
+					while (std::getline(stream, spec, ',')) {
+						try {
+							sock_des.push_back(SocketDescription::parse(spec));
+						} catch (std::invalid_argument &e) {
+							ss << "invalid socket description '" << spec << "': " << e.what();
+							throw OptionsParseException(ss.str());
 						}
 					}
 				}
 				break;
+			case 'g':
+				config_path = optarg;
+				break;
 			case 'f':
 				if_name = optarg;
 				break;
@@ -80,6 +74,94 @@ void Options::parse(int argc, char* argv[]) {
 			case 'o':
 				options_flag = true;
 				break;
+			case 'k':
+				heartbeat_interval = atoi(optarg);
+				if (heartbeat_interval < 0) {
+					throw OptionsParseException("heartbeat interval can't be negative: '-k'");
+				}
+				break;
+			case 'r':
+				reorder_hold = atoi(optarg);
+				if (reorder_hold < 0) {
+					throw OptionsParseException("reorder hold time can't be negative: '-r'");
+				}
+				break;
+			case 'p':
+				max_streams = atoi(optarg);
+				if (max_streams < 1 || max_streams > MAX_STREAMS) {
+					ss << "streams per TCP link must be between 1 and " << MAX_STREAMS << ": '-p'";
+					throw OptionsParseException(ss.str());
+				}
+				break;
+			case 'S':
+				try {
+					Scheduler::create(optarg);
+				} catch (std::invalid_argument &e) {
+					ss << "unknown scheduler: '" << optarg << "' ('-S')";
+					throw OptionsParseException(ss.str());
+				}
+				scheduler = optarg;
+				break;
+			case 'A':
+				try {
+					placement = Placement::parse(optarg);
+				} catch (std::invalid_argument &e) {
+					ss << "invalid placement: " << e.what() << " ('-A')";
+					throw OptionsParseException(ss.str());
+				}
+				break;
+			case 'B':
+				busy_poll = atoi(optarg);
+				if (busy_poll < 0) {
+					throw OptionsParseException("busy poll time can't be negative: '-B'");
+				}
+				break;
+			case 'M':
+				if (std::string(optarg) == "probe") {
+					probe_mtu = true;
+				} else if (std::string(optarg) == "tun") {
+					probe_mtu = true;
+					size_tun = true;
+				} else {
+					throw OptionsParseException(std::string("unknown MTU mode: '") + optarg + "'");
+				}
+				break;
+			case 'Z':
+				zero_copy = atoi(optarg);
+				if (zero_copy < 0 || zero_copy > UINT16_MAX) {
+					throw OptionsParseException(std::string("invalid zero copy threshold: '") + optarg + "' ('-Z')");
+				}
+				break;
+			case 'm':
+				stats_path = optarg;
+				break;
+			case 'l':
+				timestamps = true;
+				break;
+			case 'C': {
+					std::string spec(optarg);
+					size_t colon = spec.rfind(':');
+					capture_path = spec.substr(0, colon);
+					if (colon != std::string::npos) {
+						int size_mb = atoi(spec.substr(colon + 1).c_str());
+						if (size_mb < 1) {
+							throw OptionsParseException("capture size must be at least 1 MB: '-C'");
+						}
+						capture_size_mb = size_mb;
+					}
+					if (capture_path.empty()) {
+						throw OptionsParseException("capture file missing: '-C'");
+					}
+				}
+				break;
+			case 'F':
+				try {
+					capture_filter = CaptureFilter::parse(optarg);
+				} catch (std::exception &e) {
+					ss << "invalid capture filter: " << optarg;
+					throw OptionsParseException(ss.str());
+				}
+				break;
 			case ':':
 				ss << "option requires an argument: '" << static_cast<char>(optopt) << "'";
 				throw OptionsParseException(ss.str());
@@ -99,7 +181,17 @@ void Options::parse(int argc, char* argv[]) {
 	if (client_flag && server_flag) {
 		throw OptionsParseException("more than one mode specified: '-s' and '-c'");
 	}
-	if (client_flag && sock_des.empty()) {
+	if (!config_path.empty()) {
+		if (!sock_des.empty()) {
+			throw OptionsParseException("socket descriptions given twice: '-b' and '-g'");
+		}
+		try {
+			sock_des = config::read(config_path);
+		} catch (ConfigException &e) {
+			throw OptionsParseException(e.what());
+		}
+	}
+	if (client_flag && sock_des.empty() && config_path.empty()) {
 		throw OptionsParseException("client mode but no socket descriptions given: '-b'");
 	}
 	if (if_name.size() > 16) {
@@ -114,15 +206,39 @@ void Options::parse(int argc, char* argv[]) {
 
 void Options::printHelp(std::ostream &out) {
 	out << "Usage:\n"
-		<< prog_name << " {-c | -s} -b SOCKET_DES[,..] [-f IF_NAME] [-d LEVEL] [-t CLONE_DEV] [-o]\n"
+		<< prog_name << " {-c | -s} {-b SOCKET_DES[,..] | -g PATH} [-f IF_NAME] [-d LEVEL] [-t CLONE_DEV] [-k MS] [-r MS] [-p N] [-S SCHEDULER] [-A PLACEMENT] [-B US] [-M MODE] [-Z BYTES] [-m PATH] [-l] [-C PATH[:MB]] [-F FILTER] [-o]\n"
 		<< prog_name << " -h\n" 
-		<< "\tSOCKET_DES format: {UDP|TCP}:IP:PORT\n"
+		<< "\tSOCKET_DES format: {UDP|TCP|XDP}:IP:PORT[:IMPAIRMENT[:SHAPING]] or {UNIX|SHM}:PATH[:IMPAIRMENT[:SHAPING]]\n"
+		<< "\tXDP: UDP that goes through an AF_XDP socket instead of the kernel's UDP stack. IPv4, one per interface,\n"
+		<< "\t\tneeds CAP_NET_ADMIN and CAP_BPF. The peer may use UDP.\n"
+		<< "\tUNIX, SHM: to a process on this host, over a Unix SOCK_SEQPACKET socket at PATH, or through shared memory\n"
+		<< "\t\tset up over one. The server creates PATH, which can't contain ':'.\n"
+		<< "\tIMPAIRMENT format: TERM[/..], emulates a bad link on the sending side. Terms: delay=MS, jitter=MS,\n"
+		<< "\t\tdist=uniform|normal|pareto, loss=PCT, gilbert=PCT, recover=PCT, badloss=PCT, rate=KBIT, queue=MS,\n"
+		<< "\t\treorder=PCT, seed=N\n"
+		<< "\tSHAPING format: TERM[/..], caps what the link sends, spilling over to other links. Terms: rate=KBIT, burst=BYTES,\n"
+		<< "\t\tpps=N, queue=MS, cover=N (constant rate cover traffic of N datagrams/s instead), size=BYTES (of the cover traffic)\n"
 		<< "\t-s: Run as server. Excludes '-c'\n"
 		<< "\t-c: Run as client. Excludes '-s'\n"
 		<< "\t-f: IFNAME: Interface name. Should be a tun device.\n"
 		<< "\t-t: CLONE_DEV: Clone device name. Default \"/dev/net/tun\".\n"
 		<< "\t-b: Set socket descriptions. Multiple descriptions are comma separated.\n"
+		<< "\t-g: PATH: Read the links from a file instead, one per line: 'link SOCKET_DES [weight=N] [impairment=TERMS] [shaping=TERMS]'.\n"
+		<< "\t\tSIGHUP reads it again and adds, removes and changes links while the tun keeps forwarding.\n"
 		<< "\t-d: Print extra debug information. 0-3. The higher the more debug info. 0=no debug.\n"
+		<< "\t-k: MS: Heartbeat interval per link in milliseconds. Default 100. 0=no heartbeats.\n"
+		<< "\t-r: MS: Longest time a message waits for an earlier one that's missing. Default 50. 0=no reordering.\n"
+		<< "\t-p: N: Most parallel connections a TCP link grows to when it's congestion window limited. Default 4. 1=a single connection.\n"
+		<< "\t-S: SCHEDULER: How messages are spread over the links. rr=round robin, minrtt=lowest RTT first while its backlog is short. Default rr.\n"
+		<< "\t-A: PLACEMENT: Pin threads to CPUs by role, '/' separated tun=CPUS, rx=CPUS, tx=CPUS, ctl=CPUS (CPUS as in 0-3,8).\n"
+		<< "\t\tLinks take the CPU at their index. auto=the data path on the isolated CPUs (isolcpus=). Default none.\n"
+		<< "\t-B: US: Busy poll: spin on non-blocking tun and link reads until nothing came in for US microseconds, then block again. Costs a CPU per spinning thread. Default 0=always block.\n"
+		<< "\t-M: MODE: Path MTU: 'probe' finds the MTU of every UDP link with padded probes and only sends a link what fits, unfragmented. 'tun' also sets the tun's MTU to what every link carries. Default: neither, the kernel fragments.\n"
+		<< "\t-Z: BYTES: Zero copy: TCP links send frames of at least BYTES with MSG_ZEROCOPY, from the message buffer itself. Pays off for big frames only. Default 0=always copy.\n"
+		<< "\t-m: PATH: Serve counters in Prometheus text format on this Unix socket. Default none.\n"
+		<< "\t-l: Timestamp messages, so the peer keeps latency histograms (see -m). Use on both ends. One way latency needs synchronized clocks.\n"
+		<< "\t-C: PATH[:MB]: Keep the last MB (default 32) of tunneled packets in a pcapng ring file. SIGUSR1 snapshots it to PATH.<time>.pcapng.\n"
+		<< "\t-F: FILTER: Only capture matching packets. Comma separated link=N, proto=tcp|udp|icmp|N, port=N, dir=in|out, class=interactive|assured|bulk.\n"
 		<< "\t-v: Print version info.\n"
 		<< "\t-o: Print parsed options. Exits immediately after."
 		<< std::endl;
@@ -148,7 +264,21 @@ void Options::printOptions(std::ostream &out) {
 		<< "\tInterface name: " << if_name << "\n"
 		<< "\tClone device name: " << clone_dev << "\n"
 		<< "\tClose tun: " << close_tun << "\n"
-		<< "\tDebug level: " << debug_level << "\n";
+		<< "\tDebug level: " << debug_level << "\n"
+		<< "\tHeartbeat interval: " << heartbeat_interval << " ms\n"
+		<< "\tReorder hold time: " << reorder_hold << " ms\n"
+		<< "\tStreams per TCP link: " << max_streams << "\n"
+		<< "\tScheduler: " << scheduler << "\n"
+		<< "\tThreads: " << placement.describe() << "\n"
+		<< "\tBusy poll: " << (busy_poll > 0 ? std::to_string(busy_poll) + " us" : "no") << "\n"
+		<< "\tPath MTU: " << (size_tun ? "probed, tun sized" : probe_mtu ? "probed" : "no") << "\n"
+		<< "\tZero copy: " << (zero_copy > 0 ? "from " + std::to_string(zero_copy) + " bytes" : "no") << "\n"
+		<< "\tStats socket: " << (stats_path.empty() ? "none" : stats_path) << "\n"
+		<< "\tTimestamps: " << (timestamps ? "yes" : "no") << "\n"
+		<< "\tConfiguration file: " << (config_path.empty() ? "none" : config_path) << "\n"
+		<< "\tCapture: " << (capture_path.empty() ? "none" :
+			capture_path + " (" + std::to_string(capture_size_mb) + " MB, " +
+			capture_filter.describe() + ")") << "\n";
 	if (sock_des.empty()) {
 		out << "\tSocket descriptions: None\n";
 	} else {
@@ -159,6 +289,15 @@ void Options::printOptions(std::ostream &out) {
 		out << "\t\t" << std::to_string(iteration) << ") Socket type: " << socketType2String(it->type) << "\n"
 			<< "\t\t   " << "IP: " << it->ip << "\n"
 			<< "\t\t   " << "Port: " << it->port << "\n";
+		if (!it->impairment.empty()) {
+			out << "\t\t   " << "Impairment: " << Impairment::parse(it->impairment).describe() << "\n";
+		}
+		if (!it->shaping.empty()) {
+			out << "\t\t   " << "Shaping: " << Shaping::parse(it->shaping).describe() << "\n";
+		}
+		if (it->weight != 1) {
+			out << "\t\t   " << "Weight: " << it->weight << "\n";
+		}
 		++iteration;
 	}
 	out	<< "\tPrint options: " << (options_flag ? "yes" : "no")
@@ -0,0 +1,326 @@
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "packet.h"
+
+
+namespace {
+
+	const uint8_t PROTO_ICMP = 1;
+	const uint8_t PROTO_TCP = 6;
+	const uint8_t PROTO_UDP = 17;
+	const uint8_t PROTO_ICMPV6 = 58;
+
+	// IPv6 extension headers that may come before the transport header.
+	const uint8_t EXT_HOP_BY_HOP = 0;
+	const uint8_t EXT_ROUTING = 43;
+	const uint8_t EXT_FRAGMENT = 44;
+	const uint8_t EXT_AUTH = 51;
+	const uint8_t EXT_DEST_OPTS = 60;
+	const int MAX_EXTENSIONS = 8;		// More is an attack, not traffic
+
+	const uint16_t PORT_DNS = 53;
+
+	const uint8_t DSCP_CS6 = 48;
+	const uint8_t DSCP_CS7 = 56;
+	const uint8_t DSCP_EF = 46;
+
+	const uint8_t TCP_FIN = 0x01;
+	const uint8_t TCP_SYN = 0x02;
+	const uint8_t TCP_RST = 0x04;
+	const uint8_t TCP_ACK = 0x10;
+
+	const uint8_t ECN_MASK = 0x03;
+	const uint8_t ECN_CE = 0x03;
+
+	const size_t IPV4_MIN_HEADER = 20;
+	const size_t IPV6_HEADER = 40;
+
+
+	int ipVersion(const char *pkt, size_t len) {
+		if (len < 1) {
+			return 0;
+		}
+		return (static_cast<uint8_t>(pkt[0]) >> 4);
+	}
+
+
+	uint32_t fnv1a(uint32_t hash, const char *data, size_t len) {
+		for (size_t i = 0; i < len; i++) {
+			hash ^= static_cast<uint8_t>(data[i]);
+			hash *= 16777619u;
+		}
+		return hash;
+	}
+
+
+	uint8_t getECN(const char *pkt, size_t len) {
+		switch (ipVersion(pkt, len)) {
+			case 4:
+				if (len < IPV4_MIN_HEADER) {
+					return 0;
+				}
+				return static_cast<uint8_t>(pkt[1]) & ECN_MASK;
+			case 6:
+				if (len < IPV6_HEADER) {
+					return 0;
+				}
+				// Traffic class straddles the first two bytes: 4 bits version,
+				// 8 bits traffic class. ECN are the lowest two bits of the class.
+				return (static_cast<uint8_t>(pkt[1]) >> 4) & ECN_MASK;
+		}
+		return 0;
+	}
+
+
+	bool isAssuredForwarding(uint8_t dscp) {
+		// AFxy is encoded as 8x + 2y, with class x in 1..4 and drop precedence y in 1..3.
+		uint8_t af_class = dscp >> 3;
+		uint8_t drop_prec = (dscp >> 1) & 0x03;
+		return af_class >= 1 && af_class <= 4 && drop_prec >= 1 && (dscp & 0x01) == 0;
+	}
+
+
+	uint16_t readPort(const char *p) {
+		uint16_t port;
+		memcpy(&port, p, sizeof port);
+		return ntohs(port);
+	}
+
+
+	/**
+		Walks the extension headers of an IPv6 packet. Returns the offset of the header
+		after them, with proto set to its type. first_fragment is false for fragments
+		other than the first, which have no transport header. A truncated chain, or one
+		too long, ends at the extension header that couldn't be followed.
+	*/
+	size_t skipIPv6Extensions(const char *pkt, size_t len, uint8_t &proto,
+		bool &first_fragment) {
+
+		size_t offset = IPV6_HEADER;
+		proto = static_cast<uint8_t>(pkt[6]);
+		first_fragment = true;
+		for (int i = 0; i < MAX_EXTENSIONS && len >= offset + 8; i++) {
+			size_t ext_length;
+			switch (proto) {
+				case EXT_HOP_BY_HOP:
+				case EXT_ROUTING:
+				case EXT_DEST_OPTS:
+					ext_length = (static_cast<uint8_t>(pkt[offset + 1]) + 1) * 8;
+					break;
+				case EXT_FRAGMENT:
+					ext_length = 8;
+					if ((readPort(pkt + offset + 2) & 0xfff8) != 0) {
+						first_fragment = false;
+					}
+					break;
+				case EXT_AUTH:
+					ext_length = (static_cast<uint8_t>(pkt[offset + 1]) + 2) * 4;
+					break;
+				default:
+					return offset;
+			}
+			proto = static_cast<uint8_t>(pkt[offset]);
+			offset += ext_length;
+		}
+		return offset;
+	}
+
+}
+
+
+packet::Class packet::classify(const char *pkt, size_t len) {
+	uint8_t dscp, proto;
+	size_t header_length, total_length;
+
+	switch (ipVersion(pkt, len)) {
+		case 4: {
+			if (len < IPV4_MIN_HEADER) {
+				return BULK;
+			}
+			dscp = static_cast<uint8_t>(pkt[1]) >> 2;
+			proto = static_cast<uint8_t>(pkt[9]);
+			header_length = (static_cast<uint8_t>(pkt[0]) & 0x0f) * 4;
+			total_length = readPort(pkt + 2);
+			uint16_t frag;
+			memcpy(&frag, pkt + 6, sizeof frag);
+			if ((ntohs(frag) & 0x1fff) != 0) {
+				// Non-first fragments have no transport header to look at.
+				proto = 0;
+			}
+			break;
+		}
+		case 6: {
+			if (len < IPV6_HEADER) {
+				return BULK;
+			}
+			dscp = ((static_cast<uint8_t>(pkt[0]) & 0x0f) << 2)
+				| (static_cast<uint8_t>(pkt[1]) >> 6);
+			bool first_fragment;
+			header_length = skipIPv6Extensions(pkt, len, proto, first_fragment);
+			total_length = IPV6_HEADER + readPort(pkt + 4);
+			if (!first_fragment) {
+				proto = 0;
+			}
+			break;
+		}
+		default:
+			return BULK;
+	}
+
+	if (dscp == DSCP_EF || dscp == DSCP_CS6 || dscp == DSCP_CS7) {
+		return INTERACTIVE;
+	}
+
+	const char *l4 = pkt + header_length;
+	switch (proto) {
+		case PROTO_ICMP:
+		case PROTO_ICMPV6:
+			return INTERACTIVE;
+		case PROTO_UDP:
+			if (len >= header_length + 4 &&
+					(readPort(l4) == PORT_DNS || readPort(l4 + 2) == PORT_DNS)) {
+				return INTERACTIVE;
+			}
+			break;
+		case PROTO_TCP: {
+			if (len < header_length + 20) {
+				break;
+			}
+			if (readPort(l4) == PORT_DNS || readPort(l4 + 2) == PORT_DNS) {
+				return INTERACTIVE;
+			}
+			size_t tcp_header_length = (static_cast<uint8_t>(l4[12]) >> 4) * 4;
+			uint8_t flags = static_cast<uint8_t>(l4[13]);
+			bool pure_ack = (flags & TCP_ACK) && !(flags & (TCP_SYN | TCP_FIN | TCP_RST))
+				&& total_length == header_length + tcp_header_length;
+			if (pure_ack) {
+				return INTERACTIVE;
+			}
+			break;
+		}
+	}
+
+	if (isAssuredForwarding(dscp)) {
+		return ASSURED;
+	}
+	return BULK;
+}
+
+
+uint32_t packet::flowHash(const char *pkt, size_t len) {
+	uint32_t hash = 2166136261u;
+	const char *ports = nullptr;
+	uint8_t proto = 0;
+
+	switch (ipVersion(pkt, len)) {
+		case 4: {
+			if (len < IPV4_MIN_HEADER) {
+				return 0;
+			}
+			size_t ihl = (static_cast<uint8_t>(pkt[0]) & 0x0f) * 4;
+			proto = static_cast<uint8_t>(pkt[9]);
+			hash = fnv1a(hash, pkt + 12, 8);	// source and destination address
+			uint16_t frag;
+			memcpy(&frag, pkt + 6, sizeof frag);
+			// Only the first fragment carries the ports.
+			bool first_fragment = (ntohs(frag) & 0x1fff) == 0;
+			if (first_fragment && len >= ihl + 4) {
+				ports = pkt + ihl;
+			}
+			break;
+		}
+		case 6: {
+			if (len < IPV6_HEADER) {
+				return 0;
+			}
+			bool first_fragment;
+			size_t header_length = skipIPv6Extensions(pkt, len, proto, first_fragment);
+			hash = fnv1a(hash, pkt + 8, 32);	// source and destination address
+			if (first_fragment && len >= header_length + 4) {
+				ports = pkt + header_length;
+			}
+			break;
+		}
+		default:
+			return 0;
+	}
+
+	hash = fnv1a(hash, reinterpret_cast<const char*>(&proto), 1);
+	if (ports != nullptr && (proto == PROTO_TCP || proto == PROTO_UDP)) {
+		hash = fnv1a(hash, ports, 4);
+	}
+	return hash;
+}
+
+
+bool packet::transport(const char *pkt, size_t len, uint8_t &proto, uint16_t &src_port,
+	uint16_t &dst_port) {
+	size_t header_length;
+	bool first_fragment = true;
+	src_port = dst_port = 0;
+
+	switch (ipVersion(pkt, len)) {
+		case 4: {
+			if (len < IPV4_MIN_HEADER) {
+				return false;
+			}
+			header_length = (static_cast<uint8_t>(pkt[0]) & 0x0f) * 4;
+			proto = static_cast<uint8_t>(pkt[9]);
+			uint16_t frag;
+			memcpy(&frag, pkt + 6, sizeof frag);
+			first_fragment = (ntohs(frag) & 0x1fff) == 0;
+			break;
+		}
+		case 6:
+			if (len < IPV6_HEADER) {
+				return false;
+			}
+			header_length = skipIPv6Extensions(pkt, len, proto, first_fragment);
+			break;
+		default:
+			return false;
+	}
+
+	if (first_fragment && (proto == PROTO_TCP || proto == PROTO_UDP) &&
+			len >= header_length + 4) {
+		src_port = readPort(pkt + header_length);
+		dst_port = readPort(pkt + header_length + 2);
+	}
+	return true;
+}
+
+
+bool packet::isECNCapable(const char *pkt, size_t len) {
+	return getECN(pkt, len) != 0;
+}
+
+
+bool packet::markCongestion(char *pkt, size_t len) {
+	if (!isECNCapable(pkt, len)) {
+		return false;
+	}
+
+	switch (ipVersion(pkt, len)) {
+		case 4: {
+			// Incremental checksum update (RFC 1624) of the first 16 bit word,
+			// which holds version, IHL and the TOS byte.
+			uint16_t old_word, new_word, check;
+			memcpy(&old_word, pkt, 2);
+			pkt[1] |= ECN_CE;
+			memcpy(&new_word, pkt, 2);
+			memcpy(&check, pkt + 10, 2);
+			uint32_t sum = static_cast<uint16_t>(~ntohs(check))
+				+ static_cast<uint16_t>(~ntohs(old_word)) + ntohs(new_word);
+			sum = (sum & 0xffff) + (sum >> 16);
+			sum = (sum & 0xffff) + (sum >> 16);
+			check = htons(static_cast<uint16_t>(~sum));
+			memcpy(pkt + 10, &check, 2);
+			return true;
+		}
+		case 6:
+			pkt[1] |= (ECN_CE << 4);
+			return true;
+	}
+	return false;
+}
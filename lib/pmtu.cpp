@@ -0,0 +1,83 @@
+#include <algorithm>
+
+#include "pmtu.h"
+
+
+const uint16_t PathMTU::BASE;
+const int PathMTU::MAX_PROBES;
+const uint16_t PathMTU::GRANULARITY;
+constexpr std::chrono::milliseconds PathMTU::PROBE_TIMEOUT;
+constexpr std::chrono::minutes PathMTU::RAISE_AFTER;
+
+
+void PathMTU::start(uint16_t limit) {
+	std::lock_guard<std::mutex> lock(mutex);
+	this->limit = limit;
+	confirmed = 0;
+	failed = 0;
+	probing = 0;
+	searching = true;
+	mtu = std::min(BASE, limit);
+}
+
+
+uint16_t PathMTU::next(TimePoint now) {
+	std::lock_guard<std::mutex> lock(mutex);
+	if (limit == 0) {
+		return 0;
+	}
+	if (!searching) {
+		if (now < raise_at) {
+			return 0;
+		}
+		// The path may take more by now. What's confirmed stays confirmed.
+		searching = true;
+		failed = 0;
+		probing = 0;
+	}
+
+	uint16_t floor = std::min(std::max(confirmed, BASE), limit);
+	if (probing != 0) {
+		if (now - sent_at < PROBE_TIMEOUT) {
+			return 0;
+		}
+		if (++tries < MAX_PROBES) {
+			sent_at = now;
+			return probing;
+		}
+		failed = probing;
+		probing = 0;
+		mtu = floor;
+	}
+
+	if (confirmed >= limit || (failed != 0 && failed - floor <= GRANULARITY)) {
+		searching = false;
+		raise_at = now + RAISE_AFTER;
+		return 0;
+	}
+	probing = (failed == 0) ? limit : (floor + failed) / 2;
+	tries = 1;
+	sent_at = now;
+	return probing;
+}
+
+
+bool PathMTU::onAck(uint16_t size) {
+	std::lock_guard<std::mutex> lock(mutex);
+	if (limit == 0 || size > limit) {
+		return false;
+	}
+	confirmed = std::max(confirmed, size);
+	if (size == probing) {
+		probing = 0;
+	}
+	uint16_t old_mtu = mtu;
+	mtu = std::min(std::max(confirmed, BASE), limit);
+	return mtu != old_mtu;
+}
+
+
+bool PathMTU::isSearching() {
+	std::lock_guard<std::mutex> lock(mutex);
+	return searching;
+}
@@ -0,0 +1,125 @@
+#include "pool.h"
+#include "util.h"
+
+
+constexpr std::chrono::seconds StreamPool::SCALE_INTERVAL;
+const int StreamPool::GROW_PERCENT;
+const int StreamPool::IDLE_PERCENT;
+const uint32_t StreamPool::IDLE_SEGMENTS;
+const int StreamPool::SHRINK_AFTER;
+
+
+StreamPool::StreamPool(const std::string &name, int max_streams,
+	std::shared_ptr<IMux> imux_ptr, int debug) :
+	name(name), max_streams(std::max(max_streams, 1)), imux_ptr(imux_ptr), debug(debug),
+	streams(this->max_streams) {}
+
+
+int StreamPool::getWanted() {
+	std::lock_guard<std::mutex> lock(mutex);
+	return wanted;
+}
+
+
+bool StreamPool::isWanted(int stream) {
+	std::lock_guard<std::mutex> lock(mutex);
+	return !closed && stream < wanted;
+}
+
+
+void StreamPool::waitUntilWanted(int stream) {
+	std::unique_lock<std::mutex> lock(mutex);
+	wanted_changed.wait(lock, [this, stream] () {return closed || stream < wanted;});
+}
+
+
+bool StreamPool::sleepWhileWanted(int stream, std::chrono::milliseconds duration) {
+	std::unique_lock<std::mutex> lock(mutex);
+	return !wanted_changed.wait_for(lock, duration, [this, stream] () {
+		return closed || stream >= wanted;
+	});
+}
+
+
+void StreamPool::add(int stream, std::shared_ptr<TCPSocket> socket) {
+	std::lock_guard<std::mutex> lock(mutex);
+	streams[stream] = socket;
+}
+
+
+void StreamPool::remove(int stream) {
+	std::lock_guard<std::mutex> lock(mutex);
+	streams[stream].reset();
+}
+
+
+void StreamPool::close() {
+	std::lock_guard<std::mutex> lock(mutex);
+	closed = true;
+	wanted_changed.notify_all();
+}
+
+
+void StreamPool::tick(std::chrono::steady_clock::time_point now) {
+	std::lock_guard<std::mutex> lock(mutex);
+	if (closed) {
+		return;
+	}
+	for (int i = 0; i < wanted; i++) {
+		struct tcp_info info;
+		if (!streams[i] || !streams[i]->getTCPInfo(info)) {
+			continue;
+		}
+		++samples;
+		if (info.tcpi_unacked <= IDLE_SEGMENTS) {
+			++idle_samples;
+		} else if (info.tcpi_unacked >= info.tcpi_snd_cwnd) {
+			++limited_samples;
+		}
+	}
+
+	if (now < next_decision) {
+		return;
+	}
+	next_decision = now + SCALE_INTERVAL;
+	decide();
+	samples = limited_samples = idle_samples = 0;
+}
+
+
+void StreamPool::decide() {
+	// Only grow when all wanted streams are up: a stream that's still connecting
+	// doesn't show up in the samples, and would make the others look busier.
+	bool all_up = true;
+	for (int i = 0; i < wanted; i++) {
+		all_up = all_up && streams[i];
+	}
+	if (samples == 0) {
+		return;
+	}
+
+	bool idle = idle_samples * 100 >= samples * IDLE_PERCENT;
+	idle_intervals = idle ? idle_intervals + 1 : 0;
+
+	if (all_up && wanted < max_streams && limited_samples * 100 >= samples * GROW_PERCENT) {
+		++wanted;
+		idle_intervals = 0;
+		if (debug >= 1) {debugOut(1,
+		name + " is congestion window limited, growing to " + std::to_string(wanted) +
+		" streams"
+		);}
+		wanted_changed.notify_all();
+	} else if (idle_intervals >= SHRINK_AFTER && wanted > 1) {
+		--wanted;
+		idle_intervals = 0;
+		if (debug >= 1) {debugOut(1,
+		name + " is idle, shrinking to " + std::to_string(wanted) + " streams"
+		);}
+		if (streams[wanted]) {
+			// Nothing new is scheduled to it, but what it has queued still goes out.
+			// Its thread notices it's no longer wanted once the link is gone.
+			imux_ptr->retireSocket(streams[wanted]);
+		}
+		wanted_changed.notify_all();
+	}
+}
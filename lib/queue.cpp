@@ -1,7 +1,272 @@
+#include <cmath>
+
+#include "packet.h"
 #include "queue.h"
 
-/*
-Queue::Queue() {
-	
+
+const size_t Queue::FLOWS;
+const size_t Queue::LIMIT;
+const int Queue::QUANTUM;
+const size_t Queue::PRIORITY_LIMIT;
+constexpr std::chrono::microseconds Queue::TARGET;
+constexpr std::chrono::microseconds Queue::INTERVAL;
+
+
+static size_t messageSize(const Message &msg) {
+	return Message::HEADER_LENGTH + msg.payload_length;
+}
+
+
+Queue::Queue(size_t limit) : limit(limit) {}
+
+
+bool Queue::enqueue(MessagePtr msg) {
+	bool accepted = true;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (closed || closing) {
+			return false;
+		}
+
+		msg->queued_at = std::chrono::steady_clock::now();
+		++length;
+
+		if (msg->traffic_class == packet::INTERACTIVE &&
+				priority_flow.messages.size() < PRIORITY_LIMIT) {
+			priority_flow.bytes += messageSize(*msg);
+			priority_flow.messages.push_back(std::move(msg));
+		} else {
+			Flow &flow = flows[packet::flowHash(msg->payload, msg->payload_length) % FLOWS];
+			// A flow that wasn't active gets priority in the next round (sparse flows, such
+			// as DNS or TCP handshakes, always end up here). Its class sets its quantum
+			// for as long as it stays active.
+			if (!flow.listed) {
+				flow.listed = true;
+				flow.quantum = (msg->traffic_class == packet::ASSURED) ? 2 * QUANTUM : QUANTUM;
+				flow.deficit = flow.quantum;
+				new_flows.push_back(&flow);
+			}
+			flow.bytes += messageSize(*msg);
+			flow.messages.push_back(std::move(msg));
+		}
+
+		if (length > limit) {
+			dropFromFattest();
+			++overflows;
+			accepted = false;
+		}
+	}
+	not_empty.notify_one();
+	return accepted;
+}
+
+
+MessagePtr Queue::dequeue(bool wait) {
+	return dequeueUntil(wait ? TimePoint::max() : TimePoint::min());
+}
+
+
+MessagePtr Queue::dequeueUntil(TimePoint deadline) {
+	std::unique_lock<std::mutex> lock(mutex);
+	while (true) {
+		if (closed) {
+			return nullptr;
+		}
+		if (!priority_flow.messages.empty()) {
+			MessagePtr msg = codelDequeue(priority_flow, std::chrono::steady_clock::now());
+			if (msg) {
+				return msg;
+			}
+			continue;
+		}
+		if (new_flows.empty() && old_flows.empty()) {
+			if (closing) {
+				closed = true;
+				return nullptr;
+			}
+			if (deadline == TimePoint::min()) {
+				return nullptr;
+			}
+			if (deadline == TimePoint::max()) {
+				not_empty.wait(lock);
+			} else if (not_empty.wait_until(lock, deadline) == std::cv_status::timeout) {
+				return nullptr;
+			}
+			continue;
+		}
+
+		bool from_new = !new_flows.empty();
+		std::list<Flow*> &flow_list = from_new ? new_flows : old_flows;
+		Flow *flow = flow_list.front();
+
+		if (flow->deficit <= 0) {
+			flow->deficit += flow->quantum;
+			flow_list.pop_front();
+			old_flows.push_back(flow);
+			continue;
+		}
+
+		MessagePtr msg = codelDequeue(*flow, std::chrono::steady_clock::now());
+		if (!msg) {
+			flow_list.pop_front();
+			// Moving an emptied new flow to the old flows prevents a flow from keeping
+			// its priority by sending just one message each round.
+			if (from_new && !old_flows.empty()) {
+				old_flows.push_back(flow);
+			} else {
+				flow->listed = false;
+			}
+			continue;
+		}
+
+		flow->deficit -= messageSize(*msg);
+		return msg;
+	}
+}
+
+
+void Queue::close() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		closed = true;
+	}
+	not_empty.notify_all();
+}
+
+
+void Queue::closeWhenEmpty() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		closing = true;
+	}
+	not_empty.notify_all();
+}
+
+
+void Queue::holdPool(std::shared_ptr<MessagePool> pool) {
+	std::lock_guard<std::mutex> lock(mutex);
+	this->pool = pool;
+}
+
+
+bool Queue::isClosed() {
+	std::lock_guard<std::mutex> lock(mutex);
+	return closed;
+}
+
+
+size_t Queue::size() {
+	std::lock_guard<std::mutex> lock(mutex);
+	return length;
+}
+
+
+MessagePtr Queue::pop(Flow &flow, TimePoint now, bool &ok_to_drop) {
+	ok_to_drop = false;
+	if (flow.messages.empty()) {
+		flow.first_above_time = TimePoint{};
+		return nullptr;
+	}
+
+	MessagePtr msg = std::move(flow.messages.front());
+	flow.messages.pop_front();
+	flow.bytes -= messageSize(*msg);
+	--length;
+
+	auto sojourn = now - msg->queued_at;
+	if (sojourn < TARGET || flow.bytes <= static_cast<size_t>(QUANTUM)) {
+		// Went below target, or too little left to build a standing queue.
+		flow.first_above_time = TimePoint{};
+	} else if (flow.first_above_time == TimePoint{}) {
+		// Just went above target. Only act if it stays there for an interval.
+		flow.first_above_time = now + INTERVAL;
+	} else if (now >= flow.first_above_time) {
+		ok_to_drop = true;
+	}
+	return msg;
+}
+
+
+MessagePtr Queue::codelDequeue(Flow &flow, TimePoint now) {
+	bool ok_to_drop;
+	MessagePtr msg = pop(flow, now, ok_to_drop);
+	if (!msg) {
+		flow.dropping = false;
+		return msg;
+	}
+
+	if (flow.dropping) {
+		if (!ok_to_drop) {
+			flow.dropping = false;
+		}
+		while (flow.dropping && now >= flow.drop_next) {
+			++flow.count;
+			if (markOrDrop(msg)) {
+				flow.drop_next = controlLaw(flow.drop_next, flow.count);
+				return msg;
+			}
+			msg = pop(flow, now, ok_to_drop);
+			if (!msg || !ok_to_drop) {
+				flow.dropping = false;
+			} else {
+				flow.drop_next = controlLaw(flow.drop_next, flow.count);
+			}
+		}
+	} else if (ok_to_drop) {
+		if (!markOrDrop(msg)) {
+			msg = pop(flow, now, ok_to_drop);
+		}
+		flow.dropping = true;
+		// Start near the drop rate that controlled the queue last time, if that was
+		// recent enough.
+		uint32_t delta = flow.count - flow.last_count;
+		if (delta > 1 && now - flow.drop_next < 16 * INTERVAL) {
+			flow.count = delta;
+		} else {
+			flow.count = 1;
+		}
+		flow.last_count = flow.count;
+		flow.drop_next = controlLaw(now, flow.count);
+	}
+	return msg;
+}
+
+
+bool Queue::markOrDrop(MessagePtr &msg) {
+	// Only data messages carry an inner IP packet that can be marked.
+	if (msg->kind() == Message::DATA &&
+			packet::markCongestion(msg->payload, msg->payload_length)) {
+		++marks;
+		return true;
+	}
+	++drops;
+	msg.reset();
+	return false;
+}
+
+
+void Queue::dropFromFattest() {
+	Flow *fattest = nullptr;
+	for (size_t i = 0; i < FLOWS; i++) {
+		if (fattest == nullptr || flows[i].bytes > fattest->bytes) {
+			fattest = &flows[i];
+		}
+	}
+	// The priority band only loses messages when nothing else is left to drop.
+	if (fattest == nullptr || fattest->messages.empty()) {
+		fattest = &priority_flow;
+	}
+	if (fattest->messages.empty()) {
+		return;
+	}
+	fattest->bytes -= messageSize(*fattest->messages.front());
+	fattest->messages.pop_front();
+	--length;
+}
+
+
+Queue::TimePoint Queue::controlLaw(TimePoint t, uint32_t count) {
+	auto interval = std::chrono::duration_cast<std::chrono::nanoseconds>(INTERVAL);
+	return t + std::chrono::nanoseconds(
+		static_cast<int64_t>(interval.count() / std::sqrt(static_cast<double>(count))));
 }
-*/
\ No newline at end of file
@@ -1,70 +1,557 @@
 #include <cstring>		// Required for strerror()
+#include <signal.h>
+#include <sys/eventfd.h>
 #include <iostream>
 #include <memory>
+#include <random>
+#include <set>
 #include <string>
 #include <thread>
 #include <unistd.h>
 #include <vector>
 
+#include "backoff.h"
+#include "config.h"
+#include "impair.h"
 #include "roles.h"
 #include "socket.h"
 #include "util.h"
+#include "xdp.h"
 
 
-Endpoint::Endpoint(const Options &options) : 
-	tun_ptr(new Tun(options.if_name, options.clone_dev, options.debug_level)),
-	imux_ptr(new IMux(tun_ptr, options.debug_level)),
-	idemux_ptr(new IDeMux(tun_ptr, options.debug_level)),
-	debug(options.debug_level) {}
+constexpr std::chrono::milliseconds Endpoint::TIMER_TICK;
+constexpr std::chrono::seconds Endpoint::STEERING_CHECK;
+constexpr std::chrono::seconds Client::STABLE_AFTER;
+std::atomic<bool> Endpoint::reload_requested{false};
 
-Client::Client(const Options &options) : Endpoint(options) {
+
+Endpoint::Endpoint(const Options &options, std::shared_ptr<PacketDevice> device) :
+	tun_ptr(device ? device :
+		std::make_shared<Tun>(options.if_name, options.clone_dev, options.debug_level)),
+	imux_ptr(new IMux(tun_ptr, options.timestamps, options.debug_level,
+		Placement::nodeOf(options.placement.cpuOf(Placement::TUN)))),
+	idemux_ptr(new IDeMux(tun_ptr, options.reorder_hold, options.debug_level)),
+	placement(options.placement), timestamps(options.timestamps),
+	busy_poll(options.busy_poll), probe_mtu(options.probe_mtu), size_tun(options.size_tun),
+	zero_copy(static_cast<uint16_t>(options.zero_copy)),
+	config_path(options.config_path), config(options.sock_des),
+	debug(options.debug_level) {
+
+	if (busy_poll.count() > 0) {
+		// In-memory devices never block, there's nothing to spin on.
+		if (auto tun = std::dynamic_pointer_cast<Tun>(tun_ptr)) {
+			tun->enableBusyPoll(busy_poll);
+		}
+	}
+	imux_ptr->setScheduler(Scheduler::create(options.scheduler));
+	if (options.heartbeat_interval > 0) {
+		monitor_ptr.reset(new LinkMonitor(imux_ptr, options.heartbeat_interval, debug));
+	}
+	if (!options.capture_path.empty()) {
+		capture_ptr.reset(new Capture(options.capture_path, options.capture_size_mb,
+			options.capture_filter, debug));
+		imux_ptr->setCapture(capture_ptr);
+		idemux_ptr->setCapture(capture_ptr);
+		Capture::installTrigger();
+	}
+	if (!options.stats_path.empty()) {
+		stats_ptr.reset(new stats::Server(options.stats_path,
+			[this] (stats::Writer &writer) {this->renderStats(writer);}, debug));
+	}
+	if (!config_path.empty()) {
+		installReloadTrigger();
+	}
+}
+
+
+void Endpoint::startTimer() {
+	timer_t = std::thread([this] () {
+		this->placement.pin(Placement::CONTROL, 0, this->debug);
+		this->timerLoop();
+	});
 	if (debug >= 2) {debugOut(2,
-	"setting up client..."
+	"started the timer thread"
+	);}
+}
+
+
+void Endpoint::timerLoop() {
+	auto next_steering_check = std::chrono::steady_clock::now() + STEERING_CHECK;
+	while (true) {
+		auto now = std::chrono::steady_clock::now();
+		if (now >= next_steering_check) {
+			checkSteering();
+			next_steering_check = now + STEERING_CHECK;
+		}
+		if (monitor_ptr) {
+			monitor_ptr->tick(now);
+		}
+		if (probe_mtu) {
+			checkPathMTU(now);
+		}
+		idemux_ptr->flushExpired(now);
+		if (capture_ptr) {
+			capture_ptr->pollTrigger();
+		}
+		pollReload();
+		onTimer(now);
+		std::this_thread::sleep_for(TIMER_TICK);
+	}
+}
+
+
+void Endpoint::installReloadTrigger() {
+	struct sigaction action;
+	memset(&action, 0, sizeof action);
+	action.sa_handler = onReloadSignal;
+	action.sa_flags = SA_RESTART;	// Don't break the blocking reads of the links
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGHUP, &action, nullptr);
+}
+
+
+void Endpoint::onReloadSignal(int) {
+	reload_requested = true;
+}
+
+
+void Endpoint::pollReload() {
+	// One at a time, a SIGHUP during a reload is taken up after it.
+	if (reloading || !reload_requested.exchange(false)) {
+		return;
+	}
+	// Removing links waits for their threads, don't hold up the timer thread.
+	if (reload_t.joinable()) {
+		reload_t.join();
+	}
+	reloading = true;
+	reload_t = std::thread([this] () {
+		this->reload();
+		this->reloading = false;
+	});
+}
+
+
+void Endpoint::reload() {
+	std::vector<SocketDescription> links;
+	try {
+		links = config::read(config_path);
+	} catch (ConfigException &e) {
+		errorOut(std::string("not reloading: ") + e.what());
+		return;
+	}
+	config::Diff diff = config::diff(config, links);
+	if (debug >= 1) {debugOut(1,
+	"reloading " + config_path + ": " + diff.describe()
 	);}
 
+	// Links that couldn't be set up are left out, so the next reload tries them again.
+	std::set<std::string> failed;
+	for (auto it=diff.removed.begin(); it!=diff.removed.end(); it++) {
+		removeLink(*it);
+	}
+	for (auto it=diff.changed.begin(); it!=diff.changed.end(); it++) {
+		try {
+			changeLink(it->first, it->second);
+		} catch (SocketException &e) {
+			errorOut(it->second.key() + ": " + e.what());
+			failed.insert(it->second.key());
+		}
+	}
+	for (auto it=diff.added.begin(); it!=diff.added.end(); it++) {
+		try {
+			addLink(*it);
+		} catch (SocketException &e) {
+			errorOut(it->key() + ": " + e.what());
+			failed.insert(it->key());
+		}
+	}
+	config.clear();
+	for (auto it=links.begin(); it!=links.end(); it++) {
+		if (failed.count(it->key()) == 0) {
+			config.push_back(*it);
+		}
+	}
+}
+
+
+void Endpoint::retuneSocket(Socket &socket, const SocketDescription &des) {
+	socket.setWeight(des.weight);
+	if (!des.shaping.empty()) {
+		socket.retuneShaping(Shaping::parse(des.shaping));
+	}
+}
+
+
+void Endpoint::startStats() {
+	if (stats_ptr) {
+		stats_ptr->start();
+	}
+}
+
+
+void Endpoint::renderStats(stats::Writer &w) {
+	stats::Counters &imux = imux_ptr->getCounters();
+	w.header("multitun_tun_read_packets_total", "counter", "Packets read from the tun.");
+	w.sample("multitun_tun_read_packets_total", {}, imux.get(stats::TUN_PACKETS_READ));
+	w.header("multitun_tun_read_bytes_total", "counter", "Bytes read from the tun.");
+	w.sample("multitun_tun_read_bytes_total", {}, imux.get(stats::TUN_BYTES_READ));
+	w.header("multitun_imux_no_link_drops_total", "counter",
+		"Packets dropped because no link was usable.");
+	w.sample("multitun_imux_no_link_drops_total", {}, imux.get(stats::NO_LINK_DROPS));
+	w.header("multitun_imux_spilled_over_total", "counter",
+		"Messages sent on another link than picked, because the picked link was over its shaping limits.");
+	w.sample("multitun_imux_spilled_over_total", {}, imux.get(stats::SPILLED_OVER));
+
+	stats::Counters &idemux = idemux_ptr->getCounters();
+	w.header("multitun_message_pool_misses_total", "counter",
+		"Messages read from the tun that didn't fit in the message pool.");
+	w.sample("multitun_message_pool_misses_total", {}, imux_ptr->getPoolMisses());
+
+	if (auto tun = std::dynamic_pointer_cast<Tun>(tun_ptr)) {
+		const BusyPoll &poll = tun->getBusyPoll();
+		if (poll.isEnabled()) {
+			w.header("multitun_tun_busy_poll_spin_microseconds_total", "counter",
+				"Time the tun reader spun on empty reads, in microseconds.");
+			w.sample("multitun_tun_busy_poll_spin_microseconds_total", {}, poll.getSpinNanos() / 1000);
+			w.header("multitun_tun_busy_poll_sleep_microseconds_total", "counter",
+				"Time the tun reader slept waiting for packets, in microseconds.");
+			w.sample("multitun_tun_busy_poll_sleep_microseconds_total", {}, poll.getSleepNanos() / 1000);
+			w.header("multitun_tun_busy_poll_sleeps_total", "counter",
+				"Times the tun reader went idle and blocked.");
+			w.sample("multitun_tun_busy_poll_sleeps_total", {}, poll.getSleeps());
+		}
+	}
+
+	w.header("multitun_idemux_packets_total", "counter", "Data messages received from the links.");
+	w.sample("multitun_idemux_packets_total", {}, idemux.get(stats::LINK_PACKETS_IN));
+	w.header("multitun_tun_written_packets_total", "counter", "Packets written to the tun.");
+	w.sample("multitun_tun_written_packets_total", {}, idemux.get(stats::TUN_PACKETS_WRITTEN));
+	w.header("multitun_tun_written_bytes_total", "counter", "Bytes written to the tun.");
+	w.sample("multitun_tun_written_bytes_total", {}, idemux.get(stats::TUN_BYTES_WRITTEN));
+	w.header("multitun_idemux_reordered_total", "counter", "Messages held back to restore the order.");
+	w.sample("multitun_idemux_reordered_total", {}, idemux_ptr->getReordered());
+	w.header("multitun_idemux_late_total", "counter", "Messages that arrived after their gap was given up on.");
+	w.sample("multitun_idemux_late_total", {}, idemux_ptr->getLate());
+	w.header("multitun_idemux_lost_total", "counter", "Sequence numbers that never arrived in time.");
+	w.sample("multitun_idemux_lost_total", {}, idemux_ptr->getLost());
+	w.header("multitun_idemux_held", "gauge", "Messages currently held back.");
+	w.sample("multitun_idemux_held", {}, idemux_ptr->getHeld());
+
+	// Per link. Each family needs all its samples in one go.
+	std::vector<std::shared_ptr<Socket>> sockets;
+	imux_ptr->forEachSocket([&sockets] (const std::shared_ptr<Socket> &socket) {
+		sockets.push_back(socket);
+	});
+	auto family = [&w, &sockets] (const std::string &name, const std::string &type,
+			const std::string &help, const std::function<uint64_t(Socket&)> &value) {
+		w.header(name, type, help);
+		for (auto it=sockets.begin(); it!=sockets.end(); it++) {
+			Socket &s = **it;
+			w.sample(name, {
+				{"link", std::to_string(s.getLinkId())},
+				{"stream", std::to_string(s.getStream())},
+				{"socket", s.describe()}
+			}, value(s));
+		}
+	};
+	family("multitun_link_packets_in_total", "counter", "Messages received on the link.",
+		[] (Socket &s) {return s.getCounters().get(stats::PACKETS_IN);});
+	family("multitun_link_bytes_in_total", "counter", "Bytes received on the link.",
+		[] (Socket &s) {return s.getCounters().get(stats::BYTES_IN);});
+	family("multitun_link_packets_out_total", "counter", "Messages sent on the link.",
+		[] (Socket &s) {return s.getCounters().get(stats::PACKETS_OUT);});
+	family("multitun_link_bytes_out_total", "counter", "Bytes sent on the link.",
+		[] (Socket &s) {return s.getCounters().get(stats::BYTES_OUT);});
+	if (busy_poll.count() > 0) {
+		family("multitun_link_busy_poll_spin_microseconds_total", "counter",
+			"Time the link's receiver spun on empty reads, in microseconds.",
+			[] (Socket &s) {return s.getBusyPoll().getSpinNanos() / 1000;});
+		family("multitun_link_busy_poll_sleep_microseconds_total", "counter",
+			"Time the link's receiver slept waiting for messages, in microseconds.",
+			[] (Socket &s) {return s.getBusyPoll().getSleepNanos() / 1000;});
+		family("multitun_link_busy_poll_sleeps_total", "counter",
+			"Times the link's receiver went idle and blocked.",
+			[] (Socket &s) {return s.getBusyPoll().getSleeps();});
+	}
+	if (zero_copy > 0) {
+		family("multitun_link_zerocopy_sends_total", "counter",
+			"Sends with MSG_ZEROCOPY.",
+			[] (Socket &s) {return s.getZeroCopy().getSends();});
+		family("multitun_link_zerocopy_copied_total", "counter",
+			"Zero copy sends the kernel copied after all.",
+			[] (Socket &s) {return s.getZeroCopy().getCopied();});
+		family("multitun_link_zerocopy_held_messages", "gauge",
+			"Messages held until the kernel is done with their buffers.",
+			[] (Socket &s) {return static_cast<uint64_t>(s.getZeroCopy().getHeld());});
+	}
+	bool xdp = std::any_of(sockets.begin(), sockets.end(),
+		[] (const std::shared_ptr<Socket> &s) {return s->getXSK() != nullptr;});
+	if (xdp) {
+		family("multitun_link_xdp_frames_in_total", "counter",
+			"Datagrams received through AF_XDP.",
+			[] (Socket &s) {return s.getXSK() ? s.getXSK()->getFramesIn() : 0;});
+		family("multitun_link_xdp_frames_out_total", "counter",
+			"Datagrams sent through AF_XDP.",
+			[] (Socket &s) {return s.getXSK() ? s.getXSK()->getFramesOut() : 0;});
+		family("multitun_link_xdp_kernel_drops_total", "counter",
+			"Frames the kernel dropped because the AF_XDP rings were full.",
+			[] (Socket &s) {return s.getXSK() ? s.getXSK()->getKernelDrops() : 0;});
+	}
+	family("multitun_link_send_calls_total", "counter", "System calls spent on sending.",
+		[] (Socket &s) {return s.getCounters().get(stats::SEND_CALLS);});
+	family("multitun_link_errors_total", "counter", "Read and write errors and malformed messages.",
+		[] (Socket &s) {return s.getCounters().get(stats::ERRORS);});
+	family("multitun_link_oversize_drops_total", "counter",
+		"Messages dropped for being bigger than the peer's maximum frame or the path MTU.",
+		[] (Socket &s) {return s.getCounters().get(stats::OVERSIZE_DROPS);});
+	family("multitun_link_protocol_version", "gauge",
+		"Protocol version agreed on with the peer, 0 until the hello handshake is done.",
+		[] (Socket &s) {return s.getVersion();});
+	family("multitun_link_shaper_delayed_total", "counter",
+		"Messages the link's shaper held back until the buckets refilled.",
+		[] (Socket &s) {return s.getShaper() ? s.getShaper()->getDelayed() : 0;});
+	family("multitun_link_shaper_drops_total", "counter",
+		"Messages the link's shaper dropped, they would have waited too long.",
+		[] (Socket &s) {return s.getShaper() ? s.getShaper()->getDropped() : 0;});
+	family("multitun_link_padding_out_total", "counter",
+		"Cover traffic frames sent with padding only.",
+		[] (Socket &s) {return s.getCounters().get(stats::PADDING_OUT);});
+	family("multitun_link_cover_late_slots_total", "counter",
+		"Cover traffic slots skipped because the timer wheel or the link's sender was behind.",
+		[] (Socket &s) {return s.getCover() ? s.getCover()->getLateSlots() : 0;});
+	family("multitun_link_mtu_bytes", "gauge",
+		"Largest message the link carries: the peer's maximum frame, or the path MTU if smaller.",
+		[] (Socket &s) {return s.getMTU();});
+	family("multitun_link_features", "gauge",
+		"Feature bits agreed on with the peer (1 sequence numbers, 2 timestamps, 4 path MTU probes, 8 packed datagrams).",
+		[] (Socket &s) {return s.getFeatures();});
+	family("multitun_link_queue_drops_total", "counter", "Messages dropped by the send queue.",
+		[] (Socket &s) {
+			return s.getSendQueue().getDrops() + s.getSendQueue().getOverflows();
+		});
+	family("multitun_link_queue_marks_total", "counter", "Messages ECN marked by the send queue.",
+		[] (Socket &s) {return s.getSendQueue().getMarks();});
+	family("multitun_link_queue_depth", "gauge", "Messages waiting in the send queue.",
+		[] (Socket &s) {return s.getSendQueue().size();});
+	family("multitun_link_up", "gauge", "1 if the heartbeats say the link works.",
+		[] (Socket &s) {return s.getHealth().getState() == LinkState::UP ? 1 : 0;});
+	family("multitun_link_rtt_microseconds", "gauge", "Smoothed heartbeat round trip time.",
+		[] (Socket &s) {return s.getHealth().getRTT().count();});
+
+	// Only filled with timestamped messages (-l).
+	w.header("multitun_link_latency_microseconds", "summary",
+		"Latency of timestamped messages per stage: tun_to_wire (sending side), one_way, "
+		"reorder_hold and end_to_end (receiving side).");
+	for (auto it=sockets.begin(); it!=sockets.end(); it++) {
+		Socket &s = **it;
+		stats::Latency &latency = s.getLatency();
+		std::pair<const char*, const stats::Histogram*> stages[] = {
+			{"tun_to_wire", &latency.tun_to_wire},
+			{"one_way", &latency.one_way},
+			{"reorder_hold", &latency.reorder_hold},
+			{"end_to_end", &latency.end_to_end},
+		};
+		for (auto &stage : stages) {
+			w.summary("multitun_link_latency_microseconds", {
+				{"link", std::to_string(s.getLinkId())},
+				{"stream", std::to_string(s.getStream())},
+				{"socket", s.describe()},
+				{"stage", stage.first}
+			}, *stage.second);
+		}
+	}
+}
+
+
+void Endpoint::runReceiver(std::shared_ptr<Socket> socket, uint32_t index) {
+	placement.pin(Placement::RECEIVER, index, debug);
+	int cpu = placement.cpuOf(Placement::RECEIVER, index);
+	if (cpu >= 0) {
+		std::lock_guard<std::mutex> lock(steering_mutex);
+		receiver_cpus[socket.get()] = cpu;
+	}
+	try {
+		socket->startReceiving();
+	} catch (SocketException &e) {
+		if (socket->isShutDown()) {
+			return;		// Dropped on purpose, a reload or the pool shrinking
+		}
+		socket->getCounters().add(stats::ERRORS);
+		errorOut(socket->describeFull() + ": " + e.what());
+		dropLink(socket);
+	}
+}
+
+
+void Endpoint::runSender(std::shared_ptr<Socket> socket, uint32_t index) {
+	placement.pin(Placement::SENDER, index, debug);
+	try {
+		socket->startSending();
+	} catch (SocketException &e) {
+		if (socket->isShutDown()) {
+			return;		// Dropped on purpose, a reload or the pool shrinking
+		}
+		socket->getCounters().add(stats::ERRORS);
+		errorOut(socket->describeFull() + ": " + e.what());
+		dropLink(socket);
+	}
+}
+
 
-	// Create the sockets
-	for (auto it=options.sock_des.begin(); it<options.sock_des.end(); it++) {
-		// Uses unique pointers to avoid destructing the ServerTCPSocket on push_back
-		// (freeaddrinfo doesn't play nicely when called twice).
+void Endpoint::dropLink(std::shared_ptr<Socket> socket) {
+	// Both the receiver and the sender of a link end up here, in any order.
+	imux_ptr->detachSocket(socket);
+	socket->shutdownSocket();
+	std::lock_guard<std::mutex> lock(steering_mutex);
+	receiver_cpus.erase(socket.get());
+	reported_cpus.erase(socket.get());
+}
 
-		// UDP
-		if (it->type == SocketType::UDP) {
-			std::shared_ptr<Socket> sock_ptr(
-				new ClientUDPSocket(*it, idemux_ptr, debug));	
-			imux_ptr->attachSocket(sock_ptr);
-			socket_ptrs.insert({sock_ptr->describe(), sock_ptr});
 
-		// TCP
-		} else { // TCP
-			std::shared_ptr<Socket> sock_ptr(
-				new TCPSocket(*it, idemux_ptr, debug));	
-			imux_ptr->attachSocket(sock_ptr);
-			socket_ptrs.insert({sock_ptr->describe(), sock_ptr});
+void Endpoint::checkSteering() {
+	std::lock_guard<std::mutex> lock(steering_mutex);
+	imux_ptr->forEachSocket([this] (const std::shared_ptr<Socket> &socket) {
+		auto it = receiver_cpus.find(socket.get());
+		int incoming = socket->getIncomingCPU();
+		if (it == receiver_cpus.end() || incoming < 0 || incoming == it->second) {
+			return;
+		}
+		auto reported = reported_cpus.find(socket.get());
+		if (reported != reported_cpus.end() && reported->second == incoming) {
+			return;		// Once is enough
 		}
+		reported_cpus[socket.get()] = incoming;
+
+		int cpu = it->second;
+		int incoming_node = Placement::nodeOf(incoming);
+		int node = Placement::nodeOf(cpu);
+		std::string msg = socket->describeFull() + " is received on CPU " +
+			std::to_string(incoming) + " (node " + std::to_string(incoming_node) +
+			") but read on CPU " + std::to_string(cpu) + " (node " + std::to_string(node) +
+			"). point its NIC queue's IRQ (/proc/irq/N/smp_affinity_list) or RPS "
+			"(/sys/class/net/DEV/queues/rx-N/rps_cpus) at CPU " + std::to_string(cpu);
+		if (incoming_node != node) {
+			errorOut(msg);		// Every packet crosses the interconnect
+		} else if (debug >= 1) {debugOut(1,
+		msg
+		);}
+	});
+}
+
+
+void Endpoint::checkPathMTU(std::chrono::steady_clock::time_point now) {
+	int smallest = 0;
+	bool searching = false;
+	imux_ptr->forEachSocket([now, &smallest, &searching] (const std::shared_ptr<Socket> &socket) {
+		socket->probePathMTU(now);
+		if (!socket->isReady()) {
+			return;
+		}
+		searching = searching || socket->getPathMTU().isSearching();
+		if (smallest == 0 || socket->getMTU() < smallest) {
+			smallest = socket->getMTU();
+		}
+	});
+	auto tun = std::dynamic_pointer_cast<Tun>(tun_ptr);
+	if (!size_tun || !tun || searching || smallest == 0) {
+		return;
+	}
+	int mtu = smallest - Message::HEADER_LENGTH - Message::TRAILER_SPACE;
+	if (mtu == tun_mtu) {
+		return;
+	}
+	try {
+		tun->setMTU(mtu);
+	} catch (TunException &e) {
+		errorOut(e.what());
+	}
+	tun_mtu = mtu;		// Not retried if it failed
+}
+
+
+Client::Client(const Options &options, std::shared_ptr<PacketDevice> device) :
+	Endpoint(options, device), max_streams(options.max_streams) {
+	if (debug >= 2) {debugOut(2,
+	"setting up client..."
+	);}
+
+	// Any random number will do, as long as a restarted client gets a different one.
+	std::random_device rd;
+	session_id = (static_cast<uint64_t>(rd()) << 32) | rd();
+
+	for (auto it=options.sock_des.begin(); it!=options.sock_des.end(); it++) {
+		links.push_back(makeLink(links.size(), *it));
 	}
 
+	// The sockets themselves are created by the link threads, which resolve and connect
+	// them concurrently.
 	if (debug >= 1) {debugOut(1,
-	"succesfully set up the client with " + std::to_string(socket_ptrs.size()) + " sockets"
+	"succesfully set up the client with " + std::to_string(links.size()) + " sockets"
 	);}
 }
 
 
+std::shared_ptr<Client::Link> Client::makeLink(uint32_t id, const SocketDescription &des) {
+	std::shared_ptr<Link> link = std::make_shared<Link>();
+	link->id = id;
+	link->key = des.key();
+	link->des = des;
+	if (des.type == SocketType::TCP) {
+		link->pool.reset(new StreamPool(std::string("link ") + std::to_string(id),
+			max_streams, imux_ptr, debug));
+	}
+	return link;
+}
+
+
+std::shared_ptr<Client::Link> Client::findLink(const std::string &key) {
+	std::lock_guard<std::mutex> lock(links_mutex);
+	for (auto it=links.begin(); it!=links.end(); it++) {
+		if (*it && (*it)->key == key) {
+			return *it;
+		}
+	}
+	return nullptr;
+}
+
+
+std::shared_ptr<Socket> Client::createSocket(const SocketDescription &des) {
+	// UDP
+	if (des.type == SocketType::UDP) {
+		return makeSocket<ClientUDPSocket>(des, idemux_ptr, debug);
+	// UDP through AF_XDP
+	} else if (des.type == SocketType::XDP) {
+		return makeSocket<XDPSocket<ClientUDPSocket>>(des, idemux_ptr, debug);
+	// Local, over a Unix socket or shared memory
+	} else if (des.type == SocketType::UNIX) {
+		return makeSocket<UnixSocket>(des, idemux_ptr, debug);
+	} else if (des.type == SocketType::SHM) {
+		return makeSocket<ShmSocket>(des, idemux_ptr, debug);
+	// TCP
+	} else { // TCP
+		return makeSocket<TCPSocket>(des, idemux_ptr, debug);
+	}
+}
+
+
 void Client::start() {	
-	// Start socket threads
-	for (auto it=socket_ptrs.begin(); it!=socket_ptrs.end(); it++) {
-		it->second->connectSocket();
-		threads.emplace(
-			it->second->describe(), 
-			std::thread([it] () {it->second->startReceiving();})
-		);
-		if (debug >= 2) {debugOut(2,
-		"started thread for socket ..."
-		);}
+	startTimer();
+	startStats();
+
+	// Start link threads
+	{
+		std::lock_guard<std::mutex> lock(links_mutex);
+		for (auto it=links.begin(); it!=links.end(); it++) {
+			startLink(*it);
+		}
 	}
 
 	// Start imux thread
-	std::thread imux_t([this] () {this->imux_ptr->readTunLoop();});
+	std::thread imux_t([this] () {
+		this->placement.pin(Placement::TUN, 0, this->debug);
+		this->imux_ptr->readTunLoop();
+	});
 	
 	if (debug >= 2) {debugOut(2,
 	"started the imux thread"
@@ -72,72 +559,351 @@ void Client::start() {
 
 	// Join imux thread
 	imux_t.join();
+	timer_t.join();
 
-	// Join socket_ptr_threads
-	for (auto it=threads.begin(); it!=threads.end(); it++) {
+	// Join link threads
+	std::map<std::string, std::thread> link_threads;
+	{
+		std::lock_guard<std::mutex> lock(links_mutex);
+		link_threads.swap(threads);
+	}
+	for (auto it=link_threads.begin(); it!=link_threads.end(); it++) {
 		it->second.join();
 	}
 }
 
 
-Server::Server(const Options &options) : Endpoint(options) {
+void Client::startLink(std::shared_ptr<Link> link) {
+	// Every stream a TCP link may grow to gets its thread up front.
+	int streams = link->pool ? link->pool->getMaxStreams() : 1;
+	for (int stream = 0; stream < streams; stream++) {
+		threads.emplace(
+			std::string("link ") + std::to_string(link->id) + "." + std::to_string(stream),
+			std::thread([this, link, stream] () {this->maintainLink(link, stream);})
+		);
+	}
 	if (debug >= 2) {debugOut(2,
-	"setting up server..."
+	std::string("started ") + std::to_string(streams) + " thread(s) for link " +
+	std::to_string(link->id)
 	);}
+}
 
-	// Create the listening sockets
-	for (auto it=options.sock_des.begin(); it!=options.sock_des.end(); it++) {
-		// Uses unique pointers to avoid destructing the ServerTCPSocket on push_back
-		// (freeaddrinfo doesn't play nicely when called twice).
 
-		// Socket description asks for TCP
-		if (it->type == SocketType::TCP) {
-			std::unique_ptr<ServerTCPSocket> serv_sock_ptr(
-				new ServerTCPSocket(*it, idemux_ptr, debug)
-			);	
+void Client::maintainLink(std::shared_ptr<Link> link, int stream) {
+	std::shared_ptr<Socket> socket;
+	uint32_t link_id = link->id;
+	StreamPool *pool = link->pool.get();
+	std::string name = std::string("link ") + std::to_string(link_id) + " (" + link->key + ")";
+	if (pool != nullptr && pool->getMaxStreams() > 1) {
+		name += " stream " + std::to_string(stream);
+	}
+	Backoff backoff;
+
+	// Returns early if the pool lets go of the stream meanwhile, or the link is retired.
+	auto pause = [&link, pool, stream] (std::chrono::milliseconds delay) {
+		if (pool != nullptr) {
+			pool->sleepWhileWanted(stream, delay);
+		} else {
+			std::unique_lock<std::mutex> lock(link->mutex);
+			link->retiring.wait_for(lock, delay, [&link] () {return link->retired;});
+		}
+	};
+
+	while (true) {
+		if (pool != nullptr && !pool->isWanted(stream)) {
+			backoff.reset();
+			pool->waitUntilWanted(stream);
+		}
+
+		SocketDescription des;
+		uint32_t generation;
+		{
+			std::lock_guard<std::mutex> lock(link->mutex);
+			if (link->retired) {
+				break;
+			}
+			des = link->des;
+			generation = link->generation;
+		}
+
+		try {
+			socket = createSocket(des);
+			socket->connectSocket();
+		} catch (SocketException &e) {
+			auto delay = backoff.next();
+			errorOut(name + ": " + e.what() + ". retrying in " +
+				std::to_string(delay.count()) + " ms");
+			socket.reset();
+			pause(delay);
+			continue;
+		}
 
-			listen_socket_ptrs.emplace(serv_sock_ptr->describe(), std::move(serv_sock_ptr));
-		// Socket description asks for UDP
-		} else { // UDP
-			// You can't listen() nor accept() on datagram sockets. Immediately create a
-			// UDPSocket. As we're only handling one client, we'll just call connect() the first
-			// time someone sends something to us.
-			std::shared_ptr<Socket> socket_ptr(
-				new ServerUDPSocket(*it, idemux_ptr, debug));
-			socket_ptrs.insert({socket_ptr->describe(), socket_ptr});
-			imux_ptr->attachSocket(socket_ptr);
+		auto connected_at = std::chrono::steady_clock::now();
+		socket->setRestartable(true);
+		// Queued before anything else, so the server knows the link before the data.
+		socket->sendHello(session_id, link_id, stream);
+		if (timestamps) {
+			socket->enableTimestamping();
 		}
+		if (busy_poll.count() > 0) {
+			socket->enableBusyPoll(busy_poll);
+		}
+		if (probe_mtu) {
+			socket->enablePathMTU();
+		}
+		if (zero_copy > 0) {
+			socket->enableZeroCopy(zero_copy);
+		}
+		{
+			// A reload that came in while connecting didn't see this socket yet, start
+			// over with what it left.
+			std::lock_guard<std::mutex> lock(link->mutex);
+			if (link->retired || link->generation != generation) {
+				socket.reset();
+				continue;
+			}
+			imux_ptr->attachSocket(socket);
+		}
+		if (pool != nullptr) {
+			pool->add(stream, std::static_pointer_cast<TCPSocket>(socket));
+		}
+		std::thread sender([this, socket, link_id] () {this->runSender(socket, link_id);});
+
+		runReceiver(socket, link_id);	// Returns once the link is lost
+		dropLink(socket);
+		sender.join();
+		if (pool != nullptr) {
+			pool->remove(stream);
+		}
+		socket.reset();
+
+		bool changed;
+		{
+			std::lock_guard<std::mutex> lock(link->mutex);
+			if (link->retired) {
+				break;
+			}
+			changed = link->generation != generation;
+		}
+
+		if (pool != nullptr && !pool->isWanted(stream)) {
+			if (debug >= 1) {debugOut(1,
+			name + " closed, no longer needed"
+			);}
+			continue;
+		}
+
+		if (changed) {
+			backoff.reset();
+			if (debug >= 1) {debugOut(1,
+			name + " changed, reconnecting"
+			);}
+			continue;
+		}
+
+		if (std::chrono::steady_clock::now() - connected_at > STABLE_AFTER) {
+			backoff.reset();
+		}
+		auto delay = backoff.next();
+		if (debug >= 1) {debugOut(1,
+		name + " lost, reconnecting in " + std::to_string(delay.count()) + " ms"
+		);}
+		pause(delay);
+	}
+
+	if (debug >= 1) {debugOut(1,
+	name + " removed"
+	);}
+}
+
+
+void Client::onTimer(std::chrono::steady_clock::time_point now) {
+	std::lock_guard<std::mutex> lock(links_mutex);
+	for (auto it=links.begin(); it!=links.end(); it++) {
+		if (*it && (*it)->pool) {
+			(*it)->pool->tick(now);
+		}
+	}
+}
+
+
+std::vector<std::shared_ptr<Socket>> Client::socketsOf(uint32_t link_id) {
+	std::vector<std::shared_ptr<Socket>> sockets;
+	imux_ptr->forEachSocket([link_id, &sockets] (const std::shared_ptr<Socket> &socket) {
+		if (socket->getLinkId() == link_id) {
+			sockets.push_back(socket);
+		}
+	});
+	return sockets;
+}
+
+
+void Client::addLink(const SocketDescription &des) {
+	std::lock_guard<std::mutex> lock(links_mutex);
+	// Link ids aren't reused, the server may still know the removed ones.
+	std::shared_ptr<Link> link = makeLink(links.size(), des);
+	links.push_back(link);
+	startLink(link);
+	if (debug >= 1) {debugOut(1,
+	std::string("added link ") + std::to_string(link->id) + " (" + link->key + ")"
+	);}
+}
+
+
+void Client::removeLink(const SocketDescription &des) {
+	std::shared_ptr<Link> link;
+	std::vector<std::thread> stopping;
+	{
+		std::lock_guard<std::mutex> lock(links_mutex);
+		for (auto it=links.begin(); it!=links.end(); it++) {
+			if (*it && (*it)->key == des.key()) {
+				link = *it;
+				it->reset();
+				break;
+			}
+		}
+		if (!link) {
+			return;
+		}
+		std::string prefix = std::string("link ") + std::to_string(link->id) + ".";
+		for (auto it=threads.begin(); it!=threads.end(); ) {
+			if (it->first.compare(0, prefix.size(), prefix) == 0) {
+				stopping.push_back(std::move(it->second));
+				it = threads.erase(it);
+			} else {
+				it++;
+			}
+		}
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(link->mutex);
+		link->retired = true;
+	}
+	link->retiring.notify_all();
+	if (link->pool) {
+		link->pool->close();
+	}
+	// The threads stop once their sockets are gone.
+	std::vector<std::shared_ptr<Socket>> sockets = socketsOf(link->id);
+	for (auto it=sockets.begin(); it!=sockets.end(); it++) {
+		dropLink(*it);
+	}
+	for (auto it=stopping.begin(); it!=stopping.end(); it++) {
+		it->join();
+	}
+}
+
+
+void Client::changeLink(const SocketDescription &from, const SocketDescription &to) {
+	std::shared_ptr<Link> link = findLink(to.key());
+	if (!link) {
+		return;
+	}
+	bool retunable = config::isRetunable(from, to);
+	{
+		std::lock_guard<std::mutex> lock(link->mutex);
+		link->des = to;
+		++link->generation;
+	}
+	std::vector<std::shared_ptr<Socket>> sockets = socketsOf(link->id);
+	for (auto it=sockets.begin(); it!=sockets.end(); it++) {
+		if (retunable) {
+			retuneSocket(**it, to);
+		} else {
+			dropLink(*it);		// Its thread reconnects with the new description
+		}
+	}
+	if (debug >= 1) {debugOut(1,
+	std::string("link ") + std::to_string(link->id) + " (" + link->key + ") " +
+	(retunable ? "retuned" : "reconnects")
+	);}
+}
+
+
+Server::Server(const Options &options, std::shared_ptr<PacketDevice> device) :
+	Endpoint(options, device) {
+	if (debug >= 2) {debugOut(2,
+	"setting up server..."
+	);}
+
+	wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (wake_fd == -1) {
+		throw SocketException(std::string("eventfd error: ") + strerror(errno));
+	}
+
+	// Create the listening sockets
+	for (auto it=options.sock_des.begin(); it!=options.sock_des.end(); it++) {
+		openLink(*it, next_index++, false);
 	}
 
 	if (debug >= 1) {debugOut(1,
 	"succesfully set up the server with " + std::to_string(listen_socket_ptrs.size()) + \
-	" TCP sockets, " + std::to_string(socket_ptrs.size()) + " UDP sockets"
+	" listening sockets, " + std::to_string(socket_ptrs.size()) + " UDP sockets"
 	);}
 }
 
 
+void Server::openLink(const SocketDescription &des, uint32_t index, bool started) {
+	// Uses unique pointers to avoid destructing the ServerTCPSocket on push_back
+	// (freeaddrinfo doesn't play nicely when called twice).
+
+	// Socket description asks for TCP, or a local link, which connects like it
+	if (des.type == SocketType::TCP || isLocal(des.type)) {
+		std::unique_ptr<ServerTCPSocket> serv_sock_ptr(
+			new ServerTCPSocket(des, idemux_ptr, debug)
+		);	
+		link_indexes[serv_sock_ptr->describe()] = index;
+
+		listen_socket_ptrs.emplace(serv_sock_ptr->describe(), std::move(serv_sock_ptr));
+		if (started) {
+			wakeListening();
+		}
+	// Socket description asks for UDP
+	} else { // UDP, or UDP through AF_XDP
+		// You can't listen() nor accept() on datagram sockets. Immediately create a
+		// UDPSocket. As we're only handling one client, we'll just call connect() the first
+		// time someone sends something to us.
+		std::shared_ptr<Socket> socket_ptr((des.type == SocketType::XDP) ?
+			makeSocket<XDPSocket<ServerUDPSocket>>(des, idemux_ptr, debug) :
+			makeSocket<ServerUDPSocket>(des, idemux_ptr, debug));
+		socket_ptrs.insert({socket_ptr->describe(), socket_ptr});
+		link_indexes[socket_ptr->describe()] = index;
+		attachLink(socket_ptr);
+		if (started) {
+			startThreads(socket_ptr, index);
+		}
+	}
+}
+
+
 void Server::start() {
+	std::unique_lock<std::mutex> lock(links_mutex);
 	// Start a single thread for every UDPServerSocket (which are the only ones in socket_ptrs
 	// at this point)
 	for (auto it=socket_ptrs.begin(); it!=socket_ptrs.end(); it++) {
-		threads.emplace(
-			it->second->describe(), 
-			std::thread([it] () {it->second->startReceiving();})
-		);
-		if (debug >= 2) {debugOut(2,
-		std::string("started thread for ") + it->second->describeFull()
-		);}
+		startThreads(it->second, link_indexes[it->first]);
 	}
+	lock.unlock();
 
 	// Start single listening thread for all TCP server sockets
-	std::thread listen_t([this] () {this->performListening();});
+	std::thread listen_t([this] () {
+		this->placement.pin(Placement::CONTROL, 0, this->debug);
+		this->performListening();
+	});
 
 	if (debug >= 2) {debugOut(2,
 	"started the listening thread"
 	);}
 
+	startTimer();
+	startStats();
+
 	// Start imux thread
-	std::thread imux_t([this] () {this->imux_ptr->readTunLoop();});
+	std::thread imux_t([this] () {
+		this->placement.pin(Placement::TUN, 0, this->debug);
+		this->imux_ptr->readTunLoop();
+	});
 	
 	if (debug >= 2) {debugOut(2,
 	"started the imux thread"
@@ -145,9 +911,19 @@ void Server::start() {
 
 	// Join tun thread
 	imux_t.join();
+	timer_t.join();
 
 	// Join socket_ptr_threads
-	for (auto it=threads.begin(); it!=threads.end(); it++) {
+	std::map<std::string, std::thread> receive_threads;
+	std::map<std::string, std::thread> sending_threads;
+	lock.lock();
+	receive_threads.swap(threads);
+	sending_threads.swap(send_threads);
+	lock.unlock();
+	for (auto it=receive_threads.begin(); it!=receive_threads.end(); it++) {
+		it->second.join();
+	}
+	for (auto it=sending_threads.begin(); it!=sending_threads.end(); it++) {
 		it->second.join();
 	}
 
@@ -156,6 +932,137 @@ void Server::start() {
 }
 
 
+void Server::startThreads(std::shared_ptr<Socket> socket, uint32_t index) {
+	threads.emplace(
+		socket->describe(), 
+		std::thread([this, socket, index] () {this->runReceiver(socket, index);})
+	);
+	send_threads.emplace(
+		socket->describe(), 
+		std::thread([this, socket, index] () {this->runSender(socket, index);})
+	);
+	if (debug >= 2) {debugOut(2,
+	std::string("started threads for ") + socket->describeFull()
+	);}
+}
+
+
+void Server::attachLink(std::shared_ptr<Socket> socket) {
+	socket->setHelloHandler([this] (Socket &s, uint64_t session_id, uint32_t link_id,
+			uint8_t stream) {
+		this->onHello(s, session_id, link_id, stream);
+	});
+	if (timestamps) {
+		socket->enableTimestamping();
+	}
+	if (busy_poll.count() > 0) {
+		socket->enableBusyPoll(busy_poll);
+	}
+	if (probe_mtu) {
+		socket->enablePathMTU();
+	}
+	if (zero_copy > 0) {
+		socket->enableZeroCopy(zero_copy);
+	}
+	imux_ptr->attachSocket(socket);
+}
+
+
+void Server::onHello(Socket &socket, uint64_t session_id, uint32_t link_id,
+	uint8_t stream) {
+	std::lock_guard<std::mutex> lock(session_mutex);
+	if (session_id != current_session) {
+		if (current_session != 0) {
+			// The client restarted, its sequence numbers start over.
+			if (debug >= 1) {debugOut(1,
+			std::string("new session ") + std::to_string(session_id) + ", forgetting session " +
+			std::to_string(current_session)
+			);}
+			idemux_ptr->reset();
+		}
+		current_session = session_id;
+	}
+
+	std::shared_ptr<Socket> this_socket;
+	imux_ptr->forEachSocket([&socket, &this_socket] (const std::shared_ptr<Socket> &s) {
+		if (s.get() == &socket) {
+			this_socket = s;
+		}
+	});
+
+	// A reconnected TCP link comes in as a new connection. The old one may not have
+	// noticed it's dead yet. Other streams of the same link are left alone.
+	std::map<uint8_t, std::weak_ptr<Socket>> &streams = links_by_id[link_id];
+	std::shared_ptr<Socket> old_socket = streams[stream].lock();
+	if (old_socket && old_socket.get() != &socket) {
+		if (debug >= 1) {debugOut(1,
+		old_socket->describeFull() + " is replaced by " + socket.describeFull()
+		);}
+		dropLink(old_socket);
+	}
+	streams[stream] = this_socket;
+	// The streams of a link are one link to the scheduler, as on the client.
+	imux_ptr->regroup();
+}
+
+
+void Server::forgetConnection(const std::string &name) {
+	auto socket_it = socket_ptrs.find(name);
+	if (socket_it == socket_ptrs.end()) {
+		return;
+	}
+	dropLink(socket_it->second);
+	socket_ptrs.erase(socket_it);
+	listeners.erase(name);
+	for (auto *thread_map : {&threads, &send_threads}) {
+		auto thread_it = thread_map->find(name);
+		if (thread_it != thread_map->end()) {
+			thread_it->second.join();
+			thread_map->erase(thread_it);
+		}
+	}
+}
+
+
+void Server::onTimer(std::chrono::steady_clock::time_point) {
+	std::vector<std::shared_ptr<Socket>> dead;
+	std::vector<std::thread> finishing;
+	{
+		std::lock_guard<std::mutex> lock(links_mutex);
+		for (auto it=listeners.begin(); it!=listeners.end(); ) {
+			auto socket_it = socket_ptrs.find(it->first);
+			if (socket_it != socket_ptrs.end() && !socket_it->second->isShutDown()) {
+				it++;
+				continue;
+			}
+			if (socket_it != socket_ptrs.end()) {
+				dead.push_back(socket_it->second);
+				socket_ptrs.erase(socket_it);
+			}
+			for (auto *thread_map : {&threads, &send_threads}) {
+				auto thread_it = thread_map->find(it->first);
+				if (thread_it != thread_map->end()) {
+					finishing.push_back(std::move(thread_it->second));
+					thread_map->erase(thread_it);
+				}
+			}
+			it = listeners.erase(it);
+		}
+	}
+	// Both threads return right after the shutdown, don't keep the listening thread
+	// and reloads waiting for that.
+	for (auto it=finishing.begin(); it!=finishing.end(); it++) {
+		it->join();
+	}
+	for (auto it=dead.begin(); it!=dead.end(); it++) {
+		dropLink(*it);		// Detached already, unless only its heartbeats gave up on it
+		if (debug >= 2) {debugOut(2,
+		std::string("forgot ") + (*it)->describeFull()
+		);}
+	}
+}
+
+
 void Server::performListening() {
 	// Endless loop that uses select() to synchonously handle multiple listening sockets.
 	while (true) {
@@ -169,12 +1076,17 @@ void Server::performListening() {
 
 		FD_ZERO(&listen_fd_set);		// Zero out the set. Required as it's based on bits being set.
 
-		// Fill the fd_set with all socket fd's we know about.
+		// Fill the fd_set with all socket fd's we know about, and the one reloads wake us
+		// up with.
+		std::unique_lock<std::mutex> lock(links_mutex);
 		for (auto it=listen_socket_ptrs.begin(); it!=listen_socket_ptrs.end(); it++) {
 			int fd = it->second->getFD();
 			max_fd = std::max(fd, max_fd);
 			FD_SET(fd, &listen_fd_set);
 		}
+		lock.unlock();
+		max_fd = std::max(wake_fd, max_fd);
+		FD_SET(wake_fd, &listen_fd_set);
 
 		// Give us the fd's that have data
 		ret = select(max_fd + 1, &listen_fd_set, NULL, NULL, NULL);
@@ -186,21 +1098,31 @@ void Server::performListening() {
 			);
 			//throw TunException(std::string("select error: ") + strerror(errno));
 		}
+		if (ret > 0 && FD_ISSET(wake_fd, &listen_fd_set)) {
+			uint64_t value;
+			if (read(wake_fd, &value, sizeof value) < 0) {
+				// EAGAIN: nothing to reset.
+			}
+			continue;	// The listening sockets changed, the others are looked at again
+		}
 		//std::cout << std::to_string(ret) << std::endl;
 		// For each socket's fd, check whether it's marked as ready in the fd_set.
 		// If so, handle it.
+		lock.lock();
 		for (auto it=listen_socket_ptrs.begin(); it!=listen_socket_ptrs.end(); it++) {
 			if (FD_ISSET(it->second->getFD(), &listen_fd_set)) {
 				// A peer connected to us
 				try {
 					auto peer_socket_ptr = it->second->acceptPeerConnection();
+					uint32_t index = link_indexes[it->first];
 					// Now peer_socket_ptr is the socket that is connected to the peer.
+					// Streams come and go, so the peer's port may have been used before by
+					// a connection that's gone by now.
+					forgetConnection(peer_socket_ptr->describe());
 					socket_ptrs.insert({peer_socket_ptr->describe(), peer_socket_ptr});
-					imux_ptr->attachSocket(peer_socket_ptr);
-					threads.emplace(
-						peer_socket_ptr->describe(), 
-						std::thread([peer_socket_ptr] () {peer_socket_ptr->startReceiving();})
-					);
+					listeners[peer_socket_ptr->describe()] = it->first;
+					attachLink(peer_socket_ptr);
+					startThreads(peer_socket_ptr, index);
 				} catch (SocketException &e) {
 					// Error may occur but there's no reason now to jump through hoops.
 					std::cerr << e.what() << std::endl;
@@ -211,4 +1133,85 @@ void Server::performListening() {
 			}
 		}
 	}
-}
\ No newline at end of file
+}
+
+void Server::wakeListening() {
+	uint64_t one = 1;
+	if (write(wake_fd, &one, sizeof one) < 0) {
+		// EAGAIN: the counter is full, it's readable either way.
+	}
+}
+
+
+std::vector<std::string> Server::connectionsOf(const std::string &listener) {
+	std::vector<std::string> names;
+	for (auto it=listeners.begin(); it!=listeners.end(); it++) {
+		if (it->second == listener) {
+			names.push_back(it->first);
+		}
+	}
+	return names;
+}
+
+
+void Server::addLink(const SocketDescription &des) {
+	std::lock_guard<std::mutex> lock(links_mutex);
+	openLink(des, next_index++, true);
+	if (debug >= 1) {debugOut(1,
+	std::string("added ") + des.key()
+	);}
+}
+
+
+void Server::removeLink(const SocketDescription &des) {
+	std::lock_guard<std::mutex> lock(links_mutex);
+	std::string name = des.key();
+	auto listener = listen_socket_ptrs.find(name);
+	if (listener != listen_socket_ptrs.end()) {
+		std::vector<std::string> connections = connectionsOf(name);
+		for (auto it=connections.begin(); it!=connections.end(); it++) {
+			forgetConnection(*it);
+		}
+		listen_socket_ptrs.erase(listener);
+		wakeListening();
+	} else {
+		forgetConnection(name);
+	}
+	link_indexes.erase(name);
+	if (debug >= 1) {debugOut(1,
+	std::string("removed ") + name
+	);}
+}
+
+
+void Server::changeLink(const SocketDescription &from, const SocketDescription &to) {
+	std::lock_guard<std::mutex> lock(links_mutex);
+	std::string name = to.key();
+	bool retunable = config::isRetunable(from, to);
+	std::string what = retunable ? "retuned" : "recreated";
+	auto listener = listen_socket_ptrs.find(name);
+	if (listener != listen_socket_ptrs.end()) {
+		listener->second->retune(to);
+		what = retunable ? "retuned" : "dropped its connections";
+		std::vector<std::string> connections = connectionsOf(name);
+		for (auto it=connections.begin(); it!=connections.end(); it++) {
+			if (retunable) {
+				retuneSocket(*socket_ptrs[*it], to);
+			} else {
+				forgetConnection(*it);		// The client connects again, and gets the new one
+			}
+		}
+	} else if (socket_ptrs.count(name) > 0) {
+		if (retunable) {
+			retuneSocket(*socket_ptrs[name], to);
+		} else {
+			// A new socket on the same port. The client's keeps sending to it.
+			uint32_t index = link_indexes[name];
+			forgetConnection(name);
+			openLink(to, index, true);
+		}
+	}
+	if (debug >= 1) {debugOut(1,
+	name + " " + what
+	);}
+}
@@ -0,0 +1,74 @@
+#include "scheduler.h"
+
+
+const size_t MinRTTScheduler::BACKLOG_LIMIT;
+
+
+std::unique_ptr<Scheduler> Scheduler::create(const std::string &name) {
+	if (name == "rr") {
+		return std::unique_ptr<Scheduler>(new RoundRobinScheduler());
+	} else if (name == "minrtt") {
+		return std::unique_ptr<Scheduler>(new MinRTTScheduler());
+	}
+	throw std::invalid_argument("unknown scheduler: " + name);
+}
+
+
+int RoundRobinScheduler::pick(const Message &msg, const std::vector<ScheduledLink*> &links) {
+	size_t n = links.size();
+	int standby = -1;
+	for (size_t tried = 0; tried < n; tried++) {
+		index %= n;
+		size_t candidate = index;
+		ScheduledLink *link = links[candidate];
+		int weight = link->getWeight();
+		if (weight > 0 && link->takes(msg)) {
+			if (++taken >= weight) {
+				index = (index + 1) % n;
+				taken = 0;
+			}
+			return static_cast<int>(candidate);
+		}
+		if (weight <= 0 && standby == -1 && link->takes(msg)) {
+			standby = static_cast<int>(candidate);
+		}
+		index = (index + 1) % n;
+		taken = 0;
+	}
+	return standby;
+}
+
+
+int MinRTTScheduler::pick(const Message &msg, const std::vector<ScheduledLink*> &links) {
+	int fastest = -1;
+	std::chrono::microseconds fastest_rtt;
+	int shortest = -1;
+	size_t shortest_backlog = 0;
+	int standby = -1;
+	for (size_t i = 0; i < links.size(); i++) {
+		ScheduledLink *link = links[i];
+		if (!link->takes(msg)) {
+			continue;
+		}
+		if (link->getWeight() <= 0) {
+			if (standby == -1) {
+				standby = static_cast<int>(i);
+			}
+			continue;
+		}
+		size_t backlog = link->getBacklog();
+		if (shortest == -1 || backlog < shortest_backlog) {
+			shortest = static_cast<int>(i);
+			shortest_backlog = backlog;
+		}
+		if (backlog >= BACKLOG_LIMIT) {
+			continue;
+		}
+		std::chrono::microseconds rtt = link->getSmoothedRTT();
+		if (fastest == -1 || rtt < fastest_rtt) {
+			fastest = static_cast<int>(i);
+			fastest_rtt = rtt;
+		}
+	}
+	return (fastest != -1) ? fastest : (shortest != -1) ? shortest : standby;
+}
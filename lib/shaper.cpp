@@ -0,0 +1,231 @@
+#include <algorithm>
+#include <sstream>
+
+#include "shaper.h"
+
+
+static const std::chrono::milliseconds DEFAULT_BURST{10};
+// Room for a heartbeat and the padding behind it.
+static const int MIN_COVER_SIZE = 64;
+
+
+Shaping Shaping::parse(const std::string &spec) {
+	Shaping shaping;
+	std::stringstream ss(spec);
+	std::string term;
+	while (std::getline(ss, term, '/')) {
+		if (term.empty()) {
+			continue;
+		}
+		size_t eq = term.find('=');
+		if (eq == std::string::npos) {
+			throw std::invalid_argument("shaping term without '=': " + term);
+		}
+		std::string key = term.substr(0, eq);
+		double number;
+		try {
+			number = std::stod(term.substr(eq + 1));
+		} catch (std::exception &e) {
+			throw std::invalid_argument("shaping term isn't a number: " + term);
+		}
+		if (number < 0) {
+			throw std::invalid_argument("shaping term can't be negative: " + term);
+		}
+
+		if (key == "rate") {
+			shaping.rate_kbit = static_cast<uint64_t>(number);
+		} else if (key == "burst") {
+			shaping.burst_bytes = static_cast<uint64_t>(number);
+		} else if (key == "pps") {
+			shaping.pps = static_cast<uint64_t>(number);
+		} else if (key == "queue") {
+			shaping.queue_ms = number;
+		} else if (key == "cover") {
+			shaping.cover_pps = static_cast<uint64_t>(number);
+		} else if (key == "size") {
+			if (number < MIN_COVER_SIZE || number > Message::BUF_SIZE) {
+				throw std::invalid_argument("cover size out of range: " + term);
+			}
+			shaping.cover_size = static_cast<uint16_t>(number);
+		} else {
+			throw std::invalid_argument("unknown shaping term: " + term);
+		}
+	}
+	return shaping;
+}
+
+
+std::string Shaping::describe() const {
+	std::stringstream ss;
+	if (isEmpty()) {
+		return "none";
+	}
+	if (cover_pps > 0) {
+		ss << "cover traffic, " << cover_pps << " frames/s of " << cover_size << " bytes";
+		return ss.str();
+	}
+	if (rate_kbit > 0) {
+		ss << "rate " << rate_kbit << " kbit/s";
+		if (burst_bytes > 0) {
+			ss << ", burst " << burst_bytes << " bytes";
+		}
+	}
+	if (pps > 0) {
+		ss << (rate_kbit > 0 ? ", " : "") << pps << " messages/s";
+	}
+	ss << ", queue " << queue_ms << " ms";
+	return ss.str();
+}
+
+
+Shaper::Shaper(const Shaping &shaping, Release release, TimerWheel &wheel) :
+	release(release), wheel(wheel), refilled_at(Clock::now()) {
+	configure(shaping);
+	tokens = burst;
+	packet_tokens = packet_burst;
+}
+
+
+void Shaper::configure(const Shaping &shaping) {
+	this->shaping = shaping;
+	bytes_per_ns = shaping.rate_kbit * 1000 / 8 / 1e9;
+	packets_per_ns = shaping.pps / 1e9;
+	max_wait = std::chrono::nanoseconds(static_cast<int64_t>(shaping.queue_ms * 1e6));
+	double default_burst = bytes_per_ns * std::chrono::nanoseconds(DEFAULT_BURST).count();
+	burst = (shaping.burst_bytes > 0) ? shaping.burst_bytes :
+		std::max(default_burst, 2.0 * Message::BUF_SIZE);
+	packet_burst = std::max(2.0, shaping.pps / 100.0);
+}
+
+
+void Shaper::retune(const Shaping &shaping) {
+	std::lock_guard<std::mutex> lock(mutex);
+	// What filled up so far was earned at the old rates.
+	auto now = Clock::now();
+	refill(now);
+	configure(shaping);
+	tokens = std::min(tokens, burst);
+	packet_tokens = std::min(packet_tokens, packet_burst);
+	// A pending drain still goes by the old rates, and reschedules if it's early.
+	if (!held.empty() && !drain_pending && !stopped) {
+		scheduleDrain(now);
+	}
+}
+
+
+void Shaper::refill(Clock::time_point now) {
+	if (now <= refilled_at) {
+		return;
+	}
+	double ns = std::chrono::duration<double, std::nano>(now - refilled_at).count();
+	tokens = std::min(burst, tokens + ns * bytes_per_ns);
+	packet_tokens = std::min(packet_burst, packet_tokens + ns * packets_per_ns);
+	refilled_at = now;
+}
+
+
+bool Shaper::conforms(uint16_t size) {
+	return (bytes_per_ns == 0 || tokens >= size) && (packets_per_ns == 0 || packet_tokens >= 1);
+}
+
+
+void Shaper::take(uint16_t size) {
+	tokens -= size;
+	packet_tokens -= 1;
+}
+
+
+bool Shaper::admits(uint16_t size) {
+	std::lock_guard<std::mutex> lock(mutex);
+	refill(Clock::now());
+	return held.empty() && conforms(size);
+}
+
+
+bool Shaper::submit(MessagePtr message) {
+	uint16_t size = Message::HEADER_LENGTH + message->payload_length;
+	auto now = Clock::now();
+	std::lock_guard<std::mutex> lock(mutex);
+	if (stopped) {
+		++dropped;
+		return false;
+	}
+	refill(now);
+	if (held.empty() && conforms(size)) {
+		take(size);
+		release(std::move(message));
+		return true;
+	}
+
+	// How long until everything held and this one have gone out.
+	double wait_ns = 0;
+	if (bytes_per_ns > 0) {
+		wait_ns = (held_bytes + size - tokens) / bytes_per_ns;
+	}
+	if (packets_per_ns > 0) {
+		wait_ns = std::max(wait_ns, (held.size() + 1 - packet_tokens) / packets_per_ns);
+	}
+	if (wait_ns > max_wait.count()) {
+		++dropped;
+		return false;
+	}
+	held.push_back(std::move(message));
+	held_bytes += size;
+	++delayed;
+	if (!drain_pending) {
+		scheduleDrain(now);
+	}
+	return true;
+}
+
+
+void Shaper::scheduleDrain(Clock::time_point now) {
+	uint16_t size = Message::HEADER_LENGTH + held.front()->payload_length;
+	double wait_ns = 0;
+	if (bytes_per_ns > 0) {
+		wait_ns = (size - tokens) / bytes_per_ns;
+	}
+	if (packets_per_ns > 0) {
+		wait_ns = std::max(wait_ns, (1 - packet_tokens) / packets_per_ns);
+	}
+	std::weak_ptr<Shaper> weak = shared_from_this();
+	wheel.schedule(now + std::chrono::nanoseconds(static_cast<int64_t>(wait_ns) + 1),
+		[weak] () {
+			if (auto shaper = weak.lock()) {
+				shaper->drain();
+			}
+		});
+	drain_pending = true;
+}
+
+
+void Shaper::drain() {
+	std::lock_guard<std::mutex> lock(mutex);
+	drain_pending = false;
+	if (stopped) {
+		return;
+	}
+	auto now = Clock::now();
+	refill(now);
+	while (!held.empty()) {
+		uint16_t size = Message::HEADER_LENGTH + held.front()->payload_length;
+		if (!conforms(size)) {
+			scheduleDrain(now);
+			return;
+		}
+		take(size);
+		held_bytes -= size;
+		MessagePtr message = std::move(held.front());
+		held.pop_front();
+		release(std::move(message));
+	}
+}
+
+
+void Shaper::stop() {
+	std::lock_guard<std::mutex> lock(mutex);
+	stopped = true;
+	dropped += held.size();
+	held.clear();
+	held_bytes = 0;
+}
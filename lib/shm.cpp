@@ -0,0 +1,257 @@
+#include <errno.h>
+#include <poll.h>
+#include <sched.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "shm.h"
+
+
+const uint32_t ShmRing::SLOTS;
+const uint32_t ShmRing::SLOT_SIZE;
+const uint32_t ShmRing::MAX_LENGTH;
+const int ShmRing::YIELDS;
+const int ShmChannel::FDS;
+
+
+namespace {
+
+	static_assert(ATOMIC_INT_LOCK_FREE == 2,
+		"the rings' atomics are shared between processes");
+
+	// Sent along with the file descriptors, so both ends agree on the layout.
+	struct Handshake {
+		char magic[8];
+		uint32_t slots;
+		uint32_t slot_size;
+	};
+	const char MAGIC[8] = "MTSHM1";
+
+	const size_t MEMORY_SIZE = 2 * sizeof(ShmRing::Shared);
+
+}
+
+
+bool ShmRing::push(const struct iovec *iov, int count, int closed_fd) {
+	size_t length = 0;
+	for (int i = 0; i < count; i++) {
+		length += iov[i].iov_len;
+	}
+	if (length > MAX_LENGTH) {
+		throw ShmException("message of " + std::to_string(length) + " bytes doesn't fit a slot");
+	}
+
+	uint32_t tail = shared->tail.load(std::memory_order_relaxed);
+	while (tail - shared->head.load(std::memory_order_acquire) >= SLOTS) {
+		// Full. Say we're waiting before looking again, so a pop() in between wakes us
+		// (once it's half empty, which it gets to with us not writing).
+		shared->producer_waiting.store(1);
+		if (tail - shared->head.load() < SLOTS) {
+			shared->producer_waiting.store(0);
+			break;
+		}
+		bool open = sleep(space_fd, closed_fd);
+		shared->producer_waiting.store(0);
+		if (!open) {
+			return false;
+		}
+	}
+
+	char *slot = shared->slots[tail & (SLOTS - 1)];
+	uint16_t slot_length = length;
+	memcpy(slot, &slot_length, sizeof slot_length);
+	char *data = slot + sizeof slot_length;
+	for (int i = 0; i < count; i++) {
+		memcpy(data, iov[i].iov_base, iov[i].iov_len);
+		data += iov[i].iov_len;
+	}
+	shared->tail.store(tail + 1);
+	if (shared->consumer_waiting.load()) {
+		wake(data_fd);
+	}
+	return true;
+}
+
+
+ssize_t ShmRing::pop(char *buf, size_t max) {
+	uint32_t head = shared->head.load(std::memory_order_relaxed);
+	if (head == shared->tail.load(std::memory_order_acquire)) {
+		return -1;
+	}
+	const char *slot = shared->slots[head & (SLOTS - 1)];
+	uint16_t length;
+	memcpy(&length, slot, sizeof length);
+	length = std::min<size_t>(length, std::min<size_t>(max, MAX_LENGTH));
+	memcpy(buf, slot + sizeof length, length);
+	shared->head.store(head + 1);
+	// Only once half of it is free, so the producer gets to write more than one.
+	if (shared->producer_waiting.load() &&
+			shared->tail.load() - (head + 1) <= SLOTS / 2) {
+		wake(space_fd);
+	}
+	return length;
+}
+
+
+bool ShmRing::wait(int closed_fd) {
+	uint32_t head = shared->head.load(std::memory_order_relaxed);
+	// A producer that's about to write more is cheaper to wait for than a wake up per
+	// message. Yielding rather than spinning lets it run if it's on the same CPU.
+	for (int i = 0; i < YIELDS; i++) {
+		if (head != shared->tail.load(std::memory_order_acquire)) {
+			return true;
+		}
+		sched_yield();
+	}
+	// As in push(): waiting first, then looking again.
+	shared->consumer_waiting.store(1);
+	if (head != shared->tail.load()) {
+		shared->consumer_waiting.store(0);
+		return true;
+	}
+	bool open = sleep(data_fd, closed_fd);
+	shared->consumer_waiting.store(0);
+	return open;
+}
+
+
+bool ShmRing::sleep(int fd, int closed_fd) {
+	sleeps++;
+	struct pollfd pfds[2] = {{fd, POLLIN, 0}, {closed_fd, POLLIN, 0}};
+	while (poll(pfds, 2, -1) < 0) {
+		if (errno != EINTR) {
+			return false;
+		}
+	}
+	if (pfds[1].revents != 0) {
+		return false;
+	}
+	uint64_t value;
+	if (read(fd, &value, sizeof value) < 0) {
+		// EAGAIN: someone else reset it already.
+	}
+	return true;
+}
+
+
+void ShmRing::wake(int fd) {
+	wakeups++;
+	uint64_t one = 1;
+	if (write(fd, &one, sizeof one) < 0) {
+		// EAGAIN: the counter is full, it's readable either way.
+	}
+}
+
+
+std::unique_ptr<ShmChannel> ShmChannel::create(int unix_fd) {
+	int fds[FDS];
+	fds[0] = memfd_create("multitun link", MFD_CLOEXEC);
+	if (fds[0] == -1) {
+		throw ShmException(std::string("memfd_create error: ") + strerror(errno));
+	}
+	if (ftruncate(fds[0], MEMORY_SIZE) == -1) {
+		int error = errno;
+		close(fds[0]);
+		throw ShmException(std::string("ftruncate error: ") + strerror(error));
+	}
+	for (int i = 1; i < FDS; i++) {
+		fds[i] = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+		if (fds[i] == -1) {
+			int error = errno;
+			for (int j = 0; j < i; j++) {
+				close(fds[j]);
+			}
+			throw ShmException(std::string("eventfd error: ") + strerror(error));
+		}
+	}
+	std::unique_ptr<ShmChannel> channel(new ShmChannel(fds, true));
+
+	Handshake handshake = {};
+	memcpy(handshake.magic, MAGIC, sizeof MAGIC);
+	handshake.slots = ShmRing::SLOTS;
+	handshake.slot_size = ShmRing::SLOT_SIZE;
+	struct iovec iov = {&handshake, sizeof handshake};
+	char control[CMSG_SPACE(sizeof fds)] = {};
+	struct msghdr msg = {};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof control;
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof fds);
+	memcpy(CMSG_DATA(cmsg), fds, sizeof fds);
+	if (sendmsg(unix_fd, &msg, MSG_NOSIGNAL) == -1) {
+		throw ShmException(std::string("sending the shared memory: ") + strerror(errno));
+	}
+	return channel;
+}
+
+
+std::unique_ptr<ShmChannel> ShmChannel::receive(int unix_fd) {
+	int fds[FDS];
+	Handshake handshake = {};
+	struct iovec iov = {&handshake, sizeof handshake};
+	char control[CMSG_SPACE(sizeof fds)] = {};
+	struct msghdr msg = {};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof control;
+	ssize_t n_read = recvmsg(unix_fd, &msg, MSG_CMSG_CLOEXEC);
+	if (n_read == -1) {
+		throw ShmException(std::string("receiving the shared memory: ") + strerror(errno));
+	}
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg == nullptr || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+			cmsg->cmsg_len != CMSG_LEN(sizeof fds)) {
+		throw ShmException("the peer didn't send the shared memory");
+	}
+	memcpy(fds, CMSG_DATA(cmsg), sizeof fds);
+	// Owns the fds from here on, also if the rest doesn't check out.
+	std::unique_ptr<ShmChannel> channel(new ShmChannel(fds, false));
+	if (n_read != sizeof handshake || memcmp(handshake.magic, MAGIC, sizeof MAGIC) != 0 ||
+			handshake.slots != ShmRing::SLOTS || handshake.slot_size != ShmRing::SLOT_SIZE) {
+		throw ShmException("the peer's shared memory is laid out differently");
+	}
+	return channel;
+}
+
+
+ShmChannel::ShmChannel(int fds[FDS], bool client) {
+	memcpy(this->fds, fds, sizeof this->fds);
+	memory = mmap(nullptr, MEMORY_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+	if (memory == MAP_FAILED) {
+		int error = errno;
+		memory = nullptr;
+		for (int i = 0; i < FDS; i++) {
+			close(fds[i]);
+			this->fds[i] = -1;
+		}
+		throw ShmException(std::string("mmap error: ") + strerror(error));
+	}
+	// The client sends on the first ring, the server on the second.
+	ShmRing::Shared *rings = static_cast<ShmRing::Shared*>(memory);
+	std::unique_ptr<ShmRing> first(new ShmRing(&rings[0], fds[1], fds[2]));
+	std::unique_ptr<ShmRing> second(new ShmRing(&rings[1], fds[3], fds[4]));
+	out = std::move(client ? first : second);
+	in = std::move(client ? second : first);
+}
+
+
+ShmChannel::~ShmChannel() {
+	if (memory != nullptr) {
+		munmap(memory, MEMORY_SIZE);
+	}
+	for (int i = 0; i < FDS; i++) {
+		if (fds[i] != -1) {
+			close(fds[i]);
+		}
+	}
+}
@@ -0,0 +1,250 @@
+#include <algorithm>
+#include <deque>
+#include <sstream>
+#include <stdexcept>
+
+#include "device.h"
+#include "imux.h"
+#include "sim.h"
+#include "stats.h"
+
+
+constexpr std::chrono::milliseconds Simulation::FLUSH_INTERVAL;
+
+
+namespace {
+
+	uint64_t toNanos(Simulation::TimePoint t) {
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(t.time_since_epoch()).count();
+	}
+
+}
+
+
+std::string SimLinkModel::describe() const {
+	std::stringstream ss;
+	ss << rtt_ms << "ms/" << rate_mbit << "M/" << 100 * loss << "%";
+	return ss.str();
+}
+
+
+/**
+	The simulated tun. Times how long the messages took from the source.
+*/
+class Simulation::Device : public PacketDevice {
+public:
+	Device(Simulation &sim) : sim(sim) {}
+
+	void receive(Message&) {
+		throw std::logic_error("the simulated tun is only written to");
+	}
+	bool tryReceive(Message&) {return false;};
+	void writeMessage(Message &msg) {
+		++delivered;
+		bytes += msg.payload_length;
+		uint64_t now = toNanos(sim.now());
+		latency.record(now > msg.tun_ns ? (now - msg.tun_ns) / 1000 : 0);
+	}
+	std::string describeFull() {return "simulated tun";};
+
+	uint64_t delivered = 0;
+	uint64_t bytes = 0;
+	stats::Histogram latency;	// Microseconds
+private:
+	Simulation &sim;
+};
+
+
+/**
+	A modeled link. Its backlog is what's still waiting for the bottleneck, and the
+	round trip time it reports includes the time that takes, as heartbeats would see.
+*/
+class Simulation::Link : public ScheduledLink {
+public:
+	Link(Simulation &sim, const SimLinkModel &model) : sim(sim), model(model) {}
+
+	bool isUsable() {return true;};
+	std::chrono::microseconds getSmoothedRTT() {
+		auto queueing = std::max(free_at, sim.now()) - sim.now();
+		return std::chrono::duration_cast<std::chrono::microseconds>(
+			std::chrono::duration<double, std::milli>(model.rtt_ms) + queueing);
+	}
+	size_t getBacklog() {
+		while (!in_queue.empty() && in_queue.front() <= sim.now()) {
+			in_queue.pop_front();
+		}
+		return in_queue.size();
+	}
+
+	void send(MessagePtr msg) {
+		TimePoint now = sim.now();
+		auto backlog = std::max(free_at, now) - now;
+		if (backlog > std::chrono::duration<double, std::milli>(model.queue_ms)) {
+			++sim.result.queue_drops;
+			return;
+		}
+		double bits = 8.0 * (Message::HEADER_LENGTH + msg->payload_length);
+		free_at = std::max(free_at, now) + std::chrono::nanoseconds(
+			static_cast<int64_t>(bits * 1000 / model.rate_mbit));
+		getBacklog();
+		in_queue.push_back(free_at);
+
+		if (model.loss > 0 && std::uniform_real_distribution<double>(0, 1)(sim.rng) < model.loss) {
+			++sim.result.link_losses;
+			return;
+		}
+		TimePoint arrival = free_at + std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::duration<double, std::milli>(model.rtt_ms / 2));
+		arriving.push_back({sim.due(arrival), std::move(msg)});
+	}
+
+	/**
+		When the next message arrives, nullptr if none is on its way.
+	*/
+	const Due *nextArrival() {
+		return arriving.empty() ? nullptr : &arriving.front().first;
+	}
+
+	/**
+		Hands the next message to the IDeMux. Call when it's due.
+	*/
+	void arrive() {
+		MessagePtr msg = std::move(arriving.front().second);
+		arriving.pop_front();
+		msg->parseTrailers();
+		sim.idemux->handleMessage(std::move(msg), sim.now());
+		sim.result.max_held = std::max(sim.result.max_held, sim.idemux->getHeld());
+	}
+private:
+	Simulation &sim;
+	SimLinkModel model;
+	TimePoint free_at;
+	std::deque<TimePoint> in_queue;		// When each queued message leaves the bottleneck
+	std::deque<std::pair<Due, MessagePtr>> arriving;	// In the order they're due
+};
+
+
+Simulation::Simulation(const SimConfig &config) : config(config),
+	clock(std::chrono::seconds(1)), rng(config.seed) {
+
+	if (config.links.empty()) {
+		throw std::invalid_argument("nothing to simulate without links");
+	}
+	// Enough for the links' queues and the reorder buffer at the usual rates, beyond
+	// that messages come from the heap.
+	message_pool.reset(new MessagePool());
+	device = std::make_shared<Device>(*this);
+	idemux = std::make_shared<IDeMux>(device, config.reorder_hold_ms);
+	scheduler = Scheduler::create(config.scheduler);
+
+	double total_mbit = 0;
+	for (const SimLinkModel &model : config.links) {
+		links.emplace_back(new Link(*this, model));
+		links_vector.push_back(links.back().get());
+		total_mbit += model.rate_mbit;
+	}
+	double bits = 8.0 * (Message::HEADER_LENGTH + config.packet_size + Message::SEQ_LENGTH);
+	double pps = std::max(1.0, config.load * total_mbit * 1e6 / bits);
+	send_interval = std::chrono::nanoseconds(static_cast<int64_t>(1e9 / pps));
+}
+
+
+Simulation::~Simulation() = default;
+
+
+void Simulation::sendNext() {
+	MessagePtr msg = message_pool->take();
+	msg->setType(Message::DATA);
+	msg->setSize(static_cast<uint16_t>(config.packet_size));
+	msg->tun_ns = toNanos(clock);
+	++result.offered;
+
+	bool spilled;
+	int picked = IMux::route(*scheduler, *msg, links_vector, spilled);
+	if (picked < 0) {
+		++result.unschedulable;
+	} else {
+		msg->appendSeq(next_seq++);
+		links[picked]->send(std::move(msg));
+	}
+
+	sending = clock + send_interval < end;
+	if (sending) {
+		next_send = due(clock + send_interval);
+	}
+}
+
+
+void Simulation::flush() {
+	idemux->flushExpired(clock);
+	// Keeps going as long as anything may still arrive or is held.
+	flushing = sending || arriving() || idemux->getHeld() > 0;
+	if (flushing) {
+		next_flush = due(clock + FLUSH_INTERVAL);
+	}
+}
+
+
+bool Simulation::arriving() {
+	for (auto it=links.begin(); it!=links.end(); it++) {
+		if ((*it)->nextArrival() != nullptr) {
+			return true;
+		}
+	}
+	return false;
+}
+
+
+SimResult Simulation::run() {
+	auto wall_start = std::chrono::steady_clock::now();
+	TimePoint start = clock;
+	end = start + std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::duration<double>(config.seconds));
+	sending = true;
+	next_send = due(start);
+	flushing = true;
+	next_flush = due(start + FLUSH_INTERVAL);
+
+	while (true) {
+		const Due *next = nullptr;
+		Link *arrival_on = nullptr;
+		if (sending) {
+			next = &next_send;
+		}
+		if (flushing && (next == nullptr || next_flush < *next)) {
+			next = &next_flush;
+		}
+		for (auto it=links.begin(); it!=links.end(); it++) {
+			const Due *arrival = (*it)->nextArrival();
+			if (arrival != nullptr && (next == nullptr || *arrival < *next)) {
+				next = arrival;
+				arrival_on = it->get();
+			}
+		}
+		if (next == nullptr) {
+			break;
+		}
+
+		clock = next->when;
+		if (arrival_on != nullptr) {
+			arrival_on->arrive();
+		} else if (next == &next_send) {
+			sendNext();
+		} else {
+			flush();
+		}
+		++result.events;
+	}
+	// Whatever is still held never got its gap filled.
+	idemux->reset();
+
+	result.delivered = device->delivered;
+	result.reordered = idemux->getReordered();
+	result.late = idemux->getLate();
+	result.goodput_mbit = device->bytes * 8 / config.seconds / 1e6;
+	result.latency_p50_ms = device->latency.percentile(0.5) / 1e3;
+	result.latency_p99_ms = device->latency.percentile(0.99) / 1e3;
+	result.wall_seconds = std::chrono::duration<double>(
+		std::chrono::steady_clock::now() - wall_start).count();
+	return result;
+}
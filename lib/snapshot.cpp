@@ -0,0 +1,37 @@
+#include "snapshot.h"
+
+
+const int ReaderSlots::MAX_READERS;
+const int ReaderSlots::SHARED;
+const int ReaderSlots::SLOTS;
+std::mutex ReaderSlots::mutex;
+std::vector<int> ReaderSlots::free_slots;
+int ReaderSlots::next_slot = 0;
+
+
+ReaderSlots::Claim::Claim() {
+	std::lock_guard<std::mutex> lock(mutex);
+	if (!free_slots.empty()) {
+		index = free_slots.back();
+		free_slots.pop_back();
+	} else if (next_slot < MAX_READERS) {
+		index = next_slot++;
+	} else {
+		index = SHARED;
+	}
+}
+
+
+ReaderSlots::Claim::~Claim() {
+	if (index == SHARED) {
+		return;
+	}
+	std::lock_guard<std::mutex> lock(mutex);
+	free_slots.push_back(index);
+}
+
+
+int ReaderSlots::mine() {
+	thread_local Claim claim;
+	return claim.index;
+}
@@ -6,6 +6,7 @@
 #include <linux/if_tun.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netdb.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
@@ -21,13 +22,23 @@
 #include <cstring>
 #include <netinet/in.h>
 #include <algorithm>
+#include <chrono>
+#include <poll.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
 #include <thread>
+#include <vector>
 
+#include "control.h"
+#include "impair.h"
 #include "queue.h"
 #include "socket.h"
 #include "util.h"
 
 
+constexpr std::chrono::seconds Socket::CONNECT_TIMEOUT;
+constexpr std::chrono::milliseconds Socket::ATTEMPT_DELAY;
+
 
 std::string sockaddr2IP(const struct sockaddr *sa) {
 	char addr[INET6_ADDRSTRLEN];
@@ -59,6 +70,50 @@ int sockaddr2Port(const struct sockaddr *sa) {
 }
 
 
+SocketDescription SocketDescription::parse(const std::string &spec) {
+	std::stringstream stream(spec);
+	std::vector<std::string> elems;
+	std::string item;
+	while (std::getline(stream, item, ':')) {
+		elems.push_back(item);
+	}
+	const std::string format = "expected TYPE:IP:PORT or TYPE:PATH, then :IMPAIRMENT and :SHAPING";
+	if (elems.size() < 2) {
+		throw std::invalid_argument(format);
+	}
+	SocketDescription des;
+	try {
+		des.type = string2SocketType(elems[0]);
+	} catch (std::invalid_argument &e) {
+		throw std::invalid_argument("unknown socket type: " + elems[0]);
+	}
+	// Local links name a path instead of an IP and port.
+	size_t n = isLocal(des.type) ? 2 : 3;
+	if (elems.size() < n || elems.size() > n + 2) {
+		throw std::invalid_argument(format);
+	}
+	des.ip = elems[1];
+	des.port = 0;
+	if (!isLocal(des.type)) {
+		try {
+			des.port = std::stoi(elems[2]);
+		} catch (std::exception &e) {
+			throw std::invalid_argument("invalid port: " + elems[2]);
+		}
+	}
+	des.impairment = (elems.size() > n) ? elems[n] : "";
+	des.shaping = (elems.size() > n + 1) ? elems[n + 1] : "";
+	Impairment::parse(des.impairment);		// Both throw std::invalid_argument
+	Shaping::parse(des.shaping);
+	return des;
+}
+
+
+std::string SocketDescription::key() const {
+	return socketType2String(type) + ":" + ip + ":" + std::to_string(port);
+}
+
+
 Socket::Socket(	const SocketDescription &des, int sock_fd, std::shared_ptr<IDeMux> idemux_ptr, 
 	int sock_type_c, int debug) 
 	  : type(des.type), ip(des.ip), port(des.port), sock_fd(sock_fd), 
@@ -67,10 +122,35 @@ Socket::Socket(	const SocketDescription &des, int sock_fd, std::shared_ptr<IDeMu
 
 Socket::Socket(const SocketDescription &des, std::shared_ptr<IDeMux> idemux_ptr, 
 	int sock_type_c, int debug) 
-	  : type(des.type), ip(des.ip), port(des.port), 
+	  : type(des.type), ip(des.ip), port(des.port), sock_fd(-1),
 	  	idemux_ptr(idemux_ptr), sock_type_c(sock_type_c), debug(debug) {
 
-	// Create socket
+	// Resolving and creating the socket are left to connectSocket() (client) or the
+	// subclass' constructor (server), so creating a client socket never blocks.
+}
+
+
+Socket::~Socket() {
+	if (debug >= 2) {debugOut(2,
+	"destructing " + describeFull()
+	);}	
+	if (shaper) {
+		shaper->stop();		// Releases into the send queue otherwise
+	}
+	if (cover) {
+		cover->stop();
+	}
+
+	if (servinfo != nullptr) {
+		freeaddrinfo(servinfo);
+	}
+	if (sock_fd != -1) {
+		close(sock_fd);
+	}
+}
+
+
+void Socket::resolve() {
 	int status;
 	struct addrinfo hints;
 
@@ -78,15 +158,22 @@ Socket::Socket(const SocketDescription &des, std::shared_ptr<IDeMux> idemux_ptr,
 	hints.ai_family = AF_UNSPEC;		// Don't care about IPv4 or IPv6
 	hints.ai_socktype = sock_type_c; 	// TCP stream sockets
 
+	if (servinfo != nullptr) {
+		freeaddrinfo(servinfo);
+		servinfo = nullptr;
+	}
+
 	// Make servinfo point to a linked list of 1 or more struct addrinfo's.
 	status = getaddrinfo(ip.c_str(), std::to_string(port).c_str(), &hints, &servinfo);
 	if (status != 0) {
-		//do_free_addrinfo = false; // Don't call freeaddrinfo in destructor!
+		servinfo = nullptr;
 		throw SocketException(std::string("getaddrinfo error: ") + gai_strerror(status));
 	}
+}
 
-	// Create socket
-	sock_fd = socket(servinfo->ai_family, servinfo->ai_socktype, servinfo->ai_protocol);
+
+void Socket::openSocket(const struct addrinfo *ai) {
+	sock_fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
 	if (sock_fd == -1) {
 		throw SocketException(std::string("Socket error: ") + strerror(errno));
 	}
@@ -97,30 +184,639 @@ Socket::Socket(const SocketDescription &des, std::shared_ptr<IDeMux> idemux_ptr,
 }
 
 
-Socket::~Socket() {
-	if (debug >= 2) {debugOut(2,
-	"destructing " + describeFull()
-	);}	
+void Socket::connectSocket() {
+	// Runs on the link's own thread, so a slow resolver only holds up this link.
+	resolve();
+
+	if (sock_type_c == SOCK_STREAM) {
+		sock_fd = raceConnect();
+	} else {
+		// Connecting a datagram socket only sets the default destination, there's
+		// nothing to race. Take the first address.
+		openSocket(servinfo);
+		if (connect(sock_fd, servinfo->ai_addr, servinfo->ai_addrlen) == -1) {
+			throw SocketException(std::string("connect error: ") + strerror(errno));
+		}
+	}
 
-	freeaddrinfo(servinfo);
-	close(sock_fd);
+	if (debug >= 1) {debugOut(1,
+	"connected to " + ip + ":" + std::to_string(port) + " (" + describeFull() + ")"
+	);}
 }
 
 
-void Socket::connectSocket() {
+int Socket::raceConnect() {
+	// Happy Eyeballs (RFC 8305): try the addresses in turn, alternating between IPv6 and
+	// IPv4, and start the next attempt when the previous one hasn't finished within
+	// ATTEMPT_DELAY. The first connection that succeeds wins.
+	std::vector<const struct addrinfo*> v6, v4, order;
+	for (const struct addrinfo *ai = servinfo; ai != nullptr; ai = ai->ai_next) {
+		(ai->ai_family == AF_INET6 ? v6 : v4).push_back(ai);
+	}
+	for (size_t i = 0; i < std::max(v6.size(), v4.size()); i++) {
+		if (i < v6.size()) {
+			order.push_back(v6[i]);
+		}
+		if (i < v4.size()) {
+			order.push_back(v4[i]);
+		}
+	}
+
+	typedef std::chrono::steady_clock Clock;
+	auto deadline = Clock::now() + CONNECT_TIMEOUT;
+	auto next_attempt = Clock::now();
+	size_t next = 0;
+	std::vector<struct pollfd> pending;
+	std::string last_error = "no addresses";
+	int winner = -1;
+
+	auto closePending = [&pending] () {
+		for (auto it=pending.begin(); it!=pending.end(); it++) {
+			close(it->fd);
+		}
+		pending.clear();
+	};
+
+	while (winner == -1) {
+		auto now = Clock::now();
+
+		// Start the next attempt if it's time, or if there's nothing else to wait for.
+		if (next < order.size() && (now >= next_attempt || pending.empty())) {
+			const struct addrinfo *ai = order[next++];
+			int fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK, ai->ai_protocol);
+			if (fd == -1) {
+				last_error = std::string("Socket error: ") + strerror(errno);
+				continue;
+			}
+			if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+				winner = fd;
+				break;
+			}
+			if (errno != EINPROGRESS) {
+				last_error = std::string("connect error: ") + strerror(errno);
+				close(fd);
+				continue;
+			}
+			struct pollfd pfd;
+			pfd.fd = fd;
+			pfd.events = POLLOUT;
+			pfd.revents = 0;
+			pending.push_back(pfd);
+			next_attempt = now + ATTEMPT_DELAY;
+			continue;
+		}
+
+		if (pending.empty()) {
+			throw SocketException(last_error);
+		}
+		if (now >= deadline) {
+			closePending();
+			throw SocketException("connect error: timed out");
+		}
+
+		auto wake = (next < order.size()) ? std::min(deadline, next_attempt) : deadline;
+		int timeout_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+			wake - now).count() + 1;
+		if (poll(pending.data(), pending.size(), timeout_ms) < 0 && errno != EINTR) {
+			closePending();
+			throw SocketException(std::string("poll error: ") + strerror(errno));
+		}
+
+		for (auto it=pending.begin(); it!=pending.end();) {
+			if (it->revents == 0) {
+				++it;
+				continue;
+			}
+			int error = 0;
+			socklen_t length = sizeof error;
+			getsockopt(it->fd, SOL_SOCKET, SO_ERROR, &error, &length);
+			if (error == 0 && winner == -1) {
+				winner = it->fd;
+			} else {
+				if (error != 0) {
+					last_error = std::string("connect error: ") + strerror(error);
+					next_attempt = Clock::now();	// No use waiting for this one
+				}
+				close(it->fd);
+			}
+			it = pending.erase(it);
+		}
+	}
+	closePending();
+
+	// The receive loops expect a blocking socket.
+	int flags = fcntl(winner, F_GETFL);
+	fcntl(winner, F_SETFL, flags & ~O_NONBLOCK);
+	return winner;
+}
+
+
+void Socket::dropOversize(const Message &message) {
+	LOG_DEBUG(debug, 2, "dropped a {} byte message, {} takes {} at most",
+		Message::HEADER_LENGTH + message.payload_length, describeFull(), getMTU());
+	counters.add(stats::OVERSIZE_DROPS);
+}
+
+
+bool Socket::retuneShaping(const Shaping &shaping) {
+	if (!shaper || shaping.cover_pps > 0) {
+		return false;
+	}
+	shaper->retune(shaping);
+	if (debug >= 1) {debugOut(1,
+	"shaping " + describeFull() + ": " + shaping.describe()
+	);}
+	return true;
+}
+
+
+void Socket::setShaping(const Shaping &shaping) {
+	if (shaping.cover_pps > 0) {
+		cover = std::make_shared<CoverTraffic>(shaping.cover_pps, shaping.cover_size,
+			shaping.queue_ms, send_queue,
+			[this] (Message *message, struct iovec *iov, int count) {
+				this->sendCover(message, iov, count);
+			});
+		// A stream takes messages back to back anyway.
+		cover->setPacking(sock_type_c == SOCK_STREAM);
+		if (debug >= 1) {debugOut(1,
+		"cover traffic on " + describeFull() + ": " + shaping.describe()
+		);}
+		return;
+	}
+	shaper = std::make_shared<Shaper>(shaping, [this] (MessagePtr message) {
+		if (!this->send_queue.enqueue(std::move(message))) {
+			LOG_DEBUG(this->debug, 2, "send queue full, dropped a message for {}",
+				this->describeFull());
+		}
+	});
+	if (debug >= 1) {debugOut(1,
+	"shaping " + describeFull() + ": " + shaping.describe()
+	);}
+}
+
+
+bool Socket::enqueueMessage(MessagePtr message) {
+	uint16_t size = Message::HEADER_LENGTH + message->payload_length;
+	if (size > max_frame || (cover && size > cover->getMTU())) {
+		dropOversize(*message);
+		return false;
+	}
+	if (shaper) {
+		return shaper->submit(std::move(message));
+	}
+	bool accepted = send_queue.enqueue(std::move(message));
+	if (!accepted) {
+		LOG_DEBUG(debug, 2, "send queue full, dropped a message for {}", describeFull());
+	}
+	return accepted;
+}
+
+
+void Socket::sendCover(Message *message, struct iovec *iov, int count) {
+	if (!isReady()) {
+		return;		// UDP server that hasn't heard from its peer yet
+	}
+	size_t bytes = 0;
+	for (int i = 0; i < count; i++) {
+		bytes += iov[i].iov_len;
+	}
+	if (message != nullptr && message->has_timestamp) {
+		latency->tun_to_wire.record(elapsedMicros(message->tun_ns, stats::wallNanos()));
+	}
+	try {
+		sendVector(iov, count);
+	} catch (SocketException &e) {
+		// The receiving side notices dead links, a failed send just loses the frame.
+		counters.add(stats::ERRORS);
+		LOG_DEBUG(debug, 2, "cover traffic send on {} failed: {}", describeFull(), e.what());
+		return;
+	}
+	counters.add(message != nullptr ? stats::PACKETS_OUT : stats::PADDING_OUT);
+	counters.add(stats::BYTES_OUT, bytes);
+}
+
+
+void Socket::startSending() {
+	if (cover) {
+		// The cover traffic's slots pick the frames on the wheel's thread, this thread
+		// sends them.
+		cover->start();
+		cover->run();
+		return;
+	}
+	if (!zero_copy.isEnabled()) {
+		sendLoop();
+	} else {
+		try {
+			sendLoop();
+		} catch (SocketException &e) {
+			zero_copy.finish();
+			throw;
+		}
+		zero_copy.finish();
+	}
+	shutdownSocket();	// Done already, unless it was finishSending()
+}
+
+
+void Socket::sendLoop() {
+	while (true) {
+		MessagePtr message;
+		if (zero_copy.getHeld() == 0) {
+			message = send_queue.dequeue();	// will block until there's a message.
+		} else {
+			// Idle links reap as well, or their messages would stay held.
+			message = send_queue.dequeueUntil(std::chrono::steady_clock::now() +
+				ZeroCopy::IDLE_REAP);
+			if (!message && !send_queue.isClosed()) {
+				zero_copy.reap();
+				continue;
+			}
+		}
+		if (!message) {
+			return;		// Queue was closed
+		}
+		if (message->has_timestamp) {
+			latency->tun_to_wire.record(elapsedMicros(message->tun_ns, stats::wallNanos()));
+		}
+		uint16_t size = Message::HEADER_LENGTH + message->payload_length;
+		if (zero_copy.wants(size)) {
+			sendZeroCopy(std::move(message));
+		} else {
+			sendMessage(*message);
+			if (zero_copy.getHeld() > 0) {
+				zero_copy.reap();	// Or they'd wait for the next big frame
+			}
+		}
+		counters.add(stats::PACKETS_OUT);
+		counters.add(stats::BYTES_OUT, size);
+	}
+}
+
+
+uint64_t elapsedMicros(uint64_t from_ns, uint64_t to_ns) {
+	// A peer's clock that runs ahead of ours would make it negative.
+	return to_ns > from_ns ? (to_ns - from_ns) / 1000 : 0;
+}
+
+
+void Socket::enableTimestamping() {
+	int flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+	if (setsockopt(sock_fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof flags) == -1) {
+		// Not fatal, receive times are then taken in user space.
+		if (debug >= 1) {debugOut(1,
+		std::string("no kernel timestamps on ") + describeFull() + ": " + strerror(errno)
+		);}
+	}
+}
+
+
+void Socket::enableBusyPoll(std::chrono::microseconds idle) {
+	busy_poll.setIdle(idle);
+	int usecs = static_cast<int>(idle.count());
+	int prefer = 1;
+	// Raising SO_BUSY_POLL above net.core.busy_read takes CAP_NET_ADMIN. Spinning in
+	// user space works without.
+	if (setsockopt(sock_fd, SOL_SOCKET, SO_BUSY_POLL, &usecs, sizeof usecs) == -1 ||
+			setsockopt(sock_fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &prefer, sizeof prefer) == -1) {
+		if (debug >= 1) {debugOut(1,
+		std::string("no kernel busy polling on ") + describeFull() + ": " + strerror(errno)
+		);}
+	}
+}
+
+
+void Socket::enableZeroCopy(uint16_t threshold) {
+	if (sock_type_c != SOCK_STREAM) {
+		return;
+	}
+	if (!zero_copy.enable(sock_fd, threshold)) {
+		// Not fatal, the link keeps copying.
+		if (debug >= 1) {debugOut(1,
+		std::string("no zero copy on ") + describeFull() + ": " + strerror(errno)
+		);}
+	}
+}
+
+
+void Socket::enablePathMTU() {
+	if (sock_type_c != SOCK_DGRAM) {
+		return;
+	}
+	struct sockaddr_storage addr;
+	socklen_t length = sizeof addr;
+	if (getsockname(sock_fd, reinterpret_cast<struct sockaddr*>(&addr), &length) == -1) {
+		throw SocketException(std::string("getsockname error: ") + strerror(errno));
+	}
+	// Don't fragment, and ignore what ICMP says about the path: the probes decide.
 	int status;
+	if (addr.ss_family == AF_INET6) {
+		int mode = IPV6_PMTUDISC_PROBE;
+		status = setsockopt(sock_fd, IPPROTO_IPV6, IPV6_MTU_DISCOVER, &mode, sizeof mode);
+	} else {
+		int mode = IP_PMTUDISC_PROBE;
+		status = setsockopt(sock_fd, IPPROTO_IP, IP_MTU_DISCOVER, &mode, sizeof mode);
+	}
+	if (status == -1) {
+		errorOut("no path MTU discovery on " + describeFull() + ": " + strerror(errno));
+		return;
+	}
+	probes_mtu = true;
+}
 
-	status = connect(sock_fd, servinfo->ai_addr, servinfo->ai_addrlen);
-	if (status ==-1) {
-		throw SocketException(std::string("connect error: ") + strerror(errno));
+
+void Socket::probePathMTU(std::chrono::steady_clock::time_point now) {
+	if (!probes_mtu || !isReady()) {
+		return;
 	}
+	uint16_t old_mtu = path_mtu.getMTU();
+	uint16_t size = path_mtu.next(now);
+	if (path_mtu.getMTU() != old_mtu && debug >= 1) {debugOut(1,
+	"path MTU of " + describeFull() + " is " + std::to_string(path_mtu.getMTU())
+	);}
+	if (size == 0) {
+		return;
+	}
+	MessagePtr probe(new Message);
+	control::makeMTUProbe(*probe, control::MTU_PROBE, ++mtu_probe_seq, size);
+	enqueueMessage(std::move(probe));
+}
 
+
+int Socket::getIncomingCPU() {
+	int cpu = -1;
+	socklen_t length = sizeof cpu;
+	if (getsockopt(sock_fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &length) == -1) {
+		return -1;
+	}
+	return cpu;
+}
+
+
+ssize_t Socket::receiveDatagram(Message &msg, struct sockaddr_storage *addr,
+	socklen_t *addr_length) {
+	struct iovec iov;
+	iov.iov_base = msg.buffer;
+	iov.iov_len = Message::BUF_SIZE;
+	char control[CMSG_SPACE(sizeof(struct scm_timestamping))];
+
+	struct msghdr hdr;
+	memset(&hdr, 0, sizeof hdr);
+	hdr.msg_name = addr;
+	hdr.msg_namelen = (addr_length != nullptr) ? *addr_length : 0;
+	hdr.msg_iov = &iov;
+	hdr.msg_iovlen = 1;
+	hdr.msg_control = control;
+	hdr.msg_controllen = sizeof control;
+
+	ssize_t n_read;
+	if (busy_poll.isEnabled()) {
+		n_read = busy_poll.read(sock_fd, [this, &hdr] () {
+			return recvmsg(this->sock_fd, &hdr, MSG_DONTWAIT);
+		});
+	} else {
+		n_read = recvmsg(sock_fd, &hdr, 0);
+	}
+	if (n_read < 0) {
+		return n_read;
+	}
+	if (addr_length != nullptr) {
+		*addr_length = hdr.msg_namelen;
+	}
+	msg.received_ns = 0;
+	for (struct cmsghdr *c = CMSG_FIRSTHDR(&hdr); c != nullptr; c = CMSG_NXTHDR(&hdr, c)) {
+		if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_TIMESTAMPING) {
+			struct scm_timestamping ts;
+			memcpy(&ts, CMSG_DATA(c), sizeof ts);
+			msg.received_ns = static_cast<uint64_t>(ts.ts[0].tv_sec) * 1000000000 +
+				ts.ts[0].tv_nsec;
+		}
+	}
+	return n_read;
+}
+
+
+static uint64_t steadyNanos() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+void Socket::sendHeartbeat() {
+	MessagePtr msg(new Message);
+	control::makeHeartbeat(*msg, control::HEARTBEAT, ++heartbeat_seq, steadyNanos());
+	enqueueMessage(std::move(msg));
+}
+
+
+void Socket::sendHello(uint64_t session_id, uint32_t link_id, uint8_t stream) {
+	this->link_id = link_id;
+	this->stream = stream;
+	this->session_id = session_id;
+	control::Hello hello;
+	hello.session_id = session_id;
+	hello.link_id = link_id;
+	hello.stream = stream;
+	MessagePtr msg(new Message);
+	control::makeHello(*msg, control::HELLO, hello);
+	enqueueMessage(std::move(msg));
+}
+
+
+void Socket::agree(const control::Hello &agreed) {
+	version = agreed.version;
+	features = agreed.features;
+	max_frame = agreed.max_frame;
+	if (cover && sock_type_c != SOCK_STREAM) {
+		cover->setPacking(agreed.features & control::FEATURE_PACKED);
+	}
+	if (probes_mtu && (agreed.features & control::FEATURE_PMTU)) {
+		path_mtu.start(agreed.max_frame);
+	}
 	if (debug >= 1) {debugOut(1,
-	"connected to " + ip + ":" + std::to_string(port)
+	describeFull() + " speaks version " + std::to_string(agreed.version) + ", features " +
+	control::describeFeatures(agreed.features) + ", frames up to " +
+	std::to_string(agreed.max_frame) + " bytes"
+	);}
+}
+
+
+void Socket::deliver(Message &msg) {
+	counters.add(stats::PACKETS_IN);
+	counters.add(stats::BYTES_IN, Message::HEADER_LENGTH + msg.payload_length);
+	msg.parseTrailers();
+	msg.link_id = link_id;
+	msg.stream = stream;
+	if (msg.has_timestamp) {
+		if (msg.received_ns == 0) {
+			msg.received_ns = stats::wallNanos();	// No kernel timestamp for this one
+		}
+		latency->one_way.record(elapsedMicros(msg.tun_ns, msg.received_ns));
+		msg.latency = latency;
+	}
+	if (msg.kind() == Message::CONTROL) {
+		handleControl(msg);
+	} else {
+		idemux_ptr->handleMessage(msg);
+	}
+}
+
+
+void Socket::deliverDatagram(Message &msg, ssize_t n_read) {
+	ssize_t offset = Message::HEADER_LENGTH + msg.payload_length;
+	uint64_t received_ns = msg.received_ns;
+	deliver(msg);
+
+	while (n_read - offset >= Message::HEADER_LENGTH) {
+		const char *rest = msg.buffer + offset;
+		uint16_t payload_length;
+		memcpy(&payload_length, rest, sizeof payload_length);
+		payload_length = ntohs(payload_length);
+		if (offset + Message::HEADER_LENGTH + payload_length > n_read) {
+			LOG_DEBUG(debug, 2, "packed msg states payload={} bytes, but the datagram ends",
+				payload_length);
+			counters.add(stats::ERRORS);
+			return;
+		}
+		offset += Message::HEADER_LENGTH + payload_length;
+		// Padding is what usually follows, and isn't worth copying.
+		if ((rest[2] & ~Message::FLAGS) == Message::CONTROL && payload_length > 0 &&
+				rest[3] == control::PADDING) {
+			continue;
+		}
+		Message packed;
+		memcpy(packed.buffer, rest, Message::HEADER_LENGTH + payload_length);
+		packed.parseHeader();
+		packed.received_ns = received_ns;
+		deliver(packed);
+	}
+}
+
+
+void Socket::handleControl(Message &msg) {
+	uint32_t seq;
+	uint64_t sent_ns;
+	switch (control::kind(msg)) {
+		case control::HEARTBEAT: {
+			if (!control::parseHeartbeat(msg, seq, sent_ns)) {
+				break;
+			}
+			MessagePtr ack(new Message);
+			control::makeHeartbeat(*ack, control::HEARTBEAT_ACK, seq, sent_ns);
+			enqueueMessage(std::move(ack));
+			return;
+		}
+		case control::HEARTBEAT_ACK: {
+			if (!control::parseHeartbeat(msg, seq, sent_ns)) {
+				break;
+			}
+			// sent_ns is our own clock, echoed by the peer.
+			std::chrono::nanoseconds rtt(steadyNanos() - sent_ns);
+			if (health.onAck(std::chrono::steady_clock::now(), rtt)) {
+				if (debug >= 1) {debugOut(1,
+				describeFull() + " is " + linkState2String(health.getState())
+				);}
+				// The peer may have restarted while the link was down.
+				if (session_id != 0 && health.getState() == LinkState::PROBING) {
+					sendHello(session_id, link_id, stream);
+				}
+			}
+			LOG_DEBUG(debug, 3, "heartbeat {} rtt={}us on {}", seq, rtt.count() / 1000,
+				describeFull());
+			return;
+		}
+		case control::PADDING:
+			return;
+		case control::MTU_PROBE: {
+			uint16_t size;
+			if (!control::parseMTUProbe(msg, seq, size)) {
+				break;
+			}
+			// What actually came in counts, not what the probe says.
+			MessagePtr ack(new Message);
+			control::makeMTUProbe(*ack, control::MTU_PROBE_ACK, seq,
+				Message::HEADER_LENGTH + msg.payload_length);
+			enqueueMessage(std::move(ack));
+			return;
+		}
+		case control::MTU_PROBE_ACK: {
+			uint16_t size;
+			if (!control::parseMTUProbe(msg, seq, size)) {
+				break;
+			}
+			LOG_DEBUG(debug, 3, "mtu probe {} of {} bytes acked on {}", seq, size,
+				describeFull());
+			if (path_mtu.onAck(size) && debug >= 1) {debugOut(1,
+			"path MTU of " + describeFull() + " is " + std::to_string(path_mtu.getMTU())
+			);}
+			return;
+		}
+		case control::HELLO: {
+			control::Hello hello;
+			if (!control::parseHello(msg, hello)) {
+				break;
+			}
+			link_id = hello.link_id;
+			stream = hello.stream;
+			if (debug >= 1) {debugOut(1,
+			std::string("hello for link ") + std::to_string(link_id) + " stream " +
+			std::to_string(stream) + " of session " + std::to_string(hello.session_id) +
+			" on " + describeFull()
+			);}
+			if (hello_handler) {
+				hello_handler(*this, hello.session_id, link_id, stream);
+			}
+			control::Hello agreed = control::Hello().agree(hello);
+			// The ack goes out under the old terms, the peer may not have them yet.
+			MessagePtr ack(new Message);
+			control::makeHello(*ack, control::HELLO_ACK, agreed);
+			enqueueMessage(std::move(ack));
+			agree(agreed);
+			return;
+		}
+		case control::HELLO_ACK: {
+			control::Hello hello;
+			if (!control::parseHello(msg, hello)) {
+				break;
+			}
+			if (debug >= 1) {debugOut(1,
+			std::string("session ") + std::to_string(hello.session_id) + " resumed on link " +
+			std::to_string(hello.link_id) + " (" + describeFull() + ")"
+			);}
+			// Agreed by the server already, but never take more than we have.
+			agree(control::Hello().agree(hello));
+			return;
+		}
+	}
+	if (debug >= 2) {debugOut(2,
+	std::string("ignoring unknown or malformed control message on ") + describeFull()
 	);}
 }
 
 
+void Socket::shutdownSocket() {
+	// Wakes up the threads blocking on the socket. The fd itself is closed by the
+	// destructor, so nobody ends up using a recycled fd.
+	shut_down = true;
+	send_queue.close();
+	if (cover) {
+		cover->stop();		// Its frames are sent by the sending thread
+	}
+	shutdown(sock_fd, SHUT_RDWR);
+}
+
+
+void Socket::finishSending() {
+	if (cover) {
+		// The slots pad whatever the queue holds, it would never run dry.
+		shutdownSocket();
+		return;
+	}
+	send_queue.closeWhenEmpty();
+}
+
+
 std::string Socket::describe() {
 	std::string s(socketType2String(type) + ":" + ip + ":" + std::to_string(port));
 	return s;
@@ -149,19 +845,38 @@ void ClientUDPSocket::startReceiving() {
 		// because the buffer we provide is too smal (is detectable) or because of some
 		// system signal interrupting. In any case, the output always starts at the beginning
 		// of a datagram.
-		n_read = recv(sock_fd, msg.buffer, Message::BUF_SIZE, 0);
+		n_read = receiveDatagram(msg, nullptr, nullptr);
+		if (shut_down) {
+			return;
+		}
+		if (n_read < 0) {
+			// A connected UDP socket reports ICMP errors of earlier sends here, for
+			// instance when the server isn't up yet. Those don't make the link dead.
+			if (errno == ECONNREFUSED) {
+				counters.add(stats::ERRORS);
+				continue;
+			}
+			if (errno == EINTR) {
+				continue;
+			}
+			throw SocketException(std::string("Read error: ") + strerror(errno));
+		}
+		if (n_read < Message::HEADER_LENGTH) {
+			continue;
+		}
 		
 		msg.parseHeader();	// Read the header and put them in the message's fields.
 
-		if (debug >= 2 && msg.payload_length+3 > n_read) {debugOut(2,
-		std::string("msg states payload=" + std::to_string(msg.payload_length)) + "bytes, but couldn't read it all"
-		);}
+		if (msg.payload_length + Message::HEADER_LENGTH > n_read) {
+			LOG_DEBUG(debug, 2, "msg states payload={} bytes, but couldn't read it all",
+				msg.payload_length);
+			counters.add(stats::ERRORS);
+			continue;
+		}
 
-		if (debug >= 3) {debugOut(3,
-		std::string("read " + std::to_string(msg.payload_length + 3) + " bytes from " + describeFull())
-		);}
+		LOG_DEBUG(debug, 3, "read {} bytes from {}", msg.payload_length + 3, describeFull());
 
-		idemux_ptr->handleMessage(msg);	
+		deliverDatagram(msg, n_read);
 	}
 }
 
@@ -175,25 +890,41 @@ void ClientUDPSocket::sendMessage(Message &message) {
 	// In that case, try again.
 	while (left > 0) {
 		n_written = send(sock_fd, buf, left, 0);
-		if (n_written < 0) {
+		counters.add(stats::SEND_CALLS);
+		if (n_written < 0 && errno == EMSGSIZE) {
+			dropOversize(message);
+			return;
+		} else if (n_written < 0) {
 			throw SocketException(std::string("Write error: ") + strerror(errno));
 		} else {
 			left -= n_written;
 			buf += n_written;
 		}
 	}
-	if (debug >= 3) {debugOut(3,
-	std::string("wrote ") + std::to_string(n_written) + " bytes into " + describeFull()
-	);};
+	LOG_DEBUG(debug, 3, "wrote {} bytes into {}", n_written, describeFull());
 }
 
 
+void ClientUDPSocket::sendVector(struct iovec *iov, int count) {
+	struct msghdr hdr;
+	memset(&hdr, 0, sizeof hdr);
+	hdr.msg_iov = iov;
+	hdr.msg_iovlen = count;
+	counters.add(stats::SEND_CALLS);
+	if (sendmsg(sock_fd, &hdr, 0) < 0) {
+		throw SocketException(std::string("Write error: ") + strerror(errno));
+	}
+}
+
 ServerUDPSocket::ServerUDPSocket(const SocketDescription &des, 
 	std::shared_ptr<IDeMux> idemux_ptr, int debug) 
 	  : Socket(des, idemux_ptr, SOCK_DGRAM, debug) {
 
 	int status;
 
+	resolve();
+	openSocket(servinfo);
+
 	// Bind to port
 	status = bind(sock_fd, servinfo->ai_addr, servinfo->ai_addrlen);
 	if (status == -1) {
@@ -220,20 +951,19 @@ void ServerUDPSocket::startReceiving() {
 		// system signal interrupting. In any case, the output always starts at the beginning
 		// of a datagram. The last thing is also the reason we don't loop to "read it all".
 		struct sockaddr_storage addr;
-		n_read = recvfrom(sock_fd, msg.buffer, Message::BUF_SIZE, 0, 
-			(struct sockaddr*)&addr, &peer_addr_length);
+		socklen_t addr_length = sizeof addr;
+		n_read = receiveDatagram(msg, &addr, &addr_length);
+		if (shut_down) {
+			return;
+		}
+		if (n_read < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			throw SocketException(std::string("Read error: ") + strerror(errno));
+		}
 		if (!knows_peer) {
-			peer_addr = addr;
-			/*
-			switch (addr.ss_family) {
-				case AF_INET:
-					peer_addr_length = sizeof sockaddr_in;
-					break;
-				case AF_INET6:
-					peer_addr_length = sizeof sockaddr_in6;
-					break;
-			}*/
-			knows_peer = true;
+			setPeer(addr, addr_length);
 		}
 
 		if (n_read < Message::HEADER_LENGTH) {
@@ -244,19 +974,39 @@ void ServerUDPSocket::startReceiving() {
 
 		msg.parseHeader();	// Read the header and put them in the message's fields.
 
-		if (debug >= 2 && msg.payload_length+3 > n_read) {debugOut(2,
-		std::string("msg states payload=" + std::to_string(msg.payload_length)) + "bytes, but couldn't read it all"
-		);}
+		notePeer(addr, addr_length, msg);
 
-		if (debug >= 3) {debugOut(3,
-		std::string("read " + std::to_string(msg.payload_length + 3) + " bytes from " + describeFull())
-		);}
+		if (msg.payload_length + Message::HEADER_LENGTH > n_read) {
+			LOG_DEBUG(debug, 2, "msg states payload={} bytes, but couldn't read it all",
+				msg.payload_length);
+			counters.add(stats::ERRORS);
+			continue;
+		}
+
+		LOG_DEBUG(debug, 3, "read {} bytes from {}", msg.payload_length + 3, describeFull());
+
+		deliverDatagram(msg, n_read);
+	}
+}
 
-		idemux_ptr->handleMessage(msg);	
+
+void ServerUDPSocket::notePeer(const struct sockaddr_storage &addr, socklen_t addr_length,
+	const Message &msg) {
+	// A reconnected client comes from a new port. Its hello tells us to follow it.
+	if (!knows_peer || (msg.kind() == Message::CONTROL && control::kind(msg) == control::HELLO)) {
+		setPeer(addr, addr_length);
 	}
 }
 
 
+void ServerUDPSocket::setPeer(const struct sockaddr_storage &addr, socklen_t addr_length) {
+	std::lock_guard<std::mutex> lock(peer_mutex);
+	peer_addr = addr;
+	peer_addr_length = addr_length;
+	knows_peer = true;
+}
+
+
 void ServerUDPSocket::sendMessage(Message &message) {
 	int n_written;
 	int left = Message::HEADER_LENGTH + message.payload_length;
@@ -265,17 +1015,238 @@ void ServerUDPSocket::sendMessage(Message &message) {
 	// write might return less than the number we told it to send.
 	// In that case, try again.
 	while (left > 0) {
-		n_written = sendto(sock_fd, buf, left, 0, (sockaddr*)&peer_addr, peer_addr_length);
-		if (n_written < 0) {
+		{
+			std::lock_guard<std::mutex> lock(peer_mutex);
+			n_written = sendto(sock_fd, buf, left, 0, (sockaddr*)&peer_addr, peer_addr_length);
+		}
+		counters.add(stats::SEND_CALLS);
+		if (n_written < 0 && errno == EMSGSIZE) {
+			dropOversize(message);
+			return;
+		} else if (n_written < 0) {
 			throw SocketException(std::string("Write error: ") + strerror(errno));
 		} else {
 			left -= n_written;
 			buf += n_written;
 		}
 	}
-	if (debug >= 3) {debugOut(3,
-	std::string("wrote ") + std::to_string(n_written) + " bytes into " + describeFull()
-	);};
+	LOG_DEBUG(debug, 3, "wrote {} bytes into {}", n_written, describeFull());
+}
+
+
+void ServerUDPSocket::sendVector(struct iovec *iov, int count) {
+	struct msghdr hdr;
+	memset(&hdr, 0, sizeof hdr);
+	hdr.msg_iov = iov;
+	hdr.msg_iovlen = count;
+	ssize_t n_written;
+	{
+		std::lock_guard<std::mutex> lock(peer_mutex);
+		hdr.msg_name = &peer_addr;
+		hdr.msg_namelen = peer_addr_length;
+		n_written = sendmsg(sock_fd, &hdr, 0);
+	}
+	counters.add(stats::SEND_CALLS);
+	if (n_written < 0) {
+		throw SocketException(std::string("Write error: ") + strerror(errno));
+	}
+}
+
+static struct sockaddr_un unixAddress(const std::string &path) {
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof addr);
+	addr.sun_family = AF_UNIX;
+	if (path.empty() || path.size() >= sizeof addr.sun_path) {
+		throw SocketException("invalid Unix socket path: " + path);
+	}
+	memcpy(addr.sun_path, path.c_str(), path.size());
+	return addr;
+}
+
+
+UnixSocket::UnixSocket(const SocketDescription &des, int sock_fd,
+	std::shared_ptr<IDeMux> idemux_ptr, int debug)
+	  : Socket(des, sock_fd, idemux_ptr, SOCK_SEQPACKET, debug) {}
+
+
+UnixSocket::UnixSocket(const SocketDescription &des,
+	std::shared_ptr<IDeMux> idemux_ptr, int debug)
+	  : Socket(des, idemux_ptr, SOCK_SEQPACKET, debug) {}
+
+
+void UnixSocket::connectSocket() {
+	struct sockaddr_un addr = unixAddress(ip);
+	sock_fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+	if (sock_fd == -1) {
+		throw SocketException(std::string("Socket error: ") + strerror(errno));
+	}
+	if (connect(sock_fd, (struct sockaddr*)&addr, sizeof addr) == -1) {
+		throw SocketException(std::string("connect error: ") + strerror(errno));
+	}
+
+	if (debug >= 1) {debugOut(1,
+	"connected to " + ip + " (" + describeFull() + ")"
+	);}
+}
+
+
+void UnixSocket::startReceiving() {
+	ssize_t n_read;
+	while (true) {
+		Message msg;
+		// A message per read, like UDP. Unlike UDP, 0 bytes means the peer is gone.
+		n_read = receiveDatagram(msg, nullptr, nullptr);
+		if (shut_down) {
+			return;
+		}
+		if (n_read == 0) {
+			throw SocketException(std::string("Socket was closed"));
+		}
+		if (n_read < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			throw SocketException(std::string("Read error: ") + strerror(errno));
+		}
+		if (n_read < Message::HEADER_LENGTH) {
+			continue;
+		}
+
+		msg.parseHeader();
+
+		if (msg.payload_length + Message::HEADER_LENGTH > n_read) {
+			LOG_DEBUG(debug, 2, "msg states payload={} bytes, but couldn't read it all",
+				msg.payload_length);
+			counters.add(stats::ERRORS);
+			continue;
+		}
+
+		LOG_DEBUG(debug, 3, "read {} bytes from {}", msg.payload_length + 3, describeFull());
+
+		deliverDatagram(msg, n_read);
+	}
+}
+
+
+void UnixSocket::sendMessage(Message &message) {
+	int size = Message::HEADER_LENGTH + message.payload_length;
+	// Sends all of it or nothing. MSG_NOSIGNAL: a closed peer is an error, not SIGPIPE.
+	ssize_t n_written = send(sock_fd, message.buffer, size, MSG_NOSIGNAL);
+	counters.add(stats::SEND_CALLS);
+	if (n_written < 0 && errno == EMSGSIZE) {
+		dropOversize(message);
+		return;
+	} else if (n_written < 0) {
+		throw SocketException(std::string("Write error: ") + strerror(errno));
+	}
+	LOG_DEBUG(debug, 3, "wrote {} bytes into {}", size, describeFull());
+}
+
+
+void UnixSocket::sendVector(struct iovec *iov, int count) {
+	struct msghdr hdr;
+	memset(&hdr, 0, sizeof hdr);
+	hdr.msg_iov = iov;
+	hdr.msg_iovlen = count;
+	counters.add(stats::SEND_CALLS);
+	if (sendmsg(sock_fd, &hdr, MSG_NOSIGNAL) < 0) {
+		throw SocketException(std::string("Write error: ") + strerror(errno));
+	}
+}
+
+
+ShmSocket::ShmSocket(const SocketDescription &des, int sock_fd,
+	std::shared_ptr<IDeMux> idemux_ptr, int debug)
+	  : UnixSocket(des, sock_fd, idemux_ptr, debug) {
+	// The client sends the channel right after connecting. Don't let one that doesn't
+	// keep the receiving thread waiting.
+	struct timeval timeout = {static_cast<time_t>(CONNECT_TIMEOUT.count()), 0};
+	setsockopt(sock_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+}
+
+
+ShmSocket::ShmSocket(const SocketDescription &des,
+	std::shared_ptr<IDeMux> idemux_ptr, int debug)
+	  : UnixSocket(des, idemux_ptr, debug) {}
+
+
+void ShmSocket::connectSocket() {
+	UnixSocket::connectSocket();
+	try {
+		channel = ShmChannel::create(sock_fd);
+	} catch (ShmException &e) {
+		throw SocketException(e.what());
+	}
+	has_channel = true;
+}
+
+
+void ShmSocket::startReceiving() {
+	if (!has_channel) {
+		// Accepted. Received here rather than on the listening thread, which a slow
+		// client would hold up.
+		try {
+			channel = ShmChannel::receive(sock_fd);
+		} catch (ShmException &e) {
+			throw SocketException(e.what());
+		}
+		has_channel = true;
+	}
+	ShmRing &in = channel->getIn();
+	while (!shut_down) {
+		Message msg;
+		ssize_t n_read = in.pop(msg.buffer, Message::BUF_SIZE);
+		if (n_read < 0) {
+			// Empty. The Unix socket becomes readable when either side shuts the link down.
+			if (!in.wait(sock_fd) && !shut_down) {
+				throw SocketException(std::string("Socket was closed"));
+			}
+			continue;
+		}
+		if (n_read < Message::HEADER_LENGTH) {
+			continue;
+		}
+		msg.received_ns = 0;	// No kernel timestamps, taken on delivery
+		msg.parseHeader();
+
+		if (msg.payload_length + Message::HEADER_LENGTH > n_read) {
+			LOG_DEBUG(debug, 2, "msg states payload={} bytes, but couldn't read it all",
+				msg.payload_length);
+			counters.add(stats::ERRORS);
+			continue;
+		}
+
+		LOG_DEBUG(debug, 3, "read {} bytes from {}", msg.payload_length + 3, describeFull());
+
+		deliverDatagram(msg, n_read);
+	}
+}
+
+
+void ShmSocket::sendMessage(Message &message) {
+	struct iovec iov = {message.buffer,
+		static_cast<size_t>(Message::HEADER_LENGTH + message.payload_length)};
+	ShmSocket::sendVector(&iov, 1);
+}
+
+
+void ShmSocket::sendVector(struct iovec *iov, int count) {
+	if (!has_channel) {
+		LOG_DEBUG(debug, 2, "dropped a message for {}, it has no channel yet", describeFull());
+		return;
+	}
+	bool open;
+	try {
+		open = channel->getOut().push(iov, count, sock_fd);
+	} catch (ShmException &e) {
+		LOG_DEBUG(debug, 2, "dropped a message for {}: {}", describeFull(), e.what());
+		counters.add(stats::OVERSIZE_DROPS);
+		return;
+	}
+	if (!open) {
+		throw SocketException(std::string("Socket was closed"));
+	}
+	LOG_DEBUG(debug, 3, "wrote a message into {} through shared memory", describeFull());
 }
 
 
@@ -289,6 +1260,12 @@ TCPSocket::TCPSocket(const SocketDescription &des,
 	  : Socket(des, idemux_ptr, SOCK_STREAM, debug) {}
 
 
+bool TCPSocket::getTCPInfo(struct tcp_info &info) {
+	socklen_t length = sizeof info;
+	return !shut_down && getsockopt(sock_fd, IPPROTO_TCP, TCP_INFO, &info, &length) == 0;
+}
+
+
 void TCPSocket::startReceiving() {
 	int n_read;
 	while (true) {
@@ -296,14 +1273,17 @@ void TCPSocket::startReceiving() {
 		// First read the "header'" which states how many bytes follow.
 		n_read = readAll(msg.buffer, Message::HEADER_LENGTH);
 		msg.parseHeader();
+		if (msg.payload_length > Message::PAYLOAD_SIZE) {
+			// Can't resync on a stream, the link is useless from here on.
+			throw SocketException(std::string("message too large: ") +
+				std::to_string(msg.payload_length) + " bytes");
+		}
 
 		n_read = readAll(msg.payload, msg.payload_length);
 
-		if (debug >= 3) {debugOut(3,
-		std::string("read " + std::to_string(msg.payload_length + 3) + " bytes from " + describeFull())
-		);}
+		LOG_DEBUG(debug, 3, "read {} bytes from {}", msg.payload_length + 3, describeFull());
 
-		idemux_ptr->handleMessage(msg);	
+		deliver(msg);
 		//nWrite = writeAll(tun_fd, buffer, n_read);
 
 		if (debug) {
@@ -322,6 +1302,7 @@ void TCPSocket::sendMessage(Message &message) {
 	// In that case, try again.
 	while (left > 0) {
 		n_written = write(sock_fd, buf, left);
+		counters.add(stats::SEND_CALLS);
 		if (n_written < 0) {
 			throw SocketException(std::string("Write error: ") + strerror(errno));
 		} else {
@@ -329,19 +1310,63 @@ void TCPSocket::sendMessage(Message &message) {
 			buf += n_written;
 		}
 	}
-	if (debug >= 3) {debugOut(3,
-	std::string("wrote ") + std::to_string(n_written) + " bytes into " + describeFull()
-	);};
+	LOG_DEBUG(debug, 3, "wrote {} bytes into {}", n_written, describeFull());
+}
+
+
+void TCPSocket::sendZeroCopy(MessagePtr message) {
+	int size = Message::HEADER_LENGTH + message->payload_length;
+	int left = size;
+	char *buf = message->buffer;
+	while (left > 0) {
+		ssize_t n_written = zero_copy.send(buf, left);
+		counters.add(stats::SEND_CALLS);
+		if (n_written < 0) {
+			int error = errno;
+			zero_copy.hold(std::move(message));	// What went out already may still be in use
+			throw SocketException(std::string("Write error: ") + strerror(error));
+		}
+		left -= n_written;
+		buf += n_written;
+	}
+	zero_copy.hold(std::move(message));
+	LOG_DEBUG(debug, 3, "wrote {} bytes zero copy into {}", size, describeFull());
 }
 
 
+void TCPSocket::sendVector(struct iovec *iov, int count) {
+	// writev() may write less than all of it too. Skip what went out and try again.
+	while (count > 0) {
+		ssize_t n_written = writev(sock_fd, iov, count);
+		counters.add(stats::SEND_CALLS);
+		if (n_written < 0) {
+			throw SocketException(std::string("Write error: ") + strerror(errno));
+		}
+		while (count > 0 && static_cast<size_t>(n_written) >= iov->iov_len) {
+			n_written -= iov->iov_len;
+			++iov;
+			--count;
+		}
+		if (count > 0) {
+			iov->iov_base = static_cast<char*>(iov->iov_base) + n_written;
+			iov->iov_len -= n_written;
+		}
+	}
+}
+
 int TCPSocket::readAll(char *buf, int n) {
 	int n_read, left = n;
 
 	// read might return less than the number we told it to send.
 	// In that case, try again.
 	while (left > 0) {
-		n_read = read(sock_fd, buf, left);
+		if (busy_poll.isEnabled()) {
+			n_read = busy_poll.read(sock_fd, [this, buf, left] () {
+				return recv(this->sock_fd, buf, left, MSG_DONTWAIT);
+			});
+		} else {
+			n_read = read(sock_fd, buf, left);
+		}
 		if (n_read == 0) {
 			throw SocketException(std::string("Socket was closed"));
 		} else if (n_read == -1) {
@@ -357,19 +1382,29 @@ int TCPSocket::readAll(char *buf, int n) {
 
 ServerTCPSocket::ServerTCPSocket(const SocketDescription &des, 
 	std::shared_ptr<IDeMux> idemux_ptr, int debug) : 
-	type(des.type), ip(des.ip), port(des.port), idemux_ptr(idemux_ptr), debug(debug) {
-	
+	type(des.type), ip(des.ip), port(des.port), impairment(des.impairment),
+	shaping(des.shaping), weight(des.weight),
+	idemux_ptr(idemux_ptr), debug(debug) {
+
+	if (isLocal(type)) {
+		listenLocal();
+		return;
+	}
+
 	int status;
 	struct addrinfo hints;
 
 	memset(&hints, 0, sizeof hints);	// Empty struct
 	hints.ai_family = AF_UNSPEC;		// Don't care about IPv4 or IPv6
-	int sock_type;
+	int sock_type = 0;
 	switch (type) {
 		case SocketType::UDP:
+		case SocketType::XDP:
 			sock_type = SOCK_DGRAM;
 			break;
 		case SocketType::TCP:
+		case SocketType::UNIX:
+		case SocketType::SHM:
 			sock_type = SOCK_STREAM;
 			break;
 	}
@@ -395,6 +1430,12 @@ ServerTCPSocket::ServerTCPSocket(const SocketDescription &des,
 	"created " + describeFull()
 	);}
 
+	// Lets a restarted server bind while connections of the previous run are in TIME_WAIT.
+	int yes = 1;
+	if (setsockopt(sock_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof yes) == -1) {
+		throw SocketException(std::string("setsockopt error: ") + strerror(errno));
+	}
+
 	// Bind to port
 	status = bind(sock_fd, servinfo->ai_addr, servinfo->ai_addrlen);
 	if (status == -1) {
@@ -419,10 +1460,70 @@ ServerTCPSocket::ServerTCPSocket(const SocketDescription &des,
 }
 
 
+ServerTCPSocket::~ServerTCPSocket() {
+	if (sock_fd == -1) {
+		return;
+	}
+	close(sock_fd);
+	if (isLocal(type)) {
+		unlink(ip.c_str());
+	}
+}
+
+
+void ServerTCPSocket::listenLocal() {
+	struct sockaddr_un addr = unixAddress(ip);
+	sock_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK, 0);
+	if (sock_fd == -1) {
+		throw SocketException(std::string("Socket error: ") + strerror(errno));
+	}
+
+	// Left behind by a previous run, there's no SO_REUSEADDR for paths.
+	struct stat st;
+	if (lstat(ip.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) {
+		unlink(ip.c_str());
+	}
+	if (bind(sock_fd, (struct sockaddr*)&addr, sizeof addr) == -1) {
+		throw SocketException(std::string("bind error: ") + strerror(errno));
+	}
+	if (listen(sock_fd, 1) == -1) {
+		throw SocketException(std::string("listen error: ") + strerror(errno));
+	}
+
+	if (debug >= 1) {debugOut(1,
+	std::string("started listening on ") + describeFull()
+	);}
+}
+
+
 std::shared_ptr<Socket> ServerTCPSocket::acceptPeerConnection() {
 	/**
 	 * 	Takes the memory address of a dummy socket object and stuffs a new one in there.
 	 */
+	if (isLocal(type)) {
+		int connection_fd = accept(sock_fd, nullptr, nullptr);
+		if (connection_fd == -1) {
+			throw SocketException(std::string("accept error: ") + strerror(errno));
+		}
+		// Local peers have no address, number their connections instead.
+		SocketDescription des = {
+			.type=type,
+			.ip=ip,
+			.port=++accepted,
+			.impairment=impairment,
+			.shaping=shaping,
+			.weight=weight};
+
+		if (debug >= 1) {debugOut(1,
+		std::string("got incoming connnection ") + std::to_string(des.port) + " on " + ip
+		);}
+
+		if (type == SocketType::SHM) {
+			return makeSocket<ShmSocket>(des, connection_fd, idemux_ptr, debug);
+		}
+		return makeSocket<UnixSocket>(des, connection_fd, idemux_ptr, debug);
+	}
+
 	struct sockaddr client_addr;		// Keeps connected client's address info
 	int connection_fd;
 	
@@ -442,11 +1543,19 @@ std::shared_ptr<Socket> ServerTCPSocket::acceptPeerConnection() {
 	SocketDescription des = {
 		.type=type, 
 		.ip=sockaddr2IP(&client_addr), 
-		.port=sockaddr2Port(&client_addr)};
+		.port=sockaddr2Port(&client_addr),
+		.impairment=impairment,
+		.shaping=shaping,
+		.weight=weight};
+
+	return makeSocket<TCPSocket>(des, connection_fd, idemux_ptr, debug);
+}
+
 
-	std::shared_ptr<Socket> socket_ptr(
-	new TCPSocket(des, connection_fd, idemux_ptr, debug));
-	return socket_ptr;
+void ServerTCPSocket::retune(const SocketDescription &des) {
+	impairment = des.impairment;
+	shaping = des.shaping;
+	weight = des.weight;
 }
 
 
@@ -0,0 +1,260 @@
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <sstream>
+
+#include "socket.h"
+#include "stats.h"
+#include "util.h"
+
+
+const int stats::Counters::SIZE;
+const int stats::Histogram::SUB_BUCKETS;
+const int stats::Histogram::SUB_BITS;
+const int stats::Histogram::BUCKETS;
+
+
+namespace {
+
+	const size_t CACHE_LINE = 64;
+	const int REQUEST_TIMEOUT_MS = 100;
+
+	std::string escapeLabel(const std::string &value) {
+		std::string escaped;
+		for (char c : value) {
+			switch (c) {
+				case '\\':
+					escaped += "\\\\";
+					break;
+				case '"':
+					escaped += "\\\"";
+					break;
+				case '\n':
+					escaped += "\\n";
+					break;
+				default:
+					escaped += c;
+			}
+		}
+		return escaped;
+	}
+
+
+	void writeAll(int fd, const std::string &data) {
+		const char *buf = data.data();
+		size_t left = data.size();
+		while (left > 0) {
+			ssize_t n_written = send(fd, buf, left, MSG_NOSIGNAL);
+			if (n_written < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+				return;		// The scraper went away, nothing to do about it.
+			}
+			left -= n_written;
+			buf += n_written;
+		}
+	}
+
+}
+
+
+stats::Counters::Counters() :
+	memory(new char[sizeof(Slot) * ReaderSlots::SLOTS + CACHE_LINE]) {
+
+	// C++14's new doesn't honour alignas beyond the fundamental alignment, so align
+	// by hand.
+	static_assert(sizeof(Slot) == CACHE_LINE, "a slot should fill exactly one cache line");
+	uintptr_t address = reinterpret_cast<uintptr_t>(memory.get());
+	address = (address + CACHE_LINE - 1) & ~(CACHE_LINE - 1);
+	slots = reinterpret_cast<Slot*>(address);
+	for (int i = 0; i < ReaderSlots::SLOTS; i++) {
+		new (&slots[i]) Slot();
+		for (int c = 0; c < SIZE; c++) {
+			slots[i].values[c].store(0, std::memory_order_relaxed);
+		}
+	}
+}
+
+
+uint64_t stats::Counters::get(int counter) const {
+	uint64_t sum = 0;
+	for (int i = 0; i < ReaderSlots::SLOTS; i++) {
+		sum += slots[i].values[counter].load(std::memory_order_relaxed);
+	}
+	return sum;
+}
+
+
+stats::Histogram::Histogram() {
+	for (int i = 0; i < BUCKETS; i++) {
+		buckets[i].store(0, std::memory_order_relaxed);
+	}
+}
+
+
+uint64_t stats::Histogram::upperBound(int bucket) {
+	if (bucket < SUB_BUCKETS) {
+		return bucket;
+	}
+	int shift = (bucket - SUB_BUCKETS) / SUB_BUCKETS;
+	uint64_t sub = (bucket - SUB_BUCKETS) % SUB_BUCKETS;
+	return ((SUB_BUCKETS + sub + 1) << shift) - 1;
+}
+
+
+uint64_t stats::Histogram::percentile(double q) const {
+	uint64_t total = getCount();
+	if (total == 0) {
+		return 0;
+	}
+	// The rank of the value we're after, 1 based.
+	uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(q * total)));
+	uint64_t seen = 0;
+	for (int i = 0; i < BUCKETS; i++) {
+		seen += buckets[i].load(std::memory_order_relaxed);
+		if (seen >= rank) {
+			return upperBound(i);
+		}
+	}
+	// Recording raced with us; the count is ahead of the buckets.
+	return upperBound(BUCKETS - 1);
+}
+
+
+void stats::Writer::header(const std::string &name, const std::string &type,
+	const std::string &help) {
+	out << "# HELP " << name << " " << help << "\n"
+		<< "# TYPE " << name << " " << type << "\n";
+}
+
+
+void stats::Writer::sample(const std::string &name, const Labels &labels, uint64_t value) {
+	out << name;
+	if (labels.size() > 0) {
+		out << "{";
+		bool first = true;
+		for (auto it=labels.begin(); it!=labels.end(); it++) {
+			out << (first ? "" : ",") << it->first << "=\"" << escapeLabel(it->second) << "\"";
+			first = false;
+		}
+		out << "}";
+	}
+	out << " " << value << "\n";
+}
+
+
+void stats::Writer::summary(const std::string &name, const Labels &labels,
+	const Histogram &histogram) {
+	const char *quantiles[] = {"0.5", "0.99", "0.999"};
+	for (const char *quantile : quantiles) {
+		Labels with_quantile(labels);
+		with_quantile.push_back({"quantile", quantile});
+		sample(name, with_quantile, histogram.percentile(atof(quantile)));
+	}
+	sample(name + "_sum", labels, histogram.getSum());
+	sample(name + "_count", labels, histogram.getCount());
+}
+
+
+stats::Server::Server(const std::string &path, Renderer render, int debug) :
+	path(path), render(render), debug(debug) {
+
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof addr);
+	addr.sun_family = AF_UNIX;
+	if (path.size() >= sizeof addr.sun_path) {
+		throw SocketException(std::string("stats socket path too long: ") + path);
+	}
+	strncpy(addr.sun_path, path.c_str(), sizeof addr.sun_path - 1);
+
+	sock_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock_fd == -1) {
+		throw SocketException(std::string("Socket error: ") + strerror(errno));
+	}
+	// A socket file left behind by an earlier run would make bind fail.
+	unlink(path.c_str());
+	if (bind(sock_fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof addr) == -1) {
+		close(sock_fd);
+		throw SocketException(std::string("bind error: ") + strerror(errno));
+	}
+	if (listen(sock_fd, 8) == -1) {
+		close(sock_fd);
+		throw SocketException(std::string("listen error: ") + strerror(errno));
+	}
+
+	if (debug >= 1) {debugOut(1,
+	std::string("serving stats on ") + path
+	);}
+}
+
+
+stats::Server::~Server() {
+	shutdown(sock_fd, SHUT_RDWR);
+	if (serve_t.joinable()) {
+		serve_t.join();
+	}
+	close(sock_fd);
+	unlink(path.c_str());
+}
+
+
+void stats::Server::start() {
+	serve_t = std::thread([this] () {this->serveLoop();});
+}
+
+
+void stats::Server::serveLoop() {
+	while (true) {
+		int fd = accept(sock_fd, nullptr, nullptr);
+		if (fd == -1) {
+			if (errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+			if (debug >= 1) {debugOut(1,
+			std::string("stats socket closed: ") + strerror(errno)
+			);}
+			return;
+		}
+		serve(fd);
+		close(fd);
+	}
+}
+
+
+void stats::Server::serve(int fd) {
+	// An HTTP client sends its request first, a plain reader sends nothing. Don't wait
+	// long for it.
+	char request[512];
+	ssize_t n_read = 0;
+	struct pollfd pfd;
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, REQUEST_TIMEOUT_MS) > 0) {
+		n_read = recv(fd, request, sizeof request, 0);
+	}
+	bool http = n_read >= 4 && strncmp(request, "GET ", 4) == 0;
+
+	std::ostringstream body;
+	Writer writer(body);
+	render(writer);
+
+	if (http) {
+		std::string text = body.str();
+		writeAll(fd, std::string("HTTP/1.0 200 OK\r\n") +
+			"Content-Type: text/plain; version=0.0.4\r\n" +
+			"Content-Length: " + std::to_string(text.size()) + "\r\n" +
+			"Connection: close\r\n\r\n" + text);
+	} else {
+		writeAll(fd, body.str());
+	}
+}
@@ -0,0 +1,541 @@
+#include <string.h>
+#include <arpa/inet.h>
+
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+#include <thread>
+
+#include "packet.h"
+#include "trace.h"
+
+
+const size_t TraceReplayer::STAMP_LENGTH;
+const int TraceReplayer::MAX_COPIES;
+constexpr std::chrono::milliseconds TraceReplayer::LATE;
+const size_t ReplayMeter::FLOW_BUCKETS;
+
+
+namespace {
+
+	const uint32_t PCAP_MAGIC_US = 0xA1B2C3D4;
+	const uint32_t PCAP_MAGIC_NS = 0xA1B23C4D;
+	const size_t PCAP_HEADER = 24;
+	const size_t PCAP_RECORD = 16;
+
+	// pcapng block types and options, see draft-ietf-opsawg-pcapng
+	const uint32_t SECTION_HEADER_BLOCK = 0x0A0D0D0A;
+	const uint32_t INTERFACE_DESCRIPTION_BLOCK = 0x00000001;
+	const uint32_t SIMPLE_PACKET_BLOCK = 0x00000003;
+	const uint32_t ENHANCED_PACKET_BLOCK = 0x00000006;
+	const uint32_t BYTE_ORDER_MAGIC = 0x1A2B3C4D;
+	const uint16_t OPT_ENDOFOPT = 0;
+	const uint16_t IF_TSRESOL = 9;
+	const uint16_t IF_TSOFFSET = 14;
+	const uint16_t EPB_FLAGS = 2;
+	const uint32_t EPB_DIRECTION = 0x3;
+	const uint32_t EPB_INBOUND = 0x1;
+	const uint32_t EPB_OUTBOUND = 0x2;
+
+	const int LINKTYPE_NULL = 0;			// BSD loopback, 4 byte address family
+	const int LINKTYPE_ETHERNET = 1;
+	const int LINKTYPE_RAW = 101;
+	const int LINKTYPE_LINUX_SLL = 113;
+	const int LINKTYPE_IPV4 = 228;
+	const int LINKTYPE_IPV6 = 229;
+	const int LINKTYPE_LINUX_SLL2 = 276;
+
+	const uint16_t ETHERTYPE_IPV4 = 0x0800;
+	const uint16_t ETHERTYPE_IPV6 = 0x86DD;
+	const uint16_t ETHERTYPE_VLAN = 0x8100;
+	const uint16_t ETHERTYPE_QINQ = 0x88A8;
+
+	const uint8_t PROTO_ICMP = 1;
+	const uint8_t PROTO_TCP = 6;
+	const uint8_t PROTO_UDP = 17;
+	const uint8_t PROTO_ICMPV6 = 58;
+
+	size_t pad4(size_t n) {
+		return (n + 3) & ~static_cast<size_t>(3);
+	}
+
+	uint16_t read16be(const char *p) {
+		uint16_t value;
+		memcpy(&value, p, sizeof value);
+		return ntohs(value);
+	}
+
+	uint64_t steadyNanos() {
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+
+	/**
+		Reads the numbers of a capture file in its byte order.
+	*/
+	struct Reader {
+		const std::vector<char> &file;
+		bool swapped = false;
+
+		Reader(const std::vector<char> &file) : file(file) {}
+
+		bool has(size_t offset, size_t length) const {
+			return offset <= file.size() && length <= file.size() - offset;
+		}
+		uint16_t u16(size_t offset) const {
+			uint16_t value;
+			memcpy(&value, file.data() + offset, sizeof value);
+			return swapped ? __builtin_bswap16(value) : value;
+		}
+		uint32_t u32(size_t offset) const {
+			uint32_t value;
+			memcpy(&value, file.data() + offset, sizeof value);
+			return swapped ? __builtin_bswap32(value) : value;
+		}
+		uint64_t u64(size_t offset) const {
+			return (static_cast<uint64_t>(u32(offset)) << 32) | u32(offset + 4);
+		}
+	};
+
+
+	/**
+		A pcapng interface: how its packets are framed and timed.
+	*/
+	struct Interface {
+		int link_type;
+		uint32_t snap_length;
+		uint64_t units = 1000000;		// Timestamp units per second, microseconds by default
+		int64_t offset_s = 0;
+
+		uint64_t toNanos(uint64_t ts) const {
+			unsigned __int128 ns = static_cast<unsigned __int128>(ts) * 1000000000 / units;
+			return static_cast<uint64_t>(ns) + offset_s * 1000000000;
+		}
+	};
+
+
+	void fixIPv4Checksum(char *ip) {
+		size_t header_length = (ip[0] & 0x0F) * 4;
+		ip[10] = 0;
+		ip[11] = 0;
+		uint32_t sum = 0;
+		for (size_t i = 0; i < header_length; i += 2) {
+			sum += read16be(ip + i);
+		}
+		while (sum >> 16) {
+			sum = (sum & 0xFFFF) + (sum >> 16);
+		}
+		uint16_t checksum = htons(static_cast<uint16_t>(~sum));
+		memcpy(ip + 10, &checksum, sizeof checksum);
+	}
+
+	void addToAddress(char *address, uint32_t n) {
+		uint32_t value;
+		memcpy(&value, address, sizeof value);
+		value = htonl(ntohl(value) + n);
+		memcpy(address, &value, sizeof value);
+	}
+
+}
+
+
+Trace Trace::load(const std::string &path, Direction direction) {
+	std::ifstream in(path, std::ios::binary);
+	if (!in) {
+		throw TraceException("can't open trace " + path);
+	}
+	std::vector<char> file((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+	if (in.bad()) {
+		throw TraceException("can't read trace " + path);
+	}
+
+	Trace trace;
+	Reader reader(file);
+	if (!reader.has(0, 4)) {
+		throw TraceException("trace too short: " + path);
+	}
+	if (reader.u32(0) == SECTION_HEADER_BLOCK) {
+		trace.loadPcapng(file, direction);
+	} else {
+		trace.loadPcap(file);
+	}
+
+	// Snapshots of a Capture and merged files aren't necessarily in time order.
+	std::stable_sort(trace.packets.begin(), trace.packets.end(),
+		[] (const Packet &a, const Packet &b) {return a.ns < b.ns;});
+	if (!trace.packets.empty()) {
+		uint64_t first = trace.packets.front().ns;
+		for (Packet &packet : trace.packets) {
+			packet.ns -= first;
+		}
+	}
+	return trace;
+}
+
+
+void Trace::loadPcap(const std::vector<char> &file) {
+	Reader reader(file);
+	if (!reader.has(0, PCAP_HEADER)) {
+		throw TraceException("not a pcap or pcapng file");
+	}
+	uint32_t magic = reader.u32(0);
+	if (magic == __builtin_bswap32(PCAP_MAGIC_US) || magic == __builtin_bswap32(PCAP_MAGIC_NS)) {
+		reader.swapped = true;
+		magic = __builtin_bswap32(magic);
+	}
+	if (magic != PCAP_MAGIC_US && magic != PCAP_MAGIC_NS) {
+		throw TraceException("not a pcap or pcapng file");
+	}
+	uint64_t frac_ns = (magic == PCAP_MAGIC_NS) ? 1 : 1000;
+	int link_type = reader.u32(20) & 0xFFFF;	// The upper bits are about the FCS
+
+	size_t offset = PCAP_HEADER;
+	while (reader.has(offset, PCAP_RECORD)) {
+		uint64_t ns = reader.u32(offset) * 1000000000ULL + reader.u32(offset + 4) * frac_ns;
+		uint32_t captured = reader.u32(offset + 8);
+		uint32_t length = reader.u32(offset + 12);
+		offset += PCAP_RECORD;
+		if (!reader.has(offset, captured)) {
+			break;		// Cut short, still being written
+		}
+		add(ns, link_type, file.data() + offset, captured, length);
+		offset += captured;
+	}
+}
+
+
+void Trace::loadPcapng(const std::vector<char> &file, Direction direction) {
+	Reader reader(file);
+	std::vector<Interface> interfaces;
+	uint64_t last_ns = 0;
+
+	size_t offset = 0;
+	while (reader.has(offset, 12)) {
+		uint32_t type = reader.u32(offset);
+		if (type == SECTION_HEADER_BLOCK) {
+			// Every section has its own byte order and interfaces.
+			reader.swapped = false;
+			uint32_t magic = reader.u32(offset + 8);
+			if (magic == __builtin_bswap32(BYTE_ORDER_MAGIC)) {
+				reader.swapped = true;
+			} else if (magic != BYTE_ORDER_MAGIC) {
+				throw TraceException("bad pcapng byte order magic");
+			}
+			interfaces.clear();
+		}
+		uint32_t block_length = reader.u32(offset + 4);
+		if (block_length < 12 || block_length % 4 != 0) {
+			throw TraceException("bad pcapng block length at " + std::to_string(offset));
+		}
+		if (!reader.has(offset, block_length)) {
+			break;		// Cut short, still being written
+		}
+		size_t end = offset + block_length - 4;		// Where the options end
+
+		if (type == INTERFACE_DESCRIPTION_BLOCK && block_length >= 20) {
+			Interface interface;
+			interface.link_type = reader.u16(offset + 8);
+			interface.snap_length = reader.u32(offset + 12);
+			for (size_t option = offset + 16; option + 4 <= end; ) {
+				uint16_t code = reader.u16(option);
+				uint16_t option_length = reader.u16(option + 2);
+				if (code == OPT_ENDOFOPT || option + 4 + option_length > end) {
+					break;
+				}
+				if (code == IF_TSRESOL && option_length >= 1) {
+					uint8_t resolution = static_cast<uint8_t>(file[option + 4]);
+					if (resolution & 0x80) {
+						if ((resolution & 0x7F) > 63) {
+							throw TraceException("unsupported pcapng timestamp resolution");
+						}
+						interface.units = 1ULL << (resolution & 0x7F);
+					} else {
+						if (resolution > 19) {
+							throw TraceException("unsupported pcapng timestamp resolution");
+						}
+						interface.units = 1;
+						for (int i = 0; i < resolution; i++) {
+							interface.units *= 10;
+						}
+					}
+				} else if (code == IF_TSOFFSET && option_length >= 8) {
+					interface.offset_s = static_cast<int64_t>(reader.u64(option + 4));
+				}
+				option += 4 + pad4(option_length);
+			}
+			interfaces.push_back(interface);
+
+		} else if (type == ENHANCED_PACKET_BLOCK && block_length >= 32) {
+			uint32_t id = reader.u32(offset + 8);
+			if (id >= interfaces.size()) {
+				throw TraceException("pcapng packet of an undescribed interface");
+			}
+			const Interface &interface = interfaces[id];
+			uint64_t ns = interface.toNanos(reader.u64(offset + 12));
+			uint32_t captured = reader.u32(offset + 20);
+			uint32_t length = reader.u32(offset + 24);
+			size_t data = offset + 28;
+			if (captured > end - data) {
+				throw TraceException("bad pcapng packet length at " + std::to_string(offset));
+			}
+
+			uint32_t flags = 0;
+			for (size_t option = data + pad4(captured); option + 4 <= end; ) {
+				uint16_t code = reader.u16(option);
+				uint16_t option_length = reader.u16(option + 2);
+				if (code == OPT_ENDOFOPT || option + 4 + option_length > end) {
+					break;
+				}
+				if (code == EPB_FLAGS && option_length >= 4) {
+					flags = reader.u32(option + 4);
+				}
+				option += 4 + pad4(option_length);
+			}
+			uint32_t packet_direction = flags & EPB_DIRECTION;
+			last_ns = ns;
+			if ((direction == INBOUND && packet_direction == EPB_OUTBOUND) ||
+					(direction == OUTBOUND && packet_direction == EPB_INBOUND)) {
+				offset += block_length;
+				continue;
+			}
+			add(ns, interface.link_type, file.data() + data, captured, length);
+
+		} else if (type == SIMPLE_PACKET_BLOCK && block_length >= 16) {
+			// No timestamp, it goes with the packet before it.
+			if (interfaces.empty()) {
+				throw TraceException("pcapng packet of an undescribed interface");
+			}
+			const Interface &interface = interfaces[0];
+			uint32_t length = reader.u32(offset + 8);
+			size_t data = offset + 12;
+			size_t captured = std::min<size_t>(length, end - data);
+			if (interface.snap_length > 0) {
+				captured = std::min<size_t>(captured, interface.snap_length);
+			}
+			add(last_ns, interface.link_type, file.data() + data, captured, length);
+		}
+		// Other blocks (name resolution, statistics, local ones) don't matter here.
+		offset += block_length;
+	}
+}
+
+
+void Trace::add(uint64_t ns, int link_type, const char *frame, size_t captured,
+	size_t length) {
+
+	if (captured < length) {
+		++skipped;		// Cut short by the snap length
+		return;
+	}
+
+	size_t header = 0;
+	switch (link_type) {
+		case LINKTYPE_RAW:
+		case LINKTYPE_IPV4:
+		case LINKTYPE_IPV6:
+			break;
+		case LINKTYPE_NULL:
+			header = 4;
+			break;
+		case LINKTYPE_ETHERNET: {
+			header = 14;
+			if (captured < header) {
+				++skipped;
+				return;
+			}
+			uint16_t ethertype = read16be(frame + 12);
+			while ((ethertype == ETHERTYPE_VLAN || ethertype == ETHERTYPE_QINQ) &&
+					captured >= header + 4) {
+				ethertype = read16be(frame + header + 2);
+				header += 4;
+			}
+			if (ethertype != ETHERTYPE_IPV4 && ethertype != ETHERTYPE_IPV6) {
+				++skipped;
+				return;
+			}
+			break;
+		}
+		case LINKTYPE_LINUX_SLL:
+			header = 16;
+			break;
+		case LINKTYPE_LINUX_SLL2:
+			header = 20;
+			break;
+		default:
+			++skipped;
+			return;
+	}
+	if (captured < header + 20) {
+		++skipped;
+		return;
+	}
+	const char *ip = frame + header;
+	size_t ip_length = captured - header;
+
+	// The IP header knows best, Ethernet pads short frames.
+	size_t total;
+	uint8_t version = static_cast<uint8_t>(ip[0]) >> 4;
+	if (version == 4) {
+		total = read16be(ip + 2);
+	} else if (version == 6 && ip_length >= 40) {
+		total = 40 + read16be(ip + 4);
+	} else {
+		++skipped;
+		return;
+	}
+	if (total < 20 || total > ip_length ||
+			total > Message::PAYLOAD_SIZE - Message::TRAILER_SPACE) {
+		++skipped;
+		return;
+	}
+
+	packets.push_back({ns, bytes.size(), static_cast<uint16_t>(total)});
+	bytes.insert(bytes.end(), ip, ip + total);
+}
+
+
+TraceReplayer::TraceReplayer(std::shared_ptr<MemoryDevice> device, const Trace &trace,
+	double speed, int copies) : device(device), trace(trace), speed(std::max(speed, 0.0)),
+	copies(std::min(std::max(copies, 1), MAX_COPIES)), packet(Message::PAYLOAD_SIZE) {}
+
+
+size_t TraceReplayer::stampOffset(const char *pkt, size_t len) {
+	if (len < 20) {
+		return 0;
+	}
+	uint8_t version = static_cast<uint8_t>(pkt[0]) >> 4;
+	uint8_t proto;
+	size_t l4;
+	if (version == 4) {
+		l4 = (pkt[0] & 0x0F) * 4;
+		// Only first fragments have a transport header, and only unfragmented packets
+		// carry all of the payload.
+		if (l4 < 20 || (read16be(pkt + 6) & 0x3FFF) != 0) {
+			return 0;
+		}
+		proto = static_cast<uint8_t>(pkt[9]);
+	} else if (version == 6 && len >= 40) {
+		l4 = 40;
+		proto = static_cast<uint8_t>(pkt[6]);	// Extension headers aren't followed
+	} else {
+		return 0;
+	}
+
+	size_t header;
+	if (proto == PROTO_TCP) {
+		if (len < l4 + 20) {
+			return 0;
+		}
+		header = (static_cast<uint8_t>(pkt[l4 + 12]) >> 4) * 4;
+	} else if (proto == PROTO_UDP || proto == PROTO_ICMP || proto == PROTO_ICMPV6) {
+		header = 8;
+	} else {
+		return 0;
+	}
+	size_t offset = l4 + header;
+	return (offset + STAMP_LENGTH <= len) ? offset : 0;
+}
+
+
+void TraceReplayer::inject(size_t i, int copy) {
+	size_t len = trace.length(i);
+	char *pkt = packet.data();
+	memcpy(pkt, trace.data(i), len);
+
+	if (copy > 0) {
+		if ((static_cast<uint8_t>(pkt[0]) >> 4) == 4) {
+			addToAddress(pkt + 12, copy);
+			fixIPv4Checksum(pkt);
+		} else {
+			addToAddress(pkt + 20, copy);	// The last 32 bits of the IPv6 source
+		}
+	}
+	size_t stamp = stampOffset(pkt, len);
+	if (stamp != 0) {
+		uint64_t now = steadyNanos();
+		memcpy(pkt + stamp, &now, sizeof now);
+	}
+
+	while (!device->inject(pkt, len)) {
+		++refused;
+		if (speed > 0) {
+			return;		// Dropped, as a tun would
+		}
+		// The IMux is behind, give it the CPU rather than spinning on the lock.
+		std::this_thread::yield();
+	}
+	++sent;
+	sent_bytes += len;
+}
+
+
+void TraceReplayer::run(int loops) {
+	size_t n = trace.size();
+	if (n == 0) {
+		return;
+	}
+	uint64_t duration = trace.getDuration();
+	uint64_t loop_ns = duration + (n > 1 ? duration / (n - 1) : 0);
+
+	auto start = std::chrono::steady_clock::now();
+	for (int loop = 0; loop < loops; loop++) {
+		for (size_t i = 0; i < n; i++) {
+			if (speed > 0) {
+				auto due = start + std::chrono::nanoseconds(static_cast<int64_t>(
+					(loop * loop_ns + trace.timeOf(i)) / speed));
+				auto now = std::chrono::steady_clock::now();
+				if (due > now) {
+					std::this_thread::sleep_until(due);
+				} else if (now - due > LATE) {
+					++late;
+				}
+			}
+			for (int copy = 0; copy < copies; copy++) {
+				inject(i, copy);
+			}
+		}
+	}
+}
+
+
+void ReplayMeter::start() {
+	since_ns = steadyNanos();
+}
+
+
+void ReplayMeter::onPacket(const char *pkt, size_t len) {
+	uint64_t since = since_ns.load(std::memory_order_relaxed);
+	if (since == UINT64_MAX) {
+		return;
+	}
+	size_t offset = TraceReplayer::stampOffset(pkt, len);
+	if (offset == 0) {
+		packets.fetch_add(1, std::memory_order_relaxed);
+		bytes.fetch_add(len, std::memory_order_relaxed);
+		return;
+	}
+
+	uint64_t stamp;
+	memcpy(&stamp, pkt + offset, sizeof stamp);
+	if (stamp < since) {
+		return;		// Injected before the meter started
+	}
+	uint64_t now = steadyNanos();
+	latency.record(now > stamp ? now - stamp : 0);
+	packets.fetch_add(1, std::memory_order_relaxed);
+	bytes.fetch_add(len, std::memory_order_relaxed);
+	stamped.fetch_add(1, std::memory_order_relaxed);
+
+	// Packets of a flow are stamped in the order they're injected.
+	std::atomic<uint64_t> &latest = latest_stamp[packet::flowHash(pkt, len) % FLOW_BUCKETS];
+	uint64_t seen = latest.load(std::memory_order_relaxed);
+	while (stamp > seen) {
+		if (latest.compare_exchange_weak(seen, stamp, std::memory_order_relaxed)) {
+			return;
+		}
+	}
+	if (stamp < seen) {
+		reordered.fetch_add(1, std::memory_order_relaxed);
+	}
+}
@@ -0,0 +1,149 @@
+#include <string.h>
+#include <arpa/inet.h>
+
+#include <algorithm>
+#include <thread>
+
+#include "traffic.h"
+
+
+const size_t TrafficGenerator::HEADER_LENGTH;
+const size_t TrafficGenerator::MIN_SIZE;
+const int TrafficGenerator::MAX_FLOWS;
+
+
+namespace {
+
+	const uint16_t SOURCE_PORT = 40000;		// Plus the flow
+	const uint16_t DESTINATION_PORT = 9;	// Discard
+	const uint8_t PROTO_UDP = 17;
+
+	uint64_t steadyNanos() {
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	void write16(char *p, uint16_t value) {
+		value = htons(value);
+		memcpy(p, &value, sizeof value);
+	}
+
+	uint16_t read16(const char *p) {
+		uint16_t value;
+		memcpy(&value, p, sizeof value);
+		return ntohs(value);
+	}
+
+	// Host byte order, both ends are the same process (or at least the same machine).
+	void write64(char *p, uint64_t value) {
+		memcpy(p, &value, sizeof value);
+	}
+
+	uint64_t read64(const char *p) {
+		uint64_t value;
+		memcpy(&value, p, sizeof value);
+		return value;
+	}
+
+}
+
+
+TrafficGenerator::TrafficGenerator(std::shared_ptr<MemoryDevice> device, size_t size,
+	int flows, uint64_t rate_pps) : device(device),
+	packet(std::max(size, MIN_SIZE)), flows(std::min(std::max(flows, 1), MAX_FLOWS)),
+	next_seq(this->flows, 1), rate_pps(rate_pps) {
+
+	// The addresses and lengths never change, the ports and the data do.
+	char *ip = packet.data();
+	ip[0] = 0x45;				// Version 4, 20 byte header
+	write16(ip + 2, static_cast<uint16_t>(packet.size()));
+	ip[8] = 64;					// TTL
+	ip[9] = PROTO_UDP;
+	ip[12] = 10; ip[13] = 0; ip[14] = 0; ip[15] = 1;
+	ip[16] = 10; ip[17] = 0; ip[18] = 0; ip[19] = 2;
+	write16(ip + 22, DESTINATION_PORT);
+	write16(ip + 24, static_cast<uint16_t>(packet.size() - 20));
+}
+
+
+void TrafficGenerator::build(int flow) {
+	char *ip = packet.data();
+	write16(ip + 20, static_cast<uint16_t>(SOURCE_PORT + flow));
+	write64(ip + HEADER_LENGTH, next_seq[flow]);
+	write64(ip + HEADER_LENGTH + 8, steadyNanos());
+}
+
+
+void TrafficGenerator::run(std::chrono::steady_clock::duration duration) {
+	auto start = std::chrono::steady_clock::now();
+	auto end = start + duration;
+	uint64_t n = 0;		// Packets offered
+	while (true) {
+		auto now = std::chrono::steady_clock::now();
+		if (now >= end) {
+			break;
+		}
+		if (rate_pps > 0) {
+			// Paced: wait for this packet's turn.
+			auto due = start + std::chrono::nanoseconds(n * 1000000000 / rate_pps);
+			if (due > now) {
+				std::this_thread::sleep_until(due);
+			}
+		}
+		int flow = n % flows;
+		build(flow);
+		if (device->inject(packet.data(), packet.size())) {
+			++sent;
+			++next_seq[flow];
+			++n;
+		} else {
+			++refused;
+			if (rate_pps == 0) {
+				// The IMux is behind, give it the CPU rather than spinning on the lock.
+				std::this_thread::yield();
+			} else {
+				++n;
+			}
+		}
+	}
+}
+
+
+bool TrafficGenerator::parse(const char *pkt, size_t len, int &flow, uint64_t &seq,
+	uint64_t &sent_ns) {
+	if (len < MIN_SIZE || static_cast<uint8_t>(pkt[0]) != 0x45 ||
+			static_cast<uint8_t>(pkt[9]) != PROTO_UDP || read16(pkt + 22) != DESTINATION_PORT) {
+		return false;
+	}
+	flow = read16(pkt + 20) - SOURCE_PORT;
+	if (flow < 0 || flow >= MAX_FLOWS) {
+		return false;
+	}
+	seq = read64(pkt + HEADER_LENGTH);
+	sent_ns = read64(pkt + HEADER_LENGTH + 8);
+	return true;
+}
+
+
+void TrafficMeter::onPacket(const char *pkt, size_t len) {
+	int flow;
+	uint64_t seq, sent_ns;
+	if (!TrafficGenerator::parse(pkt, len, flow, seq, sent_ns) || sent_ns < since_ns) {
+		return;
+	}
+	uint64_t now = steadyNanos();
+	latency.record(now > sent_ns ? now - sent_ns : 0);
+	packets.fetch_add(1, std::memory_order_relaxed);
+	bytes.fetch_add(len, std::memory_order_relaxed);
+
+	std::atomic<uint64_t> &highest_seq = this->highest_seq[flow];
+	uint64_t highest = highest_seq.load(std::memory_order_relaxed);
+	while (seq > highest) {
+		if (highest_seq.compare_exchange_weak(highest, seq, std::memory_order_relaxed)) {
+			return;
+		}
+	}
+	if (seq < highest) {
+		reordered.fetch_add(1, std::memory_order_relaxed);
+	}
+}
@@ -21,6 +21,7 @@
 #include <cstring>
 #include <netinet/in.h>
 #include <algorithm>
+#include <poll.h>
 
 #include "tun.h"
 #include "queue.h"
@@ -135,9 +136,7 @@ void Tun::writeMessage(Message &msg) {
 		int n_written;
 		n_written = writeAll(msg.payload, msg.payload_length);
 
-		if (debug >= 3) {debugOut(3,
-		std::string("wrote ") + std::to_string(n_written) + " bytes into " + describeFull()
-		);}
+		LOG_DEBUG(debug, 3, "wrote {} bytes into {}", n_written, describeFull());
 	}
 	catch (TunException &e) {	
 		errorOut(e.what());
@@ -158,7 +157,14 @@ void Tun::receive(Message &msg) {
 	int n_read;
 	msg.setType(Message::DATA);
 	// msg.start_payload points to the location where the payload is supposed to be.
-	n_read = read(tun_fd, msg.payload, msg.PAYLOAD_SIZE);
+	// Leaves room for the trailers IMux adds.
+	if (busy_poll.isEnabled()) {
+		n_read = busy_poll.read(tun_fd, [this, &msg] () {
+			return read(this->tun_fd, msg.payload, Message::PAYLOAD_SIZE - Message::TRAILER_SPACE);
+		});
+	} else {
+		n_read = read(tun_fd, msg.payload, Message::PAYLOAD_SIZE - Message::TRAILER_SPACE);
+	}
 
 	if (n_read < 0) {
 		throw TunException(std::string("tun error: ") + strerror(errno)); 
@@ -166,8 +172,52 @@ void Tun::receive(Message &msg) {
 
 	msg.setSize(n_read);
 
-	if (debug >= 3) {debugOut(3,
-	std::string("read ") + std::to_string(n_read) + " bytes from " + if_name
+	LOG_DEBUG(debug, 3, "read {} bytes from {}", n_read, if_name);
+}
+
+
+bool Tun::tryReceive(Message &msg) {
+	/**
+	 *	Like receive(), but returns false instead of blocking when there's nothing to read.
+	 */
+	struct pollfd pfd = {.fd=tun_fd, .events=POLLIN, .revents=0};
+	if (poll(&pfd, 1, 0) <= 0 || !(pfd.revents & POLLIN)) {
+		return false;
+	}
+	receive(msg);
+	return true;
+}
+
+
+void Tun::enableBusyPoll(std::chrono::microseconds idle) {
+	// Blocking is up to the BusyPoll from now on. Writes to a tun never block anyway.
+	int flags = fcntl(tun_fd, F_GETFL);
+	if (flags == -1 || fcntl(tun_fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+		throw TunException(std::string("can't make the tun non-blocking: ") + strerror(errno));
+	}
+	busy_poll.setIdle(idle);
+}
+
+
+void Tun::setMTU(int mtu) {
+	struct ifreq ifr;
+	memset(&ifr, 0, sizeof(ifr));
+	strncpy(ifr.ifr_name, if_name.c_str(), IFNAMSIZ - 1);
+	ifr.ifr_mtu = mtu;
+	// Interface ioctls go through any socket.
+	int fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (fd == -1) {
+		throw TunException(std::string("can't set the MTU: socket(): ") + strerror(errno));
+	}
+	int status = ioctl(fd, SIOCSIFMTU, &ifr);
+	int error = errno;
+	close(fd);
+	if (status == -1) {
+		throw TunException("can't set the MTU of " + if_name + " to " + std::to_string(mtu) +
+			": " + strerror(error));
+	}
+	if (debug >= 1) {debugOut(1,
+	"set the MTU of " + if_name + " to " + std::to_string(mtu)
 	);}
 }
 
@@ -0,0 +1,116 @@
+#include <algorithm>
+#include <iterator>
+
+#include "wheel.h"
+
+
+constexpr std::chrono::microseconds TimerWheel::TICK;
+const size_t TimerWheel::SLOTS;
+
+
+TimerWheel::TimerWheel() : slots(SLOTS), start(Clock::now()) {
+	thread = std::thread([this] () {this->run();});
+}
+
+
+TimerWheel::~TimerWheel() {
+	stop();
+}
+
+
+TimerWheel &TimerWheel::shared() {
+	static TimerWheel wheel;
+	return wheel;
+}
+
+
+void TimerWheel::stop() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopped = true;
+	}
+	wake_up.notify_all();
+	if (thread.joinable() && thread.get_id() != std::this_thread::get_id()) {
+		thread.join();
+	}
+}
+
+
+uint64_t TimerWheel::tickOf(Clock::time_point when) {
+	if (when <= start) {
+		return 0;
+	}
+	return (when - start) / TICK;
+}
+
+
+void TimerWheel::schedule(Clock::time_point when, Callback callback) {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (stopped) {
+			return;
+		}
+		if (pending == 0) {
+			// The thread stopped moving through the slots while idle. They're all
+			// empty, so skip them instead of having it walk them one by one.
+			uint64_t now_tick = tickOf(Clock::now());
+			if (now_tick > current_tick + 1) {
+				current_tick = now_tick - 1;
+			}
+		}
+		// Never behind the tick that's being worked on, or it would wait a whole turn.
+		uint64_t tick = std::max(tickOf(when), current_tick + 1);
+		slots[tick % SLOTS].push_back({when, std::move(callback)});
+		++pending;
+	}
+	wake_up.notify_one();
+}
+
+
+uint64_t TimerWheel::nextBusyTick() {
+	for (uint64_t tick = current_tick + 1; tick < current_tick + SLOTS; tick++) {
+		if (!slots[tick % SLOTS].empty()) {
+			return tick;
+		}
+	}
+	return current_tick + SLOTS;
+}
+
+
+void TimerWheel::run() {
+	std::vector<Timer> due;
+	std::unique_lock<std::mutex> lock(mutex);
+	while (!stopped) {
+		if (pending == 0) {
+			wake_up.wait(lock, [this] () {return stopped || pending > 0;});
+			continue;
+		}
+
+		// Catch up with the clock, one slot at a time.
+		uint64_t now_tick = tickOf(Clock::now());
+		if (current_tick >= now_tick) {
+			wake_up.wait_until(lock, start + nextBusyTick() * TICK);
+			continue;
+		}
+		++current_tick;
+		Clock::time_point tick_end = start + (current_tick + 1) * TICK;
+		std::vector<Timer> &slot = slots[current_tick % SLOTS];
+		auto later = std::stable_partition(slot.begin(), slot.end(),
+			[tick_end] (const Timer &timer) {return timer.when < tick_end;});
+		std::move(slot.begin(), later, std::back_inserter(due));
+		slot.erase(slot.begin(), later);
+		if (due.empty()) {
+			continue;
+		}
+		pending -= due.size();
+
+		std::stable_sort(due.begin(), due.end(),
+			[] (const Timer &a, const Timer &b) {return a.when < b.when;});
+		lock.unlock();
+		for (auto it=due.begin(); it!=due.end(); it++) {
+			it->callback();
+		}
+		due.clear();
+		lock.lock();
+	}
+}
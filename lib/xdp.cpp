@@ -0,0 +1,551 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <ifaddrs.h>
+#include <linux/if_ether.h>
+#include <linux/bpf.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+#include <net/if.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "xdp.h"
+
+
+const uint32_t XSK::FRAME_SIZE;
+const uint32_t XSK::NUM_FRAMES;
+const uint32_t XSK::RING_SIZE;
+const uint16_t XSK::HEADERS_LENGTH;
+const uint32_t XSK::KICK_BATCH;
+
+
+namespace {
+
+	const uint16_t ETHERNET_LENGTH = 14;
+	const uint16_t IP_LENGTH = 20;
+	const uint16_t UDP_LENGTH = 8;
+
+	long bpf(int cmd, union bpf_attr &attr) {
+		return syscall(__NR_bpf, cmd, &attr, sizeof attr);
+	}
+
+	/**
+		Builds a BPF program. Jumps go to labels that may come later.
+	*/
+	class Assembler {
+	public:
+		void add(uint8_t code, uint8_t dst, uint8_t src, int16_t off, int32_t imm) {
+			struct bpf_insn insn = {};
+			insn.code = code;
+			insn.dst_reg = dst;
+			insn.src_reg = src;
+			insn.off = off;
+			insn.imm = imm;
+			insns.push_back(insn);
+		}
+		void jumpTo(int label, uint8_t code, uint8_t dst, uint8_t src, int32_t imm) {
+			jumps.push_back({insns.size(), label});
+			add(code, dst, src, 0, imm);
+		}
+		void mark(int label) {
+			if (labels.size() <= static_cast<size_t>(label)) {
+				labels.resize(label + 1);
+			}
+			labels[label] = insns.size();
+		}
+		std::vector<struct bpf_insn> &finish() {
+			for (auto it=jumps.begin(); it!=jumps.end(); it++) {
+				insns[it->first].off = labels[it->second] - it->first - 1;
+			}
+			return insns;
+		}
+	private:
+		std::vector<struct bpf_insn> insns;
+		std::vector<std::pair<size_t, int>> jumps;
+		std::vector<size_t> labels;
+	};
+
+	/**
+		Ones' complement sum, as the IP and UDP checksums take it.
+	*/
+	uint32_t sum16(const char *data, size_t length, uint32_t sum=0) {
+		for (; length > 1; data += 2, length -= 2) {
+			uint16_t word;
+			memcpy(&word, data, 2);
+			sum += word;
+		}
+		if (length == 1) {
+			uint16_t word = 0;
+			memcpy(&word, data, 1);
+			sum += word;
+		}
+		return sum;
+	}
+
+	uint16_t fold(uint32_t sum) {
+		while (sum >> 16) {
+			sum = (sum & 0xffff) + (sum >> 16);
+		}
+		return static_cast<uint16_t>(~sum);
+	}
+
+}
+
+
+XSK::XSK(const struct sockaddr_in &local, int debug) : debug(debug) {
+	if (local.sin_addr.s_addr == htonl(INADDR_ANY)) {
+		throw XDPException("needs a specific address, not " + std::string(inet_ntoa(local.sin_addr)));
+	}
+	try {
+		if_index = findInterface(local);
+
+		// The UMEM, and the rings to pass its frames back and forth.
+		umem = static_cast<char*>(mmap(nullptr, static_cast<size_t>(NUM_FRAMES) * FRAME_SIZE,
+			PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+		if (umem == MAP_FAILED) {
+			umem = nullptr;
+			throw XDPException(std::string("UMEM: ") + strerror(errno), errno);
+		}
+		xsk_fd = socket(AF_XDP, SOCK_RAW, 0);
+		if (xsk_fd == -1) {
+			throw XDPException(std::string("AF_XDP socket: ") + strerror(errno), errno);
+		}
+		struct xdp_umem_reg reg = {};
+		reg.addr = reinterpret_cast<uint64_t>(umem);
+		reg.len = static_cast<uint64_t>(NUM_FRAMES) * FRAME_SIZE;
+		reg.chunk_size = FRAME_SIZE;
+		reg.headroom = 0;
+		if (setsockopt(xsk_fd, SOL_XDP, XDP_UMEM_REG, &reg, sizeof reg) == -1) {
+			throw XDPException(std::string("UMEM registration: ") + strerror(errno), errno);
+		}
+		uint32_t ring_size = RING_SIZE;
+		int options[] = {XDP_UMEM_FILL_RING, XDP_UMEM_COMPLETION_RING, XDP_RX_RING, XDP_TX_RING};
+		for (int option : options) {
+			if (setsockopt(xsk_fd, SOL_XDP, option, &ring_size, sizeof ring_size) == -1) {
+				throw XDPException(std::string("ring size: ") + strerror(errno), errno);
+			}
+		}
+		struct xdp_mmap_offsets off;
+		socklen_t length = sizeof off;
+		if (getsockopt(xsk_fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &length) == -1) {
+			throw XDPException(std::string("ring offsets: ") + strerror(errno), errno);
+		}
+		mapRing(fill, XDP_UMEM_FILL_RING, off.fr.desc, sizeof(uint64_t),
+			XDP_UMEM_PGOFF_FILL_RING, &off.fr);
+		mapRing(completion, XDP_UMEM_COMPLETION_RING, off.cr.desc, sizeof(uint64_t),
+			XDP_UMEM_PGOFF_COMPLETION_RING, &off.cr);
+		mapRing(rx, XDP_RX_RING, off.rx.desc, sizeof(struct xdp_desc), XDP_PGOFF_RX_RING, &off.rx);
+		mapRing(tx, XDP_TX_RING, off.tx.desc, sizeof(struct xdp_desc), XDP_PGOFF_TX_RING, &off.tx);
+
+		// First half for receiving, second half for sending.
+		uint64_t *fill_descs = static_cast<uint64_t*>(fill.descs);
+		for (uint32_t i = 0; i < RING_SIZE; i++) {
+			fill_descs[i] = static_cast<uint64_t>(i) * FRAME_SIZE;
+		}
+		__atomic_store_n(fill.producer, RING_SIZE, __ATOMIC_RELEASE);
+		for (uint32_t i = RING_SIZE; i < NUM_FRAMES; i++) {
+			free_frames.push_back(static_cast<uint64_t>(i) * FRAME_SIZE);
+		}
+
+		loadProgram(local);
+		attachProgram();
+
+		// Zero copy needs the driver's support, copying always works.
+		struct sockaddr_xdp addr = {};
+		addr.sxdp_family = AF_XDP;
+		addr.sxdp_ifindex = if_index;
+		addr.sxdp_queue_id = 0;
+		addr.sxdp_flags = XDP_ZEROCOPY;
+		zero_copy = native && bind(xsk_fd, (struct sockaddr*)&addr, sizeof addr) == 0;
+		if (!zero_copy) {
+			addr.sxdp_flags = XDP_COPY;
+			if (bind(xsk_fd, (struct sockaddr*)&addr, sizeof addr) == -1) {
+				throw XDPException(std::string("AF_XDP bind: ") + strerror(errno), errno);
+			}
+		}
+
+		union bpf_attr attr = {};
+		uint32_t key = 0;
+		uint32_t value = xsk_fd;
+		attr.map_fd = map_fd;
+		attr.key = reinterpret_cast<uint64_t>(&key);
+		attr.value = reinterpret_cast<uint64_t>(&value);
+		if (bpf(BPF_MAP_UPDATE_ELEM, attr) == -1) {
+			throw XDPException(std::string("XSK map: ") + strerror(errno), errno);
+		}
+	} catch (XDPException &e) {
+		cleanUp();
+		throw;
+	}
+}
+
+
+XSK::~XSK() {
+	cleanUp();
+}
+
+
+void XSK::cleanUp() {
+	// Detaching the program first hands the traffic back to the kernel.
+	int fds[] = {link_fd, prog_fd, map_fd, xsk_fd};
+	for (int fd : fds) {
+		if (fd != -1) {
+			close(fd);
+		}
+	}
+	link_fd = prog_fd = map_fd = xsk_fd = -1;
+	Ring *rings[] = {&fill, &completion, &rx, &tx};
+	for (Ring *ring : rings) {
+		if (ring->map != nullptr) {
+			munmap(ring->map, ring->map_length);
+			ring->map = nullptr;
+		}
+	}
+	if (umem != nullptr) {
+		munmap(umem, static_cast<size_t>(NUM_FRAMES) * FRAME_SIZE);
+		umem = nullptr;
+	}
+}
+
+
+int XSK::findInterface(const struct sockaddr_in &local) {
+	struct ifaddrs *addrs;
+	if (getifaddrs(&addrs) == -1) {
+		throw XDPException(std::string("getifaddrs: ") + strerror(errno), errno);
+	}
+	for (struct ifaddrs *a = addrs; a != nullptr; a = a->ifa_next) {
+		if (a->ifa_addr != nullptr && a->ifa_addr->sa_family == AF_INET &&
+				((struct sockaddr_in*)a->ifa_addr)->sin_addr.s_addr == local.sin_addr.s_addr) {
+			if_name = a->ifa_name;
+			break;
+		}
+	}
+	freeifaddrs(addrs);
+	if (if_name.empty()) {
+		throw XDPException(std::string("no interface has ") + inet_ntoa(local.sin_addr));
+	}
+
+	struct ifreq ifr = {};
+	strncpy(ifr.ifr_name, if_name.c_str(), IFNAMSIZ - 1);
+	int fd = socket(AF_INET, SOCK_DGRAM, 0);
+	int status = (fd == -1) ? -1 : ioctl(fd, SIOCGIFMTU, &ifr);
+	int error = errno;
+	if (fd != -1) {
+		close(fd);
+	}
+	if (status == -1) {
+		throw XDPException("MTU of " + if_name + ": " + strerror(error), error);
+	}
+	if_mtu = static_cast<uint16_t>(std::min(ifr.ifr_mtu, static_cast<int>(UINT16_MAX)));
+	return if_nametoindex(if_name.c_str());
+}
+
+
+void XSK::loadProgram(const struct sockaddr_in &local) {
+	union bpf_attr attr = {};
+	attr.map_type = BPF_MAP_TYPE_XSKMAP;
+	attr.key_size = sizeof(uint32_t);
+	attr.value_size = sizeof(uint32_t);
+	attr.max_entries = 1;		// Queue 0
+	map_fd = bpf(BPF_MAP_CREATE, attr);
+	if (map_fd == -1) {
+		throw XDPException(std::string("XSK map: ") + strerror(errno), errno);
+	}
+
+	// Values as they are in the packet, loads don't swap bytes.
+	enum {PASS};
+	Assembler a;
+	a.add(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_1, 0, 0);			// r6 = ctx
+	a.add(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_1, 0, 0);			// r2 = data
+	a.add(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_3, BPF_REG_1, 4, 0);			// r3 = data_end
+	a.add(BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_4, BPF_REG_2, 0, 0);
+	a.add(BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_4, 0, 0, HEADERS_LENGTH);
+	a.jumpTo(PASS, BPF_JMP | BPF_JGT | BPF_X, BPF_REG_4, BPF_REG_3, 0);		// Too short
+	a.add(BPF_LDX | BPF_MEM | BPF_H, BPF_REG_5, BPF_REG_2, 12, 0);
+	a.jumpTo(PASS, BPF_JMP32 | BPF_JNE | BPF_K, BPF_REG_5, 0, htons(ETH_P_IP));
+	a.add(BPF_LDX | BPF_MEM | BPF_B, BPF_REG_5, BPF_REG_2, ETHERNET_LENGTH, 0);
+	a.jumpTo(PASS, BPF_JMP32 | BPF_JNE | BPF_K, BPF_REG_5, 0, 0x45);		// No IP options
+	a.add(BPF_LDX | BPF_MEM | BPF_B, BPF_REG_5, BPF_REG_2, ETHERNET_LENGTH + 9, 0);
+	a.jumpTo(PASS, BPF_JMP32 | BPF_JNE | BPF_K, BPF_REG_5, 0, IPPROTO_UDP);
+	a.add(BPF_LDX | BPF_MEM | BPF_H, BPF_REG_5, BPF_REG_2, ETHERNET_LENGTH + 6, 0);
+	a.add(BPF_ALU | BPF_AND | BPF_K, BPF_REG_5, 0, 0, htons(0x3fff));
+	a.jumpTo(PASS, BPF_JMP32 | BPF_JNE | BPF_K, BPF_REG_5, 0, 0);			// Fragments
+	a.add(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_5, BPF_REG_2, ETHERNET_LENGTH + 16, 0);
+	a.jumpTo(PASS, BPF_JMP32 | BPF_JNE | BPF_K, BPF_REG_5, 0,
+		static_cast<int32_t>(local.sin_addr.s_addr));
+	a.add(BPF_LDX | BPF_MEM | BPF_H, BPF_REG_5, BPF_REG_2, ETHERNET_LENGTH + IP_LENGTH + 2, 0);
+	a.jumpTo(PASS, BPF_JMP32 | BPF_JNE | BPF_K, BPF_REG_5, 0, local.sin_port);
+	// bpf_redirect_map(map, ctx->rx_queue_index, XDP_PASS): passes if no XSK is there.
+	a.add(BPF_LDX | BPF_MEM | BPF_W, BPF_REG_2, BPF_REG_6, 16, 0);
+	a.add(BPF_LD | BPF_DW | BPF_IMM, BPF_REG_1, BPF_PSEUDO_MAP_FD, 0, map_fd);
+	a.add(0, 0, 0, 0, 0);
+	a.add(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_3, 0, 0, XDP_PASS);
+	a.add(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map);
+	a.add(BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+	a.mark(PASS);
+	a.add(BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, XDP_PASS);
+	a.add(BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+	std::vector<struct bpf_insn> &insns = a.finish();
+
+	char log[4096] = "";
+	attr = {};
+	attr.prog_type = BPF_PROG_TYPE_XDP;
+	attr.insns = reinterpret_cast<uint64_t>(insns.data());
+	attr.insn_cnt = insns.size();
+	attr.license = reinterpret_cast<uint64_t>("GPL");
+	if (debug >= 2) {
+		attr.log_buf = reinterpret_cast<uint64_t>(log);
+		attr.log_size = sizeof log;
+		attr.log_level = 1;
+	}
+	prog_fd = bpf(BPF_PROG_LOAD, attr);
+	if (prog_fd == -1) {
+		int error = errno;
+		throw XDPException(std::string("XDP program: ") + strerror(error) +
+			(log[0] != '\0' ? std::string("\n") + log : ""), error);
+	}
+}
+
+
+void XSK::attachProgram() {
+	// Native XDP if the driver has it, generic otherwise. The link detaches the program
+	// when its fd is closed, also if the process dies.
+	uint32_t modes[] = {XDP_FLAGS_DRV_MODE, XDP_FLAGS_SKB_MODE};
+	int error = 0;
+	for (uint32_t mode : modes) {
+		union bpf_attr attr = {};
+		attr.link_create.prog_fd = prog_fd;
+		attr.link_create.target_ifindex = if_index;
+		attr.link_create.attach_type = BPF_XDP;
+		attr.link_create.flags = mode;
+		link_fd = bpf(BPF_LINK_CREATE, attr);
+		if (link_fd != -1) {
+			native = (mode == XDP_FLAGS_DRV_MODE);
+			return;
+		}
+		error = errno;
+		if (error == EBUSY) {
+			break;		// Someone else's program is there, the mode doesn't matter
+		}
+	}
+	throw XDPException("attaching the XDP program to " + if_name + ": " + strerror(error), error);
+}
+
+
+void XSK::mapRing(Ring &ring, int option, uint64_t desc_offset, uint64_t desc_size,
+		uint64_t page_offset, const void *offsets) {
+	const struct xdp_ring_offset *off = static_cast<const struct xdp_ring_offset*>(offsets);
+	ring.map_length = desc_offset + RING_SIZE * desc_size;
+	ring.map = mmap(nullptr, ring.map_length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		xsk_fd, page_offset);
+	if (ring.map == MAP_FAILED) {
+		ring.map = nullptr;
+		throw XDPException("mapping ring " + std::to_string(option) + ": " + strerror(errno), errno);
+	}
+	char *base = static_cast<char*>(ring.map);
+	ring.producer = reinterpret_cast<uint32_t*>(base + off->producer);
+	ring.consumer = reinterpret_cast<uint32_t*>(base + off->consumer);
+	ring.descs = base + off->desc;
+}
+
+
+std::string XSK::describe() {
+	return if_name + " queue 0 (" + (native ? "native" : "generic") + ", " +
+		(zero_copy ? "zero copy" : "copy") + ")";
+}
+
+
+size_t XSK::receive(Frame *frames, size_t max, int timeout_ms) {
+	uint32_t consumer = *rx.consumer;
+	uint32_t available = __atomic_load_n(rx.producer, __ATOMIC_ACQUIRE) - consumer;
+	if (available == 0) {
+		struct pollfd pfd = {xsk_fd, POLLIN, 0};
+		if (poll(&pfd, 1, timeout_ms) <= 0) {
+			return 0;
+		}
+		available = __atomic_load_n(rx.producer, __ATOMIC_ACQUIRE) - consumer;
+	}
+	rx_taken = std::min<uint32_t>(available, max);
+
+	const struct xdp_desc *descs = static_cast<const struct xdp_desc*>(rx.descs);
+	size_t n = 0;
+	for (uint32_t i = 0; i < rx_taken; i++) {
+		const struct xdp_desc &desc = descs[(consumer + i) & (RING_SIZE - 1)];
+		const char *data = umem + desc.addr;
+		// The program checked the headers are there, and what they say.
+		if (desc.len < HEADERS_LENGTH) {
+			continue;
+		}
+		uint16_t ip_length, udp_length;
+		memcpy(&ip_length, data + ETHERNET_LENGTH + 2, 2);
+		memcpy(&udp_length, data + ETHERNET_LENGTH + IP_LENGTH + 4, 2);
+		ip_length = ntohs(ip_length);
+		udp_length = ntohs(udp_length);
+		if (udp_length < UDP_LENGTH || ip_length < IP_LENGTH + udp_length ||
+				static_cast<uint32_t>(ETHERNET_LENGTH + IP_LENGTH + udp_length) > desc.len) {
+			continue;
+		}
+		Frame &frame = frames[n++];
+		frame.headers = data;
+		frame.payload = data + HEADERS_LENGTH;
+		frame.length = udp_length - UDP_LENGTH;
+		struct sockaddr_in *from = (struct sockaddr_in*)&frame.from;
+		memset(from, 0, sizeof *from);
+		from->sin_family = AF_INET;
+		memcpy(&from->sin_addr, data + ETHERNET_LENGTH + 12, 4);
+		memcpy(&from->sin_port, data + ETHERNET_LENGTH + IP_LENGTH, 2);
+	}
+	frames_in += n;
+	return n;
+}
+
+
+void XSK::release() {
+	if (rx_taken == 0) {
+		return;
+	}
+	// Back to the fill ring. It holds all receive frames, so there's always room.
+	uint32_t consumer = *rx.consumer;
+	uint32_t producer = *fill.producer;
+	const struct xdp_desc *descs = static_cast<const struct xdp_desc*>(rx.descs);
+	uint64_t *fill_descs = static_cast<uint64_t*>(fill.descs);
+	for (uint32_t i = 0; i < rx_taken; i++) {
+		uint64_t addr = descs[(consumer + i) & (RING_SIZE - 1)].addr;
+		fill_descs[(producer + i) & (RING_SIZE - 1)] = addr - addr % FRAME_SIZE;
+	}
+	__atomic_store_n(fill.producer, producer + rx_taken, __ATOMIC_RELEASE);
+	__atomic_store_n(rx.consumer, consumer + rx_taken, __ATOMIC_RELEASE);
+	rx_taken = 0;
+}
+
+
+void XSK::setPeer(const Frame &frame) {
+	// Swapped: what came from the peer goes to it.
+	const char *in = frame.headers;
+	char out[HEADERS_LENGTH] = {};
+	memcpy(out, in + 6, 6);										// Destination MAC
+	memcpy(out + 6, in, 6);										// Source MAC
+	memcpy(out + 12, in + 12, 2);								// EtherType
+	char *ip = out + ETHERNET_LENGTH;
+	ip[0] = 0x45;
+	ip[6] = 0x40;												// Don't fragment
+	ip[8] = 64;													// TTL
+	ip[9] = IPPROTO_UDP;
+	memcpy(ip + 12, in + ETHERNET_LENGTH + 16, 4);				// Source address
+	memcpy(ip + 16, in + ETHERNET_LENGTH + 12, 4);				// Destination address
+	char *udp = ip + IP_LENGTH;
+	memcpy(udp, in + ETHERNET_LENGTH + IP_LENGTH + 2, 2);		// Source port
+	memcpy(udp + 2, in + ETHERNET_LENGTH + IP_LENGTH, 2);		// Destination port
+
+	std::lock_guard<std::mutex> lock(tx_mutex);
+	memcpy(header, out, HEADERS_LENGTH);
+	knows_peer = true;
+}
+
+
+int XSK::send(const struct iovec *iov, int count, bool flush) {
+	size_t length = 0;
+	for (int i = 0; i < count; i++) {
+		length += iov[i].iov_len;
+	}
+	if (!knows_peer || IP_LENGTH + UDP_LENGTH + length > if_mtu) {
+		return -1;
+	}
+
+	std::lock_guard<std::mutex> lock(tx_mutex);
+	int calls = 0;
+	reapCompletions();
+	uint32_t producer = *tx.producer;
+	if (free_frames.empty() ||
+			producer - __atomic_load_n(tx.consumer, __ATOMIC_ACQUIRE) >= RING_SIZE) {
+		// Full. Waking up the kernel frees up frames, eventually.
+		kick();
+		calls++;
+		return -1;
+	}
+	uint64_t addr = free_frames.back();
+	free_frames.pop_back();
+
+	char *frame = umem + addr;
+	memcpy(frame, header, HEADERS_LENGTH);
+	char *ip = frame + ETHERNET_LENGTH;
+	char *udp = ip + IP_LENGTH;
+	char *payload = udp + UDP_LENGTH;
+	for (int i = 0; i < count; i++) {
+		memcpy(payload, iov[i].iov_base, iov[i].iov_len);
+		payload += iov[i].iov_len;
+	}
+	uint16_t ip_length = htons(IP_LENGTH + UDP_LENGTH + length);
+	uint16_t udp_length = htons(UDP_LENGTH + length);
+	uint16_t id = htons(ip_id++);
+	memcpy(ip + 2, &ip_length, 2);
+	memcpy(ip + 4, &id, 2);
+	uint16_t ip_check = fold(sum16(ip, IP_LENGTH));
+	memcpy(ip + 10, &ip_check, 2);
+	memcpy(udp + 4, &udp_length, 2);
+	// Pseudo header: addresses, protocol and UDP length.
+	uint32_t sum = sum16(ip + 12, 8) + htons(IPPROTO_UDP) + udp_length;
+	uint16_t udp_check = fold(sum16(udp, UDP_LENGTH + length, sum));
+	if (udp_check == 0) {
+		udp_check = 0xffff;		// 0 means none
+	}
+	memcpy(udp + 6, &udp_check, 2);
+
+	struct xdp_desc *descs = static_cast<struct xdp_desc*>(tx.descs);
+	struct xdp_desc &desc = descs[producer & (RING_SIZE - 1)];
+	desc.addr = addr;
+	desc.len = HEADERS_LENGTH + length;
+	desc.options = 0;
+	__atomic_store_n(tx.producer, producer + 1, __ATOMIC_RELEASE);
+	frames_out++;
+
+	if (flush || ++unkicked >= KICK_BATCH) {
+		kick();
+		calls++;
+	}
+	return calls;
+}
+
+
+void XSK::flush() {
+	if (unkicked == 0) {
+		return;
+	}
+	std::lock_guard<std::mutex> lock(tx_mutex);
+	if (unkicked > 0) {
+		kick();
+	}
+}
+
+
+void XSK::kick() {
+	// EAGAIN and friends only mean the kernel is busy with the ring already.
+	sendto(xsk_fd, nullptr, 0, MSG_DONTWAIT, nullptr, 0);
+	unkicked = 0;
+	kicks++;
+}
+
+
+void XSK::reapCompletions() {
+	uint32_t consumer = *completion.consumer;
+	uint32_t done = __atomic_load_n(completion.producer, __ATOMIC_ACQUIRE) - consumer;
+	const uint64_t *descs = static_cast<const uint64_t*>(completion.descs);
+	for (uint32_t i = 0; i < done; i++) {
+		free_frames.push_back(descs[(consumer + i) & (RING_SIZE - 1)]);
+	}
+	__atomic_store_n(completion.consumer, consumer + done, __ATOMIC_RELEASE);
+}
+
+
+uint64_t XSK::getKernelDrops() {
+	struct xdp_statistics statistics;
+	socklen_t length = sizeof statistics;
+	if (getsockopt(xsk_fd, SOL_XDP, XDP_STATISTICS, &statistics, &length) == -1) {
+		return 0;
+	}
+	return statistics.rx_dropped + statistics.rx_ring_full;
+}
@@ -0,0 +1,128 @@
+#include <errno.h>
+#include <time.h>
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include <thread>
+
+#include "zerocopy.h"
+
+
+const size_t ZeroCopy::MAX_HELD;
+const int ZeroCopy::WAIT_MS;
+constexpr std::chrono::milliseconds ZeroCopy::IDLE_REAP;
+constexpr std::chrono::milliseconds ZeroCopy::FINISH_TIMEOUT;
+
+
+ZeroCopy::~ZeroCopy() {
+	leak();		// Held by a sender that never finished
+}
+
+
+bool ZeroCopy::enable(int fd, uint16_t threshold) {
+	int one = 1;
+	if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof one) == -1) {
+		return false;
+	}
+	this->fd = fd;
+	this->threshold = threshold;
+	return true;
+}
+
+
+ssize_t ZeroCopy::send(const char *buf, size_t length) {
+	ssize_t n_sent = ::send(fd, buf, length, MSG_ZEROCOPY);
+	if (n_sent >= 0) {
+		++next_id;
+		++sends;
+		sent_since_hold = true;
+	} else if (errno == ENOBUFS) {
+		// Over the socket's optmem for pinned pages. Copying always works.
+		n_sent = ::send(fd, buf, length, 0);
+	}
+	return n_sent;
+}
+
+
+void ZeroCopy::hold(MessagePtr message) {
+	if (sent_since_hold) {
+		held.push_back({next_id - 1, std::move(message)});
+		held_count = held.size();
+		sent_since_hold = false;
+	}	// Else it was all copied, the message can go
+	reap();
+	while (held.size() > MAX_HELD) {
+		reap(true);
+	}
+}
+
+
+void ZeroCopy::reap(bool wait) {
+	if (wait) {
+		// Completions show as POLLERR, whatever the events asked for.
+		struct pollfd pfd = {fd, 0, 0};
+		if (poll(&pfd, 1, WAIT_MS) <= 0) {
+			return;
+		}
+	}
+	while (true) {
+		char control[CMSG_SPACE(sizeof(struct sock_extended_err)) + 64];
+		struct msghdr msg = {};
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof control;
+		if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1) {
+			return;		// EAGAIN: nothing (more) completed
+		}
+		for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr;
+				cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			if (!((cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) ||
+					(cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR))) {
+				continue;
+			}
+			struct sock_extended_err err;
+			memcpy(&err, CMSG_DATA(cmsg), sizeof err);
+			if (err.ee_origin != SO_EE_ORIGIN_ZEROCOPY || err.ee_errno != 0) {
+				continue;
+			}
+			// ee_info to ee_data (inclusive) completed.
+			if (err.ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+				copied += err.ee_data - err.ee_info + 1;
+			}
+			release(err.ee_data);
+		}
+	}
+}
+
+
+void ZeroCopy::finish() {
+	auto deadline = std::chrono::steady_clock::now() + FINISH_TIMEOUT;
+	while (!held.empty() && std::chrono::steady_clock::now() < deadline) {
+		reap();
+		if (!held.empty()) {
+			// Not reap(true): a shut down socket polls as ready all the time.
+			std::this_thread::sleep_for(IDLE_REAP);
+		}
+	}
+	leak();
+}
+
+
+void ZeroCopy::leak() {
+	for (auto it=held.begin(); it!=held.end(); it++) {
+		it->message.release();
+	}
+	held.clear();
+	held_count = 0;
+}
+
+
+void ZeroCopy::release(uint32_t through) {
+	// The counter wraps, compare the distance.
+	while (!held.empty() && static_cast<int32_t>(held.front().last_id - through) <= 0) {
+		held.pop_front();
+	}
+	held_count = held.size();
+}
@@ -0,0 +1,409 @@
+/**
+	Runs a client and a server in one process, over loopback, with in-memory packet
+	devices instead of tuns. Traffic goes one way, from the client's device to the
+	server's. Needs neither root nor a second host, so it can run in CI.
+
+	Every combination of transport, link count and packet size runs in a process of its
+	own, as endpoints can't be stopped once started.
+
+	With -m, it measures the shared memory ring alone instead: a producer and a consumer
+	thread, pinned to the CPUs given, pass messages of each size through a ShmChannel.
+*/
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <exception>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "affinity.h"
+#include "device.h"
+#include "impair.h"
+#include "log.h"
+#include "options.h"
+#include "roles.h"
+#include "scheduler.h"
+#include "shm.h"
+#include "traffic.h"
+#include "util.h"
+
+
+struct BenchOptions {
+	std::vector<std::string> transports{"UDP", "TCP"};
+	std::vector<int> links{1, 2, 4};
+	std::vector<int> sizes{64, 512, 1400};
+	std::vector<std::string> schedulers{"rr"};
+	int seconds = 3;
+	uint64_t rate_pps = 0;
+	int flows = 16;
+	int max_streams = 1;
+	int reorder_hold = 50;
+	std::string impairment;
+	std::string shaping;			// Of the first link only
+	int base_port = 47000;
+	int debug_level = 0;
+	std::vector<int> ring_cpus;		// Producer, consumer. Only the ring is measured if set
+};
+
+
+struct Run {
+	std::string scheduler;
+	std::string transport;
+	int links;
+	int size;
+	int port;
+};
+
+
+static const std::chrono::seconds WARM_UP{1};
+static const std::chrono::milliseconds DRAIN{200};
+
+
+static std::vector<std::string> splitList(const std::string &list) {
+	std::vector<std::string> items;
+	std::stringstream ss(list);
+	std::string item;
+	while (std::getline(ss, item, ',')) {
+		if (!item.empty()) {
+			items.push_back(item);
+		}
+	}
+	return items;
+}
+
+
+static std::vector<int> splitInts(const std::string &list) {
+	std::vector<int> values;
+	for (const std::string &item : splitList(list)) {
+		values.push_back(std::stoi(item));
+	}
+	return values;
+}
+
+
+static void printHelp(const char *prog_name, std::ostream &out) {
+	out << "Usage:\n"
+		<< prog_name << " [-S SCHEDULERS] [-t TRANSPORTS] [-n LINKS] [-s SIZES] [-T SECONDS] [-r PPS] [-f FLOWS] [-p N] [-R MS] [-I IMPAIRMENT] [-L SHAPING] [-P PORT] [-d LEVEL] [-m CPUS]\n"
+		<< "\t-S: Schedulers to compare, comma separated (rr, minrtt). Default rr.\n"
+		<< "\t-t: Transports to run over, comma separated: UDP, TCP, XDP, UNIX, SHM. Default UDP,TCP.\n"
+		<< "\t-n: Link counts, comma separated. Default 1,2,4.\n"
+		<< "\t-s: Packet sizes in bytes (inner IP packets), comma separated. Default 64,512,1400.\n"
+		<< "\t-T: Seconds each run measures, after a second of warm up. Default 3.\n"
+		<< "\t-r: PPS: Packets per second to offer. Default 0=as fast as the client takes them.\n"
+		<< "\t-f: Number of inner flows. Default 16.\n"
+		<< "\t-p: N: Most parallel connections per TCP link. Default 1.\n"
+		<< "\t-R: MS: Reorder hold time. Default 50.\n"
+		<< "\t-I: IMPAIRMENT: Impair every link both ways, see multitun -h. Default none.\n"
+		<< "\t-L: SHAPING: Shape the first link both ways, see multitun -h. What it can't take spills over to the others. Default none.\n"
+		<< "\t-P: PORT: First loopback port to use. Every run takes the next LINKS ports. Default 47000.\n"
+		<< "\t-d: Debug level of the endpoints. Default 0.\n"
+		<< "\t-m: CPUS: Measure only the shared memory ring, between a producer and a consumer pinned to these two CPUs (e.g. 2,3). Takes the sizes from -s and the seconds from -T."
+		<< std::endl;
+}
+
+
+static BenchOptions parseOptions(int argc, char *argv[]) {
+	BenchOptions bench;
+	int c;
+	opterr = 0;
+	while ((c = getopt(argc, argv, ":hS:t:n:s:T:r:f:p:R:I:L:P:d:m:")) != -1) {
+		switch (c) {
+			case 'h':
+				printHelp(argv[0], std::cout);
+				std::exit(0);
+			case 'S':
+				bench.schedulers = splitList(optarg);
+				for (const std::string &scheduler : bench.schedulers) {
+					Scheduler::create(scheduler);	// Throws std::invalid_argument
+				}
+				break;
+			case 't':
+				bench.transports = splitList(optarg);
+				for (const std::string &transport : bench.transports) {
+					string2SocketType(transport);	// Throws std::invalid_argument
+				}
+				break;
+			case 'n':
+				bench.links = splitInts(optarg);
+				break;
+			case 's':
+				bench.sizes = splitInts(optarg);
+				break;
+			case 'T':
+				bench.seconds = std::stoi(optarg);
+				break;
+			case 'r':
+				bench.rate_pps = std::stoull(optarg);
+				break;
+			case 'f':
+				bench.flows = std::stoi(optarg);
+				break;
+			case 'p':
+				bench.max_streams = std::stoi(optarg);
+				break;
+			case 'R':
+				bench.reorder_hold = std::stoi(optarg);
+				break;
+			case 'I':
+				Impairment::parse(optarg);		// Throws std::invalid_argument
+				bench.impairment = optarg;
+				break;
+			case 'L':
+				Shaping::parse(optarg);		// Throws std::invalid_argument
+				bench.shaping = optarg;
+				break;
+			case 'P':
+				bench.base_port = std::stoi(optarg);
+				break;
+			case 'd':
+				bench.debug_level = std::stoi(optarg);
+				break;
+			case 'm':
+				bench.ring_cpus = splitInts(optarg);
+				if (bench.ring_cpus.size() != 2) {
+					throw std::invalid_argument("-m takes two CPUs");
+				}
+				break;
+			case ':':
+				throw std::invalid_argument(
+					std::string("option requires an argument: '") + static_cast<char>(optopt) + "'");
+			default:
+				throw std::invalid_argument(
+					std::string("invalid option: '") + static_cast<char>(optopt) + "'");
+		}
+	}
+	if (bench.seconds < 1 || bench.links.empty() || bench.sizes.empty()) {
+		throw std::invalid_argument("nothing to run");
+	}
+	for (int size : bench.sizes) {
+		if (size < static_cast<int>(TrafficGenerator::MIN_SIZE) ||
+				size > Message::PAYLOAD_SIZE - Message::TRAILER_SPACE) {
+			throw std::invalid_argument(std::string("packet size out of range: ") +
+				std::to_string(size));
+		}
+	}
+	return bench;
+}
+
+
+static Options endpointOptions(const BenchOptions &bench, const Run &run, bool server) {
+	Options options;
+	options.prog_name = "multitun_bench";
+	options.server_flag = server;
+	options.client_flag = !server;
+	options.debug_level = bench.debug_level;
+	options.max_streams = bench.max_streams;
+	options.reorder_hold = bench.reorder_hold;
+	options.scheduler = run.scheduler;
+	for (int i = 0; i < run.links; i++) {
+		SocketDescription des = {.type=string2SocketType(run.transport), .ip="127.0.0.1",
+			.port=run.port + i, .impairment=bench.impairment,
+			.shaping=(i == 0) ? bench.shaping : ""};
+		if (isLocal(des.type)) {
+			// The port still keeps the runs apart.
+			des.ip = "/tmp/multitun_bench." + std::to_string(des.port) + ".sock";
+			des.port = 0;
+		}
+		options.sock_des.push_back(des);
+	}
+	return options;
+}
+
+
+/**
+	Runs in the child process. Prints one line of results, then exits: the endpoints'
+	threads never end, so there's no unwinding them.
+*/
+static void runOnce(const BenchOptions &bench, const Run &run) {
+	auto server_device = std::make_shared<MemoryDevice>("bench server", MemoryDevice::DEFAULT_LIMIT,
+		bench.debug_level);
+	auto client_device = std::make_shared<MemoryDevice>("bench client", MemoryDevice::DEFAULT_LIMIT,
+		bench.debug_level);
+	TrafficMeter meter;
+	meter.countFrom(UINT64_MAX);	// Nothing counts during the warm up
+	server_device->setSink([&meter] (const char *pkt, size_t len) {meter.onPacket(pkt, len);});
+
+	Server server(endpointOptions(bench, run, true), server_device);
+	std::thread([&server] () {server.start();}).detach();
+	Client client(endpointOptions(bench, run, false), client_device);
+	std::thread([&client] () {client.start();}).detach();
+
+	// The warm up connects the links and lets TCP pools settle.
+	TrafficGenerator generator(client_device, run.size, bench.flows, bench.rate_pps);
+	generator.run(WARM_UP);
+	uint64_t sent_before = generator.getSent();
+	meter.countFrom(std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count());
+
+	auto start = std::chrono::steady_clock::now();
+	generator.run(std::chrono::seconds(bench.seconds));
+	double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	std::this_thread::sleep_for(DRAIN);
+
+	uint64_t sent = generator.getSent() - sent_before;
+	uint64_t received = meter.getPackets();
+	const stats::Histogram &latency = meter.getLatency();
+	double loss = (sent > 0 && sent > received) ? 100.0 * (sent - received) / sent : 0.0;
+
+	logging::flush();
+	printf("%-9s %-9s %5d %6d %10.0f %8.3f %9.1f %9.1f %9.1f %7.2f %9llu\n",
+		run.scheduler.c_str(), run.transport.c_str(), run.links, run.size,
+		received / elapsed, meter.getBytes() * 8 / elapsed / 1e9,
+		latency.percentile(0.5) / 1e3, latency.percentile(0.99) / 1e3,
+		latency.percentile(0.999) / 1e3, loss,
+		static_cast<unsigned long long>(meter.getReordered()));
+	fflush(stdout);
+	_exit(0);
+}
+
+
+/**
+	Pushes messages of the given size through a ShmChannel for the given time, from a
+	thread pinned to the first CPU to one pinned to the second, and prints how many got
+	through. Both ends of the channel live in this process, over a socketpair.
+*/
+static void runRing(const BenchOptions &bench, int size) {
+	Placement placement = Placement::parse("tx=" + std::to_string(bench.ring_cpus[0]) +
+		"/rx=" + std::to_string(bench.ring_cpus[1]));	// Throws std::invalid_argument
+	int fds[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) == -1) {
+		throw std::runtime_error(std::string("socketpair error: ") + strerror(errno));
+	}
+	std::unique_ptr<ShmChannel> producer_end = ShmChannel::create(fds[0]);
+	std::unique_ptr<ShmChannel> consumer_end = ShmChannel::receive(fds[1]);
+	ShmRing &out = producer_end->getOut();
+	ShmRing &in = consumer_end->getIn();
+
+	std::atomic<bool> stop{false};
+	uint64_t received = 0;
+	std::thread consumer([&] () {
+		placement.pin(Placement::RECEIVER, 0, bench.debug_level);
+		char buf[ShmRing::SLOT_SIZE];
+		while (!stop.load(std::memory_order_relaxed)) {
+			if (in.pop(buf, sizeof buf) >= 0) {
+				++received;
+			} else if (!in.wait(fds[1])) {
+				break;
+			}
+		}
+	});
+
+	uint64_t sent = 0;
+	double elapsed = 0;
+	std::thread producer([&] () {
+		placement.pin(Placement::SENDER, 0, bench.debug_level);
+		std::vector<char> payload(size, 'x');
+		struct iovec iov = {payload.data(), payload.size()};
+		auto start = std::chrono::steady_clock::now();
+		auto end = start + std::chrono::seconds(bench.seconds);
+		auto now = start;
+		while (now < end) {
+			// The clock is read once a batch, it costs about as much as a push.
+			for (int i = 0; i < 64; i++) {
+				out.push(&iov, 1, fds[0]);
+			}
+			sent += 64;
+			now = std::chrono::steady_clock::now();
+		}
+		elapsed = std::chrono::duration<double>(now - start).count();
+		stop = true;
+		// Wakes the consumer if it sleeps.
+		shutdown(fds[0], SHUT_RDWR);
+	});
+	producer.join();
+	consumer.join();
+	close(fds[0]);
+	close(fds[1]);
+
+	printf("%6d %10.2f %8.3f %10llu %10llu %10llu\n", size, received / elapsed / 1e6,
+		received * size * 8 / elapsed / 1e9, static_cast<unsigned long long>(sent - received),
+		static_cast<unsigned long long>(out.getWakeups() + in.getWakeups()),
+		static_cast<unsigned long long>(out.getSleeps() + in.getSleeps()));
+	fflush(stdout);
+}
+
+
+int main(int argc, char* argv[]) {
+	BenchOptions bench;
+	try {
+		bench = parseOptions(argc, argv);
+	} catch (std::exception &e) {
+		std::cerr << "Parse error: " << e.what() << std::endl;
+		printHelp(argv[0], std::cerr);
+		return 1;
+	}
+
+	if (!bench.ring_cpus.empty()) {
+		printf("%6s %10s %8s %10s %10s %10s\n", "size", "Mpps", "Gbit/s", "unread", "wakeups",
+			"sleeps");
+		fflush(stdout);
+		for (int size : bench.sizes) {
+			try {
+				runRing(bench, size);
+			} catch (std::exception &e) {
+				std::cerr << size << ": " << e.what() << std::endl;
+				return 1;
+			}
+		}
+		return 0;
+	}
+
+	printf("%-9s %-9s %5s %6s %10s %8s %9s %9s %9s %7s %9s\n", "scheduler", "transport",
+		"links", "size",
+		"pps", "Gbit/s", "p50_us", "p99_us", "p999_us", "loss%", "reordered");
+	fflush(stdout);
+
+	std::vector<Run> runs;
+	int port = bench.base_port;
+	for (const std::string &scheduler : bench.schedulers) {
+		for (const std::string &transport : bench.transports) {
+			for (int links : bench.links) {
+				for (int size : bench.sizes) {
+					runs.push_back({scheduler, transport, links, size, port});
+					port += links;
+				}
+			}
+		}
+	}
+
+	int failures = 0;
+	for (const Run &run : runs) {
+		std::string name = run.scheduler + " " + run.transport + " " +
+			std::to_string(run.links) + " " + std::to_string(run.size);
+		pid_t pid = fork();
+		if (pid == 0) {
+			// A run that hangs (links never come up) is killed.
+			alarm(WARM_UP.count() + bench.seconds + 10);
+			try {
+				runOnce(bench, run);
+			} catch (std::exception &e) {
+				logging::flush();
+				std::cerr << name << ": " << e.what() << std::endl;
+				_exit(1);
+			}
+		} else if (pid < 0) {
+			perror("fork");
+			return 1;
+		}
+		int status;
+		waitpid(pid, &status, 0);
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			std::cerr << name << ": run failed" << std::endl;
+			++failures;
+		}
+	}
+	return failures > 0 ? 1 : 0;
+}
@@ -6,6 +6,7 @@
 #include "options.h"
 //#include "simpletun.h"
 #include "roles.h"
+#include "log.h"
 #include "util.h"
 
 
@@ -24,6 +25,7 @@ Options options;
 		}
 	} catch (OptionsParseException const &e) {
 		errorOut(e.what());
+		logging::flush();
 		options.printHelp(std::cerr);
 		std::exit(1);
 	}
@@ -40,6 +42,7 @@ Options options;
 			Client client(options);
 			client.start();
 		} catch (std::exception &e) {
+			logging::flush();
 			std::cerr << e.what() << std::endl;
 		}
 	} else {
@@ -48,6 +51,7 @@ Options options;
 			Server server(options);
 			server.start();
 		} catch (std::exception &e) {
+			logging::flush();
 			std::cerr << e.what() << std::endl;
 		}
 	}
@@ -0,0 +1,251 @@
+/**
+	Replays a pcap or pcapng trace of real traffic through a client and a server in one
+	process, over loopback, with in-memory packet devices instead of tuns (like
+	multitun_bench). Measures what arrives at the server's device: throughput, loss,
+	latency and reordering.
+*/
+#include <stdlib.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#include <chrono>
+#include <cstdio>
+#include <exception>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include "device.h"
+#include "impair.h"
+#include "log.h"
+#include "options.h"
+#include "roles.h"
+#include "scheduler.h"
+#include "trace.h"
+#include "traffic.h"
+#include "util.h"
+
+
+struct ReplayOptions {
+	std::string trace_path;
+	Trace::Direction direction = Trace::ANY;
+	double speed = 1;
+	int copies = 1;
+	int loops = 1;
+	std::string transport = "UDP";
+	int links = 2;
+	std::string scheduler = "rr";
+	int max_streams = 1;
+	int reorder_hold = 50;
+	std::string impairment;
+	int base_port = 48500;
+	int debug_level = 0;
+};
+
+
+static const std::chrono::seconds WARM_UP{1};
+static const std::chrono::milliseconds DRAIN{200};
+static const int WARM_UP_SIZE = 512;
+
+
+static void printHelp(const char *prog_name, std::ostream &out) {
+	out << "Usage:\n"
+		<< prog_name << " [-D DIRECTION] [-x SPEED] [-c COPIES] [-l LOOPS] [-t TRANSPORT] [-n LINKS] [-S SCHEDULER] [-p N] [-R MS] [-I IMPAIRMENT] [-P PORT] [-d LEVEL] TRACE\n"
+		<< "\tTRACE: pcap or pcapng file of IP packets (raw, Ethernet or Linux cooked).\n"
+		<< "\t-D: DIRECTION: Only replay the packets captured going in or out (pcapng only). Default any.\n"
+		<< "\t-x: SPEED: Replay the trace's timing this much faster. Default 1=as captured, 0=as fast as the client takes them.\n"
+		<< "\t-c: COPIES: Replay every packet this many times, as flows of their own. Default 1.\n"
+		<< "\t-l: LOOPS: Replay the trace this many times. Default 1.\n"
+		<< "\t-t: Transport to run over: UDP, TCP, XDP, UNIX, SHM. Default UDP.\n"
+		<< "\t-n: Number of links. Default 2.\n"
+		<< "\t-S: Scheduler (rr, minrtt). Default rr.\n"
+		<< "\t-p: N: Most parallel connections per TCP link. Default 1.\n"
+		<< "\t-R: MS: Reorder hold time. Default 50.\n"
+		<< "\t-I: IMPAIRMENT: Impair every link both ways, see multitun -h. Default none.\n"
+		<< "\t-P: PORT: First loopback port to use. Default 48500.\n"
+		<< "\t-d: Debug level of the endpoints. Default 0."
+		<< std::endl;
+}
+
+
+static ReplayOptions parseOptions(int argc, char *argv[]) {
+	ReplayOptions replay;
+	int c;
+	opterr = 0;
+	while ((c = getopt(argc, argv, ":hD:x:c:l:t:n:S:p:R:I:P:d:")) != -1) {
+		switch (c) {
+			case 'h':
+				printHelp(argv[0], std::cout);
+				std::exit(0);
+			case 'D':
+				if (std::string(optarg) == "in") {
+					replay.direction = Trace::INBOUND;
+				} else if (std::string(optarg) == "out") {
+					replay.direction = Trace::OUTBOUND;
+				} else if (std::string(optarg) == "any") {
+					replay.direction = Trace::ANY;
+				} else {
+					throw std::invalid_argument(std::string("invalid direction: ") + optarg);
+				}
+				break;
+			case 'x':
+				replay.speed = std::stod(optarg);
+				break;
+			case 'c':
+				replay.copies = std::stoi(optarg);
+				break;
+			case 'l':
+				replay.loops = std::stoi(optarg);
+				break;
+			case 't':
+				string2SocketType(optarg);		// Throws std::invalid_argument
+				replay.transport = optarg;
+				break;
+			case 'n':
+				replay.links = std::stoi(optarg);
+				break;
+			case 'S':
+				Scheduler::create(optarg);		// Throws std::invalid_argument
+				replay.scheduler = optarg;
+				break;
+			case 'p':
+				replay.max_streams = std::stoi(optarg);
+				break;
+			case 'R':
+				replay.reorder_hold = std::stoi(optarg);
+				break;
+			case 'I':
+				Impairment::parse(optarg);		// Throws std::invalid_argument
+				replay.impairment = optarg;
+				break;
+			case 'P':
+				replay.base_port = std::stoi(optarg);
+				break;
+			case 'd':
+				replay.debug_level = std::stoi(optarg);
+				break;
+			case ':':
+				throw std::invalid_argument(
+					std::string("option requires an argument: '") + static_cast<char>(optopt) + "'");
+			default:
+				throw std::invalid_argument(
+					std::string("invalid option: '") + static_cast<char>(optopt) + "'");
+		}
+	}
+	if (optind != argc - 1) {
+		throw std::invalid_argument("need exactly one trace");
+	}
+	replay.trace_path = argv[optind];
+	if (replay.speed < 0 || replay.loops < 1 || replay.links < 1) {
+		throw std::invalid_argument("nothing to replay");
+	}
+	if (replay.copies < 1 || replay.copies > TraceReplayer::MAX_COPIES) {
+		throw std::invalid_argument("copies out of range");
+	}
+	return replay;
+}
+
+
+static Options endpointOptions(const ReplayOptions &replay, bool server) {
+	Options options;
+	options.prog_name = "multitun_replay";
+	options.server_flag = server;
+	options.client_flag = !server;
+	options.debug_level = replay.debug_level;
+	options.max_streams = replay.max_streams;
+	options.reorder_hold = replay.reorder_hold;
+	options.scheduler = replay.scheduler;
+	for (int i = 0; i < replay.links; i++) {
+		SocketDescription des = {.type=string2SocketType(replay.transport), .ip="127.0.0.1",
+			.port=replay.base_port + i, .impairment=replay.impairment, .shaping=""};
+		if (isLocal(des.type)) {
+			des.ip = "/tmp/multitun_replay." + std::to_string(des.port) + ".sock";
+			des.port = 0;
+		}
+		options.sock_des.push_back(des);
+	}
+	return options;
+}
+
+
+int main(int argc, char* argv[]) {
+	ReplayOptions replay;
+	try {
+		replay = parseOptions(argc, argv);
+	} catch (std::exception &e) {
+		std::cerr << "Parse error: " << e.what() << std::endl;
+		printHelp(argv[0], std::cerr);
+		return 1;
+	}
+
+	Trace trace;
+	try {
+		trace = Trace::load(replay.trace_path, replay.direction);
+	} catch (std::exception &e) {
+		std::cerr << e.what() << std::endl;
+		return 1;
+	}
+	printf("trace: %zu packets, %.1f MB, %.3f s, %llu skipped\n", trace.size(),
+		trace.getBytes() / 1e6, trace.getDuration() / 1e9,
+		static_cast<unsigned long long>(trace.getSkipped()));
+	if (trace.size() == 0) {
+		std::cerr << "nothing to replay in " << replay.trace_path << std::endl;
+		return 1;
+	}
+	fflush(stdout);
+
+	auto server_device = std::make_shared<MemoryDevice>("replay server",
+		MemoryDevice::DEFAULT_LIMIT, replay.debug_level);
+	auto client_device = std::make_shared<MemoryDevice>("replay client",
+		MemoryDevice::DEFAULT_LIMIT, replay.debug_level);
+	ReplayMeter meter;
+	server_device->setSink([&meter] (const char *pkt, size_t len) {meter.onPacket(pkt, len);});
+
+	try {
+		Server server(endpointOptions(replay, true), server_device);
+		std::thread([&server] () {server.start();}).detach();
+		Client client(endpointOptions(replay, false), client_device);
+		std::thread([&client] () {client.start();}).detach();
+
+		// The warm up connects the links and lets TCP pools settle. The meter only counts
+		// what's replayed.
+		TrafficGenerator generator(client_device, WARM_UP_SIZE);
+		generator.run(WARM_UP);
+		std::this_thread::sleep_for(DRAIN);
+		meter.start();
+
+		TraceReplayer replayer(client_device, trace, replay.speed, replay.copies);
+		auto start = std::chrono::steady_clock::now();
+		replayer.run(replay.loops);
+		double elapsed = std::chrono::duration<double>(
+			std::chrono::steady_clock::now() - start).count();
+		std::this_thread::sleep_for(DRAIN);
+
+		uint64_t sent = replayer.getSent();
+		uint64_t received = meter.getPackets();
+		const stats::Histogram &latency = meter.getLatency();
+		double loss = (sent > 0 && sent > received) ? 100.0 * (sent - received) / sent : 0.0;
+
+		logging::flush();
+		printf("%10s %9s %9s %9s %7s %10s %10s %9s %9s %9s %9s\n", "sent", "refused", "late",
+			"received", "loss%", "in_Mbit/s", "out_Mbit/s", "p50_us", "p99_us", "p999_us",
+			"reordered");
+		printf("%10llu %9llu %9llu %9llu %7.2f %10.2f %10.2f %9.1f %9.1f %9.1f %9llu\n",
+			static_cast<unsigned long long>(sent),
+			static_cast<unsigned long long>(replayer.getRefused()),
+			static_cast<unsigned long long>(replayer.getLate()),
+			static_cast<unsigned long long>(received), loss,
+			replayer.getSentBytes() * 8 / elapsed / 1e6, meter.getBytes() * 8 / elapsed / 1e6,
+			latency.percentile(0.5) / 1e3, latency.percentile(0.99) / 1e3,
+			latency.percentile(0.999) / 1e3,
+			static_cast<unsigned long long>(meter.getReordered()));
+		fflush(stdout);
+		// The endpoints' threads never end, so there's no unwinding them.
+		_exit(0);
+	} catch (std::exception &e) {
+		logging::flush();
+		std::cerr << e.what() << std::endl;
+		_exit(1);
+	}
+}
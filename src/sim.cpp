@@ -0,0 +1,200 @@
+/**
+	Sweeps schedulers and link conditions through the discrete event simulation (see
+	sim.h). The first link always gets the first round trip time, rate and loss given; the
+	other links get every combination of them. Prints a line per combination.
+*/
+#include <stdlib.h>
+#include <getopt.h>
+
+#include <cstdio>
+#include <exception>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "log.h"
+#include "queue.h"
+#include "scheduler.h"
+#include "sim.h"
+
+
+struct SweepOptions {
+	std::vector<std::string> schedulers{"rr", "minrtt"};
+	int links = 2;
+	std::vector<double> rtts_ms{10, 50, 200};
+	std::vector<double> rates_mbit{1, 10, 100};
+	std::vector<double> losses{0, 1};		// Percent
+	SimConfig base;
+};
+
+
+static std::vector<std::string> splitList(const std::string &list) {
+	std::vector<std::string> items;
+	std::stringstream ss(list);
+	std::string item;
+	while (std::getline(ss, item, ',')) {
+		if (!item.empty()) {
+			items.push_back(item);
+		}
+	}
+	return items;
+}
+
+
+static std::vector<double> splitDoubles(const std::string &list) {
+	std::vector<double> values;
+	for (const std::string &item : splitList(list)) {
+		double value = std::stod(item);
+		if (value < 0) {
+			throw std::invalid_argument("negative value: " + item);
+		}
+		values.push_back(value);
+	}
+	if (values.empty()) {
+		throw std::invalid_argument("empty list");
+	}
+	return values;
+}
+
+
+static void printHelp(const char *prog_name, std::ostream &out) {
+	out << "Usage:\n"
+		<< prog_name << " [-S SCHEDULERS] [-n LINKS] [-R RTTS] [-b RATES] [-l LOSSES] [-H MS] [-s SIZE] [-L LOAD] [-T SECONDS] [-x SEED]\n"
+		<< "\t-S: Schedulers to compare, comma separated (rr, minrtt). Default rr,minrtt.\n"
+		<< "\t-n: Number of links. Default 2.\n"
+		<< "\t-R: Round trip times in ms, comma separated. Default 10,50,200.\n"
+		<< "\t-b: Link rates in Mbit/s, comma separated. Default 1,10,100.\n"
+		<< "\t-l: Loss percentages, comma separated. Default 0,1.\n"
+		<< "\t-H: MS: Reorder hold time. Default 50.\n"
+		<< "\t-s: Packet size in bytes. Default 1400.\n"
+		<< "\t-L: Offered load, as a fraction of the links' total rate. Default 0.9.\n"
+		<< "\t-T: Simulated seconds per run. Default 10.\n"
+		<< "\t-x: Random seed. The same seed gives the same results. Default 1."
+		<< std::endl;
+}
+
+
+static SweepOptions parseOptions(int argc, char *argv[]) {
+	SweepOptions sweep;
+	int c;
+	opterr = 0;
+	while ((c = getopt(argc, argv, ":hS:n:R:b:l:H:s:L:T:x:")) != -1) {
+		switch (c) {
+			case 'h':
+				printHelp(argv[0], std::cout);
+				std::exit(0);
+			case 'S':
+				sweep.schedulers = splitList(optarg);
+				for (const std::string &scheduler : sweep.schedulers) {
+					Scheduler::create(scheduler);	// Throws std::invalid_argument
+				}
+				break;
+			case 'n':
+				sweep.links = std::stoi(optarg);
+				break;
+			case 'R':
+				sweep.rtts_ms = splitDoubles(optarg);
+				break;
+			case 'b':
+				sweep.rates_mbit = splitDoubles(optarg);
+				break;
+			case 'l':
+				sweep.losses = splitDoubles(optarg);
+				break;
+			case 'H':
+				sweep.base.reorder_hold_ms = std::stoi(optarg);
+				break;
+			case 's':
+				sweep.base.packet_size = std::stoul(optarg);
+				break;
+			case 'L':
+				sweep.base.load = std::stod(optarg);
+				break;
+			case 'T':
+				sweep.base.seconds = std::stod(optarg);
+				break;
+			case 'x':
+				sweep.base.seed = std::stoull(optarg);
+				break;
+			case ':':
+				throw std::invalid_argument(
+					std::string("option requires an argument: '") + static_cast<char>(optopt) + "'");
+			default:
+				throw std::invalid_argument(
+					std::string("invalid option: '") + static_cast<char>(optopt) + "'");
+		}
+	}
+	if (sweep.links < 1 || sweep.base.seconds <= 0 || sweep.base.load <= 0) {
+		throw std::invalid_argument("nothing to simulate");
+	}
+	for (double rate : sweep.rates_mbit) {
+		if (rate == 0) {
+			throw std::invalid_argument("link rate can't be 0");
+		}
+	}
+	for (double loss : sweep.losses) {
+		if (loss > 100) {
+			throw std::invalid_argument("loss above 100%");
+		}
+	}
+	if (sweep.base.packet_size < 1 ||
+			sweep.base.packet_size > Message::PAYLOAD_SIZE - Message::TRAILER_SPACE) {
+		throw std::invalid_argument("packet size out of range");
+	}
+	return sweep;
+}
+
+
+int main(int argc, char* argv[]) {
+	SweepOptions sweep;
+	try {
+		sweep = parseOptions(argc, argv);
+	} catch (std::exception &e) {
+		std::cerr << "Parse error: " << e.what() << std::endl;
+		printHelp(argv[0], std::cerr);
+		return 1;
+	}
+
+	printf("%-9s %-18s %-18s %12s %8s %8s %8s %8s %8s %9s\n", "scheduler", "link 0",
+		"other links", "goodput_mbit", "deliv%", "p50_ms", "p99_ms", "reord%", "max_held",
+		"speedup");
+
+	SimLinkModel first;
+	first.rtt_ms = sweep.rtts_ms[0];
+	first.rate_mbit = sweep.rates_mbit[0];
+	first.loss = sweep.losses[0] / 100;
+
+	for (const std::string &scheduler : sweep.schedulers) {
+		for (double rtt : sweep.rtts_ms) {
+			for (double rate : sweep.rates_mbit) {
+				for (double loss : sweep.losses) {
+					SimLinkModel other;
+					other.rtt_ms = rtt;
+					other.rate_mbit = rate;
+					other.loss = loss / 100;
+
+					SimConfig config = sweep.base;
+					config.scheduler = scheduler;
+					config.links.push_back(first);
+					for (int i = 1; i < sweep.links; i++) {
+						config.links.push_back(other);
+					}
+
+					SimResult result = Simulation(config).run();
+					double offered = static_cast<double>(std::max<uint64_t>(result.offered, 1));
+					printf("%-9s %-18s %-18s %12.2f %8.2f %8.1f %8.1f %8.2f %8zu %9.0f\n",
+						scheduler.c_str(), first.describe().c_str(),
+						sweep.links > 1 ? other.describe().c_str() : "-",
+						result.goodput_mbit, 100 * result.delivered / offered,
+						result.latency_p50_ms, result.latency_p99_ms,
+						100 * result.reordered / offered, result.max_held,
+						config.seconds / std::max(result.wall_seconds, 1e-9));
+					fflush(stdout);
+				}
+			}
+		}
+	}
+	logging::flush();
+	return 0;
+}